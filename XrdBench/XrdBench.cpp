@@ -0,0 +1,362 @@
+/**
+ * @file XrdBench.cpp
+ * @brief Console benchmark: replays a corpus of clipboard payloads against a pattern file.
+ *
+ * Usage: XrdBench <patterns.txt> <corpus file or directory> [options]
+ *        XrdBench --self-check
+ *   --iterations N   Timed passes over the corpus (default 5), after one untimed warm-up pass
+ *   --per-rule       Also time every rule compiled on its own
+ *   --max-chars N    Scan budget per payload, as [Scan] MaxChars in xrd.ini (default unlimited)
+ *   --max-ms N       Scan budget per payload, as [Scan] MaxTimeMs in xrd.ini (default unlimited)
+ *
+ * Every file is one payload: UTF-16LE if it starts with a BOM, UTF-8 otherwise. Payloads below
+ * a directory named "benign" must not match and payloads below one named "malicious" must; each
+ * mismatch is listed and sets exit code 1, so the tool can gate a pattern update. Exit code 2
+ * means the patterns or the corpus could not be loaded.
+ *
+ * --self-check compiles pairs of rules that pattern folding once got wrong and compares the
+ * verdict on a sample text with std::wregex; any difference sets exit code 1.
+ */
+
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "PatternFile.h"
+#include "PatternMatcher.h"
+
+namespace {
+    enum class Label { None, Benign, Malicious };
+
+    struct Payload
+    {
+        std::filesystem::path path;
+        std::wstring          text;
+        Label                 label = Label::None;
+    };
+
+    /** @brief Timings of one replay; latencies of the timed passes only. */
+    struct Replay
+    {
+        std::vector<double> latencyUs;      ///< One entry per scanned payload and pass
+        double              coldSeconds = 0;    ///< Warm-up pass, including lazy DFA construction
+        double              seconds = 0;        ///< All timed passes
+        std::vector<PatternMatcher::ScanOutcome> outcomes;  ///< Verdict per payload
+    };
+
+    struct Options
+    {
+        std::wstring               patterns;
+        std::wstring               corpus;
+        int                        iterations = 5;
+        bool                       perRule = false;
+        bool                       selfCheck = false;
+        PatternMatcher::ScanBudget budget;
+    };
+
+    bool ReadPayload(const std::filesystem::path& path, std::wstring& text)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in.is_open())
+            return false;
+        const std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        if (bytes.size() >= 2 && bytes.compare(0, 2, "\xFF\xFE") == 0) {
+            text.resize((bytes.size() - 2) / sizeof(wchar_t));
+            std::memcpy(text.data(), bytes.data() + 2, text.size() * sizeof(wchar_t));
+            return true;
+        }
+
+        std::string_view utf8(bytes);
+        if (utf8.size() >= 3 && utf8.substr(0, 3) == "\xEF\xBB\xBF")
+            utf8.remove_prefix(3);
+        text.clear();
+        if (utf8.empty())
+            return true;
+        const int length = MultiByteToWideChar(CP_UTF8, 0, utf8.data(), static_cast<int>(utf8.size()), nullptr, 0);
+        text.resize(length);
+        MultiByteToWideChar(CP_UTF8, 0, utf8.data(), static_cast<int>(utf8.size()), text.data(), length);
+        return true;
+    }
+
+    bool SameName(const std::wstring& a, const wchar_t* b)
+    {
+        return CompareStringOrdinal(a.c_str(), -1, b, -1, TRUE) == CSTR_EQUAL;
+    }
+
+    /** @brief Expected verdict from the directories between the corpus root and the file. */
+    Label LabelOf(const std::filesystem::path& relative)
+    {
+        for (const auto& part : relative.parent_path()) {
+            if (SameName(part.wstring(), L"benign"))
+                return Label::Benign;
+            if (SameName(part.wstring(), L"malicious"))
+                return Label::Malicious;
+        }
+        return Label::None;
+    }
+
+    std::vector<Payload> LoadCorpus(const std::filesystem::path& corpus)
+    {
+        std::vector<Payload> payloads;
+        std::error_code ec;
+        auto add = [&](const std::filesystem::path& path, const std::filesystem::path& relative) {
+            Payload payload;
+            payload.path = path;
+            payload.label = LabelOf(relative);
+            if (ReadPayload(path, payload.text))
+                payloads.push_back(std::move(payload));
+            else
+                fwprintf(stderr, L"Cannot read %ls\n", path.c_str());
+            };
+
+        if (std::filesystem::is_regular_file(corpus, ec)) {
+            add(corpus, corpus.filename());
+            return payloads;
+        }
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(corpus, ec)) {
+            if (entry.is_regular_file(ec))
+                add(entry.path(), entry.path().lexically_relative(corpus));
+        }
+        // Directory order is not guaranteed; a fixed order keeps runs comparable
+        std::sort(payloads.begin(), payloads.end(),
+            [](const Payload& a, const Payload& b) { return a.path < b.path; });
+        return payloads;
+    }
+
+    /** @brief Two rules compiled together, and a text only std::wregex can tell them apart on. */
+    struct FoldCase
+    {
+        const wchar_t* first;
+        const wchar_t* second;
+        const wchar_t* text;
+    };
+
+    // "\b" and "$" of a rule matching mid-text were once judged as if the text ended there
+    constexpr FoldCase kFoldCases[] = {
+        { L"cmd\\W*$", L"\\bcmd\\b", L"cmd /c start x" },
+        { L"cmd\\W?$", L"cmd\\b",     L"cmd x" },
+        { L"\\b.\\b",  L"\\b",        L"ab" },
+    };
+
+    /** @brief Runs kFoldCases; the verdict of the set must be that of its rules under std::wregex. */
+    int SelfCheck()
+    {
+        int failures = 0;
+        for (const auto& check : kFoldCases) {
+            PatternMatcher matcher;
+            matcher.AddPattern(check.first);
+            matcher.AddPattern(check.second);
+            matcher.Compile();
+
+            const std::wstring text = check.text;
+            const bool expected =
+                std::regex_search(text, std::wregex(check.first, std::regex::ECMAScript | std::regex::icase)) ||
+                std::regex_search(text, std::wregex(check.second, std::regex::ECMAScript | std::regex::icase));
+            PatternMatcher::Scratch scratch;
+            const bool matched = matcher.Scan(text, scratch, {}).rule >= 0;
+            if (matched != expected) {
+                wprintf(L"  %ls + %ls on \"%ls\": %ls, std::wregex %ls (%zu folded)\n", check.first, check.second,
+                    check.text, matched ? L"match" : L"no match", expected ? L"matches" : L"does not match",
+                    matcher.FoldedRules().size());
+                ++failures;
+            }
+        }
+        wprintf(L"Self-check : %zu cases, %d failed\n", std::size(kFoldCases), failures);
+        return failures != 0 ? 1 : 0;
+    }
+
+    double Elapsed(const LARGE_INTEGER& start, const LARGE_INTEGER& end, const LARGE_INTEGER& frequency)
+    {
+        return static_cast<double>(end.QuadPart - start.QuadPart) / static_cast<double>(frequency.QuadPart);
+    }
+
+    /** @brief One warm-up pass, then the timed passes, all with one Scratch as the scan worker does. */
+    Replay Run(const PatternMatcher& matcher, const std::vector<Payload>& corpus, const Options& options)
+    {
+        Replay replay;
+        PatternMatcher::Scratch scratch;
+        LARGE_INTEGER frequency{}, start{}, end{};
+        QueryPerformanceFrequency(&frequency);
+
+        QueryPerformanceCounter(&start);
+        for (const auto& payload : corpus)
+            replay.outcomes.push_back(matcher.Scan(payload.text, scratch, options.budget));
+        QueryPerformanceCounter(&end);
+        replay.coldSeconds = Elapsed(start, end, frequency);
+
+        replay.latencyUs.reserve(corpus.size() * options.iterations);
+        for (int pass = 0; pass < options.iterations; ++pass) {
+            for (const auto& payload : corpus) {
+                QueryPerformanceCounter(&start);
+                matcher.Scan(payload.text, scratch, options.budget);
+                QueryPerformanceCounter(&end);
+                const double seconds = Elapsed(start, end, frequency);
+                replay.seconds += seconds;
+                replay.latencyUs.push_back(seconds * 1e6);
+            }
+        }
+        return replay;
+    }
+
+    /** @brief Nearest-rank percentile of sorted values. */
+    double Percentile(const std::vector<double>& sorted, double percent)
+    {
+        if (sorted.empty())
+            return 0;
+        const size_t rank = static_cast<size_t>(percent / 100.0 * static_cast<double>(sorted.size()) + 0.5);
+        return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+    }
+
+    double MegabytesPerSecond(size_t bytes, double seconds)
+    {
+        return seconds > 0 ? static_cast<double>(bytes) / (1024.0 * 1024.0) / seconds : 0;
+    }
+
+    bool ParseOptions(int argc, wchar_t* argv[], Options& options)
+    {
+        std::vector<std::wstring> positional;
+        for (int i = 1; i < argc; ++i) {
+            const std::wstring arg = argv[i];
+            const bool hasValue = i + 1 < argc;
+            if (arg == L"--per-rule")
+                options.perRule = true;
+            else if (arg == L"--self-check")
+                options.selfCheck = true;
+            else if (arg == L"--iterations" && hasValue)
+                options.iterations = std::max(1, _wtoi(argv[++i]));
+            else if (arg == L"--max-chars" && hasValue)
+                options.budget.maxChars = static_cast<size_t>(_wtoi64(argv[++i]));
+            else if (arg == L"--max-ms" && hasValue)
+                options.budget.maxTime = std::chrono::milliseconds(_wtoi(argv[++i]));
+            else if (arg.rfind(L"--", 0) == 0)
+                return false;
+            else
+                positional.push_back(arg);
+        }
+        if (options.selfCheck)
+            return positional.empty();
+        if (positional.size() != 2)
+            return false;
+        options.patterns = positional[0];
+        options.corpus = positional[1];
+        return true;
+    }
+} // anonymous namespace
+
+int wmain(int argc, wchar_t* argv[])
+{
+    _setmode(_fileno(stdout), _O_U8TEXT);
+    _setmode(_fileno(stderr), _O_U8TEXT);
+
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        fwprintf(stderr, L"Usage: XrdBench <patterns.txt> <corpus file or directory>\n"
+            L"                [--iterations N] [--per-rule] [--max-chars N] [--max-ms N]\n"
+            L"       XrdBench --self-check\n");
+        return 2;
+    }
+    if (options.selfCheck)
+        return SelfCheck();
+
+    const PatternFileResult loaded = LoadPatternFile(options.patterns);
+    for (const auto& error : loaded.errors)
+        fwprintf(stderr, L"%ls\n", error.c_str());
+    if (!loaded.matcher)
+        return 2;
+
+    const std::vector<Payload> corpus = LoadCorpus(options.corpus);
+    if (corpus.empty()) {
+        fwprintf(stderr, L"No payloads found in %ls\n", options.corpus.c_str());
+        return 2;
+    }
+    size_t corpusBytes = 0;
+    for (const auto& payload : corpus)
+        corpusBytes += payload.text.size() * sizeof(wchar_t);
+
+    //
+    // Whole set, as the watcher scans it
+    //
+    Replay replay = Run(*loaded.matcher, corpus, options);
+    std::vector<double> sorted = replay.latencyUs;
+    std::sort(sorted.begin(), sorted.end());
+
+    wprintf(L"Patterns   : %zu rules%ls, %zu folded\n", loaded.matcher->RuleCount(),
+        loaded.fromCache ? L" (from cache)" : L"", loaded.matcher->FoldedRules().size());
+    wprintf(L"Corpus     : %zu payloads, %.2f MB of UTF-16 text\n", corpus.size(), corpusBytes / (1024.0 * 1024.0));
+    wprintf(L"Cold pass  : %.2f ms\n", replay.coldSeconds * 1e3);
+    wprintf(L"Throughput : %.1f MB/s over %d passes\n",
+        MegabytesPerSecond(corpusBytes * options.iterations, replay.seconds), options.iterations);
+    wprintf(L"Latency    : p50 %.1f us, p99 %.1f us, max %.1f us\n",
+        Percentile(sorted, 50), Percentile(sorted, 99), sorted.back());
+
+    std::vector<size_t> matches(loaded.matcher->RuleCount());
+    size_t partial = 0;
+    int mismatches = 0;
+    for (size_t i = 0; i < corpus.size(); ++i) {
+        const auto& outcome = replay.outcomes[i];
+        const bool matched = outcome.rule >= 0;
+        if (matched)
+            ++matches[outcome.rule];
+        else if (outcome.status == PatternMatcher::ScanStatus::Partial)
+            ++partial;
+
+        const Label label = corpus[i].label;
+        if ((label == Label::Benign && matched) || (label == Label::Malicious && !matched)) {
+            if (mismatches++ == 0)
+                wprintf(L"\nMismatches:\n");
+            wprintf(L"  %ls: %ls\n", corpus[i].path.c_str(),
+                matched ? (L"matched rule " + std::to_wstring(outcome.rule)).c_str()
+                : outcome.status == PatternMatcher::ScanStatus::Partial ? L"not scanned completely"
+                : L"no match");
+        }
+    }
+
+    wprintf(L"\nPayloads matched per rule (%zu partial):\n", partial);
+    for (size_t rule = 0; rule < matches.size(); ++rule) {
+        if (matches[rule] != 0)
+            wprintf(L"  rule %zu: %zu\n", rule, matches[rule]);
+    }
+
+    //
+    // Every rule on its own: what a rule costs, independent of the rest of the set
+    //
+    if (options.perRule) {
+        const std::vector<PatternSource> sources = ReadPatternSources(options.patterns);
+        struct RuleCost
+        {
+            size_t rule;
+            double seconds;
+        };
+        std::vector<RuleCost> costs;
+        for (size_t rule = 0; rule < sources.size(); ++rule) {
+            PatternMatcher single;
+            single.AddPattern(sources[rule].pattern, sources[rule].options);
+            single.Compile();
+            costs.push_back({ rule, Run(single, corpus, options).seconds / options.iterations });
+        }
+        std::sort(costs.begin(), costs.end(),
+            [](const RuleCost& a, const RuleCost& b) { return a.seconds > b.seconds; });
+
+        wprintf(L"\nCost per rule alone (per pass, most expensive first):\n");
+        for (const auto& cost : costs) {
+            const PatternSource& source = sources[cost.rule];
+            wprintf(L"  rule %zu (line %zu): %.3f ms, %.1f MB/s  %ls\n", cost.rule, source.line,
+                cost.seconds * 1e3, MegabytesPerSecond(corpusBytes, cost.seconds), source.pattern.c_str());
+        }
+    }
+
+    return mismatches != 0 ? 1 : 0;
+}
+
+// End of XrdBench.cpp
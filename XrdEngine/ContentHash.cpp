@@ -0,0 +1,122 @@
+/**
+ * @file ContentHash.cpp
+ * @brief XXH64 content hashing for caches keyed by clipboard payloads.
+ */
+
+#include "ContentHash.h"
+
+#include <windows.h>
+#include <cstring>
+
+namespace {
+    constexpr std::uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+    constexpr std::uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr std::uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+    constexpr std::uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr std::uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+    inline std::uint64_t Rotl(std::uint64_t value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    inline std::uint64_t Read64(const unsigned char* p)
+    {
+        std::uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline std::uint32_t Read32(const unsigned char* p)
+    {
+        std::uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline std::uint64_t Round(std::uint64_t acc, std::uint64_t input)
+    {
+        acc += input * kPrime2;
+        acc = Rotl(acc, 31);
+        return acc * kPrime1;
+    }
+
+    inline std::uint64_t MergeRound(std::uint64_t acc, std::uint64_t value)
+    {
+        acc ^= Round(0, value);
+        return acc * kPrime1 + kPrime4;
+    }
+
+    std::uint64_t RandomSeed()
+    {
+        // Not a secret against local admins, just unpredictable from outside the process
+        LARGE_INTEGER counter{};
+        QueryPerformanceCounter(&counter);
+        std::uint64_t seed = static_cast<std::uint64_t>(counter.QuadPart);
+        seed ^= static_cast<std::uint64_t>(GetCurrentProcessId()) << 32;
+        seed ^= GetTickCount64() * kPrime5;
+        seed ^= reinterpret_cast<std::uintptr_t>(&seed);    // ASLR
+        return HashBytes(&seed, sizeof(seed), kPrime3);
+    }
+} // anonymous namespace
+
+std::uint64_t HashBytes(const void* data, size_t size, std::uint64_t seed)
+{
+    const auto* p = static_cast<const unsigned char*>(data);
+    const unsigned char* const end = p + size;
+    std::uint64_t hash;
+
+    if (size >= 32) {
+        std::uint64_t v1 = seed + kPrime1 + kPrime2;
+        std::uint64_t v2 = seed + kPrime2;
+        std::uint64_t v3 = seed;
+        std::uint64_t v4 = seed - kPrime1;
+        const unsigned char* const limit = end - 32;
+        do {
+            v1 = Round(v1, Read64(p));
+            v2 = Round(v2, Read64(p + 8));
+            v3 = Round(v3, Read64(p + 16));
+            v4 = Round(v4, Read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        hash = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+        hash = MergeRound(hash, v1);
+        hash = MergeRound(hash, v2);
+        hash = MergeRound(hash, v3);
+        hash = MergeRound(hash, v4);
+    }
+    else {
+        hash = seed + kPrime5;
+    }
+
+    hash += static_cast<std::uint64_t>(size);
+    for (; p + 8 <= end; p += 8) {
+        hash ^= Round(0, Read64(p));
+        hash = Rotl(hash, 27) * kPrime1 + kPrime4;
+    }
+    if (p + 4 <= end) {
+        hash ^= static_cast<std::uint64_t>(Read32(p)) * kPrime1;
+        hash = Rotl(hash, 23) * kPrime2 + kPrime3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        hash ^= (*p) * kPrime5;
+        hash = Rotl(hash, 11) * kPrime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+std::uint64_t HashText(std::wstring_view text)
+{
+    static const std::uint64_t s_seed = RandomSeed();
+    return HashBytes(text.data(), text.size() * sizeof(wchar_t), s_seed);
+}
+
+// End of ContentHash.cpp
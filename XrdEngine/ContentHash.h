@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * @brief XXH64 of a byte range (non-cryptographic, ~memory bandwidth).
+ * @param data First byte.
+ * @param size Number of bytes.
+ * @param seed Hash seed.
+ * @return 64-bit hash, identical to the reference XXH64 implementation.
+ */
+std::uint64_t HashBytes(const void* data, size_t size, std::uint64_t seed = 0);
+
+/**
+ * @brief Hashes UTF-16 text with a seed chosen randomly once per process.
+ *
+ * The random seed keeps hashes unpredictable to other processes, so clipboard content
+ * cannot be crafted to collide with a payload that was cached as clean.
+ */
+std::uint64_t HashText(std::wstring_view text);
@@ -0,0 +1,388 @@
+/**
+ * @file PatternFile.cpp
+ * @brief Parses patterns.txt into a compiled PatternMatcher, through an on-disk cache.
+ *
+ * Cache layout: a CacheHeader, the PatternMatcher::Serialize() bytes, then the load
+ * errors and the folding notes, each as UTF-16 lines ending in '\n'. The header carries the hash of the source
+ * file and of everything after it, so stale and damaged caches are both detected.
+ */
+
+#include "PatternFile.h"
+
+#include <windows.h>
+#include <algorithm>
+#include <cstring>
+#include <cwctype>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#include "ContentHash.h"
+
+namespace {
+    constexpr std::uint32_t kCacheMagic = 0x43445258;   // "XRDC"
+    constexpr std::uint32_t kCacheVersion = 4;     // 4: earlier builds could fold rules that still matter
+
+    struct CacheHeader
+    {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint64_t sourceHash;   // HashBytes() of patterns.txt
+        std::uint64_t matcherSize;  // Bytes of serialized PatternMatcher
+        std::uint64_t errorSize;    // Bytes of error text
+        std::uint64_t noteSize;     // Bytes of folding notes
+        std::uint64_t payloadHash;  // HashBytes() of everything after the header
+    };
+
+    /** @brief Read-only view of a whole file; unmapped on destruction. */
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::wstring& path)
+        {
+            _file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (_file == INVALID_HANDLE_VALUE)
+                return;
+            LARGE_INTEGER size{};
+            if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0 ||
+                static_cast<std::uint64_t>(size.QuadPart) > SIZE_MAX)
+                return;
+            _mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!_mapping)
+                return;
+            _view = static_cast<const std::uint8_t*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+            if (_view)
+                _size = static_cast<size_t>(size.QuadPart);
+        }
+
+        ~MappedFile()
+        {
+            if (_view)
+                UnmapViewOfFile(_view);
+            if (_mapping)
+                CloseHandle(_mapping);
+            if (_file != INVALID_HANDLE_VALUE)
+                CloseHandle(_file);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const std::uint8_t* Data() const { return _view; }
+        size_t Size() const { return _size; }
+
+    private:
+        HANDLE              _file = INVALID_HANDLE_VALUE;
+        HANDLE              _mapping = nullptr;
+        const std::uint8_t* _view = nullptr;
+        size_t              _size = 0;
+    };
+
+    void AppendLines(std::vector<std::uint8_t>& out, const std::vector<std::wstring>& lines)
+    {
+        for (const auto& line : lines) {
+            const std::wstring text = line + L'\n';
+            const auto* bytes = reinterpret_cast<const std::uint8_t*>(text.data());
+            out.insert(out.end(), bytes, bytes + text.size() * sizeof(wchar_t));
+        }
+    }
+
+    std::vector<std::wstring> SplitLines(const std::uint8_t* data, std::uint64_t size)
+    {
+        std::wstring text(static_cast<size_t>(size / sizeof(wchar_t)), L'\0');
+        if (!text.empty())
+            std::memcpy(text.data(), data, text.size() * sizeof(wchar_t));
+        std::vector<std::wstring> lines;
+        std::wistringstream in(text);
+        for (std::wstring line; std::getline(in, line); )
+            lines.push_back(line);
+        return lines;
+    }
+
+    /** @brief Restores a cached set built from the given source; false on any mismatch. */
+    bool ReadCache(const std::wstring& cachePath, std::uint64_t sourceHash, PatternFileResult& result)
+    {
+        const MappedFile cache(cachePath);
+        if (cache.Size() < sizeof(CacheHeader))
+            return false;
+
+        CacheHeader header;
+        std::memcpy(&header, cache.Data(), sizeof(header));
+        const std::uint8_t* payload = cache.Data() + sizeof(header);
+        const size_t payloadSize = cache.Size() - sizeof(header);
+        if (header.magic != kCacheMagic || header.version != kCacheVersion ||
+            header.sourceHash != sourceHash ||
+            header.matcherSize > payloadSize ||
+            header.errorSize > payloadSize - header.matcherSize ||
+            header.noteSize != payloadSize - header.matcherSize - header.errorSize ||
+            header.errorSize % sizeof(wchar_t) != 0 || header.noteSize % sizeof(wchar_t) != 0 ||
+            HashBytes(payload, payloadSize) != header.payloadHash)
+            return false;
+
+        auto matcher = std::make_shared<PatternMatcher>();
+        if (!matcher->Deserialize(payload, static_cast<size_t>(header.matcherSize)))
+            return false;
+
+        const std::uint8_t* errors = payload + header.matcherSize;
+        result.errors = SplitLines(errors, header.errorSize);
+        result.notes = SplitLines(errors + header.errorSize, header.noteSize);
+
+        result.matcher = std::move(matcher);
+        result.fromCache = true;
+        return true;
+    }
+
+    /**
+     * @brief Stores a compiled set for the next load. Best effort: written to a temporary
+     *        file and renamed, so concurrent starts never see a half-written cache.
+     */
+    void WriteCache(const std::wstring& cachePath, const PatternFileResult& result)
+    {
+        std::vector<std::uint8_t> payload = result.matcher->Serialize();
+        CacheHeader header{};
+        header.magic = kCacheMagic;
+        header.version = kCacheVersion;
+        header.sourceHash = result.sourceHash;
+        header.matcherSize = payload.size();
+        AppendLines(payload, result.errors);
+        header.errorSize = payload.size() - header.matcherSize;
+        AppendLines(payload, result.notes);
+        header.noteSize = payload.size() - header.matcherSize - header.errorSize;
+        header.payloadHash = HashBytes(payload.data(), payload.size());
+
+        const std::wstring tempPath = cachePath + L"." + std::to_wstring(GetCurrentProcessId()) + L".tmp";
+        HANDLE file = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return;     // Read-only install directory: compile on every start
+
+        DWORD written = 0;
+        bool ok = WriteFile(file, &header, sizeof(header), &written, nullptr) && written == sizeof(header)
+            && WriteFile(file, payload.data(), static_cast<DWORD>(payload.size()), &written, nullptr)
+            && written == payload.size();
+        ok = CloseHandle(file) && ok;
+        if (!ok || !MoveFileExW(tempPath.c_str(), cachePath.c_str(), MOVEFILE_REPLACE_EXISTING))
+            DeleteFileW(tempPath.c_str());
+    }
+
+    /** @brief Decodes UTF-8 file bytes (optional BOM) to UTF-16. */
+    std::wstring DecodeUtf8(const std::string& bytes)
+    {
+        std::string_view text(bytes);
+        if (text.size() >= 3 && text.substr(0, 3) == "\xEF\xBB\xBF")
+            text.remove_prefix(3);
+        if (text.empty())
+            return {};
+
+        const int length = MultiByteToWideChar(CP_UTF8, 0,
+            text.data(), static_cast<int>(text.size()), nullptr, 0);
+        std::wstring wide(length, L'\0');
+        MultiByteToWideChar(CP_UTF8, 0,
+            text.data(), static_cast<int>(text.size()), wide.data(), length);
+        return wide;
+    }
+
+    /** @brief Reads a whole file; false if it cannot be opened. */
+    bool ReadBytes(const std::wstring& path, std::string& bytes)
+    {
+        std::ifstream infile(path, std::ios::binary);
+        if (!infile.is_open())
+            return false;
+        bytes.assign(std::istreambuf_iterator<char>(infile), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    /**
+     * @brief Applies "key=value" rule options separated by blanks.
+     * @param[out] error The first option that is unknown or has an invalid value.
+     * @return False on error; options then holds every option before it.
+     */
+    bool ParseOptions(std::wstring_view text, PatternMatcher::RuleOptions& options, std::wstring& error)
+    {
+        std::wistringstream in{ std::wstring(text) };
+        for (std::wstring option; in >> option; ) {
+            const auto equals = option.find(L'=');
+            std::wstring key = option.substr(0, equals);
+            std::wstring value = (equals == std::wstring::npos) ? std::wstring() : option.substr(equals + 1);
+            for (auto* part : { &key, &value })
+                std::transform(part->begin(), part->end(), part->begin(), ::towlower);
+
+            wchar_t* end = nullptr;
+            const unsigned long long number = std::wcstoull(value.c_str(), &end, 10);
+            const bool isNumber = !value.empty() && *end == L'\0' && std::iswdigit(value[0]);
+            if (key == L"tier" && isNumber && number <= 0xFF) {
+                options.tier = static_cast<std::uint8_t>(number);
+            }
+            else if (key == L"window" && isNumber && number <= 0xFFFFFFFF) {
+                options.window = static_cast<std::uint32_t>(number);
+            }
+            else if (key == L"severity" && value == L"low") {
+                options.severity = PatternMatcher::Severity::Low;
+            }
+            else if (key == L"severity" && value == L"medium") {
+                options.severity = PatternMatcher::Severity::Medium;
+            }
+            else if (key == L"severity" && value == L"high") {
+                options.severity = PatternMatcher::Severity::High;
+            }
+            else {
+                error = option;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Adds every pattern line of the decoded file to the matcher.
+     * @param[out] accepted Source line and accepted text of each added pattern, in rule order.
+     * @param[out] errors One message per line that is not a valid pattern.
+     */
+    void AddPatterns(const std::wstring& text, PatternMatcher& matcher,
+        std::vector<PatternSource>& accepted, std::vector<std::wstring>& errors)
+    {
+        std::wistringstream lines(text);
+        std::wstring line;
+        size_t lineNumber = 0;
+        PatternMatcher::RuleOptions blockOptions;   // From the last "#@" line
+        auto optionError = [&](const std::wstring& option) {
+            std::wstringstream err;
+            err << L"Invalid rule option (line " << lineNumber << L"): " << option;
+            errors.push_back(err.str());
+        };
+        while (std::getline(lines, line)) {
+            ++lineNumber;
+            // Trim whitespace and strip comments
+            const auto first = line.find_first_not_of(L" \t\r\n");
+            if (first == std::wstring::npos) continue;
+
+            // Rule options: "#@ ..." up to the end of the line or the next comment
+            const auto commentPos = line.find(L'#', first);
+            std::wstring_view optionText;
+            if (commentPos != std::wstring::npos && line.compare(commentPos, 2, L"#@") == 0) {
+                optionText = std::wstring_view(line).substr(commentPos + 2);
+                optionText = optionText.substr(0, optionText.find(L'#'));
+            }
+            std::wstring badOption;
+            if (commentPos == first) {
+                if (line.compare(first, 2, L"#@") == 0) {
+                    blockOptions = {};
+                    if (!ParseOptions(optionText, blockOptions, badOption))
+                        optionError(badOption);
+                }
+                continue;
+            }
+            PatternMatcher::RuleOptions options = blockOptions;
+            if (!optionText.empty() && !ParseOptions(optionText, options, badOption))
+                optionError(badOption);
+
+            std::wstring raw = (commentPos == std::wstring::npos)
+                ? line.substr(first)
+                : line.substr(first, commentPos - first);
+
+            const auto last = raw.find_last_not_of(L" \t\r\n");
+            if (last == std::wstring::npos) continue;
+            raw.resize(last + 1);
+
+            // Remove inline case-insensitive flag
+            if (raw.rfind(L"(?i)", 0) == 0)
+                raw.erase(0, 4);
+
+            if (raw.empty()) continue;
+
+            auto tryCompile = [&](const std::wstring& pattern) {
+                if (matcher.AddPattern(pattern, options) == PatternMatcher::AddResult::Invalid)
+                    return false;
+                accepted.push_back({ lineNumber, pattern, options });
+                return true;
+                };
+
+            if (tryCompile(raw))
+                continue;
+
+            // Escape braces and retry
+            std::wstring escaped;
+            escaped.reserve(raw.size() * 2);
+            for (wchar_t ch : raw) {
+                if (ch == L'{' || ch == L'}')
+                    escaped.push_back(L'\\');
+                escaped.push_back(ch);
+            }
+            if (!tryCompile(escaped)) {
+                std::wstringstream err;
+                err << L"Invalid regex (line " << lineNumber << L"): " << raw;
+                errors.push_back(err.str());
+            }
+        }
+    }
+} // anonymous namespace
+
+std::wstring PatternCachePath(const std::wstring& patternFile)
+{
+    return std::filesystem::path(patternFile).replace_extension(L".xrdc").wstring();
+}
+
+PatternFileResult LoadCachedPatternFile(const std::wstring& path)
+{
+    PatternFileResult result;
+
+    std::string bytes;
+    if (!ReadBytes(path, bytes))
+        return result;
+    result.sourceHash = HashBytes(bytes.data(), bytes.size());
+    ReadCache(PatternCachePath(path), result.sourceHash, result);
+    return result;
+}
+
+PatternFileResult LoadPatternFile(const std::wstring& path)
+{
+    PatternFileResult result;
+
+    std::string bytes;
+    if (!ReadBytes(path, bytes)) {
+        result.errors.push_back(L"Pattern file not found");
+        return result;
+    }
+    result.sourceHash = HashBytes(bytes.data(), bytes.size());
+
+    const std::wstring cachePath = PatternCachePath(path);
+    if (ReadCache(cachePath, result.sourceHash, result))
+        return result;
+
+    auto matcher = std::make_shared<PatternMatcher>();
+    std::vector<PatternSource> accepted;
+    AddPatterns(DecodeUtf8(bytes), *matcher, accepted, result.errors);
+
+    if (matcher->RuleCount() == 0) {
+        result.errors.push_back(L"No valid patterns loaded");
+        return result;
+    }
+    matcher->Compile();
+    for (const auto& folded : matcher->FoldedRules()) {
+        std::wstringstream note;
+        note << L"Pattern (line " << accepted[folded.rule].line << L")"
+            << (folded.duplicate ? L" duplicates line " : L" is covered by line ")
+            << accepted[folded.keptRule].line << L"; folded into it";
+        result.notes.push_back(note.str());
+    }
+    result.matcher = std::move(matcher);
+    WriteCache(cachePath, result);
+    return result;
+}
+
+std::vector<PatternSource> ReadPatternSources(const std::wstring& path)
+{
+    std::vector<PatternSource> accepted;
+    std::string bytes;
+    if (!ReadBytes(path, bytes))
+        return accepted;
+
+    PatternMatcher matcher;     // Validates each line exactly as LoadPatternFile() does
+    std::vector<std::wstring> errors;
+    AddPatterns(DecodeUtf8(bytes), matcher, accepted, errors);
+    return accepted;
+}
+
+// End of PatternFile.cpp
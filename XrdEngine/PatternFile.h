@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "PatternMatcher.h"
+
+/** @brief Result of reading and compiling a pattern file. */
+struct PatternFileResult
+{
+    std::shared_ptr<const PatternMatcher> matcher;  ///< Compiled set, or null if nothing usable was found
+    std::vector<std::wstring>             errors;   ///< One message per problem, in file order
+    std::vector<std::wstring>             notes;    ///< Redundant patterns that were folded
+    std::uint64_t                         sourceHash = 0;   ///< HashBytes() of the raw file
+    bool                                  fromCache = false; ///< Restored from the compiled cache
+};
+
+/** @brief One accepted pattern of a pattern file. */
+struct PatternSource
+{
+    size_t       line = 0;      ///< 1-based line in the file
+    std::wstring pattern;       ///< Text given to PatternMatcher::AddPattern()
+    PatternMatcher::RuleOptions options;    ///< From "#@" options on the line or above it
+};
+
+/**
+ * @brief Reads a pattern file (UTF-8, one pattern per line, '#' starts a comment)
+ *        and compiles every valid line into one PatternMatcher.
+ *
+ * A comment starting with "#@" holds rule options: "tier=<0-255>", "window=<chars>" and
+ * "severity=low|medium|high", separated by blanks. On a line of its own it sets the
+ * options of every pattern below it, up to the next such line ("#@" alone resets them);
+ * after a pattern it changes that pattern's options only. An unknown option is an error.
+ *
+ * The compiled set is cached next to the pattern file (see PatternCachePath()), keyed by
+ * a hash of the file contents. While the file is unchanged, later loads map the cache
+ * and skip parsing and compilation. A missing, stale, or damaged cache is rebuilt; if the
+ * directory is read-only the set is simply compiled every time.
+ *
+ * Never shows UI: problems are returned in PatternFileResult::errors so the caller can
+ * decide whether to display, log, or reject them.
+ * @param path Full path of patterns.txt.
+ */
+PatternFileResult LoadPatternFile(const std::wstring& path);
+
+/**
+ * @brief Like LoadPatternFile(), but only from an up-to-date cache; never compiles.
+ * @return No matcher (and no errors) if the cache is missing or stale.
+ */
+PatternFileResult LoadCachedPatternFile(const std::wstring& path);
+
+/** @brief Path of the compiled cache for the given pattern file. */
+std::wstring PatternCachePath(const std::wstring& patternFile);
+
+/**
+ * @brief Reads the patterns of a file without compiling them, for tools that need the rules
+ *        one by one (the benchmark times each rule alone).
+ * @return Accepted patterns in rule order, so index i is rule i of LoadPatternFile(); empty
+ *         if the file cannot be read.
+ */
+std::vector<PatternSource> ReadPatternSources(const std::wstring& path);
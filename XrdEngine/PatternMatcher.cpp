@@ -0,0 +1,2369 @@
+/**
+ * @file PatternMatcher.cpp
+ * @brief Implements the multi-pattern matcher used by ClipboardWatcher.
+ *
+ * Pipeline: every pattern is parsed into a small AST, all character sets are
+ * partitioned into equivalence classes (case-folded, like std::regex icase), and
+ * the ASTs are emitted into one Thompson NFA. Scans run the NFA as a lazy DFA whose
+ * states are built on first use and cached in the caller's Scratch.
+ *
+ * Before the final NFA is built, rules that can never change a verdict are folded:
+ * a rule is dropped if every text it matches also contains a match of a rule that stays,
+ * which is decided exactly on the product of the two rules' search DFAs.
+ *
+ * When every rule must start with one of a few short literals (case-folded class
+ * strings), the scan is a literal pass instead: an Aho-Corasick automaton finds the
+ * literal occurrences and only those positions are verified with the rule's anchored
+ * DFA. Literals that are complete matches need no verification at all.
+ *
+ * A Checkpoint resumes either pass exactly where a clean scan of a prefix ended: the
+ * search DFA from its state there, the literal pass from its Aho-Corasick row plus every
+ * verification that was still undecided at the old end of text. No overlap is rescanned,
+ * since these states are all that the next character's step depends on.
+ */
+
+#include "PatternMatcher.h"
+
+#include "ContentHash.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstring>
+#include <locale>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+    constexpr std::uint32_t kAlphabet = 0x10000;        // UTF-16 code units
+    constexpr std::uint32_t kUnbounded = 0xFFFFFFFF;    // Repeat without maximum
+    constexpr std::uint32_t kNone = 0xFFFFFFFF;         // Unpatched NFA edge
+    constexpr std::uint32_t kMaxRepeat = 100000;        // Larger counts stay std::wregex
+    constexpr size_t        kMaxRuleInsts = 1u << 16;   // Larger patterns stay std::wregex
+    constexpr size_t        kMaxNesting = 200;
+    constexpr size_t        kMaxDfaStates = 4096;       // Per DFA; the cache is flushed when full
+    constexpr size_t        kChunkLength = 16 * 1024;   // Characters between cancel/budget checks
+    constexpr size_t        kMaxCoverPairs = 4096;      // Product states per rule-coverage check
+    constexpr size_t        kFoldBudget = 1u << 18;     // Product states for all checks of one Compile()
+    constexpr size_t        kMaxOpenRuns = 64;          // Undecided verifications a Checkpoint keeps
+
+    // DFA transition encoding
+    constexpr std::int32_t  kUnknown = -1;              // Not computed yet
+    constexpr std::int32_t  kDead = -2;                 // Anchored run cannot match any more
+    constexpr std::int32_t  kMatchBase = -3;            // kMatchBase - rule: pattern matched
+
+    constexpr int           kStopped = -2;              // Scan result: cancelled or out of time
+
+    std::atomic<std::uint64_t> g_nextGeneration{ 0 };
+
+    using CharBits = std::bitset<kAlphabet>;
+
+    //--------------------------------------------------------------------------
+    // Character tables (same classification std::regex_traits<wchar_t> uses)
+    //--------------------------------------------------------------------------
+    struct CharTables
+    {
+        std::array<wchar_t, kAlphabet> fold{};  // Case folding (ctype::tolower)
+        CharBits word;                          // \w, over folded units
+        CharBits space;                         // \s, over folded units
+        CharBits digit;                         // \d, over folded units
+    };
+
+    const CharTables& Tables()
+    {
+        static const std::unique_ptr<const CharTables> tables = [] {
+            auto t = std::make_unique<CharTables>();
+            const auto& ct = std::use_facet<std::ctype<wchar_t>>(std::locale());
+            for (std::uint32_t c = 0; c < kAlphabet; ++c) {
+                const wchar_t ch = static_cast<wchar_t>(c);
+                const wchar_t folded = ct.tolower(ch);
+                t->fold[c] = folded;
+                const auto f = static_cast<std::uint16_t>(folded);
+                if (ct.is(std::ctype_base::alnum, ch) || ch == L'_')
+                    t->word.set(f);
+                if (ct.is(std::ctype_base::space, ch))
+                    t->space.set(f);
+                if (ct.is(std::ctype_base::digit, ch))
+                    t->digit.set(f);
+            }
+            return std::unique_ptr<const CharTables>(std::move(t));
+            }();
+        return *tables;
+    }
+
+    std::uint16_t Fold(wchar_t ch)
+    {
+        return static_cast<std::uint16_t>(Tables().fold[static_cast<std::uint16_t>(ch)]);
+    }
+
+    //--------------------------------------------------------------------------
+    // AST
+    //--------------------------------------------------------------------------
+    enum class Assertion : std::uint8_t
+    {
+        TextStart,          // ^
+        TextEnd,            // $
+        WordBoundary,       // \b
+        NotWordBoundary     // \B
+    };
+
+    /** What surrounds a text position, as far as assertions care. */
+    enum Context : std::uint8_t
+    {
+        kEdge = 0,          // Start or end of the text
+        kWord = 1,          // A \w character
+        kOther = 2          // Any other character
+    };
+
+    bool Holds(Assertion assertion, Context prev, Context next)
+    {
+        switch (assertion) {
+        case Assertion::TextStart:       return prev == kEdge;
+        case Assertion::TextEnd:         return next == kEdge;
+        case Assertion::WordBoundary:    return (prev == kWord) != (next == kWord);
+        case Assertion::NotWordBoundary: return (prev == kWord) == (next == kWord);
+        }
+        return false;
+    }
+
+    struct Node
+    {
+        enum class Kind : std::uint8_t { Empty, Set, Concat, Alt, Repeat, Assert };
+
+        Kind          kind = Kind::Empty;
+        Assertion     assertion = Assertion::TextStart;
+        std::uint32_t set = 0;          // Set: index into SetTable
+        std::uint32_t min = 0;          // Repeat: lower bound
+        std::uint32_t max = 0;          // Repeat: upper bound or kUnbounded
+        std::vector<Node> kids;
+    };
+
+    /** Character sets over folded code units; single characters are shared. */
+    class SetTable
+    {
+    public:
+        std::uint32_t Single(wchar_t ch)
+        {
+            const std::uint16_t folded = Fold(ch);
+            auto it = _single.find(folded);
+            if (it != _single.end())
+                return it->second;
+            CharBits bits;
+            bits.set(folded);
+            const std::uint32_t id = Add(bits);
+            _single.emplace(folded, id);
+            return id;
+        }
+
+        std::uint32_t Add(const CharBits& bits)
+        {
+            _sets.push_back(std::make_unique<CharBits>(bits));
+            return static_cast<std::uint32_t>(_sets.size() - 1);
+        }
+
+        size_t Size() const { return _sets.size(); }
+        const CharBits& operator[](size_t i) const { return *_sets[i]; }
+
+    private:
+        std::vector<std::unique_ptr<CharBits>> _sets;
+        std::unordered_map<std::uint16_t, std::uint32_t> _single;
+    };
+
+    //--------------------------------------------------------------------------
+    // Parser (ECMAScript subset)
+    //--------------------------------------------------------------------------
+    enum class ParseStatus
+    {
+        Ok,
+        Unsupported,    // Valid syntax the automaton cannot express
+        Invalid         // Not a valid pattern
+    };
+
+    class Parser
+    {
+    public:
+        Parser(std::wstring_view source, SetTable& sets)
+            : _src(source), _sets(sets)
+        {
+        }
+
+        ParseStatus Parse(Node& root)
+        {
+            const ParseStatus status = ParseAlternation(root, 0);
+            if (status != ParseStatus::Ok)
+                return status;
+            return AtEnd() ? ParseStatus::Ok : ParseStatus::Invalid;   // stray ')'
+        }
+
+    private:
+        bool AtEnd() const { return _pos >= _src.size(); }
+        bool Next(wchar_t ch, size_t ahead = 0) const
+        {
+            return _pos + ahead < _src.size() && _src[_pos + ahead] == ch;
+        }
+
+        static Node SetNode(std::uint32_t set)
+        {
+            Node node;
+            node.kind = Node::Kind::Set;
+            node.set = set;
+            return node;
+        }
+
+        ParseStatus ParseAlternation(Node& out, size_t depth)
+        {
+            if (depth > kMaxNesting)
+                return ParseStatus::Unsupported;
+
+            Node alt;
+            alt.kind = Node::Kind::Alt;
+            for (;;) {
+                Node seq;
+                const ParseStatus status = ParseSequence(seq, depth);
+                if (status != ParseStatus::Ok)
+                    return status;
+                alt.kids.push_back(std::move(seq));
+                if (!Next(L'|'))
+                    break;
+                ++_pos;
+            }
+            out = (alt.kids.size() == 1) ? std::move(alt.kids.front()) : std::move(alt);
+            return ParseStatus::Ok;
+        }
+
+        ParseStatus ParseSequence(Node& out, size_t depth)
+        {
+            Node seq;
+            seq.kind = Node::Kind::Concat;
+            while (!AtEnd() && !Next(L'|') && !Next(L')')) {
+                Node atom;
+                const ParseStatus status = ParseQuantified(atom, depth);
+                if (status != ParseStatus::Ok)
+                    return status;
+                seq.kids.push_back(std::move(atom));
+            }
+            if (seq.kids.empty())
+                out = Node{};
+            else if (seq.kids.size() == 1)
+                out = std::move(seq.kids.front());
+            else
+                out = std::move(seq);
+            return ParseStatus::Ok;
+        }
+
+        ParseStatus ParseQuantified(Node& out, size_t depth)
+        {
+            Node atom;
+            ParseStatus status = ParseAtom(atom, depth);
+            if (status != ParseStatus::Ok || AtEnd())
+            {
+                out = std::move(atom);
+                return status;
+            }
+
+            std::uint32_t min = 0, max = 0;
+            switch (_src[_pos]) {
+            case L'*': min = 0; max = kUnbounded; ++_pos; break;
+            case L'+': min = 1; max = kUnbounded; ++_pos; break;
+            case L'?': min = 0; max = 1;          ++_pos; break;
+            case L'{':
+                status = ParseBraces(min, max);
+                if (status != ParseStatus::Ok)
+                    return status;
+                break;
+            default:
+                out = std::move(atom);
+                return ParseStatus::Ok;
+            }
+
+            if (atom.kind == Node::Kind::Assert)
+                return ParseStatus::Unsupported;
+            if (Next(L'?'))
+                ++_pos;     // Lazy quantifier: same verdict for a yes/no search
+            if (Next(L'*') || Next(L'+') || Next(L'?') || Next(L'{'))
+                return ParseStatus::Invalid;
+
+            Node rep;
+            rep.kind = Node::Kind::Repeat;
+            rep.min = min;
+            rep.max = max;
+            rep.kids.push_back(std::move(atom));
+            out = std::move(rep);
+            return ParseStatus::Ok;
+        }
+
+        ParseStatus ParseNumber(std::uint32_t& value)
+        {
+            const size_t start = _pos;
+            std::uint64_t v = 0;
+            while (!AtEnd() && _src[_pos] >= L'0' && _src[_pos] <= L'9') {
+                v = v * 10 + (_src[_pos] - L'0');
+                if (v > kMaxRepeat)
+                    return ParseStatus::Unsupported;
+                ++_pos;
+            }
+            if (_pos == start)
+                return ParseStatus::Invalid;
+            value = static_cast<std::uint32_t>(v);
+            return ParseStatus::Ok;
+        }
+
+        ParseStatus ParseBraces(std::uint32_t& min, std::uint32_t& max)
+        {
+            ++_pos;     // '{'
+            ParseStatus status = ParseNumber(min);
+            if (status != ParseStatus::Ok)
+                return status;
+            max = min;
+            if (Next(L',')) {
+                ++_pos;
+                if (Next(L'}')) {
+                    max = kUnbounded;
+                }
+                else {
+                    status = ParseNumber(max);
+                    if (status != ParseStatus::Ok)
+                        return status;
+                    if (max < min)
+                        return ParseStatus::Invalid;
+                }
+            }
+            if (!Next(L'}'))
+                return ParseStatus::Invalid;
+            ++_pos;
+            return ParseStatus::Ok;
+        }
+
+        ParseStatus ParseAtom(Node& out, size_t depth)
+        {
+            const wchar_t ch = _src[_pos];
+            switch (ch) {
+            case L'(':
+            {
+                ++_pos;
+                if (Next(L'?')) {
+                    if (Next(L':', 1))
+                        _pos += 2;
+                    else if (Next(L'=', 1) || Next(L'!', 1))
+                        return ParseStatus::Unsupported;   // look-ahead
+                    else
+                        return ParseStatus::Invalid;
+                }
+                const ParseStatus status = ParseAlternation(out, depth + 1);
+                if (status != ParseStatus::Ok)
+                    return status;
+                if (!Next(L')'))
+                    return ParseStatus::Invalid;
+                ++_pos;
+                return ParseStatus::Ok;
+            }
+            case L'*': case L'+': case L'?': case L'{':
+                return ParseStatus::Invalid;    // Nothing to repeat
+            case L'.':
+            {
+                ++_pos;
+                CharBits bits;
+                bits.set(Fold(L'\n'));
+                bits.set(Fold(L'\r'));
+                out = SetNode(_sets.Add(~bits));
+                return ParseStatus::Ok;
+            }
+            case L'[':
+                return ParseClass(out);
+            case L'\\':
+                return ParseEscape(out);
+            case L'^':
+            case L'$':
+                ++_pos;
+                out.kind = Node::Kind::Assert;
+                out.assertion = (ch == L'^') ? Assertion::TextStart : Assertion::TextEnd;
+                return ParseStatus::Ok;
+            default:
+                ++_pos;
+                out = SetNode(_sets.Single(ch));
+                return ParseStatus::Ok;
+            }
+        }
+
+        /** Handles \d \D \s \S \w \W; returns false for any other letter. */
+        static bool ClassEscape(wchar_t esc, CharBits& bits)
+        {
+            const auto& tables = Tables();
+            switch (esc) {
+            case L'd': bits = tables.digit;  return true;
+            case L'D': bits = ~tables.digit; return true;
+            case L's': bits = tables.space;  return true;
+            case L'S': bits = ~tables.space; return true;
+            case L'w': bits = tables.word;   return true;
+            case L'W': bits = ~tables.word;  return true;
+            default:   return false;
+            }
+        }
+
+        ParseStatus HexDigits(size_t count, wchar_t& out)
+        {
+            std::uint32_t v = 0;
+            for (size_t i = 0; i < count; ++i, ++_pos) {
+                if (AtEnd())
+                    return ParseStatus::Invalid;
+                const wchar_t h = _src[_pos];
+                v <<= 4;
+                if (h >= L'0' && h <= L'9')      v |= h - L'0';
+                else if (h >= L'a' && h <= L'f') v |= h - L'a' + 10;
+                else if (h >= L'A' && h <= L'F') v |= h - L'A' + 10;
+                else return ParseStatus::Invalid;
+            }
+            out = static_cast<wchar_t>(v);
+            return ParseStatus::Ok;
+        }
+
+        /** Character escapes shared by atoms and classes; _pos is past the escaped char. */
+        ParseStatus CharEscape(wchar_t esc, wchar_t& out)
+        {
+            switch (esc) {
+            case L't': out = L'\t'; return ParseStatus::Ok;
+            case L'n': out = L'\n'; return ParseStatus::Ok;
+            case L'v': out = L'\v'; return ParseStatus::Ok;
+            case L'f': out = L'\f'; return ParseStatus::Ok;
+            case L'r': out = L'\r'; return ParseStatus::Ok;
+            case L'0':
+                if (!AtEnd() && _src[_pos] >= L'0' && _src[_pos] <= L'9')
+                    return ParseStatus::Unsupported;
+                out = L'\0';
+                return ParseStatus::Ok;
+            case L'x': return HexDigits(2, out);
+            case L'u': return HexDigits(4, out);
+            case L'c':
+                if (AtEnd() || !((_src[_pos] >= L'a' && _src[_pos] <= L'z') ||
+                                 (_src[_pos] >= L'A' && _src[_pos] <= L'Z')))
+                    return ParseStatus::Invalid;
+                out = static_cast<wchar_t>(_src[_pos++] % 32);
+                return ParseStatus::Ok;
+            default:
+                break;
+            }
+            // Back-references and unknown letter escapes are left to std::wregex
+            if ((esc >= L'0' && esc <= L'9') || (esc >= L'a' && esc <= L'z') ||
+                (esc >= L'A' && esc <= L'Z'))
+                return ParseStatus::Unsupported;
+            out = esc;   // Identity escape: \. \\ \$ \( ...
+            return ParseStatus::Ok;
+        }
+
+        ParseStatus ParseEscape(Node& out)
+        {
+            ++_pos;     // '\'
+            if (AtEnd())
+                return ParseStatus::Invalid;
+            const wchar_t esc = _src[_pos++];
+
+            CharBits bits;
+            if (ClassEscape(esc, bits)) {
+                out = SetNode(_sets.Add(bits));
+                return ParseStatus::Ok;
+            }
+            if (esc == L'b' || esc == L'B') {
+                out.kind = Node::Kind::Assert;
+                out.assertion = (esc == L'b') ? Assertion::WordBoundary
+                                              : Assertion::NotWordBoundary;
+                return ParseStatus::Ok;
+            }
+
+            wchar_t ch = 0;
+            const ParseStatus status = CharEscape(esc, ch);
+            if (status == ParseStatus::Ok)
+                out = SetNode(_sets.Single(ch));
+            return status;
+        }
+
+        /** Reads one class member: a character, or a class escape into bits. */
+        ParseStatus ClassAtom(wchar_t& ch, bool& isClass, CharBits& bits)
+        {
+            isClass = false;
+            const wchar_t c = _src[_pos++];
+            if (c != L'\\') {
+                ch = c;
+                return ParseStatus::Ok;
+            }
+            if (AtEnd())
+                return ParseStatus::Invalid;
+            const wchar_t esc = _src[_pos++];
+            if (ClassEscape(esc, bits)) {
+                isClass = true;
+                return ParseStatus::Ok;
+            }
+            if (esc == L'b') {
+                ch = L'\b';
+                return ParseStatus::Ok;
+            }
+            if (esc == L'B')
+                return ParseStatus::Unsupported;
+            return CharEscape(esc, ch);
+        }
+
+        ParseStatus ParseClass(Node& out)
+        {
+            ++_pos;     // '['
+            bool negate = false;
+            if (Next(L'^')) {
+                negate = true;
+                ++_pos;
+            }
+            if (Next(L']'))
+                return ParseStatus::Unsupported;   // "[]" differs between regex libraries
+
+            const auto& fold = Tables().fold;
+            CharBits bits;
+            for (;;) {
+                if (AtEnd())
+                    return ParseStatus::Invalid;
+                if (Next(L']')) {
+                    ++_pos;
+                    break;
+                }
+                if (Next(L'[') && (Next(L':', 1) || Next(L'.', 1) || Next(L'=', 1)))
+                    return ParseStatus::Unsupported;   // POSIX classes
+
+                wchar_t lo = 0;
+                bool isClass = false;
+                CharBits classBits;
+                ParseStatus status = ClassAtom(lo, isClass, classBits);
+                if (status != ParseStatus::Ok)
+                    return status;
+
+                const bool range = Next(L'-') && _pos + 1 < _src.size() && !Next(L']', 1);
+                if (isClass) {
+                    if (range)
+                        return ParseStatus::Unsupported;
+                    bits |= classBits;
+                    continue;
+                }
+                if (!range) {
+                    bits.set(static_cast<std::uint16_t>(fold[static_cast<std::uint16_t>(lo)]));
+                    continue;
+                }
+
+                ++_pos;     // '-'
+                wchar_t hi = 0;
+                status = ClassAtom(hi, isClass, classBits);
+                if (status != ParseStatus::Ok)
+                    return status;
+                if (isClass)
+                    return ParseStatus::Unsupported;
+                const auto first = static_cast<std::uint16_t>(lo);
+                const auto last = static_cast<std::uint16_t>(hi);
+                if (last < first)
+                    return ParseStatus::Invalid;
+                for (std::uint32_t c = first; c <= last; ++c)
+                    bits.set(static_cast<std::uint16_t>(fold[c]));
+            }
+            if (negate)
+                bits.flip();
+            out = SetNode(_sets.Add(bits));
+            return ParseStatus::Ok;
+        }
+
+        std::wstring_view _src;
+        size_t            _pos = 0;
+        SetTable&         _sets;
+    };
+
+    /** Upper bound of NFA instructions a node emits, saturating above kMaxRuleInsts. */
+    size_t EstimateInsts(const Node& node)
+    {
+        auto add = [](size_t a, size_t b) { return std::min(a + b, kMaxRuleInsts + 1); };
+        switch (node.kind) {
+        case Node::Kind::Concat:
+        case Node::Kind::Alt:
+        {
+            size_t total = node.kids.size();
+            for (const auto& kid : node.kids)
+                total = add(total, EstimateInsts(kid));
+            return total;
+        }
+        case Node::Kind::Repeat:
+        {
+            const size_t copies = (node.max == kUnbounded)
+                ? std::max<size_t>(node.min, 1)
+                : node.max;
+            const size_t each = add(EstimateInsts(node.kids.front()), 1);
+            if (copies != 0 && each > (kMaxRuleInsts + 1) / copies)
+                return kMaxRuleInsts + 1;
+            return add(each * copies, 1);
+        }
+        default:
+            return 1;
+        }
+    }
+
+    //--------------------------------------------------------------------------
+    // NFA
+    //--------------------------------------------------------------------------
+    struct Inst
+    {
+        enum class Op : std::uint8_t { Char, Split, Assert, Match, Nop };
+
+        Op            op;
+        std::uint32_t arg;      // Char: set; Assert: Assertion; Match: rule
+        std::uint32_t out;
+        std::uint32_t out1;     // Split only
+    };
+
+    /** Thompson construction; holes are (inst << 1 | edge) references to unpatched edges. */
+    class Emitter
+    {
+    public:
+        struct Frag
+        {
+            std::uint32_t start = kNone;
+            std::vector<std::uint32_t> holes;
+        };
+
+        explicit Emitter(std::vector<Inst>& insts) : _insts(insts) {}
+
+        void Patch(const std::vector<std::uint32_t>& holes, std::uint32_t target)
+        {
+            for (const auto hole : holes) {
+                Inst& inst = _insts[hole >> 1];
+                ((hole & 1) ? inst.out1 : inst.out) = target;
+            }
+        }
+
+        std::uint32_t Push(Inst::Op op, std::uint32_t arg = 0)
+        {
+            _insts.push_back({ op, arg, kNone, kNone });
+            return static_cast<std::uint32_t>(_insts.size() - 1);
+        }
+
+        Frag Emit(const Node& node)
+        {
+            switch (node.kind) {
+            case Node::Kind::Set:
+                return Single(Inst::Op::Char, node.set);
+            case Node::Kind::Assert:
+                return Single(Inst::Op::Assert, static_cast<std::uint32_t>(node.assertion));
+            case Node::Kind::Concat:
+            {
+                Frag seq;
+                for (const auto& kid : node.kids)
+                    Append(seq, Emit(kid));
+                return seq.start == kNone ? Single(Inst::Op::Nop) : seq;
+            }
+            case Node::Kind::Alt:
+            {
+                Frag alt;
+                std::uint32_t prevSplit = kNone;
+                for (size_t i = 0; i < node.kids.size(); ++i) {
+                    Frag branch = Emit(node.kids[i]);
+                    std::uint32_t entry = branch.start;
+                    if (i + 1 < node.kids.size()) {
+                        entry = Push(Inst::Op::Split);
+                        _insts[entry].out = branch.start;
+                    }
+                    if (prevSplit == kNone)
+                        alt.start = entry;
+                    else
+                        _insts[prevSplit].out1 = entry;
+                    prevSplit = entry;
+                    alt.holes.insert(alt.holes.end(), branch.holes.begin(), branch.holes.end());
+                }
+                return alt;
+            }
+            case Node::Kind::Repeat:
+                return EmitRepeat(node.kids.front(), node.min, node.max);
+            default:
+                return Single(Inst::Op::Nop);
+            }
+        }
+
+    private:
+        Frag Single(Inst::Op op, std::uint32_t arg = 0)
+        {
+            const std::uint32_t pc = Push(op, arg);
+            return { pc, { pc << 1 } };
+        }
+
+        void Append(Frag& seq, Frag next)
+        {
+            if (seq.start == kNone) {
+                seq = std::move(next);
+                return;
+            }
+            Patch(seq.holes, next.start);
+            seq.holes = std::move(next.holes);
+        }
+
+        /** x+ : x followed by a split looping back to x. */
+        Frag Plus(const Node& x)
+        {
+            Frag body = Emit(x);
+            const std::uint32_t loop = Push(Inst::Op::Split);
+            _insts[loop].out = body.start;
+            Patch(body.holes, loop);
+            return { body.start, { (loop << 1) | 1 } };
+        }
+
+        Frag EmitRepeat(const Node& x, std::uint32_t min, std::uint32_t max)
+        {
+            if (max == 0)
+                return Single(Inst::Op::Nop);
+
+            Frag seq;
+            if (max == kUnbounded) {
+                if (min == 0) {
+                    // x* : split into x (looping back) or out
+                    const std::uint32_t loop = Push(Inst::Op::Split);
+                    Frag body = Emit(x);
+                    _insts[loop].out = body.start;
+                    Patch(body.holes, loop);
+                    return { loop, { (loop << 1) | 1 } };
+                }
+                for (std::uint32_t i = 0; i + 1 < min; ++i)
+                    Append(seq, Emit(x));
+                Append(seq, Plus(x));
+                return seq;
+            }
+
+            for (std::uint32_t i = 0; i < min; ++i)
+                Append(seq, Emit(x));
+
+            // (max - min) nested optionals: (x(x(x)?)?)?
+            Frag optional;
+            std::vector<std::uint32_t> previous;
+            for (std::uint32_t i = min; i < max; ++i) {
+                const std::uint32_t split = Push(Inst::Op::Split);
+                if (optional.start == kNone)
+                    optional.start = split;
+                else
+                    Patch(previous, split);
+                Frag body = Emit(x);
+                _insts[split].out = body.start;
+                optional.holes.push_back((split << 1) | 1);
+                previous = std::move(body.holes);
+            }
+            if (optional.start != kNone) {
+                optional.holes.insert(optional.holes.end(), previous.begin(), previous.end());
+                Append(seq, std::move(optional));
+            }
+            return seq;
+        }
+
+        std::vector<Inst>& _insts;
+    };
+
+    /** Set of small integers with O(1) insert and clear. */
+    class SparseSet
+    {
+    public:
+        void Resize(size_t n)
+        {
+            _dense.assign(n, 0);
+            _sparse.assign(n, 0);
+            _size = 0;
+        }
+        void Clear() { _size = 0; }
+        bool Insert(std::uint32_t v)
+        {
+            const std::uint32_t i = _sparse[v];
+            if (i < _size && _dense[i] == v)
+                return false;
+            _dense[_size] = v;
+            _sparse[v] = static_cast<std::uint32_t>(_size++);
+            return true;
+        }
+
+    private:
+        std::vector<std::uint32_t> _dense;
+        std::vector<std::uint32_t> _sparse;
+        size_t _size = 0;
+    };
+
+    /**
+     * Lazily built DFA. A state is the sorted set of NFA instructions reached after the
+     * last consumed character (its kernel) plus that character's Context.
+     *
+     * Unanchored DFAs re-add their seeds after every character, so a match may start
+     * anywhere; anchored DFAs only start at the position they are run from.
+     */
+    struct LazyDfa
+    {
+        std::vector<std::int32_t> trans;        // state * stride + class
+        std::vector<std::int32_t> endResult;    // kUnknown, kNoMatch or rule at end of text
+        std::vector<const std::u32string*> keys;
+        std::unordered_map<std::u32string, std::int32_t> index;
+        std::array<std::int32_t, 3> start{ kUnknown, kUnknown, kUnknown };  // Per Context
+        std::vector<std::uint32_t> seeds;       // Start instructions
+        bool anchored = false;
+        size_t stride = 0;
+        size_t epoch = 0;                       // Bumped whenever the cache is flushed
+
+        void Reset(size_t classCount)
+        {
+            trans.clear();
+            endResult.clear();
+            keys.clear();
+            index.clear();
+            start.fill(kUnknown);
+            stride = classCount;
+            ++epoch;
+        }
+    };
+
+    //--------------------------------------------------------------------------
+    // Literal prefixes (prefilter)
+    //--------------------------------------------------------------------------
+    constexpr size_t kMaxLiterals = 64;         // Per rule
+    constexpr size_t kMaxLiteralLength = 16;    // Longer prefixes are cut
+    constexpr size_t kMinLiteralLength = 2;     // Shorter ones would fire on most text
+    constexpr size_t kMaxSetExpansion = 4;      // Larger character sets end a literal
+
+    using Literal = std::vector<std::uint16_t>; // Sequence of character classes
+
+    /**
+     * Strings every match of a node starts with. "exact" strings are complete matches,
+     * "open" strings are prefixes of longer matches. An open empty string means the
+     * node can start with something we could not enumerate.
+     */
+    struct Prefixes
+    {
+        std::vector<Literal> exact;
+        std::vector<Literal> open;
+    };
+
+    class PrefixExtractor
+    {
+    public:
+        PrefixExtractor(const std::vector<std::uint64_t>& setClasses, size_t setWords,
+            size_t classCount)
+            : _setClasses(setClasses), _setWords(setWords), _classCount(classCount)
+        {
+        }
+
+        Prefixes Extract(const Node& node) const
+        {
+            switch (node.kind) {
+            case Node::Kind::Set:
+                return FromSet(node.set);
+            case Node::Kind::Concat:
+            {
+                Prefixes acc = Epsilon();
+                for (const auto& kid : node.kids) {
+                    if (acc.exact.empty())
+                        break;
+                    acc = Cross(std::move(acc), Extract(kid));
+                }
+                return acc;
+            }
+            case Node::Kind::Alt:
+            {
+                Prefixes all;
+                for (const auto& kid : node.kids) {
+                    Prefixes branch = Extract(kid);
+                    all.exact.insert(all.exact.end(), branch.exact.begin(), branch.exact.end());
+                    all.open.insert(all.open.end(), branch.open.begin(), branch.open.end());
+                    if (all.exact.size() + all.open.size() > kMaxLiterals)
+                        return Unknown();
+                }
+                Normalize(all);
+                return all;
+            }
+            case Node::Kind::Repeat:
+                return FromRepeat(node);
+            default:
+                return Epsilon();   // Empty and zero-width assertions
+            }
+        }
+
+    private:
+        static Prefixes Epsilon()
+        {
+            Prefixes p;
+            p.exact.emplace_back();
+            return p;
+        }
+
+        static Prefixes Unknown()
+        {
+            Prefixes p;
+            p.open.emplace_back();
+            return p;
+        }
+
+        static void Normalize(Prefixes& p)
+        {
+            for (auto* list : { &p.exact, &p.open }) {
+                std::sort(list->begin(), list->end());
+                list->erase(std::unique(list->begin(), list->end()), list->end());
+            }
+        }
+
+        Prefixes FromSet(std::uint32_t set) const
+        {
+            Prefixes p;
+            for (size_t cls = 0; cls < _classCount; ++cls) {
+                if (!((_setClasses[set * _setWords + cls / 64] >> (cls % 64)) & 1))
+                    continue;
+                if (p.exact.size() == kMaxSetExpansion)
+                    return Unknown();
+                p.exact.push_back(Literal{ static_cast<std::uint16_t>(cls) });
+            }
+            return p;
+        }
+
+        static void Join(Prefixes& out, const Literal& head, const Literal& tail, bool exact)
+        {
+            Literal joined(head);
+            joined.insert(joined.end(), tail.begin(), tail.end());
+            if (joined.size() > kMaxLiteralLength) {
+                joined.resize(kMaxLiteralLength);
+                exact = false;
+            }
+            (exact ? out.exact : out.open).push_back(std::move(joined));
+        }
+
+        static Prefixes Cross(Prefixes head, const Prefixes& tail)
+        {
+            Prefixes out;
+            out.open = std::move(head.open);
+            const size_t product = out.open.size() +
+                head.exact.size() * (tail.exact.size() + tail.open.size());
+            if (product > kMaxLiterals) {
+                // Stop growing: what we have so far are prefixes of every match
+                out.open.insert(out.open.end(), head.exact.begin(), head.exact.end());
+                Normalize(out);
+                return out;
+            }
+            for (const auto& e : head.exact) {
+                for (const auto& x : tail.exact)
+                    Join(out, e, x, true);
+                for (const auto& y : tail.open)
+                    Join(out, e, y, false);
+            }
+            Normalize(out);
+            return out;
+        }
+
+        Prefixes FromRepeat(const Node& node) const
+        {
+            if (node.max == 0)
+                return Epsilon();
+
+            const Prefixes once = Extract(node.kids.front());
+            Prefixes acc = once;
+            const std::uint32_t copies = std::max<std::uint32_t>(node.min, 1);
+            for (std::uint32_t i = 1; i < copies && !acc.exact.empty(); ++i)
+                acc = Cross(std::move(acc), once);
+            if (node.max != copies) {
+                // More copies may follow, so complete strings become prefixes
+                acc.open.insert(acc.open.end(), acc.exact.begin(), acc.exact.end());
+                acc.exact.clear();
+            }
+            if (node.min == 0)
+                acc.exact.emplace_back();
+            Normalize(acc);
+            return acc;
+        }
+
+        const std::vector<std::uint64_t>& _setClasses;
+        size_t _setWords;
+        size_t _classCount;
+    };
+
+    bool HasAssertion(const Node& node)
+    {
+        if (node.kind == Node::Kind::Assert)
+            return true;
+        return std::any_of(node.kids.begin(), node.kids.end(), HasAssertion);
+    }
+
+    /** Aho-Corasick automaton over character classes, stored as a full DFA. */
+    struct LiteralAutomaton
+    {
+        struct Output
+        {
+            std::uint32_t rule;     // Index into Program::rules
+            std::uint32_t length;   // Literal length, to find where the match starts
+            bool          direct;   // The literal is a complete match on its own
+        };
+
+        std::vector<std::int32_t>  next;        // Row offset of the target, by row + class
+        std::vector<std::uint32_t> outBegin;    // By state - first output state, CSR into outputs
+        std::vector<Output>        outputs;
+        size_t                     stride = 0;
+        std::int32_t               firstOutputRow = 0;  // Rows from here on have outputs
+        std::vector<std::uint8_t>  leavesRoot;  // Per class: can start a literal
+
+        void Build(const std::vector<std::pair<Literal, Output>>& literals, size_t classCount)
+        {
+            stride = classCount;
+            next.assign(stride, -1);
+            std::vector<std::vector<Output>> own(1);
+
+            // Trie
+            for (const auto& [literal, output] : literals) {
+                std::int32_t state = 0;
+                for (const auto cls : literal) {
+                    std::int32_t target = next[state * stride + cls];
+                    if (target < 0) {
+                        target = static_cast<std::int32_t>(own.size());
+                        own.emplace_back();
+                        next.resize(next.size() + stride, -1);
+                        next[state * stride + cls] = target;
+                    }
+                    state = target;
+                }
+                own[state].push_back(output);
+            }
+
+            // Failure links folded into a complete transition table (BFS order)
+            const size_t stateCount = own.size();
+            std::vector<std::int32_t> fail(stateCount, 0);
+            std::vector<std::int32_t> order;
+            order.reserve(stateCount);
+            for (size_t cls = 0; cls < stride; ++cls) {
+                std::int32_t& target = next[cls];
+                if (target < 0) {
+                    target = 0;
+                }
+                else {
+                    fail[target] = 0;
+                    order.push_back(target);
+                }
+            }
+            for (size_t head = 0; head < order.size(); ++head) {
+                const std::int32_t state = order[head];
+                own[state].insert(own[state].end(), own[fail[state]].begin(), own[fail[state]].end());
+                for (size_t cls = 0; cls < stride; ++cls) {
+                    std::int32_t& target = next[state * stride + cls];
+                    const std::int32_t viaFail = next[fail[state] * stride + cls];
+                    if (target < 0) {
+                        target = viaFail;
+                    }
+                    else {
+                        fail[target] = viaFail;
+                        order.push_back(target);
+                    }
+                }
+            }
+
+            // Renumber so that states with outputs come last, and store row offsets in the
+            // table: the scan loop then needs one compare to know whether to look at outputs
+            std::vector<std::int32_t> renumber(stateCount);
+            std::int32_t id = 0;
+            for (int pass = 0; pass < 2; ++pass) {
+                for (size_t state = 0; state < stateCount; ++state) {
+                    if (own[state].empty() == (pass == 0))
+                        renumber[state] = id++;
+                }
+            }
+            std::vector<std::int32_t> table(next.size());
+            for (size_t state = 0; state < stateCount; ++state) {
+                for (size_t cls = 0; cls < stride; ++cls) {
+                    table[renumber[state] * stride + cls] =
+                        renumber[next[state * stride + cls]] * static_cast<std::int32_t>(stride);
+                }
+            }
+            next = std::move(table);
+            leavesRoot.assign(stride, 0);
+            for (size_t cls = 0; cls < stride; ++cls)
+                leavesRoot[cls] = next[cls] != 0;
+
+            const auto quiet = static_cast<std::int32_t>(
+                std::count_if(own.begin(), own.end(), [](const auto& o) { return o.empty(); }));
+            firstOutputRow = quiet * static_cast<std::int32_t>(stride);
+            outBegin.assign(stateCount - quiet + 1, 0);
+            outputs.clear();
+            std::vector<std::int32_t> original(stateCount);
+            for (size_t state = 0; state < stateCount; ++state)
+                original[renumber[state]] = static_cast<std::int32_t>(state);
+            for (size_t slot = 0; slot + quiet < stateCount; ++slot) {
+                const auto& list = own[original[slot + quiet]];
+                outBegin[slot] = static_cast<std::uint32_t>(outputs.size());
+                outputs.insert(outputs.end(), list.begin(), list.end());
+            }
+            outBegin.back() = static_cast<std::uint32_t>(outputs.size());
+        }
+    };
+
+    //--------------------------------------------------------------------------
+    // Serialization
+    //--------------------------------------------------------------------------
+    constexpr std::uint32_t kFormatMagic = 0x4D505258;  // "XRPM"
+    constexpr std::uint32_t kFormatVersion = 3;         // Bump with any change to Program
+
+    /** Appends plain values; sizes are always written as 64 bits so x86 and x64 agree. */
+    class ByteWriter
+    {
+    public:
+        template <typename T>
+        void Put(const T& value)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            const auto* bytes = reinterpret_cast<const std::uint8_t*>(&value);
+            _bytes.insert(_bytes.end(), bytes, bytes + sizeof(T));
+        }
+
+        template <typename T>
+        void PutArray(const std::vector<T>& values)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            Put<std::uint64_t>(values.size());
+            const auto* bytes = reinterpret_cast<const std::uint8_t*>(values.data());
+            _bytes.insert(_bytes.end(), bytes, bytes + values.size() * sizeof(T));
+        }
+
+        void PutString(const std::wstring& text)
+        {
+            Put<std::uint64_t>(text.size());
+            const auto* bytes = reinterpret_cast<const std::uint8_t*>(text.data());
+            _bytes.insert(_bytes.end(), bytes, bytes + text.size() * sizeof(wchar_t));
+        }
+
+        std::vector<std::uint8_t> Take() { return std::move(_bytes); }
+
+    private:
+        std::vector<std::uint8_t> _bytes;
+    };
+
+    /** Reads what ByteWriter wrote; every read is bounds-checked. */
+    class ByteReader
+    {
+    public:
+        ByteReader(const std::uint8_t* data, size_t size) : _data(data), _left(size) {}
+
+        template <typename T>
+        bool Get(T& value)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            if (_left < sizeof(T))
+                return false;
+            std::memcpy(&value, _data, sizeof(T));
+            Skip(sizeof(T));
+            return true;
+        }
+
+        bool GetSize(size_t& value)
+        {
+            std::uint64_t wide = 0;
+            if (!Get(wide) || wide > SIZE_MAX)
+                return false;
+            value = static_cast<size_t>(wide);
+            return true;
+        }
+
+        template <typename T>
+        bool GetArray(std::vector<T>& values)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            size_t count = 0;
+            if (!GetSize(count) || count > _left / sizeof(T))
+                return false;
+            values.resize(count);
+            if (count)
+                std::memcpy(values.data(), _data, count * sizeof(T));
+            Skip(count * sizeof(T));
+            return true;
+        }
+
+        bool GetString(std::wstring& text)
+        {
+            size_t count = 0;
+            if (!GetSize(count) || count > _left / sizeof(wchar_t))
+                return false;
+            text.resize(count);
+            if (count)
+                std::memcpy(text.data(), _data, count * sizeof(wchar_t));
+            Skip(count * sizeof(wchar_t));
+            return true;
+        }
+
+        bool AtEnd() const { return _left == 0; }
+
+    private:
+        void Skip(size_t n) { _data += n; _left -= n; }
+
+        const std::uint8_t* _data;
+        size_t _left;
+    };
+} // anonymous namespace
+
+//------------------------------------------------------------------------------
+// Internal state
+//------------------------------------------------------------------------------
+struct PatternMatcher::Pending
+{
+    SetTable sets;
+    std::vector<std::pair<int, Node>> rules;    // rule index, AST
+};
+
+struct PatternMatcher::ScratchData
+{
+    /** DFA caches of one tier's program. */
+    struct Caches
+    {
+        LazyDfa                base;            // All rules, unanchored
+        std::vector<std::unique_ptr<LazyDfa>> verify; // Anchored, per literal rule
+    };
+
+    std::uint64_t              generation = 0;
+    std::vector<Caches>        tiers;           // Per tier of the matcher
+    Caches*                    caches = nullptr; // Of the tier being scanned
+    SparseSet                  visited;
+    std::vector<std::uint32_t> stack;
+    std::vector<std::uint32_t> chars;           // Char instructions of the last closure
+    std::u32string             kernel;
+
+    // End state of the running scan, for a Checkpoint
+    bool                       recording = false;
+    std::u32string             endState;        // Search DFA state at the end of text
+    std::int32_t               endRow = 0;      // Literal automaton row at the end of text
+    std::vector<std::pair<std::uint32_t, std::u32string>> openRuns; // Verifications alive at the end
+    bool                       tooManyOpenRuns = false;
+
+    // Limits of the running scan
+    const std::atomic<bool>*   cancel = nullptr;
+    std::chrono::steady_clock::time_point deadline;
+    bool                       hasDeadline = false;
+    bool                       atTextEnd = true;    // False if the text was cut by the budget
+    bool                       gaveUp = false;      // std::wregex could not finish a rule
+    PatternMatcher::ScanStatus stopReason = PatternMatcher::ScanStatus::Complete;
+
+    /** Checked between chunks; records why the scan has to stop. */
+    bool Stopped()
+    {
+        if (cancel && cancel->load(std::memory_order_relaxed)) {
+            stopReason = PatternMatcher::ScanStatus::Cancelled;
+            return true;
+        }
+        if (hasDeadline && std::chrono::steady_clock::now() >= deadline) {
+            stopReason = PatternMatcher::ScanStatus::Partial;
+            return true;
+        }
+        return false;
+    }
+
+    /** Keeps an anchored run that reached the end of text undecided; more text may decide it. */
+    void RecordOpenRun(std::uint32_t r, const std::u32string& state)
+    {
+        if (!recording || tooManyOpenRuns)
+            return;
+        for (const auto& run : openRuns) {
+            if (run.first == r && run.second == state)
+                return;     // Equal states behave the same from here on
+        }
+        if (openRuns.size() >= kMaxOpenRuns) {
+            tooManyOpenRuns = true;
+            return;
+        }
+        openRuns.emplace_back(r, state);
+    }
+};
+
+struct PatternMatcher::CheckpointData
+{
+    /** End state of one tier's automaton. */
+    struct Pass
+    {
+        std::u32string state;       // Search DFA state, if the search DFA ran
+        std::int32_t   row = 0;     // Literal automaton row, if the literal pass ran
+        std::vector<std::pair<std::uint32_t, std::u32string>> openRuns;
+    };
+
+    bool              valid = false;
+    std::uint64_t     generation = 0;
+    size_t            length = 0;   // Characters the state was taken after
+    std::uint64_t     hash = 0;     // HashText() of those characters
+    std::vector<Pass> tiers;        // Per tier of the matcher
+};
+
+struct PatternMatcher::Program
+{
+    struct Rule
+    {
+        int           id;       // Index in AddPattern() order
+        std::uint32_t start;    // First NFA instruction
+    };
+
+    std::vector<Inst>          insts;
+    std::vector<std::uint16_t> classMap;        // UTF-16 unit -> class
+    std::vector<Context>       classContext;    // kWord / kOther per class
+    std::vector<std::uint64_t> setClasses;      // Per set: bitmap over classes
+    size_t                     setWords = 0;
+    size_t                     classCount = 0;
+    std::vector<Rule>          rules;
+    std::vector<std::uint32_t> baseSeeds;       // All rule starts, unless the prefilter gates them
+    LiteralAutomaton           literals;
+
+    size_t ClassOf(wchar_t ch) const
+    {
+        return classMap[static_cast<std::uint16_t>(ch)];
+    }
+
+    bool SetHas(std::uint32_t set, size_t cls) const
+    {
+        return (setClasses[set * setWords + cls / 64] >> (cls % 64)) & 1;
+    }
+
+    void Write(ByteWriter& out) const
+    {
+        out.PutArray(insts);
+        out.PutArray(classMap);
+        out.PutArray(classContext);
+        out.PutArray(setClasses);
+        out.Put<std::uint64_t>(setWords);
+        out.Put<std::uint64_t>(classCount);
+        out.PutArray(rules);
+        out.PutArray(baseSeeds);
+        out.PutArray(literals.next);
+        out.PutArray(literals.outBegin);
+        out.PutArray(literals.outputs);
+        out.Put<std::uint64_t>(literals.stride);
+        out.Put(literals.firstOutputRow);
+        out.PutArray(literals.leavesRoot);
+    }
+
+    bool Read(ByteReader& in)
+    {
+        return in.GetArray(insts)
+            && in.GetArray(classMap)
+            && in.GetArray(classContext)
+            && in.GetArray(setClasses)
+            && in.GetSize(setWords)
+            && in.GetSize(classCount)
+            && in.GetArray(rules)
+            && in.GetArray(baseSeeds)
+            && in.GetArray(literals.next)
+            && in.GetArray(literals.outBegin)
+            && in.GetArray(literals.outputs)
+            && in.GetSize(literals.stride)
+            && in.Get(literals.firstOutputRow)
+            && in.GetArray(literals.leavesRoot);
+    }
+
+    /** Checks that every index a scan follows stays in range (for deserialized programs). */
+    bool Valid(size_t ruleCount) const
+    {
+        const size_t instCount = insts.size();
+        if (classCount == 0 || classCount > kAlphabet || classMap.size() != kAlphabet ||
+            classContext.size() != classCount || setWords != (classCount + 63) / 64 ||
+            setClasses.size() % setWords != 0 || rules.empty())
+            return false;
+        if (std::any_of(classMap.begin(), classMap.end(),
+            [&](std::uint16_t cls) { return cls >= classCount; }))
+            return false;
+
+        const size_t setCount = setClasses.size() / setWords;
+        for (const Inst& inst : insts) {
+            switch (inst.op) {
+            case Inst::Op::Char:
+                if (inst.arg >= setCount || inst.out >= instCount) return false;
+                break;
+            case Inst::Op::Split:
+                if (inst.out >= instCount || inst.out1 >= instCount) return false;
+                break;
+            case Inst::Op::Nop:
+                if (inst.out >= instCount) return false;
+                break;
+            case Inst::Op::Assert:
+                if (inst.arg > static_cast<std::uint32_t>(Assertion::NotWordBoundary) ||
+                    inst.out >= instCount) return false;
+                break;
+            case Inst::Op::Match:
+                if (inst.arg >= ruleCount) return false;
+                break;
+            default:
+                return false;
+            }
+        }
+        for (const Rule& rule : rules) {
+            if (rule.id < 0 || static_cast<size_t>(rule.id) >= ruleCount || rule.start >= instCount)
+                return false;
+        }
+        for (const auto seed : baseSeeds) {
+            if (seed >= instCount)
+                return false;
+        }
+        if (!baseSeeds.empty())
+            return true;
+
+        // Gated: the literal automaton must be complete and consistent
+        const size_t tableSize = literals.next.size();
+        if (literals.stride != classCount || tableSize == 0 || tableSize % classCount != 0 ||
+            literals.leavesRoot.size() != classCount || literals.firstOutputRow < 0 ||
+            static_cast<size_t>(literals.firstOutputRow) > tableSize ||
+            literals.firstOutputRow % classCount != 0)
+            return false;
+        for (const auto row : literals.next) {
+            if (row < 0 || static_cast<size_t>(row) >= tableSize || row % classCount != 0)
+                return false;
+        }
+        const size_t outputStates = (tableSize - literals.firstOutputRow) / classCount;
+        if (literals.outBegin.size() != outputStates + 1 || literals.outBegin.front() != 0 ||
+            literals.outBegin.back() != literals.outputs.size() ||
+            !std::is_sorted(literals.outBegin.begin(), literals.outBegin.end()))
+            return false;
+        return std::all_of(literals.outputs.begin(), literals.outputs.end(),
+            [&](const LiteralAutomaton::Output& o) { return o.rule < rules.size(); });
+    }
+
+    /** Follows epsilon edges from a kernel; fills s.chars and returns the lowest matched rule. */
+    int Closure(ScratchData& s, const std::u32string& key, Context next) const
+    {
+        const auto prev = static_cast<Context>(key.back());
+        int best = kNoMatch;
+        s.visited.Clear();
+        s.chars.clear();
+        s.stack.assign(key.begin(), key.end() - 1);
+        while (!s.stack.empty()) {
+            const std::uint32_t pc = s.stack.back();
+            s.stack.pop_back();
+            if (!s.visited.Insert(pc))
+                continue;
+            const Inst& inst = insts[pc];
+            switch (inst.op) {
+            case Inst::Op::Char:
+                s.chars.push_back(pc);
+                break;
+            case Inst::Op::Split:
+                s.stack.push_back(inst.out1);
+                s.stack.push_back(inst.out);
+                break;
+            case Inst::Op::Nop:
+                s.stack.push_back(inst.out);
+                break;
+            case Inst::Op::Assert:
+                if (Holds(static_cast<Assertion>(inst.arg), prev, next))
+                    s.stack.push_back(inst.out);
+                break;
+            case Inst::Op::Match:
+                if (best == kNoMatch || static_cast<int>(inst.arg) < best)
+                    best = static_cast<int>(inst.arg);
+                break;
+            }
+        }
+        return best;
+    }
+
+    std::int32_t Intern(LazyDfa& dfa, const std::u32string& key) const
+    {
+        auto it = dfa.index.find(key);
+        if (it != dfa.index.end())
+            return it->second;
+        if (dfa.keys.size() >= kMaxDfaStates)
+            dfa.Reset(classCount);
+
+        const auto id = static_cast<std::int32_t>(dfa.keys.size());
+        auto inserted = dfa.index.emplace(key, id).first;
+        dfa.keys.push_back(&inserted->first);
+        dfa.trans.resize(dfa.trans.size() + dfa.stride, kUnknown);
+        dfa.endResult.push_back(kUnknown);
+        return id;
+    }
+
+    std::int32_t Start(LazyDfa& dfa, ScratchData& s, Context prev) const
+    {
+        std::int32_t& start = dfa.start[prev];
+        if (start == kUnknown) {
+            s.kernel.assign(dfa.seeds.begin(), dfa.seeds.end());
+            std::sort(s.kernel.begin(), s.kernel.end());
+            s.kernel.push_back(prev);
+            const std::int32_t state = Intern(dfa, s.kernel);
+            dfa.start[prev] = state;    // Intern may have flushed the cache
+            return state;
+        }
+        return start;
+    }
+
+    std::int32_t Transition(LazyDfa& dfa, ScratchData& s, std::int32_t state, size_t cls) const
+    {
+        const std::u32string& key = *dfa.keys[state];
+        const Context next = classContext[cls];
+        const int best = Closure(s, key, next);
+        if (best != kNoMatch) {
+            dfa.trans[state * dfa.stride + cls] = kMatchBase - best;
+            return kMatchBase - best;
+        }
+
+        if (dfa.anchored)
+            s.kernel.clear();
+        else
+            s.kernel.assign(dfa.seeds.begin(), dfa.seeds.end());
+        for (const auto pc : s.chars) {
+            if (SetHas(insts[pc].arg, cls))
+                s.kernel.push_back(insts[pc].out);
+        }
+        if (s.kernel.empty()) {
+            dfa.trans[state * dfa.stride + cls] = kDead;
+            return kDead;
+        }
+        std::sort(s.kernel.begin(), s.kernel.end());
+        s.kernel.erase(std::unique(s.kernel.begin(), s.kernel.end()), s.kernel.end());
+        s.kernel.push_back(next);
+
+        const size_t epoch = dfa.epoch;
+        const std::int32_t target = Intern(dfa, s.kernel);
+        if (dfa.epoch == epoch)
+            dfa.trans[state * dfa.stride + cls] = target;
+        return target;
+    }
+
+    int EndOfText(LazyDfa& dfa, ScratchData& s, std::int32_t state) const
+    {
+        std::int32_t& result = dfa.endResult[state];
+        if (result == kUnknown)
+            result = Closure(s, *dfa.keys[state], kEdge);
+        return result;
+    }
+
+    /**
+     * Runs a DFA from the start of text (preceded by prev) to its end. The DFA state
+     * carries over from chunk to chunk, so matches spanning chunk borders need no overlap.
+     */
+    int Run(LazyDfa& dfa, ScratchData& s, std::wstring_view text, Context prev) const
+    {
+        std::int32_t state = Start(dfa, s, prev);
+        return Continue(dfa, s, text, state);
+    }
+
+    /**
+     * Runs a DFA over text from state. On kNoMatch, state is where the run ended, or
+     * kDead if it could not match any more.
+     */
+    int Continue(LazyDfa& dfa, ScratchData& s, std::wstring_view text, std::int32_t& state) const
+    {
+        for (size_t begin = 0; begin < text.size(); begin += kChunkLength) {
+            if (s.Stopped())
+                return kStopped;
+            const size_t end = std::min(text.size(), begin + kChunkLength);
+            for (size_t i = begin; i < end; ++i) {
+                const size_t cls = ClassOf(text[i]);
+                std::int32_t next = dfa.trans[state * dfa.stride + cls];
+                if (next == kUnknown)
+                    next = Transition(dfa, s, state, cls);
+                if (next == kDead) {
+                    state = kDead;
+                    return kNoMatch;
+                }
+                if (next <= kMatchBase)
+                    return kMatchBase - next;
+                state = next;
+            }
+        }
+        // Where the budget cut the text, "$" and "\\b" must not see an end
+        return s.atTextEnd ? EndOfText(dfa, s, state) : kNoMatch;
+    }
+
+    /** Search DFA pass over text[from..], from the saved state if there is one. */
+    int Search(ScratchData& s, std::wstring_view text, size_t from, const std::u32string* saved) const
+    {
+        LazyDfa& base = s.caches->base;
+        std::int32_t state = saved ? Intern(base, *saved) : Start(base, s, kEdge);
+        const int rule = Continue(base, s, text.substr(from), state);
+        if (rule == kNoMatch && s.recording)
+            s.endState = *base.keys[state];     // Never dead: the seeds are re-added after every character
+        return rule;
+    }
+
+    LazyDfa& VerifyDfa(ScratchData& s, std::uint32_t r) const
+    {
+        auto& dfa = s.caches->verify[r];
+        if (!dfa) {
+            dfa = std::make_unique<LazyDfa>();
+            dfa->Reset(classCount);
+            dfa->seeds.assign(1, rules[r].start);
+            dfa->anchored = true;
+        }
+        return *dfa;
+    }
+
+    /** Checks whether rule r matches at exactly text[start]. */
+    int Verify(ScratchData& s, std::uint32_t r, std::wstring_view text, size_t start) const
+    {
+        LazyDfa& dfa = VerifyDfa(s, r);
+        const Context prev = (start == 0) ? kEdge : classContext[ClassOf(text[start - 1])];
+        std::int32_t state = Start(dfa, s, prev);
+        return FinishVerify(s, r, text.substr(start), state);
+    }
+
+    /** Runs rule r's anchored DFA over the rest of the text from state. */
+    int FinishVerify(ScratchData& s, std::uint32_t r, std::wstring_view rest, std::int32_t state) const
+    {
+        LazyDfa& dfa = *s.caches->verify[r];
+        const int rule = Continue(dfa, s, rest, state);
+        if (rule == kNoMatch && state != kDead)
+            s.RecordOpenRun(r, *dfa.keys[state]);
+        return rule;
+    }
+
+    /**
+     * Literal pass: one Aho-Corasick walk that skips ahead to characters which can start a
+     * literal, verifying a rule only where one of its literals occurs. Resumed at from with
+     * the saved row and the verifications that were open there.
+     */
+    int Prefilter(ScratchData& s, std::wstring_view text, size_t from = 0, std::int32_t row = 0,
+        const std::vector<std::pair<std::uint32_t, std::u32string>>* openRuns = nullptr) const
+    {
+        if (openRuns) {
+            for (const auto& [r, saved] : *openRuns) {
+                const int rule = FinishVerify(s, r, text.substr(from), Intern(VerifyDfa(s, r), saved));
+                if (rule != kNoMatch)
+                    return rule;
+            }
+        }
+
+        const std::uint16_t* classes = classMap.data();
+        const std::int32_t* next = literals.next.data();
+        const std::uint8_t* leavesRoot = literals.leavesRoot.data();
+        const std::int32_t outputRow = literals.firstOutputRow;
+        const size_t size = text.size();
+
+        for (size_t begin = from; begin < size; begin += kChunkLength) {
+            if (s.Stopped())
+                return kStopped;
+            const size_t end = std::min(size, begin + kChunkLength);
+            for (size_t i = begin; i < end; ++i) {
+                if (row == 0) {
+                    while (i < end && !leavesRoot[classes[static_cast<std::uint16_t>(text[i])]])
+                        ++i;
+                    if (i == end)
+                        break;
+                }
+                row = next[row + classes[static_cast<std::uint16_t>(text[i])]];
+                if (row < outputRow)
+                    continue;
+
+                const size_t slot = (row - outputRow) / literals.stride;
+                for (std::uint32_t o = literals.outBegin[slot]; o < literals.outBegin[slot + 1]; ++o) {
+                    const auto& output = literals.outputs[o];
+                    if (output.direct)
+                        return rules[output.rule].id;
+                    const int rule = Verify(s, output.rule, text, i + 1 - output.length);
+                    if (rule != kNoMatch)
+                        return rule;
+                }
+            }
+        }
+        s.endRow = row;
+        return kNoMatch;
+    }
+
+    /**
+     * Shortest text (as classes) in which the search DFA reports a match, found by a
+     * breadth-first walk. Empty optional if none is found within kMaxCoverPairs states.
+     */
+    std::optional<std::vector<std::uint16_t>> ShortestMatch(ScratchData& s, LazyDfa& dfa) const
+    {
+        const size_t epoch = dfa.epoch;
+        std::vector<std::pair<std::int32_t, std::int32_t>> queue;  // state, parent entry
+        std::vector<std::uint16_t> via;                             // class leading to the entry
+        std::unordered_set<std::int32_t> seen;
+        queue.emplace_back(Start(dfa, s, kEdge), -1);
+        via.push_back(0);
+        seen.insert(queue[0].first);
+
+        auto path = [&](std::int32_t entry) {
+            std::vector<std::uint16_t> classes;
+            for (; entry > 0; entry = queue[entry].second)
+                classes.push_back(via[entry]);
+            std::reverse(classes.begin(), classes.end());
+            return classes;
+        };
+
+        for (size_t head = 0; head < queue.size() && head < kMaxCoverPairs; ++head) {
+            const std::int32_t state = queue[head].first;
+            if (EndOfText(dfa, s, state) != kNoMatch)
+                return path(static_cast<std::int32_t>(head));
+            for (size_t cls = 0; cls < classCount; ++cls) {
+                std::int32_t next = dfa.trans[state * dfa.stride + cls];
+                if (next == kUnknown)
+                    next = Transition(dfa, s, state, cls);
+                if (dfa.epoch != epoch)
+                    return std::nullopt;
+                if (next <= kMatchBase) {
+                    auto classes = path(static_cast<std::int32_t>(head));
+                    classes.push_back(static_cast<std::uint16_t>(cls));
+                    return classes;
+                }
+                if (next != kDead && seen.insert(next).second) {
+                    queue.emplace_back(next, static_cast<std::int32_t>(head));
+                    via.push_back(static_cast<std::uint16_t>(cls));
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+    /** True if the search DFA reports a match somewhere in the given text of classes. */
+    bool MatchesClasses(ScratchData& s, LazyDfa& dfa, const std::vector<std::uint16_t>& classes) const
+    {
+        std::int32_t state = Start(dfa, s, kEdge);
+        for (const auto cls : classes) {
+            std::int32_t next = dfa.trans[state * dfa.stride + cls];
+            if (next == kUnknown)
+                next = Transition(dfa, s, state, cls);
+            if (next <= kMatchBase)
+                return true;
+            if (next == kDead)
+                return false;
+            state = next;
+        }
+        return EndOfText(dfa, s, state) != kNoMatch;
+    }
+
+    /**
+     * True if every text that contains a match of `inner` also contains a match of `outer`.
+     * Walks the product of both search DFAs: a counterexample is a path on which inner has
+     * matched and outer has not matched by the same point. Gives up (false) when the
+     * product outgrows its limits, so a true result is always exact.
+     */
+    bool Covers(ScratchData& s, LazyDfa& outer, LazyDfa& inner, size_t& budget) const
+    {
+        const size_t outerEpoch = outer.epoch;
+        const size_t innerEpoch = inner.epoch;
+        auto stale = [&] { return outer.epoch != outerEpoch || inner.epoch != innerEpoch; };
+        auto pairKey = [](std::int32_t a, std::int32_t b) {
+            return (static_cast<std::uint64_t>(a) << 32) | static_cast<std::uint32_t>(b);
+        };
+
+        std::vector<std::pair<std::int32_t, std::int32_t>> queue;
+        std::unordered_set<std::uint64_t> seen;
+        queue.emplace_back(Start(outer, s, kEdge), Start(inner, s, kEdge));
+        seen.insert(pairKey(queue[0].first, queue[0].second));
+
+        for (size_t head = 0; head < queue.size(); ++head) {
+            if (head >= kMaxCoverPairs || budget == 0 || stale())
+                return false;
+            --budget;
+            const auto [a, b] = queue[head];
+            if (EndOfText(inner, s, b) != kNoMatch && EndOfText(outer, s, a) == kNoMatch)
+                return false;
+
+            for (size_t cls = 0; cls < classCount; ++cls) {
+                std::int32_t nextA = outer.trans[a * outer.stride + cls];
+                if (nextA == kUnknown)
+                    nextA = Transition(outer, s, a, cls);
+                if (nextA <= kMatchBase)
+                    continue;       // Outer has matched; every longer text is covered
+                std::int32_t nextB = inner.trans[b * inner.stride + cls];
+                if (nextB == kUnknown)
+                    nextB = Transition(inner, s, b, cls);
+                if (stale() || nextA == kDead)
+                    return false;
+                // Inner matched with this character and outer did not. EndOfText(outer, nextA)
+                // would assume the text ends here, but "\\b" and "$" in inner saw the character
+                if (nextB <= kMatchBase)
+                    return false;
+                if (nextB != kDead && seen.insert(pairKey(nextA, nextB)).second)
+                    queue.emplace_back(nextA, nextB);
+            }
+        }
+        return !stale();
+    }
+
+    /**
+     * Finds rules that cannot change a verdict: every text they match also contains a match
+     * of a kept rule. Of rules matching exactly the same texts the first one is kept.
+     * @param keep Per entry of rules; cleared for folded rules.
+     * @param severity Per entry of rules; a rule only folds into one at least as severe,
+     *        since its matches are then reported as the kept rule's.
+     */
+    std::vector<FoldedRule> FindRedundant(std::vector<std::uint8_t>& keep,
+        const std::vector<Severity>& severity) const
+    {
+        ScratchData s;
+        s.visited.Resize(insts.size());
+        std::vector<LazyDfa> dfas(rules.size());
+        for (size_t r = 0; r < rules.size(); ++r) {
+            dfas[r].Reset(classCount);
+            dfas[r].seeds.assign(1, rules[r].start);
+        }
+
+        // A rule's shortest match rejects most pairs before the exact product walk
+        std::vector<std::optional<std::vector<std::uint16_t>>> witness(rules.size());
+        for (size_t r = 0; r < rules.size(); ++r)
+            witness[r] = ShortestMatch(s, dfas[r]);
+
+        size_t budget = kFoldBudget;
+        auto covers = [&](std::uint32_t outer, std::uint32_t inner) {
+            if (severity[outer] < severity[inner])
+                return false;
+            if (!witness[inner] || !MatchesClasses(s, dfas[outer], *witness[inner]))
+                return false;
+            return Covers(s, dfas[outer], dfas[inner], budget);
+        };
+
+        // by[r]: rule that covered r when it was dropped (kept at that time), or -1
+        std::vector<std::int32_t> by(rules.size(), -1);
+        std::vector<std::uint8_t> equal(rules.size(), 0);
+        std::vector<std::uint32_t> kept;
+        for (std::uint32_t r = 0; r < rules.size(); ++r) {
+            bool covered = false;
+            for (const auto k : kept) {
+                if (covers(k, r)) {
+                    by[r] = static_cast<std::int32_t>(k);
+                    equal[r] = covers(r, k);
+                    covered = true;
+                    break;
+                }
+            }
+            if (covered)
+                continue;
+
+            // r may in turn cover rules kept so far; they are strictly smaller
+            std::vector<std::uint32_t> survivors;
+            for (const auto k : kept) {
+                if (covers(r, k))
+                    by[k] = static_cast<std::int32_t>(r);
+                else
+                    survivors.push_back(k);
+            }
+            survivors.push_back(r);
+            kept = std::move(survivors);
+        }
+
+        std::vector<FoldedRule> folded;
+        for (std::uint32_t r = 0; r < rules.size(); ++r) {
+            if (by[r] < 0)
+                continue;
+            // Follow the chain to the rule that stayed; equal only if every link is
+            std::int32_t target = by[r];
+            bool same = equal[r] != 0;
+            while (by[target] >= 0) {
+                same = same && equal[target];
+                target = by[target];
+            }
+            keep[r] = 0;
+            folded.push_back({ rules[r].id, rules[target].id, same });
+        }
+        return folded;
+    }
+};
+
+//------------------------------------------------------------------------------
+// Scratch
+//------------------------------------------------------------------------------
+PatternMatcher::Scratch::Scratch()
+    : _data(std::make_unique<ScratchData>())
+{
+}
+
+PatternMatcher::Scratch::~Scratch() = default;
+PatternMatcher::Scratch::Scratch(Scratch&&) noexcept = default;
+PatternMatcher::Scratch& PatternMatcher::Scratch::operator=(Scratch&&) noexcept = default;
+
+//------------------------------------------------------------------------------
+// Checkpoint
+//------------------------------------------------------------------------------
+PatternMatcher::Checkpoint::Checkpoint()
+    : _data(std::make_unique<CheckpointData>())
+{
+}
+
+PatternMatcher::Checkpoint::~Checkpoint() = default;
+PatternMatcher::Checkpoint::Checkpoint(Checkpoint&&) noexcept = default;
+PatternMatcher::Checkpoint& PatternMatcher::Checkpoint::operator=(Checkpoint&&) noexcept = default;
+
+void PatternMatcher::Checkpoint::Clear()
+{
+    _data->valid = false;
+    _data->tiers.clear();
+}
+
+size_t PatternMatcher::Checkpoint::Length() const
+{
+    return _data->valid ? _data->length : 0;
+}
+
+//------------------------------------------------------------------------------
+// Construction / compilation
+//------------------------------------------------------------------------------
+PatternMatcher::PatternMatcher() = default;
+PatternMatcher::~PatternMatcher() = default;
+PatternMatcher::PatternMatcher(PatternMatcher&&) noexcept = default;
+PatternMatcher& PatternMatcher::operator=(PatternMatcher&&) noexcept = default;
+
+PatternMatcher::AddResult PatternMatcher::AddPattern(const std::wstring& pattern)
+{
+    return AddPattern(pattern, RuleOptions{});
+}
+
+PatternMatcher::AddResult PatternMatcher::AddPattern(const std::wstring& pattern, const RuleOptions& options)
+{
+    if (!_pending)
+        _pending = std::make_unique<Pending>();
+
+    const int rule = static_cast<int>(_ruleCount);
+    Node root;
+    Parser parser(pattern, _pending->sets);
+    if (parser.Parse(root) == ParseStatus::Ok && EstimateInsts(root) <= kMaxRuleInsts) {
+        _pending->rules.emplace_back(rule, std::move(root));
+        _options.push_back(options);
+        ++_ruleCount;
+        return AddResult::Compiled;
+    }
+
+    // Outside the automaton subset: keep std::wregex semantics for this pattern
+    try {
+        _fallback.push_back({ rule, pattern, std::wregex(pattern, std::regex_constants::icase) });
+    }
+    catch (...) {
+        return AddResult::Invalid;
+    }
+    _options.push_back(options);
+    ++_ruleCount;
+    return AddResult::Fallback;
+}
+
+void PatternMatcher::Compile()
+{
+    if (!_pending)
+        return;
+
+    _generation = ++g_nextGeneration;
+    _tiers.clear();
+    _folded.clear();
+
+    // One automaton per tier; rules of different tiers never share DFA states
+    std::vector<std::uint8_t> levels;
+    for (const auto& [rule, root] : _pending->rules)
+        levels.push_back(_options[rule].tier);
+    std::sort(levels.begin(), levels.end());
+    levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+    for (const std::uint8_t level : levels) {
+        std::vector<size_t> members;
+        for (size_t i = 0; i < _pending->rules.size(); ++i) {
+            if (_options[_pending->rules[i].first].tier == level)
+                members.push_back(i);
+        }
+        Tier tier;
+        tier.level = level;
+        tier.program = Build(members);
+        _tiers.push_back(std::move(tier));
+    }
+    AssignFallback();
+    _pending.reset();
+}
+
+std::unique_ptr<PatternMatcher::Program> PatternMatcher::Build(const std::vector<size_t>& members)
+{
+    auto program = std::make_unique<Program>();
+    const SetTable& sets = _pending->sets;
+    const CharTables& tables = Tables();
+
+    // 1) Partition folded code units into classes no set can tell apart
+    std::vector<std::uint16_t> unitClass(kAlphabet, 0);
+    size_t classCount = 1;
+    auto refine = [&](const CharBits& bits) {
+        std::vector<std::int32_t> inside(classCount, -1), outside(classCount, -1);
+        std::int32_t next = 0;
+        for (std::uint32_t f = 0; f < kAlphabet; ++f) {
+            std::int32_t& slot = bits.test(f) ? inside[unitClass[f]] : outside[unitClass[f]];
+            if (slot < 0)
+                slot = next++;
+            unitClass[f] = static_cast<std::uint16_t>(slot);
+        }
+        classCount = static_cast<size_t>(next);
+    };
+    refine(tables.word);
+    for (size_t i = 0; i < sets.Size(); ++i)
+        refine(sets[i]);
+
+    std::vector<std::uint32_t> representative(classCount, kNone);
+    for (std::uint32_t f = 0; f < kAlphabet; ++f) {
+        if (representative[unitClass[f]] == kNone)
+            representative[unitClass[f]] = f;
+    }
+
+    program->classCount = classCount;
+    program->classMap.resize(kAlphabet);
+    for (std::uint32_t c = 0; c < kAlphabet; ++c)
+        program->classMap[c] = unitClass[static_cast<std::uint16_t>(tables.fold[c])];
+
+    program->classContext.resize(classCount);
+    for (size_t cls = 0; cls < classCount; ++cls)
+        program->classContext[cls] = tables.word.test(representative[cls]) ? kWord : kOther;
+
+    program->setWords = (classCount + 63) / 64;
+    program->setClasses.assign(sets.Size() * program->setWords, 0);
+    for (size_t i = 0; i < sets.Size(); ++i) {
+        for (size_t cls = 0; cls < classCount; ++cls) {
+            if (sets[i].test(representative[cls]))
+                program->setClasses[i * program->setWords + cls / 64] |= 1ULL << (cls % 64);
+        }
+    }
+
+    // 2) Emit the tier's rules into one NFA
+    std::vector<const Node*> roots;     // AST of each entry of program->rules
+    auto emit = [&](const std::vector<std::uint8_t>& keep) {
+        program->insts.clear();
+        program->rules.clear();
+        roots.clear();
+        Emitter emitter(program->insts);
+        for (size_t i = 0; i < members.size(); ++i) {
+            if (!keep[i])
+                continue;
+            const auto& [rule, root] = _pending->rules[members[i]];
+            Emitter::Frag frag = emitter.Emit(root);
+            const std::uint32_t match = emitter.Push(Inst::Op::Match, static_cast<std::uint32_t>(rule));
+            emitter.Patch(frag.holes, match);
+            program->rules.push_back({ rule, frag.start });
+            roots.push_back(&root);
+        }
+    };
+    std::vector<std::uint8_t> keep(members.size(), 1);
+    emit(keep);
+
+    // 2b) Fold duplicate and covered rules of the tier; the NFA is rebuilt without them
+    std::vector<Severity> severity;
+    for (const auto& rule : program->rules)
+        severity.push_back(_options[rule.id].severity);
+    const std::vector<FoldedRule> folded = program->FindRedundant(keep, severity);
+    _folded.insert(_folded.end(), folded.begin(), folded.end());
+    if (!folded.empty())
+        emit(keep);
+
+    // 3) Gate the rules behind their literal prefixes if every rule has long enough ones.
+    //    Otherwise one DFA pass over all rules is cheaper than a DFA plus literal pass.
+    const PrefixExtractor extractor(program->setClasses, program->setWords, classCount);
+    std::vector<std::pair<Literal, LiteralAutomaton::Output>> literals;
+    bool gated = true;
+    for (std::uint32_t r = 0; r < program->rules.size() && gated; ++r) {
+        const Node& root = *roots[r];
+        const Prefixes prefixes = extractor.Extract(root);
+
+        std::vector<std::pair<Literal, bool>> candidates;   // literal, complete match
+        for (const auto& literal : prefixes.exact)
+            candidates.emplace_back(literal, true);
+        for (const auto& literal : prefixes.open)
+            candidates.emplace_back(literal, false);
+
+        gated = !candidates.empty() &&
+            std::all_of(candidates.begin(), candidates.end(), [](const auto& c) {
+                return c.first.size() >= kMinLiteralLength;
+            });
+
+        // A literal that extends another one of the same rule adds nothing
+        std::sort(candidates.begin(), candidates.end());
+        const bool assertions = HasAssertion(root);
+        const Literal* last = nullptr;
+        for (const auto& [literal, exact] : candidates) {
+            if (last && literal.size() >= last->size() &&
+                std::equal(last->begin(), last->end(), literal.begin()))
+                continue;
+            last = &literal;
+            literals.push_back({ literal, { r, static_cast<std::uint32_t>(literal.size()),
+                exact && !assertions } });
+        }
+    }
+
+    if (gated) {
+        program->literals.Build(literals, classCount);
+    }
+    else {
+        for (const auto& rule : program->rules)
+            program->baseSeeds.push_back(rule.start);
+    }
+    return program;
+}
+
+void PatternMatcher::AssignFallback()
+{
+    for (size_t f = 0; f < _fallback.size(); ++f) {
+        const std::uint8_t level = _options[_fallback[f].rule].tier;
+        auto tier = std::lower_bound(_tiers.begin(), _tiers.end(), level,
+            [](const Tier& t, std::uint8_t l) { return t.level < l; });
+        if (tier == _tiers.end() || tier->level != level) {
+            tier = _tiers.insert(tier, Tier{});
+            tier->level = level;
+        }
+        tier->fallback.push_back(f);
+    }
+}
+
+void PatternMatcher::Clear()
+{
+    _pending.reset();
+    _tiers.clear();
+    _fallback.clear();
+    _options.clear();
+    _folded.clear();
+    _ruleCount = 0;
+    _generation = 0;
+}
+
+size_t PatternMatcher::RuleCount() const
+{
+    return _ruleCount;
+}
+
+const PatternMatcher::RuleOptions& PatternMatcher::OptionsOf(int rule) const
+{
+    static const RuleOptions s_default;
+    return (rule >= 0 && static_cast<size_t>(rule) < _options.size()) ? _options[rule] : s_default;
+}
+
+std::uint64_t PatternMatcher::Generation() const
+{
+    return _generation;
+}
+
+const std::vector<PatternMatcher::FoldedRule>& PatternMatcher::FoldedRules() const
+{
+    return _folded;
+}
+
+//------------------------------------------------------------------------------
+// Serialization
+//------------------------------------------------------------------------------
+std::vector<std::uint8_t> PatternMatcher::Serialize() const
+{
+    ByteWriter out;
+    out.Put(kFormatMagic);
+    out.Put(kFormatVersion);
+    out.Put<std::uint32_t>(sizeof(Inst));
+    out.Put<std::uint32_t>(sizeof(LiteralAutomaton::Output));
+    out.Put<std::uint32_t>(sizeof(RuleOptions));
+    out.Put<std::uint64_t>(_ruleCount);
+    out.PutArray(_options);
+
+    // Tiers of std::wregex rules only are rebuilt from the rule options
+    out.Put<std::uint64_t>(std::count_if(_tiers.begin(), _tiers.end(),
+        [](const Tier& tier) { return tier.program != nullptr; }));
+    for (const auto& tier : _tiers) {
+        if (!tier.program)
+            continue;
+        out.Put(tier.level);
+        tier.program->Write(out);
+    }
+
+    // std::wregex has no serialized form; fallback rules are recompiled from source
+    out.Put<std::uint64_t>(_fallback.size());
+    for (const auto& fallback : _fallback) {
+        out.Put(fallback.rule);
+        out.PutString(fallback.source);
+    }
+    out.PutArray(_folded);
+    return out.Take();
+}
+
+bool PatternMatcher::Deserialize(const void* data, size_t size)
+{
+    Clear();
+    ByteReader in(static_cast<const std::uint8_t*>(data), size);
+
+    std::uint32_t magic = 0, version = 0, instSize = 0, outputSize = 0, optionsSize = 0;
+    size_t ruleCount = 0, tierCount = 0;
+    std::vector<RuleOptions> options;
+    if (!in.Get(magic) || magic != kFormatMagic ||
+        !in.Get(version) || version != kFormatVersion ||
+        !in.Get(instSize) || instSize != sizeof(Inst) ||
+        !in.Get(outputSize) || outputSize != sizeof(LiteralAutomaton::Output) ||
+        !in.Get(optionsSize) || optionsSize != sizeof(RuleOptions) ||
+        !in.GetSize(ruleCount) || !in.GetArray(options) || options.size() != ruleCount ||
+        !in.GetSize(tierCount))
+        return false;
+    for (const auto& rule : options) {
+        if (rule.severity > Severity::High)
+            return false;
+    }
+
+    std::vector<Tier> tiers;
+    for (size_t t = 0; t < tierCount; ++t) {
+        Tier tier;
+        tier.program = std::make_unique<Program>();
+        if (!in.Get(tier.level) || (!tiers.empty() && tier.level <= tiers.back().level) ||
+            !tier.program->Read(in) || !tier.program->Valid(ruleCount))
+            return false;
+        for (const auto& rule : tier.program->rules) {
+            if (rule.id < 0 || static_cast<size_t>(rule.id) >= ruleCount || options[rule.id].tier != tier.level)
+                return false;
+        }
+        tiers.push_back(std::move(tier));
+    }
+
+    size_t fallbackCount = 0;
+    if (!in.GetSize(fallbackCount))
+        return false;
+    std::vector<FallbackRule> fallback;
+    for (size_t i = 0; i < fallbackCount; ++i) {
+        FallbackRule rule{};
+        if (!in.Get(rule.rule) || rule.rule < 0 || static_cast<size_t>(rule.rule) >= ruleCount ||
+            !in.GetString(rule.source))
+            return false;
+        try {
+            rule.regex = std::wregex(rule.source, std::regex_constants::icase);
+        }
+        catch (...) {
+            return false;
+        }
+        fallback.push_back(std::move(rule));
+    }
+
+    std::vector<FoldedRule> folded;
+    if (!in.GetArray(folded) || !in.AtEnd())
+        return false;
+    for (const auto& f : folded) {
+        if (f.rule < 0 || static_cast<size_t>(f.rule) >= ruleCount ||
+            f.keptRule < 0 || static_cast<size_t>(f.keptRule) >= ruleCount)
+            return false;
+    }
+
+    _tiers = std::move(tiers);
+    _fallback = std::move(fallback);
+    _options = std::move(options);
+    _folded = std::move(folded);
+    _ruleCount = ruleCount;
+    AssignFallback();
+    _generation = ++g_nextGeneration;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Scanning
+//------------------------------------------------------------------------------
+PatternMatcher::ScanOutcome PatternMatcher::Scan(std::wstring_view text, Scratch& scratch,
+    const ScanBudget& budget, const std::atomic<bool>* cancel, ScanProfile* profile,
+    Checkpoint* checkpoint) const
+{
+    using Clock = std::chrono::steady_clock;
+    if (profile) {
+        profile->automaton = std::chrono::nanoseconds::zero();
+        profile->fallback.clear();
+    }
+
+    ScratchData& s = *scratch._data;
+    const bool truncated = budget.maxChars && text.size() > budget.maxChars;
+    if (truncated)
+        text = text.substr(0, budget.maxChars);
+
+    s.cancel = cancel;
+    s.hasDeadline = budget.maxTime.count() > 0;
+    if (s.hasDeadline)
+        s.deadline = std::chrono::steady_clock::now() + budget.maxTime;
+    s.atTextEnd = !truncated;
+    s.gaveUp = false;
+    s.stopReason = ScanStatus::Complete;
+
+    if (s.generation != _generation) {
+        s.generation = _generation;
+        s.tiers.clear();
+        s.tiers.resize(_tiers.size());
+        size_t insts = 0;
+        for (size_t t = 0; t < _tiers.size(); ++t) {
+            const Program* program = _tiers[t].program.get();
+            if (!program)
+                continue;
+            s.tiers[t].base.Reset(program->classCount);
+            s.tiers[t].base.seeds = program->baseSeeds;
+            s.tiers[t].verify.resize(program->rules.size());
+            insts = std::max(insts, program->insts.size());
+        }
+        s.visited.Resize(insts);
+    }
+
+    // Resume only where the saved state is known to describe a prefix of this text
+    CheckpointData* saved = checkpoint ? checkpoint->_data.get() : nullptr;
+    size_t from = 0;
+    if (saved && saved->valid && saved->generation == _generation && saved->length <= text.size() &&
+        HashText(text.substr(0, saved->length)) == saved->hash)
+        from = saved->length;
+    if (saved) {
+        saved->valid = false;   // Until every automaton has reached the end
+        saved->tiers.resize(_tiers.size());
+    }
+    bool resumable = saved != nullptr;
+
+    // Cheap tiers first: a match there ends the scan before the expensive ones run
+    for (size_t t = 0; t < _tiers.size(); ++t) {
+        const Tier& tier = _tiers[t];
+        if (tier.program) {
+            const auto started = profile ? Clock::now() : Clock::time_point();
+            CheckpointData::Pass* pass = saved ? &saved->tiers[t] : nullptr;
+            s.caches = &s.tiers[t];
+            s.recording = resumable;
+            s.openRuns.clear();
+            s.tooManyOpenRuns = false;
+            const int rule = s.caches->base.seeds.empty()
+                ? tier.program->Prefilter(s, text, from, from ? pass->row : 0, from ? &pass->openRuns : nullptr)
+                : tier.program->Search(s, text, from, from ? &pass->state : nullptr);
+            if (profile)
+                profile->automaton += Clock::now() - started;
+
+            if (rule == kStopped)
+                return { kNoMatch, s.stopReason };
+            if (rule != kNoMatch)
+                return { rule, ScanStatus::Complete };
+            if (s.tooManyOpenRuns)
+                resumable = false;
+            if (resumable) {
+                pass->state.swap(s.endState);
+                pass->row = s.endRow;
+                pass->openRuns.swap(s.openRuns);
+            }
+        }
+
+        for (const size_t f : tier.fallback) {
+            if (s.Stopped())
+                return { kNoMatch, s.stopReason };
+            const FallbackRule& fallback = _fallback[f];
+            const auto started = profile ? Clock::now() : Clock::time_point();
+            const int rule = SearchFallback(fallback, text, truncated, s);
+            if (profile)
+                profile->fallback.emplace_back(fallback.rule, Clock::now() - started);
+            if (rule == kStopped)
+                return { kNoMatch, s.stopReason };
+            if (rule != kNoMatch)
+                return { rule, ScanStatus::Complete };
+        }
+    }
+
+    if (resumable) {
+        saved->valid = true;
+        saved->generation = _generation;
+        saved->length = text.size();
+        saved->hash = HashText(text);
+    }
+    return { kNoMatch, (truncated || s.gaveUp) ? ScanStatus::Partial : ScanStatus::Complete };
+}
+
+int PatternMatcher::SearchFallback(const FallbackRule& fallback, std::wstring_view text, bool truncated,
+    ScratchData& s) const
+{
+    const size_t window = _options[fallback.rule].window;
+    const size_t step = window ? std::max<size_t>(window / 2, 1) : text.size();
+    for (size_t begin = 0; ; begin += step) {
+        const size_t end = window ? std::min(text.size(), begin + window) : text.size();
+
+        // A window edge inside the text is no "^", "$" or "\\b" of it
+        auto flags = std::regex_constants::match_default;
+        if (begin > 0)
+            flags |= std::regex_constants::match_prev_avail;
+        if (end < text.size() || truncated)
+            flags |= std::regex_constants::match_not_eol | std::regex_constants::match_not_eow;
+        try {
+            if (std::regex_search(text.data() + begin, text.data() + end, fallback.regex, flags))
+                return fallback.rule;
+        }
+        catch (const std::regex_error&) {
+            s.gaveUp = true;    // error_complexity or error_stack: this rule has no verdict
+            return kNoMatch;
+        }
+        if (end == text.size())
+            return kNoMatch;
+        if (s.Stopped())
+            return kStopped;
+    }
+}
+
+int PatternMatcher::Find(std::wstring_view text, Scratch& scratch,
+    const std::atomic<bool>* cancel) const
+{
+    const ScanOutcome outcome = Scan(text, scratch, ScanBudget{}, cancel);
+    return (outcome.status == ScanStatus::Cancelled) ? kCancelled : outcome.rule;
+}
+
+// End of PatternMatcher.cpp
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * @class PatternMatcher
+ * @brief Compiles the whole pattern set into a single automaton and scans text in one pass.
+ *
+ * Patterns are written in the ECMAScript dialect understood by std::wregex and are always
+ * matched case-insensitively. Each supported pattern is parsed and added to one shared
+ * Thompson NFA, which is executed as a lazily built DFA: the text is read exactly once,
+ * regardless of how many patterns are loaded. If every pattern starts with a short literal
+ * (for example "powershell" or "cmd\.exe"), a literal prefilter skips ahead to each
+ * occurrence and verifies only those positions. Patterns outside the supported subset
+ * (look-ahead, back-references, POSIX classes) are kept as std::wregex objects and
+ * evaluated after the automaton, so every pattern std::wregex accepts still works.
+ *
+ * The compiled matcher is immutable once Compile() has run. Scanning state lives in a
+ * caller-owned Scratch, so one matcher can be shared by several threads.
+ *
+ * Rules can be put in tiers: each tier has its own automaton, and tiers are scanned in
+ * order, so a match among cheap rules ends the scan before expensive ones run, and an
+ * expensive rule cannot blow up the DFA cache of the cheap ones. A std::wregex rule can
+ * be given an input window, so one backtracking pattern cannot stall every scan.
+ *
+ * Text that only grows between scans (a terminal or log viewer re-copying its buffer)
+ * needs no full rescan: a Checkpoint keeps the automaton state at the end of a clean
+ * scan, and the next Scan() of text that starts with the same characters continues from
+ * there. Only the appended characters go through the automaton; std::wregex patterns
+ * still see the whole text.
+ */
+class PatternMatcher
+{
+    struct ScratchData;     ///< Lazily built DFA states, defined in PatternMatcher.cpp
+    struct CheckpointData;  ///< Saved automaton state, defined in PatternMatcher.cpp
+
+public:
+    /** @brief Returned by Find() when no pattern matches. */
+    static constexpr int kNoMatch = -1;
+
+    /** @brief Returned by Find() when the scan was cancelled before a verdict. */
+    static constexpr int kCancelled = -2;
+
+    /** @brief Limits for one Scan(); zero means unlimited. */
+    struct ScanBudget
+    {
+        size_t                    maxChars = 0;   ///< Characters scanned before giving up
+        std::chrono::milliseconds maxTime{ 0 };   ///< Wall time before giving up
+    };
+
+    /** @brief How far a Scan() got. */
+    enum class ScanStatus
+    {
+        Complete,   ///< Whole text scanned, or stopped at the first match
+        Partial,    ///< Budget ran out before the end; no match in the scanned part
+        Cancelled   ///< Cancel flag was set; no verdict
+    };
+
+    /** @brief Result of Scan(). */
+    struct ScanOutcome
+    {
+        int        rule = kNoMatch;               ///< Matching pattern, or kNoMatch
+        ScanStatus status = ScanStatus::Complete;
+    };
+
+    /**
+     * @brief Where the time of one Scan() went; pass one to Scan() to have it filled.
+     *
+     * Reuse one per thread: the vector keeps its capacity, so profiling does not allocate.
+     */
+    struct ScanProfile
+    {
+        std::chrono::nanoseconds automaton{ 0 };    ///< Automaton pass, all compiled patterns at once
+        std::vector<std::pair<int, std::chrono::nanoseconds>> fallback;    ///< Each std::wregex pattern run, in order
+    };
+
+    /** @brief How serious a match of a rule is; reported with the verdict, never changes it. */
+    enum class Severity : std::uint8_t
+    {
+        Low,
+        Medium,
+        High
+    };
+
+    /** @brief Scheduling and reporting options of one rule. */
+    struct RuleOptions
+    {
+        std::uint8_t  tier = 0;     ///< Lower tiers are scanned first; a match skips the rest
+        std::uint32_t window = 0;   ///< std::wregex rules: characters examined per search (0 = whole text)
+        Severity      severity = Severity::Medium;
+    };
+
+    /** @brief Outcome of AddPattern(). */
+    enum class AddResult
+    {
+        Compiled,   ///< Pattern is part of the automaton
+        Fallback,   ///< Pattern is evaluated by std::wregex
+        Invalid     ///< Pattern is not a valid regular expression
+    };
+
+    /** @brief A pattern left out of the automaton because another pattern already covers it. */
+    struct FoldedRule
+    {
+        int  rule;          ///< Folded pattern, in AddPattern() order
+        int  keptRule;      ///< Pattern that still matches every text the folded one matched
+        bool duplicate;     ///< Both match exactly the same texts
+    };
+
+    /**
+     * @brief Per-thread scan state (lazily built DFA states).
+     *
+     * Reuse one Scratch across scans on the same thread; never share it between threads.
+     * A Scratch automatically resets when it is used with a different matcher.
+     */
+    class Scratch
+    {
+    public:
+        Scratch();
+        ~Scratch();
+        Scratch(Scratch&&) noexcept;
+        Scratch& operator=(Scratch&&) noexcept;
+
+    private:
+        friend class PatternMatcher;
+        std::unique_ptr<ScratchData> _data;
+    };
+
+    /**
+     * @brief Automaton state at the end of the last text scanned with it, for Scan().
+     *
+     * Holds the length and hash of that text, never the text itself. It is only used when
+     * the next text starts with exactly those characters and the matcher generation is
+     * unchanged; otherwise the scan starts from the beginning. Owned by one thread, like
+     * a Scratch, and kept per stream of related texts (one per clipboard format).
+     */
+    class Checkpoint
+    {
+    public:
+        Checkpoint();
+        ~Checkpoint();
+        Checkpoint(Checkpoint&&) noexcept;
+        Checkpoint& operator=(Checkpoint&&) noexcept;
+
+        /** @brief Forgets the saved state; the next Scan() starts at the beginning. */
+        void Clear();
+
+        /** @brief Characters the saved state covers; 0 if there is none. */
+        size_t Length() const;
+
+    private:
+        friend class PatternMatcher;
+        std::unique_ptr<CheckpointData> _data;
+    };
+
+    PatternMatcher();
+    ~PatternMatcher();
+    PatternMatcher(PatternMatcher&&) noexcept;
+    PatternMatcher& operator=(PatternMatcher&&) noexcept;
+
+    /**
+     * @brief Adds one pattern to the set. Call Compile() once all patterns are added.
+     *
+     * With a window, a std::wregex rule searches windows of that many characters that
+     * overlap by half, so a match up to half the window long is found anywhere in the text
+     * and the cost grows linearly with the text. The automaton reads every character once,
+     * so compiled rules ignore the window.
+     * @param pattern Pattern source without the leading "(?i)" flag.
+     * @param options Tier, window and severity of the rule.
+     * @return How the pattern will be evaluated, or Invalid if it was rejected.
+     */
+    AddResult AddPattern(const std::wstring& pattern, const RuleOptions& options);
+
+    /** @brief Adds one pattern with default options (tier 0, no window, medium severity). */
+    AddResult AddPattern(const std::wstring& pattern);
+
+    /** @brief Builds the automaton of every tier from all added patterns. */
+    void Compile();
+
+    /** @brief Removes all patterns and frees the automaton. */
+    void Clear();
+
+    /** @brief Number of accepted patterns (automaton and fallback), including folded ones. */
+    size_t RuleCount() const;
+
+    /** @brief Options a rule was added with. @param rule Index in AddPattern() order. */
+    const RuleOptions& OptionsOf(int rule) const;
+
+    /**
+     * @brief Patterns Compile() dropped as redundant: duplicates, and patterns whose every
+     *        match implies a match of another pattern. Verdicts are unaffected, but Scan()
+     *        reports the kept pattern instead of the folded one.
+     */
+    const std::vector<FoldedRule>& FoldedRules() const;
+
+    /**
+     * @brief Identifies the compiled pattern set; changes with every Compile() and Clear().
+     *
+     * Results cached for one generation must not be reused for another.
+     */
+    std::uint64_t Generation() const;
+
+    /**
+     * @brief Writes the compiled set to a buffer that Deserialize() can restore.
+     *
+     * Call after Compile(). The format is tied to this engine version; a buffer from
+     * another version is rejected by Deserialize() rather than misread.
+     */
+    std::vector<std::uint8_t> Serialize() const;
+
+    /**
+     * @brief Replaces the set with one written by Serialize(), skipping parsing and compilation.
+     * @param data First byte of the serialized set.
+     * @param size Number of bytes.
+     * @return False if the data is malformed or from another version; the matcher is then empty.
+     */
+    bool Deserialize(const void* data, size_t size);
+
+    /**
+     * @brief Scans text for the first matching pattern.
+     * @param text Text to scan.
+     * @param scratch Scan state owned by the calling thread.
+     * @param cancel Optional flag, polled every few thousand characters; set it from
+     *        another thread to abandon the scan.
+     * @return Index of the matching pattern in AddPattern() order, kNoMatch, or kCancelled.
+     */
+    int Find(std::wstring_view text, Scratch& scratch,
+        const std::atomic<bool>* cancel = nullptr) const;
+
+    /**
+     * @brief Scans text in chunks within a budget, stopping at the first match.
+     *
+     * Tiers are scanned in order, each with its automaton and then its std::wregex rules.
+     * Text beyond budget.maxChars is not looked at, and the time limit is checked
+     * between chunks and windows. If either limit ends the scan before a match, or
+     * std::wregex gives up on a rule (error_complexity, error_stack), the status is
+     * Partial: the text was not proven clean and the caller has to decide.
+     * @param text Text to scan.
+     * @param scratch Scan state owned by the calling thread.
+     * @param budget Character and time limits.
+     * @param cancel Optional cancel flag, as for Find().
+     * @param profile Optional; receives the time spent in the automaton and per fallback pattern.
+     * @param checkpoint Optional; if it holds the state of a prefix of text, the automaton
+     *        continues from there. Afterwards it holds the state at the end of the scanned
+     *        text, or nothing if the automaton stopped early (match, budget, cancel).
+     */
+    ScanOutcome Scan(std::wstring_view text, Scratch& scratch, const ScanBudget& budget,
+        const std::atomic<bool>* cancel = nullptr, ScanProfile* profile = nullptr,
+        Checkpoint* checkpoint = nullptr) const;
+
+private:
+    struct Program;     ///< Compiled NFA and alphabet, defined in PatternMatcher.cpp
+    struct Pending;     ///< Parsed patterns awaiting Compile()
+
+    struct FallbackRule
+    {
+        int          rule;      ///< Index in AddPattern() order
+        std::wstring source;    ///< Pattern text, kept for Serialize()
+        std::wregex  regex;     ///< Compiled std::wregex (icase)
+    };
+
+    /** @brief Rules of one tier: one automaton, then the std::wregex rules. */
+    struct Tier
+    {
+        std::uint8_t             level = 0;
+        std::unique_ptr<Program> program;   ///< Null if the tier has only std::wregex rules
+        std::vector<size_t>      fallback;  ///< Indices into _fallback, in rule order
+    };
+
+    /** @brief Builds the automaton of the given entries of _pending; folded rules go to _folded. */
+    std::unique_ptr<Program> Build(const std::vector<size_t>& members);
+
+    /**
+     * @brief Searches text with one std::wregex rule, window by window.
+     * @return The rule, kNoMatch, or kStopped (PatternMatcher.cpp) if the scan has to stop between windows.
+     */
+    int SearchFallback(const FallbackRule& fallback, std::wstring_view text, bool truncated,
+        ScratchData& s) const;
+
+    /** @brief Groups the std::wregex rules into _tiers by their tier. */
+    void AssignFallback();
+
+    std::unique_ptr<Pending>      _pending;
+    std::vector<Tier>             _tiers;       ///< Ascending level
+    std::vector<FallbackRule>     _fallback;
+    std::vector<RuleOptions>      _options;     ///< Per rule
+    std::vector<FoldedRule>       _folded;
+    size_t                        _ruleCount = 0;
+    std::uint64_t                 _generation = 0;   ///< Identifies this compiled set to Scratch
+};
@@ -0,0 +1,63 @@
+/**
+ * @file VerdictCache.cpp
+ * @brief Implements the LRU verdict cache used by ScanWorker.
+ */
+
+#include "VerdictCache.h"
+
+#include "ContentHash.h"
+
+VerdictCache::VerdictCache(size_t capacity)
+    : _capacity(capacity ? capacity : 1)
+{
+}
+
+VerdictCache::Key VerdictCache::KeyOf(std::wstring_view text)
+{
+    return { HashText(text), text.size() };
+}
+
+std::optional<int> VerdictCache::Lookup(std::uint64_t generation, const Key& key)
+{
+    SyncGeneration(generation);
+    auto it = _index.find(key);
+    if (it == _index.end())
+        return std::nullopt;
+
+    _entries.splice(_entries.begin(), _entries, it->second);
+    return it->second->rule;
+}
+
+void VerdictCache::Store(std::uint64_t generation, const Key& key, int rule)
+{
+    SyncGeneration(generation);
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+        it->second->rule = rule;
+        _entries.splice(_entries.begin(), _entries, it->second);
+        return;
+    }
+
+    if (_entries.size() >= _capacity) {
+        _index.erase(_entries.back().key);
+        _entries.pop_back();
+    }
+    _entries.push_front({ key, rule });
+    _index.emplace(key, _entries.begin());
+}
+
+void VerdictCache::Clear()
+{
+    _entries.clear();
+    _index.clear();
+}
+
+void VerdictCache::SyncGeneration(std::uint64_t generation)
+{
+    if (generation != _generation) {
+        Clear();
+        _generation = generation;
+    }
+}
+
+// End of VerdictCache.cpp
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+/**
+ * @class VerdictCache
+ * @brief Bounded LRU cache of scan verdicts, keyed by a hash of the scanned text.
+ *
+ * Entries remember the matched rule (or PatternMatcher::kNoMatch) for one compiled
+ * pattern set. Every call passes the matcher's Generation(); when it differs from the
+ * cached one the whole cache is dropped, so a changed pattern set never reuses a verdict.
+ *
+ * Not thread-safe: the scan worker is its only user.
+ */
+class VerdictCache
+{
+public:
+    /** @brief Identifies a payload: content hash plus length in UTF-16 units. */
+    struct Key
+    {
+        std::uint64_t hash = 0;
+        size_t        length = 0;
+
+        bool operator==(const Key& other) const = default;
+    };
+
+    static constexpr size_t kDefaultCapacity = 256;
+
+    /** @param capacity Maximum number of remembered payloads. */
+    explicit VerdictCache(size_t capacity = kDefaultCapacity);
+
+    /** @brief Computes the cache key of a payload (one hash pass). */
+    static Key KeyOf(std::wstring_view text);
+
+    /**
+     * @brief Looks up a verdict and marks it as most recently used.
+     * @param generation Generation of the matcher the verdict must come from.
+     * @param key Payload key from KeyOf().
+     * @return Matched rule or kNoMatch, or nothing if the payload is unknown.
+     */
+    std::optional<int> Lookup(std::uint64_t generation, const Key& key);
+
+    /** @brief Remembers a verdict, evicting the least recently used entry when full. */
+    void Store(std::uint64_t generation, const Key& key, int rule);
+
+    /** @brief Drops all entries. */
+    void Clear();
+
+private:
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const noexcept
+        {
+            return static_cast<size_t>(key.hash);
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        int rule;
+    };
+
+    /** @brief Drops everything if the entries belong to another pattern set. */
+    void SyncGeneration(std::uint64_t generation);
+
+    size_t                  _capacity;
+    std::uint64_t           _generation = 0;
+    std::list<Entry>        _entries;       ///< Most recently used first
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> _index;
+};
@@ -5,7 +5,8 @@
  * Loads regex patterns, listens for clipboard changes, prompts the user,
  * and logs actions via XrdLogger.
  *
- * @note Consider minimizing clipboard lock duration to reduce potential UI blocking.
+ * The clipboard is only held open long enough to copy the text; scanning runs on
+ * ScanWorker's thread and the verdict comes back as WM_XRD_SCANRESULT.
  */
 
 #ifndef UNICODE
@@ -21,12 +22,15 @@
     "language='*'\"")
 
 #include "ClipboardWatcher.h"
+#include "PatternFile.h"
 
 #include <Lmcons.h>
 #include <psapi.h>
 #include <shellapi.h>
 #include <commctrl.h>
+#include <algorithm>
 #include <fstream>
+#include <iterator>
 #include <sstream>
 #include <locale>
 #include <Shlwapi.h>    // for PathFindExtensionW
@@ -56,6 +60,29 @@ static HRESULT CALLBACK TopmostCallback(
 }
 
 namespace {
+    constexpr UINT_PTR kScanTimerId = 1;        // Debounce timer on the message window
+    constexpr UINT     kScanDebounceMs = 50;    // Quiet period before a burst is scanned
+    constexpr int      kMaxOpenRetries = 5;     // OpenClipboard attempts per scan
+    constexpr UINT_PTR kPasteTimerId = 2;       // Revokes an unused paste approval
+    constexpr UINT_PTR kTrimTimerId = 3;        // Bounded memory: trims the idle process
+    constexpr UINT_PTR kStatsTimerId = 4;       // Writes the scan statistics to the log
+
+    // Dropped files worth scanning: text and script formats (no executables, images, archives)
+    constexpr const wchar_t* kScannedExtensions[] = {
+        L".txt", L".log", L".csv", L".json", L".xml", L".svg", L".html", L".hta",
+        L".ps1", L".psm1", L".bat", L".cmd", L".sh", L".vbs", L".js", L".py"
+    };
+
+    bool IsScannedFile(const wchar_t* path)
+    {
+        const wchar_t* extension = PathFindExtensionW(path);
+        for (const wchar_t* scanned : kScannedExtensions) {
+            if (CompareStringOrdinal(extension, -1, scanned, -1, TRUE) == CSTR_EQUAL)
+                return true;
+        }
+        return false;
+    }
+
     /**
      * @brief Displays an error task dialog.
      * @param owner Owner window handle (nullptr for no owner).
@@ -63,6 +90,10 @@ namespace {
      */
     void ShowError(HWND /*owner*/, const wchar_t* message)
     {
+        // Only errors and DecisionDialog show task dialogs; nobody else needs the classes
+        INITCOMMONCONTROLSEX icc{ sizeof(icc), ICC_STANDARD_CLASSES };
+        InitCommonControlsEx(&icc);
+
         TASKDIALOGCONFIG cfg = {};
         cfg.cbSize = sizeof(cfg);
         cfg.hwndParent = nullptr;
@@ -80,41 +111,18 @@ namespace {
         TaskDialogIndirect(&cfg, nullptr, nullptr, nullptr);
     }
 
-
-    /**
-     * @brief Prompts a Yes/No dialog.
-     * @param owner Owner window handle.
-     * @param title Dialog title.
-     * @param text Main instruction.
-     * @param footer Optional footer text.
-     * @return IDYES or IDNO.
-     */
-    int AskYesNo(HWND /*owner*/,
-        const wchar_t* title,
-        const wchar_t* text,
-        const wchar_t* footer /*= nullptr*/)
+    /** @brief Time since the process was created, for the startup statistics. */
+    std::chrono::microseconds SinceProcessStart()
     {
-        int result = 0;
-        TASKDIALOGCONFIG cfg = {};
-        cfg.cbSize = sizeof(cfg);
-        cfg.hwndParent = nullptr;
-        cfg.dwFlags = TDF_ALLOW_DIALOG_CANCELLATION;
-        cfg.pszWindowTitle = title;
-        cfg.pszMainInstruction = text;
-        cfg.pszContent = footer;
-        cfg.pszMainIcon = MAKEINTRESOURCEW(TD_WARNING_ICON);
-        cfg.pfCallback = TopmostCallback;
-
-        TASKDIALOG_BUTTON buttons[] = {
-            { IDYES, L"Yes" },
-            { IDNO,  L"No"  }
+        FILETIME created{}, exited{}, kernel{}, user{}, now{};
+        if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+            return std::chrono::microseconds(0);
+        GetSystemTimePreciseAsFileTime(&now);
+        const auto ticks = [](const FILETIME& ft) {
+            return (static_cast<unsigned long long>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
         };
-        cfg.cButtons = _countof(buttons);
-        cfg.pButtons = buttons;
-        cfg.nDefaultButton = IDYES;
-
-        TaskDialogIndirect(&cfg, &result, nullptr, nullptr);
-        return result;
+        const unsigned long long start = ticks(created), end = ticks(now);
+        return std::chrono::microseconds(end > start ? (end - start) / 10 : 0);    // 100 ns units
     }
 
 
@@ -154,19 +162,57 @@ ClipboardWatcher::~ClipboardWatcher()
 //------------------------------------------------------------------------------
 // Public API
 //------------------------------------------------------------------------------
-bool ClipboardWatcher::Start(HINSTANCE instance,
-    HWND trayHwnd,
-    UINT trayId)
+bool ClipboardWatcher::Start(HINSTANCE instance)
 {
-    _trayHwnd = trayHwnd;
-    _trayID = trayId;
+    _config = XrdConfig::Load(XrdConfig::PathFor(_patternFile));
 
-    // Initialize common controls once
-    INITCOMMONCONTROLSEX icc{ sizeof(icc), ICC_STANDARD_CLASSES };
-    InitCommonControlsEx(&icc);
+    // Fast start: updates are queued from here on and scanned once the loop runs
+    if (_config.fastStart) {
+        if (!CreateMsgWindow(instance))
+            return false;
+        _listeningAfter = SinceProcessStart();
+    }
 
-    if (!LoadPatterns())                 return false;
-    if (!CreateMsgWindow(instance))      return false;
+    // Agent of the scan service: its rule set and its log serve every session
+    _agent = _config.serviceMode == XrdConfig::ServiceMode::Agent ||
+        (_config.serviceMode == XrdConfig::ServiceMode::Auto && _service.Connect());
+    XrdLogger::Options logOptions = _config.LogOptions();
+    logOptions.perSession = true;   // one tray process per session, all logging next to the exe
+    if (_agent) {
+        logOptions.forward = [this](const XrdLogger::Record& record) { return _service.Log(record); };
+        _worker.SetService(&_service);
+    }
+    _logger.configure(logOptions);
+    if (_agent && !_service.Connect())
+        _logger.logMessage(L"Scan service not reachable: copies count as partially scanned until it is");
+    _worker.SetBudget({ _config.maxScanChars, std::chrono::milliseconds(_config.maxScanMs) });
+    _worker.SetFileLimits({ _config.filesMaxBytes, _config.filesThreads });
+    _images.SetOptions({ static_cast<size_t>(_config.imageMaxSampleKB) * 1024 });
+    const bool formatEnabled[] = { _config.formatsHtml, _config.formatsRtf, _config.formatsAnsi };
+    static_assert(std::size(formatEnabled) == static_cast<size_t>(TextFormat::Count));
+    for (size_t i = 0; i < std::size(formatEnabled); ++i) {
+        if (formatEnabled[i])
+            _formats.emplace_back(static_cast<TextFormat>(i), ClipboardFormatOf(static_cast<TextFormat>(i)));
+    }
+    if (_config.statsEnabled) {
+        _stats.Open();
+        _worker.SetStats(&_stats);
+    }
+
+    // Fast start takes only an up-to-date patterns.xrdc here; anything else compiles
+    // on the pattern watcher's thread and is published with WM_XRD_PATTERNSLOADED
+    const bool compileLater = !_agent && _config.fastStart && !LoadPatterns(true);
+    if (!_agent && !_config.fastStart && !LoadPatterns()) return false;
+    if (!_hWnd && !CreateMsgWindow(instance)) return false;
+    if (!_worker.Start(_hWnd))           return false;
+    _dialog.Start(_hWnd);
+    if (_config.statsEnabled && _config.statsSummaryMinutes != 0)
+        SetTimer(_hWnd, kStatsTimerId, _config.statsSummaryMinutes * 60 * 1000, nullptr);
+    if (!_agent && !_patternWatcher.Start(_patternFile, _patternHash, compileLater ? _hWnd : nullptr)) {
+        if (compileLater && !LoadPatterns())
+            return false;
+        _logger.logMessage(L"Pattern hot reload unavailable: cannot watch the pattern directory");
+    }
 
     // Cache user and host names for logging
     wchar_t userBuffer[UNLEN + 1] = {};
@@ -180,18 +226,39 @@ bool ClipboardWatcher::Start(HINSTANCE instance,
     _host.assign(hostBuffer, hostLen);
 
     s_this = this;
+    if (!_config.fastStart)
+        _listeningAfter = SinceProcessStart();
+    if (_agent || _patterns.load())
+        RecordProtected();
     return true;
 }
 
+void ClipboardWatcher::AttachTray(HWND trayHwnd, UINT trayId)
+{
+    _trayHwnd = trayHwnd;
+    _trayID = trayId;
+}
+
 void ClipboardWatcher::Stop()
 {
-    UninstallHooks();
+    _dialog.Stop();     // an open question is dropped unanswered
+
+    // An approved text still on offer is rendered by WM_RENDERALLFORMATS when the
+    // window goes (the hooks are already gone in that state), so leave the gate open
+    if (_gate.load(std::memory_order_acquire) != PasteGate::Offered)
+        UninstallHooks();
+    _patternWatcher.Stop();
+    _worker.Stop();     // before the window and the automaton it scans with go away
+    if (_hWnd && _config.statsEnabled)
+        LogStats();     // the period since the last summary
     if (_hWnd) {
         RemoveClipboardFormatListener(_hWnd);
         DestroyWindow(_hWnd);
     }
     _hWnd = nullptr;
-    _patterns.clear();  // free regex objects
+    _gate.store(PasteGate::Idle, std::memory_order_release);
+    _patterns.store(nullptr);   // free the compiled automaton
+    _logger.shutdown();         // write out everything still queued
     s_this = nullptr;
 }
 
@@ -203,81 +270,43 @@ void ClipboardWatcher::ForceInitialScan()
 //------------------------------------------------------------------------------
 // Pattern handling
 //------------------------------------------------------------------------------
-bool ClipboardWatcher::LoadPatterns()
+bool ClipboardWatcher::LoadPatterns(bool cachedOnly)
 {
-    std::wifstream infile(_patternFile);
-    if (!infile.is_open()) {
-        ShowError(nullptr, L"Pattern file not found");
-        return false;
-    }
-
-    std::wstring line;
-    size_t lineNumber = 0;
-    std::vector<std::wstring> patternStrings;
-    while (std::getline(infile, line)) {
-        ++lineNumber;
-        // Trim whitespace and strip comments
-        const auto first = line.find_first_not_of(L" \t\r\n");
-        if (first == std::wstring::npos) continue;
-
-        const auto commentPos = line.find(L'#', first);
-        std::wstring raw = (commentPos == std::wstring::npos)
-            ? line.substr(first)
-            : line.substr(first, commentPos - first);
+    PatternFileResult loaded = cachedOnly ? LoadCachedPatternFile(_patternFile) : LoadPatternFile(_patternFile);
 
-        const auto last = raw.find_last_not_of(L" \t\r\n");
-        if (last == std::wstring::npos) continue;
-        raw.resize(last + 1);
+    // Bad lines are skipped and logged; a dialog per line would block unattended logons
+    for (const auto& error : loaded.errors)
+        _logger.logMessage(error);
+    for (const auto& note : loaded.notes)
+        _logger.logMessage(note);
 
-        // Remove inline case-insensitive flag
-        if (raw.rfind(L"(?i)", 0) == 0)
-            raw.erase(0, 4);
-
-        if (raw.empty()) continue;
-
-        auto tryCompile = [&](const std::wstring& pattern) {
-            try {
-                _patterns.emplace_back(pattern, std::regex_constants::icase);
-                return true;
-            }
-            catch (...) {
-                return false;
-            }
-            };
-
-        if (tryCompile(raw))
-            continue;
-
-        // Escape braces and retry
-        std::wstring escaped;
-        escaped.reserve(raw.size() * 2);
-        for (wchar_t ch : raw) {
-            if (ch == L'{' || ch == L'}')
-                escaped.push_back(L'\\');
-            escaped.push_back(ch);
-        }
-        if (!tryCompile(escaped)) {
-            std::wstringstream err;
-            err << L"Invalid regex (line " << lineNumber << L"): " << raw;
-            ShowError(nullptr, err.str().c_str());
-        }
-    }
-
-    if (_patterns.empty()) {
-        ShowError(nullptr, L"No valid patterns loaded");
+    if (!loaded.matcher) {
+        if (!cachedOnly)
+            ShowError(nullptr, loaded.errors.back().c_str());   // Nothing to protect with
         return false;
     }
+    _patternHash = loaded.sourceHash;
+    _patterns.store(std::move(loaded.matcher));
     return true;
 }
 
-bool ClipboardWatcher::ContainsBad(const std::wstring& text) const
+void ClipboardWatcher::OnPatternsLoaded(bool published)
 {
-    // Suggestion: For high-performance, consider combining patterns into a single regex
-    for (const auto& regex : _patterns) {
-        if (std::regex_search(text, regex))
-            return true;
+    if (!published) {
+        ShowError(nullptr, L"No valid patterns loaded from patterns.txt; see the log for details.");
+        PostQuitMessage(EXIT_FAILURE);
+        return;
     }
-    return false;
+    RecordProtected();
+
+    // Copies made while compiling were dropped by the worker: scan what is there now
+    _scannedSequence = 0;
+    OnClipboardUpdate();
+}
+
+void ClipboardWatcher::RecordProtected()
+{
+    _stats.RecordStartup(_listeningAfter, SinceProcessStart());     // no-op without statistics
 }
 
 //------------------------------------------------------------------------------
@@ -319,6 +348,52 @@ LRESULT CALLBACK ClipboardWatcher::WndProc(HWND hWnd,
         self->OnClipboardUpdate();
         return 0;
     }
+    if (self && msg == WM_TIMER && wParam == kScanTimerId) {
+        self->OnScanTimer();
+        return 0;
+    }
+    if (self && msg == WM_TIMER && wParam == kPasteTimerId) {
+        self->OnPasteTimeout();
+        return 0;
+    }
+    if (self && msg == WM_TIMER && wParam == kTrimTimerId) {
+        self->OnTrimTimer();
+        return 0;
+    }
+    if (self && msg == WM_TIMER && wParam == kStatsTimerId) {
+        self->LogStats();
+        return 0;
+    }
+    if (self && msg == WM_RENDERFORMAT) {
+        self->OnRenderFormat(static_cast<UINT>(wParam));
+        return 0;
+    }
+    if (self && msg == WM_RENDERALLFORMATS) {
+        self->OnRenderAllFormats();
+        return 0;
+    }
+    if (self && msg == WM_DESTROYCLIPBOARD) {
+        self->OnDestroyClipboard();
+        return 0;
+    }
+    if (self && msg == WM_XRD_PASTE) {
+        self->OnPaste();
+        return 0;
+    }
+    if (self && msg == WM_XRD_DECISION) {
+        self->OnDecision(static_cast<int>(wParam));
+        return 0;
+    }
+    if (self && msg == WM_XRD_PATTERNSLOADED) {
+        self->OnPatternsLoaded(wParam != FALSE);
+        return 0;
+    }
+    if (msg == WM_XRD_SCANRESULT) {
+        auto result = ScanWorker::TakeResult(lParam);
+        if (self)
+            self->OnScanResult(std::move(result));
+        return 0;
+    }
     return DefWindowProcW(hWnd, msg, wParam, lParam);
 }
 
@@ -331,150 +406,179 @@ void ClipboardWatcher::OnClipboardUpdate()
     if (_holdClipboard)
         return;
 
-    // Try to open the clipboard; if it fails, bail out
-    if (!OpenClipboard(_hWnd))
+    // Repeated notifications for content we already scanned change nothing
+    if (GetClipboardSequenceNumber() == _scannedSequence)
+        return;
+
+    // Newer content makes the scan in flight pointless; bursts of updates are
+    // coalesced by (re)arming the debounce timer, so only the latest one is read.
+    _worker.Cancel();
+    _openRetries = 0;
+    SetTimer(_hWnd, kScanTimerId, kScanDebounceMs, nullptr);
+}
+
+void ClipboardWatcher::OnScanTimer()
+{
+    KillTimer(_hWnd, kScanTimerId);
+    if (_holdClipboard)
+        return;
+
+    const DWORD sequence = GetClipboardSequenceNumber();
+    if (sequence == _scannedSequence)
         return;
 
-    bool suspicious = false;
-    std::wstring snippet;
-    const size_t kFileReadLimit = 16 * 1024;       // maximum 16 KB per file
-    const double kLsbLower = 0.4,                  // LSB anomaly detection thresholds
-        kLsbUpper = 0.6;
+    // Another application may still hold the clipboard: try again shortly
+    if (!OpenClipboard(_hWnd)) {
+        if (++_openRetries < kMaxOpenRetries)
+            SetTimer(_hWnd, kScanTimerId, kScanDebounceMs, nullptr);
+        return;
+    }
+    _scannedSequence = sequence;
+    const auto opened = std::chrono::steady_clock::now();
+
+    ScanJob job;
+    job.sequence = sequence;
 
 
     //
-    // A) Check for Unicode text
+    // A) Snapshot Unicode text; the scan runs on the worker thread.
+    //    This is the only copy: it moves into the job, the result and _fullContent.
     //
-    if (!suspicious)
+    if (HANDLE hText = GetClipboardData(CF_UNICODETEXT))
     {
-        if (HANDLE hText = GetClipboardData(CF_UNICODETEXT))
+        if (const wchar_t* data = static_cast<const wchar_t*>(GlobalLock(hText)))
         {
-            if (const wchar_t* data = static_cast<const wchar_t*>(GlobalLock(hText)))
-            {
-                // Copy clipboard text into a std::wstring
-                std::wstring content(data);
-                GlobalUnlock(hText);
-                _fullContent = content;
-                // If the text contains suspicious patterns, mark it
-                if (ContainsBad(content))
-                {
-                    // Take a snippet of up to 100 characters for preview
-                    snippet = content.substr(0, 100)
-                        + (content.size() > 100 ? L"…" : L"");
-                    suspicious = true;
-                }
+            // GlobalSize bounds the text, so a missing terminator cannot run past the block
+            const std::wstring_view block(data, GlobalSize(hText) / sizeof(wchar_t));
+            std::wstring_view text = block.substr(0, block.find(L'\0'));
+
+            // Bounded memory: never hold more than the cap; the rest counts as unscanned
+            const size_t cap = _config.memoryBounded
+                ? static_cast<size_t>(_config.memoryMaxContentMB) * 1024 * 1024 / sizeof(wchar_t) : 0;
+            if (cap != 0 && text.size() > cap) {
+                text = text.substr(0, cap);
+                job.truncated = true;
             }
+            job.text.assign(text);
+            GlobalUnlock(hText);
         }
     }
 
     //
-    // B) Check for file drops (CF_HDROP) - Experimental
-    /*
-    if (!suspicious)
+    // A2) Rich renderings of the same copy (HTML, RTF, ANSI text): raw bytes only,
+    //     text extraction runs on the worker. CF_TEXT listed after CF_UNICODETEXT is
+    //     almost always synthesized from it and is not fetched, which would convert it.
+    //
     {
-        if (HANDLE hDrop = GetClipboardData(CF_HDROP))
+        size_t cap = _config.formatsMaxBytes;
+        if (_config.memoryBounded && _config.memoryMaxContentMB != 0)
+            cap = std::min<size_t>(cap, static_cast<size_t>(_config.memoryMaxContentMB) * 1024 * 1024);
+        bool unicodeSeen = false;
+        for (UINT format = EnumClipboardFormats(0); format != 0; format = EnumClipboardFormats(format))
         {
-            // How many files are on the clipboard?
-            UINT count = DragQueryFileW((HDROP)hDrop, 0xFFFFFFFF, nullptr, 0);
-            for (UINT i = 0; i < count && !suspicious; ++i)
+            unicodeSeen |= format == CF_UNICODETEXT;
+            for (const auto& [textFormat, id] : _formats)
             {
-                wchar_t path[MAX_PATH] = {};
-                if (DragQueryFileW((HDROP)hDrop, i, path, MAX_PATH))
-                {
-                    // Only scan certain extensions
-                    std::wstring ext = PathFindExtensionW(path);
-                    std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
-                    static const std::vector<std::wstring> allowed = {
-                        L".txt", L".log", L".csv", L".json", L".xml", L".svg",
-                        L".ps1", L".bat", L".sh",  L".docx", L".xlsx", L".html"
-                    };
-                    if (std::find(allowed.begin(), allowed.end(), ext)
-                        == allowed.end())
-                        continue;  // skip executables, DLLs, images, etc.
-
-                    // Read up to kFileReadLimit bytes from the file
-                    std::wifstream in(path, std::ios::binary);
-                    if (!in)
-                        continue;
-                    std::wstring buffer;
-                    buffer.resize(kFileReadLimit);
-                    in.read(&buffer[0], buffer.size());
-                    buffer.resize(in.gcount());
-
-                    // Check for suspicious content inside the file
-                    if (ContainsBad(buffer))
-                    {
-                        snippet = buffer.substr(0, 100)
-                            + (buffer.size() > 100 ? L"…" : L"");
-                        suspicious = true;
-                    }
-                }
+                if (id != format || (textFormat == TextFormat::Ansi && unicodeSeen))
+                    continue;
+                HANDLE hData = GetClipboardData(format);
+                const char* data = hData ? static_cast<const char*>(GlobalLock(hData)) : nullptr;
+                if (!data)
+                    continue;
+                const size_t size = GlobalSize(hData);
+                if (cap != 0 && size > cap)
+                    job.truncated = true;
+                job.formats.push_back({ textFormat, std::string(data, cap != 0 ? std::min(size, cap) : size) });
+                GlobalUnlock(hData);
             }
         }
-    }*/
+    }
 
     //
-    // C) (Optional) Check for images (CF_DIB)
-    //    This section is currently commented out. It would:
-    //    1) Scan image metadata header (up to 64 KB) for bad patterns
-    //    2) Perform an LSB entropy check to detect steganography
-    /*
-    if (!suspicious)
+    // B) File drops (CF_HDROP): only the paths are taken here; the worker reads
+    //    and scans the files, so the clipboard is not held open for disk I/O.
+    //
+    if (_config.filesEnabled)
     {
-        if (HANDLE hDib = GetClipboardData(CF_DIB))
+        if (HDROP hDrop = static_cast<HDROP>(GetClipboardData(CF_HDROP)))
         {
-            if (void* ptr = GlobalLock(hDib))
+            const UINT count = DragQueryFileW(hDrop, 0xFFFFFFFF, nullptr, 0);
+            std::wstring path;
+            for (UINT i = 0; i < count; ++i)
             {
-                SIZE_T size = GlobalSize(hDib);
-                std::vector<BYTE> data((BYTE*)ptr, (BYTE*)ptr + size);
-                GlobalUnlock(hDib);
-
-                // 1) Check metadata header
-                size_t metaLen = std::min<size_t>(data.size(), 64 * 1024);
-                std::wstring header(reinterpret_cast<wchar_t*>(data.data()),
-                    metaLen / sizeof(wchar_t));
-                if (ContainsBad(header))
-                {
-                    snippet = L"[Image metadata]";
-                    suspicious = true;
-                }
-
-                // 2) LSB anomaly check
-                if (!suspicious)
-                {
-                    size_t zeros = 0, ones = 0;
-                    const size_t offset = sizeof(BITMAPINFOHEADER);
-                    for (size_t i = offset; i + 3 < data.size(); i += 4)
-                    {
-                        zeros += ((data[i]   & 1) == 0);
-                        zeros += ((data[i+1] & 1) == 0);
-                        zeros += ((data[i+2] & 1) == 0);
-                        ones  += ((data[i]   & 1) == 1);
-                        ones  += ((data[i+1] & 1) == 1);
-                        ones  += ((data[i+2] & 1) == 1);
-                    }
-                    double ratio = double(ones) / (zeros + ones);
-                    if (ratio > kLsbLower && ratio < kLsbUpper)
-                    {
-                        snippet = L"[Image LSB anomaly]";
-                        suspicious = true;
-                    }
+                path.resize(DragQueryFileW(hDrop, i, nullptr, 0) + 1);
+                path.resize(DragQueryFileW(hDrop, i, path.data(), static_cast<UINT>(path.size())));
+                if (path.empty() || !IsScannedFile(path.c_str()))
+                    continue;   // Executables, images, archives, directories
+                if (job.files.size() >= static_cast<size_t>(_config.filesMaxFiles)) {
+                    job.truncated = true;   // The rest of the drop counts as unscanned
+                    break;
                 }
+                job.files.push_back(path);
             }
-            else
+        }
+    }
+
+    //
+    // C) Bitmaps (CF_DIB), opt-in: analysed in place while the clipboard is open;
+    //    sampling keeps this bounded for screenshots of any size.
+    //
+    if (_config.imageEnabled)
+    {
+        if (HANDLE hDib = GetClipboardData(CF_DIB))
+        {
+            if (const void* dib = GlobalLock(hDib))
             {
+                const ImageAnalyzer::Finding finding = _images.Analyze(dib, GlobalSize(hDib));
                 GlobalUnlock(hDib);
+                if (finding.anomalous)
+                    job.image = ImageAnalyzer::Describe(finding);
             }
         }
     }
-    */
 
-    // Release the clipboard
+    // Release the clipboard before scanning
     CloseClipboard();
+    _stats.RecordClipboardLock(std::chrono::steady_clock::now() - opened);
+
+    if (!job.text.empty() || !job.formats.empty() || !job.files.empty() || !job.image.empty())
+        _worker.Submit(std::move(job));
+}
+
+//------------------------------------------------------------------------------
+// Scan verdict handler
+//------------------------------------------------------------------------------
+void ClipboardWatcher::OnScanResult(std::unique_ptr<ScanResult> result)
+{
+    // Ignore verdicts while a decision is pending, and for content that has been replaced
+    if (_holdClipboard || result->sequence != GetClipboardSequenceNumber())
+        return;
 
     // If nothing suspicious was found, we're done
-    if (!suspicious)
+    const bool partial = result->status == PatternMatcher::ScanStatus::Partial;
+    if (result->rule == PatternMatcher::kNoMatch && !partial && !result->image) {
+        ScheduleTrim();
+        return;
+    }
+
+    _gatedSequence = result->sequence;
+    _fullContent = std::move(result->text);
+    _contentIncomplete = result->incomplete;
+
+    // Take a snippet of up to 100 characters for preview
+    const std::wstring snippet = _fullContent.substr(0, 100)
+        + (_fullContent.size() > 100 ? L"…" : L"");
+
+    // Determine the source application
+    _srcApp = _processes.NameOfWindow(GetClipboardOwner());
+
+    // Scan budget ran out without a match: the policy decides whether that needs the user
+    if (partial && !_config.promptOnPartial) {
+        _logger.logEvent(_user, _host, _srcApp,
+            L"N/A", snippet, L"Allow (partially scanned)");
+        ReleaseContent();
         return;
+    }
 
     //
     // Original workflow upon detection:
@@ -483,42 +587,32 @@ void ClipboardWatcher::OnClipboardUpdate()
     //   - Log the event
     //
     _holdClipboard = true;
-    _decisionPending = true;
+    _gate.store(PasteGate::Deciding, std::memory_order_release);
     InstallHooks();
 
-    _suspicious = snippet;
     _preview = snippet;
 
-    // Determine the source application
-    _srcApp = L"Unknown";
-    if (HWND owner = GetClipboardOwner())
-    {
-        DWORD pid = 0;
-        GetWindowThreadProcessId(owner, &pid);
-        if (auto proc = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION,
-            FALSE, pid))
-        {
-            wchar_t buf[MAX_PATH] = {};
-            DWORD len = MAX_PATH;
-            if (QueryFullProcessImageNameW(proc, 0, buf, &len))
-            {
-                std::wstring full(buf, len);
-                auto pos = full.find_last_of(L"\\/");
-                _srcApp = (pos == std::wstring::npos)
-                    ? full
-                    : full.substr(pos + 1);
-            }
-            CloseHandle(proc);
-        }
+    // The severity comes from the matching rule; image findings have none
+    std::wstring message = L"Suspicious clipboard content detected.\nKeep it?";
+    if (partial) {
+        message = L"Clipboard content is too large to be scanned completely.\nKeep it?";
+    }
+    else if (result->rule != PatternMatcher::kNoMatch) {
+        static const wchar_t* const kSeverityNames[] = { L"low", L"medium", L"high" };
+        message = L"Suspicious clipboard content detected ("
+            + std::wstring(kSeverityNames[static_cast<size_t>(result->severity)]) + L" severity).\nKeep it?";
     }
 
-    // Ask the user whether to discard the suspicious content
-    int choice = AskYesNo(
-        _hWnd,
-        L"Security Alert – Extended Runtime Detection",
-        L"Suspicious clipboard content detected.\nKeep it?",
-        _preview.c_str()
-    );
+    // Ask the user whether to discard the suspicious content; the answer arrives as
+    // WM_XRD_DECISION while this thread keeps serving the hooks
+    if (!_dialog.Ask(L"Security Alert – Extended Runtime Detection", std::move(message), _preview))
+        OnDecision(IDNO);
+}
+
+void ClipboardWatcher::OnDecision(int choice)
+{
+    if (_gate.load(std::memory_order_acquire) != PasteGate::Deciding)
+        return;     // Stopped meanwhile
 
     if (choice == IDNO)
     {
@@ -540,7 +634,7 @@ void ClipboardWatcher::OnClipboardUpdate()
         _logger.logEvent(_user, _host, _srcApp,
             L"N/A", _preview, L"Discard");
 
-        _holdClipboard = _decisionPending = false;
+        ReleaseContent();
         UninstallHooks();
     }
     else
@@ -556,10 +650,159 @@ void ClipboardWatcher::OnClipboardUpdate()
         nid.dwInfoFlags = NIIF_USER;
         Shell_NotifyIconW(NIM_MODIFY, &nid);
 
-        _decisionPending = false;
-        _awaitPaste = true;
-        _tokenUsed = false;
+        // Render gate: no hooks at all until the paste; the consumer reveals itself
+        // by asking for the text (WM_RENDERFORMAT). Falls back to the hooks.
+        _paste = PasteEvent{};
+        if (_config.pasteRenderGate && OfferClipboardText()) {
+            UninstallHooks();
+            _gate.store(PasteGate::Offered, std::memory_order_release);
+        }
+        else {
+            Advance(PasteGate::Deciding, PasteGate::Armed);
+        }
+        if (_config.pasteTimeoutMs != 0)
+            SetTimer(_hWnd, kPasteTimerId, _config.pasteTimeoutMs, nullptr);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Paste gate by delayed rendering
+//------------------------------------------------------------------------------
+bool ClipboardWatcher::OfferClipboardText()
+{
+    // Only the full text can stand in for the original; a capped copy cannot
+    if (_contentIncomplete || !OpenClipboard(_hWnd))
+        return false;
+    EmptyClipboard();
+    SetClipboardData(CF_UNICODETEXT, nullptr);  // rendered on WM_RENDERFORMAT
+    CloseClipboard();
+    _scannedSequence = GetClipboardSequenceNumber();    // our own offer needs no scan
+    return true;
+}
+
+void ClipboardWatcher::RenderClipboardText()
+{
+    const size_t bytes = (_fullContent.size() + 1) * sizeof(wchar_t);
+    HGLOBAL mem = GlobalAlloc(GMEM_MOVEABLE, bytes);
+    if (!mem)
+        return;
+    if (auto ptr = GlobalLock(mem)) {
+        memcpy(ptr, _fullContent.c_str(), bytes);
+        GlobalUnlock(mem);
+        if (SetClipboardData(CF_UNICODETEXT, mem))
+            return;     // the clipboard owns it now
+    }
+    GlobalFree(mem);
+}
+
+void ClipboardWatcher::OnRenderFormat(UINT format)
+{
+    if (format != CF_UNICODETEXT || !Advance(PasteGate::Offered, PasteGate::Idle))
+        return;
+
+    // The consumer holds the clipboard open right now: it is the paste destination
+    HWND consumer = GetOpenClipboardWindow();
+    if (!consumer)
+        consumer = _paste.window ? _paste.window : GetForegroundWindow();
+
+    RenderClipboardText();
+    KillTimer(_hWnd, kPasteTimerId);
+    LogFinalPaste(_processes.NameOfWindow(consumer));
+}
+
+void ClipboardWatcher::OnRenderAllFormats()
+{
+    // Exiting with an approved paste still on offer: leave the text behind
+    if (_gate.load(std::memory_order_acquire) != PasteGate::Offered || !OpenClipboard(_hWnd))
+        return;
+    if (GetClipboardOwner() == _hWnd)
+        RenderClipboardText();
+    CloseClipboard();
+}
+
+void ClipboardWatcher::OnDestroyClipboard()
+{
+    // Another application replaced the offered text before anyone pasted it
+    if (!Advance(PasteGate::Offered, PasteGate::Idle))
+        return;
+    KillTimer(_hWnd, kPasteTimerId);
+    ReleaseContent();
+}
+
+void ClipboardWatcher::OnPasteTimeout()
+{
+    KillTimer(_hWnd, kPasteTimerId);
+
+    // Closing the gate first: a paste the hooks take from here on is refused
+    const bool offered = Advance(PasteGate::Offered, PasteGate::Idle);
+    if (!offered && !Advance(PasteGate::Armed, PasteGate::Idle))
+        return;     // pasted meanwhile, or finishing right now
+
+    // The approval covered one paste soon after the decision: take the content back
+    UninstallHooks();
+    const bool removed = (offered || GetClipboardSequenceNumber() == _gatedSequence) && OpenClipboard(_hWnd);
+    if (removed) {
+        EmptyClipboard();
+        CloseClipboard();
+        _scannedSequence = GetClipboardSequenceNumber();
     }
+
+    NOTIFYICONDATA nid{ sizeof(nid) };
+    nid.hWnd = _trayHwnd;
+    nid.uID = _trayID;
+    nid.uFlags = NIF_INFO;
+    wcscpy_s(nid.szInfoTitle, L"Clipboard verdict");
+    wcscpy_s(nid.szInfo, L"Paste approval expired. Content removed.");
+    nid.dwInfoFlags = NIIF_WARNING;
+    Shell_NotifyIconW(NIM_MODIFY, &nid);
+
+    _logger.logEvent(_user, _host, _srcApp,
+        L"N/A", _preview, L"Expired");
+    ReleaseContent();
+
+    // Whatever was copied while the decision held the clipboard has not been scanned yet
+    if (!removed)
+        OnClipboardUpdate();
+}
+
+//------------------------------------------------------------------------------
+// Statistics
+//------------------------------------------------------------------------------
+void ClipboardWatcher::LogStats()
+{
+    const std::wstring summary = _stats.Summarize();
+    if (!summary.empty())
+        _logger.logMessage(summary);
+}
+
+//------------------------------------------------------------------------------
+// Memory
+//------------------------------------------------------------------------------
+void ClipboardWatcher::ReleaseContent()
+{
+    std::wstring().swap(_fullContent);  // release the retained copy
+    _contentIncomplete = false;
+    _holdClipboard = false;
+    ScheduleTrim();
+}
+
+void ClipboardWatcher::ScheduleTrim()
+{
+    // Re-armed by every decision, so the trim only runs once the process is idle
+    if (_config.memoryBounded && _config.memoryIdleTrimMs != 0)
+        SetTimer(_hWnd, kTrimTimerId, _config.memoryIdleTrimMs, nullptr);
+}
+
+void ClipboardWatcher::OnTrimTimer()
+{
+    KillTimer(_hWnd, kTrimTimerId);
+    if (_holdClipboard)
+        return;     // a decision is pending; its release schedules the next trim
+
+    // Hand freed heap blocks back to the system, then drop the resident pages;
+    // anything still in use faults back in from the standby list on demand
+    HeapCompact(GetProcessHeap(), 0);
+    SetProcessWorkingSetSize(GetCurrentProcess(), static_cast<SIZE_T>(-1), static_cast<SIZE_T>(-1));
 }
 
 
@@ -580,69 +823,7 @@ void ClipboardWatcher::InstallHooks()
     if (!s_mouseHook) {
         s_mouseHook = SetWindowsHookExW(
             WH_MOUSE_LL,
-            [](int code, WPARAM wp, LPARAM lp) -> LRESULT {
-                if (code == HC_ACTION && s_this) {
-                    auto* self = s_this;
-                    // Block clicks during decision dialog
-                    if (self->_decisionPending &&
-                        (wp == WM_RBUTTONDOWN || wp == WM_RBUTTONUP ||
-                            wp == WM_MBUTTONDOWN || wp == WM_MBUTTONUP))
-                        return 1;
-                    // Handle single allowed paste
-                    if (self->_awaitPaste) {
-                        if (self->_tokenUsed &&
-                            (wp == WM_RBUTTONDOWN || wp == WM_RBUTTONUP ||
-                                wp == WM_MBUTTONDOWN || wp == WM_MBUTTONUP))
-                            return 1;
-                        if (wp == WM_RBUTTONUP) {
-                            // TODO: factor out common paste-finalization code
-                            self->_tokenUsed = true;
-                            self->UninstallHooks();
-                            // Restore clipboard and log paste
-                            if (OpenClipboard(self->_hWnd)) {
-                                HGLOBAL mem = GlobalAlloc(GMEM_MOVEABLE,
-                                    (self->_suspicious.size() + 1) * sizeof(wchar_t));
-                                if (auto ptr = GlobalLock(mem)) {
-                                    memcpy(ptr, self->_suspicious.c_str(),
-                                        (self->_suspicious.size() + 1) * sizeof(wchar_t));
-                                    GlobalUnlock(mem);
-                                    EmptyClipboard();
-                                    SetClipboardData(CF_UNICODETEXT, mem);
-                                }
-                                CloseClipboard();
-                            }
-                            // Determine destination app and log
-                            POINT pt; GetCursorPos(&pt);
-                            HWND destWin = WindowFromPoint(pt);
-                            std::wstring destName = L"Unknown";
-                            if (destWin) {
-                                DWORD pid = 0;
-                                GetWindowThreadProcessId(destWin, &pid);
-                                if (auto proc = OpenProcess(
-                                    PROCESS_QUERY_LIMITED_INFORMATION,
-                                    FALSE, pid)) {
-                                    wchar_t path[MAX_PATH] = {};
-                                    DWORD len = MAX_PATH;
-                                    if (QueryFullProcessImageNameW(
-                                        proc, 0, path, &len)) {
-                                        std::wstring full(path, len);
-                                        auto pos = full.find_last_of(L"/\\");
-                                        destName = (pos == std::wstring::npos) ?
-                                            full : full.substr(pos + 1);
-                                    }
-                                    CloseHandle(proc);
-                                }
-                            }
-                            self->LogFinalPaste(destName);
-                            return 1;
-                        }
-                        // Block middle-click paste
-                        if (wp == WM_MBUTTONDOWN || wp == WM_MBUTTONUP)
-                            return 1;
-                    }
-                }
-                return CallNextHookEx(s_mouseHook, code, wp, lp);
-            },
+            LLMouseProc,
             GetModuleHandle(nullptr),
             0);
         // TODO: check for failure and log
@@ -659,68 +840,98 @@ void ClipboardWatcher::UninstallHooks()
         UnhookWindowsHookEx(s_mouseHook);
         s_mouseHook = nullptr;
     }
-    _awaitPaste = false;
-    _tokenUsed = false;
-    _decisionPending = false;
+    _gate.store(PasteGate::Idle, std::memory_order_release);
+}
+
+bool ClipboardWatcher::Advance(PasteGate from, PasteGate to)
+{
+    return _gate.compare_exchange_strong(from, to, std::memory_order_acq_rel);
 }
 
 //------------------------------------------------------------------------------
-// Low-level keyboard hook
+// Low-level hooks
+//
+// Windows silently removes a low-level hook that misses LowLevelHooksTimeout, so
+// these only check the gate, fill the preallocated _paste slot and post
+// WM_XRD_PASTE: no allocation, no clipboard, no process lookups, no logging.
 //------------------------------------------------------------------------------
 LRESULT CALLBACK ClipboardWatcher::LLKBProc(int code,
     WPARAM wParam,
     LPARAM lParam)
 {
-    if (code == HC_ACTION && s_this) {
-        auto* self = s_this;
+    ClipboardWatcher* self = s_this;
+    if (code == HC_ACTION && self && self->_gate.load(std::memory_order_acquire) != PasteGate::Idle) {
         auto* kb = reinterpret_cast<KBDLLHOOKSTRUCT*>(lParam);
         bool ctrl = (GetAsyncKeyState(VK_CONTROL) & 0x8000) != 0;
         bool shift = (GetAsyncKeyState(VK_SHIFT) & 0x8000) != 0;
 
-        if (self->_decisionPending &&
-            IsCopyCutPaste(kb->vkCode, ctrl, shift))
-            return 1;
-
-        if (self->_awaitPaste &&
-            IsCopyCutPaste(kb->vkCode, ctrl, shift)) {
-            if (self->_tokenUsed)
-                return 1;
-            self->_tokenUsed = true;
-            self->UninstallHooks();
-            // Determine destination and log
-            HWND fg = GetForegroundWindow();
-            std::wstring dest = L"Unknown";
-            if (fg) {
-                DWORD pid = 0;
-                GetWindowThreadProcessId(fg, &pid);
-                if (auto proc = OpenProcess(
-                    PROCESS_QUERY_LIMITED_INFORMATION,
-                    FALSE, pid)) {
-                    wchar_t path[MAX_PATH] = {};
-                    DWORD len = MAX_PATH;
-                    if (QueryFullProcessImageNameW(proc, 0, path, &len)) {
-                        std::wstring full(path, len);
-                        auto pos = full.find_last_of(L"/\\");
-                        dest = (pos == std::wstring::npos) ? full
-                            : full.substr(pos + 1);
-                    }
-                    CloseHandle(proc);
-                }
+        if (IsCopyCutPaste(kb->vkCode, ctrl, shift)) {
+            if (self->Advance(PasteGate::Armed, PasteGate::Used)) {
+                self->_paste.mouse = false;
+                self->_paste.window = GetForegroundWindow();
+                PostMessageW(self->_hWnd, WM_XRD_PASTE, 0, 0);
             }
-            self->LogFinalPaste(dest);
-            return 1;
+            return 1;   // Deciding, or the single allowed paste was just taken
         }
     }
     return CallNextHookEx(s_kbHook, code, wParam, lParam);
 }
 
+LRESULT CALLBACK ClipboardWatcher::LLMouseProc(int code,
+    WPARAM wParam,
+    LPARAM lParam)
+{
+    ClipboardWatcher* self = s_this;
+    const PasteGate gate = self ? self->_gate.load(std::memory_order_acquire) : PasteGate::Idle;
+    if (code == HC_ACTION && gate != PasteGate::Idle) {
+        const bool right = wParam == WM_RBUTTONDOWN || wParam == WM_RBUTTONUP;
+        const bool middle = wParam == WM_MBUTTONDOWN || wParam == WM_MBUTTONUP;
+
+        // Right-button release takes the approval; middle-click paste is always blocked.
+        // The release still goes through: most windows open their context menu from it,
+        // and the offer is in place long before the user picks Paste there
+        if (gate == PasteGate::Armed && wParam == WM_RBUTTONUP &&
+            self->Advance(PasteGate::Armed, PasteGate::Used)) {
+            self->_paste.mouse = true;
+            self->_paste.point = reinterpret_cast<MSLLHOOKSTRUCT*>(lParam)->pt;
+            PostMessageW(self->_hWnd, WM_XRD_PASTE, 0, 0);
+            return CallNextHookEx(s_mouseHook, code, wParam, lParam);
+        }
+        if (middle || (right && gate != PasteGate::Armed))
+            return 1;
+    }
+    return CallNextHookEx(s_mouseHook, code, wParam, lParam);
+}
+
+//------------------------------------------------------------------------------
+// Allowed paste, finished on the message thread
+//------------------------------------------------------------------------------
+void ClipboardWatcher::OnPaste()
+{
+    if (_gate.load(std::memory_order_acquire) != PasteGate::Used)
+        return;
+    UninstallHooks();
+
+    if (_paste.mouse) {
+        // The context menu pastes later: offer the full text and finish when it is
+        // rendered (OnRenderFormat); the approval timer keeps running until then
+        _paste.window = WindowFromPoint(_paste.point);
+        if (OfferClipboardText()) {
+            _gate.store(PasteGate::Offered, std::memory_order_release);
+            return;
+        }
+    }
+    KillTimer(_hWnd, kPasteTimerId);
+    LogFinalPaste(_processes.NameOfWindow(_paste.window));
+}
+
 //------------------------------------------------------------------------------
 // Final log
 //------------------------------------------------------------------------------
 void ClipboardWatcher::LogFinalPaste(const std::wstring& destApp)
 {
-    _logger.logEvent(_user, _host, _srcApp, destApp, _fullContent, L"Keep");
-    _holdClipboard = false;
+    _logger.logEvent(_user, _host, _srcApp, destApp, std::move(_fullContent), L"Keep");
+    ReleaseContent();
 }
 
 // End of ClipboardWatcher.cpp
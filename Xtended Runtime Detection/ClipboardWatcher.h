@@ -1,22 +1,47 @@
 #pragma once
 
 #include <windows.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
-#include <regex>
 
+#include "DecisionDialog.h"
+#include "ImageAnalyzer.h"
+#include "PatternMatcher.h"
+#include "PatternWatcher.h"
+#include "ProcessIdentity.h"
+#include "ScanStats.h"
+#include "ScanWorker.h"
+#include "ServiceClient.h"
+#include "XrdConfig.h"
 #include "XrdLogger.h"
 
 #ifndef WM_CLIPBOARDUPDATE
 #define WM_CLIPBOARDUPDATE 0x031D
 #endif
 
+/** @brief Posted by the low-level hooks when the single allowed paste happened. */
+constexpr UINT WM_XRD_PASTE = WM_APP + 3;
+
 /**
  * @class ClipboardWatcher
  * @brief Monitors the Windows clipboard for suspicious patterns and intercepts paste operations.
  *
  * Loads regex patterns from a file, listens to clipboard updates, and prompts the user
  * to confirm or discard content matching any pattern. Logs events via XrdLogger.
+ * Edits to the pattern file are picked up while running (see PatternWatcher).
+ *
+ * On a terminal server the watcher of each session can run as an agent of the scan
+ * service ([Service] Mode in xrd.ini): it then compiles no patterns of its own, sends
+ * its snapshots to the service and forwards its log records to the service's log.
+ *
+ * With [Startup] Fast=1 the clipboard listener is registered before anything else, a
+ * stale patterns.xrdc is recompiled in the background while copies wait for the rules,
+ * and the log is opened with its first record. The time from process start to the
+ * listener and to the first rule set goes to the scan statistics either way.
  */
 class ClipboardWatcher
 {
@@ -35,11 +60,16 @@ public:
     /**
      * @brief Initializes the watcher.
      * @param inst The HINSTANCE of the application.
+     * @return True if initialization succeeded.
+     */
+    bool Start(HINSTANCE inst);
+
+    /**
+     * @brief Sets the notification icon used for verdict balloons; call after Start().
      * @param trayHwnd The window handle owning the notification icon.
      * @param trayId The ID of the tray icon.
-     * @return True if initialization succeeded.
      */
-    bool Start(HINSTANCE inst, HWND trayHwnd, UINT trayId);
+    void AttachTray(HWND trayHwnd, UINT trayId);
 
     /**
      * @brief Stops watching clipboard updates and removes hooks.
@@ -54,28 +84,78 @@ public:
 private:
     // Helper functions
 
-    /** @brief Loads regex patterns from the configured file. */
-    bool LoadPatterns();
-
     /**
-     * @brief Checks if the given text matches any loaded pattern.
-     * @param txt Clipboard text to check.
-     * @return True if any pattern matches.
+     * @brief Loads regex patterns from the configured file and compiles the matcher.
+     * @param cachedOnly Only take an up-to-date patterns.xrdc; false if there is none.
      */
-    bool ContainsBad(const std::wstring& txt) const;
+    bool LoadPatterns(bool cachedOnly = false);
+
+    /** @brief WM_XRD_PATTERNSLOADED: the background compile of a fast start is done. */
+    void OnPatternsLoaded(bool published);
+
+    /** @brief Records the time to protection once rules are in place. */
+    void RecordProtected();
 
     /** @brief Creates a hidden message-only window for receiving clipboard events. */
     bool CreateMsgWindow(HINSTANCE inst);
 
-    /** @brief Called when the clipboard content changes. */
+    /** @brief Called when the clipboard content changes; schedules a debounced scan. */
     void OnClipboardUpdate();
 
+    /** @brief Debounce timer expired: snapshots the latest content for the scan worker. */
+    void OnScanTimer();
+
+    /**
+     * @brief Called on the message thread when the scan worker has a verdict.
+     * @param result Scanned snapshot and matching pattern.
+     */
+    void OnScanResult(std::unique_ptr<ScanResult> result);
+
+    /**
+     * @brief Called on the message thread when the user has answered the dialog.
+     * @param choice IDNO discards the content; any other button keeps it.
+     */
+    void OnDecision(int choice);
+
     /** @brief Installs keyboard and mouse hooks to intercept actions. */
     void InstallHooks();
 
-    /** @brief Uninstalls keyboard and mouse hooks. */
+    /** @brief Uninstalls keyboard and mouse hooks and closes the paste gate. */
     void UninstallHooks();
 
+    /** @brief Finishes the allowed paste a hook recorded: clipboard, destination, log. */
+    void OnPaste();
+
+    /** @brief Puts CF_UNICODETEXT on the clipboard for delayed rendering; false if it is busy. */
+    bool OfferClipboardText();
+
+    /** @brief Renders _fullContent as CF_UNICODETEXT; the clipboard must be open. */
+    void RenderClipboardText();
+
+    /** @brief WM_RENDERFORMAT: a consumer reads the offered text, i.e. the paste happens. */
+    void OnRenderFormat(UINT format);
+
+    /** @brief WM_RENDERALLFORMATS: leave the offered text on the clipboard before exiting. */
+    void OnRenderAllFormats();
+
+    /** @brief WM_DESTROYCLIPBOARD: the offered text was replaced before it was pasted. */
+    void OnDestroyClipboard();
+
+    /** @brief The allowed paste did not happen in time: revoke it and clear the clipboard. */
+    void OnPasteTimeout();
+
+    /** @brief Writes the scan statistics of the last period to the log. */
+    void LogStats();
+
+    /** @brief Frees the retained content once a decision is complete; ends the clipboard hold. */
+    void ReleaseContent();
+
+    /** @brief Bounded memory: (re)arms the idle working set trim. */
+    void ScheduleTrim();
+
+    /** @brief Compacts the heap and trims the working set while nothing is retained. */
+    void OnTrimTimer();
+
     /**
      * @brief Logs the final paste action to the logger.
      * @param destApp The destination application name.
@@ -90,6 +170,37 @@ private:
     /** @brief Low-level keyboard hook procedure. */
     static LRESULT CALLBACK LLKBProc(int code, WPARAM wParam, LPARAM lParam);
 
+    /** @brief Low-level mouse hook procedure. */
+    static LRESULT CALLBACK LLMouseProc(int code, WPARAM wParam, LPARAM lParam);
+
+    /**
+     * @brief State of the paste gate; checked by the hooks on every input event.
+     *
+     * One atomic value, so a hook answers with a single load, or a single exchange for
+     * the paste it lets through, whatever the dialog thread is doing. The hooks only ever
+     * take Armed to Used; the transitions that can race with that go through Advance(),
+     * so a timer or a paste that arrives after the gate moved on changes nothing.
+     */
+    enum class PasteGate : std::uint8_t
+    {
+        Idle,       ///< No hooks installed
+        Deciding,   ///< Dialog open: copy/paste keys and right/middle clicks are blocked
+        Armed,      ///< The next paste is allowed and consumes the token
+        Used,       ///< Token consumed; OnPaste() finishes on the message thread
+        Offered,    ///< No hooks; the full text waits for WM_RENDERFORMAT (render gate, right-click)
+    };
+
+    /** @brief Moves the gate from one state to another; false if it is no longer in from. */
+    bool Advance(PasteGate from, PasteGate to);
+
+    /** @brief The allowed paste as captured by a hook; one slot, filled without allocating. */
+    struct PasteEvent
+    {
+        bool  mouse = false;        ///< Right-click paste (else keyboard)
+        HWND  window = nullptr;     ///< Foreground window at the key press, or window under the click
+        POINT point{};              ///< Mouse: cursor position at the click
+    };
+
     // Static members
 
     static ClipboardWatcher* s_this; ///< Pointer to current instance for hooks
@@ -99,25 +210,40 @@ private:
     // Configuration
 
     std::wstring _patternFile;         ///< Path to regex pattern file
-    std::vector<std::wregex> _patterns;///< Compiled regex patterns
+    XrdConfig _config;                 ///< Settings from xrd.ini
+    std::uint64_t _patternHash = 0;    ///< Hash of the pattern file behind the initial set
+    std::chrono::microseconds _listeningAfter{ 0 };    ///< Process start to AddClipboardFormatListener()
+    ScanWorker::RuleSet _patterns;     ///< All patterns compiled into one automaton; swapped on reload
+    ScanStats _stats;                 ///< Declared before _worker, which records into it
+    ServiceClient _service;           ///< Agent mode: connection to the scan service; before _worker too
+    bool _agent = false;              ///< Scans and logs through the scan service
+    ScanWorker _worker{ _patterns };   ///< Scans clipboard snapshots off the message thread
 
     // Runtime state
 
     HWND _hWnd = nullptr;             ///< Hidden window for message loop
     HWND _trayHwnd = nullptr;         ///< Tray icon owner window
     UINT _trayID = 0;                 ///< Tray icon ID
+    ProcessIdentityCache _processes;  ///< Source/destination app names without kernel calls in hooks
+    ImageAnalyzer _images;            ///< Opt-in CF_DIB check, run while the clipboard is open
+    std::vector<std::pair<TextFormat, UINT>> _formats;  ///< Rich formats to snapshot, with their clipboard ids
 
-    bool _decisionPending = false;    ///< True if user confirmation dialog is open
-    bool _awaitPaste = false;         ///< True if awaiting a single paste action
-    bool _tokenUsed = false;          ///< True if the allowed paste has occurred
+    std::atomic<PasteGate> _gate{ PasteGate::Idle };    ///< Read by the hooks on every input event
+    DecisionDialog _dialog;           ///< Asks Keep/Discard off the message thread
+    PasteEvent _paste;                ///< Filled by a hook, consumed by OnPaste()
     bool _holdClipboard = false;      ///< True to ignore nested clipboard events
+    DWORD _scannedSequence = 0;       ///< Clipboard sequence number last handed to the worker
+    DWORD _gatedSequence = 0;         ///< Clipboard sequence number of the content being decided
+    int _openRetries = 0;             ///< Failed OpenClipboard attempts for the pending scan
 
-    std::wstring _suspicious;         ///< Cached suspicious text preview
     std::wstring _srcApp;             ///< Source application of clipboard text
     std::wstring _preview;            ///< Preview of the clipboard content
     std::wstring _user;               ///< Username for logging
     std::wstring _host;               ///< Hostname for logging
 	std::wstring _fullContent;        /// Full content of the clipboard
+    bool _contentIncomplete = false;  ///< _fullContent is not the whole clipboard (memory cap, file drop)
 
     XrdLogger _logger;                ///< Logger for events
+
+    PatternWatcher _patternWatcher{ _patterns, _logger };  ///< Hot reload of the pattern file
 };
@@ -0,0 +1,122 @@
+/**
+ * @file ContentStore.cpp
+ * @brief Implements the content-addressed payload store of the logger.
+ *
+ * File layout: a SpillHeader followed by the payload, either raw UTF-8 or one
+ * Compression API buffer (decompress with CreateDecompressor(header.algorithm)).
+ */
+
+#include "ContentStore.h"
+
+#include <algorithm>
+#include <cstring>
+
+#pragma comment(lib, "bcrypt.lib")
+#pragma comment(lib, "Cabinet.lib")
+
+namespace {
+    constexpr std::uint32_t kSpillMagic = 0x5A445258;   // "XRDZ"
+    constexpr std::uint16_t kSpillVersion = 1;
+    constexpr std::uint16_t kStoredRaw = 0;             // Otherwise a COMPRESS_ALGORITHM_* value
+
+    struct SpillHeader
+    {
+        std::uint32_t magic;
+        std::uint16_t version;
+        std::uint16_t algorithm;
+        std::uint64_t size;         // Payload bytes before compression
+    };
+} // anonymous namespace
+
+ContentStore::~ContentStore()
+{
+    if (_compressor)
+        CloseCompressor(_compressor);
+    if (_sha256)
+        BCryptCloseAlgorithmProvider(_sha256, 0);
+}
+
+bool ContentStore::Open(const std::filesystem::path& directory)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    if (ec)
+        return false;
+    _directory = directory;
+
+    if (!_sha256 && !BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&_sha256, BCRYPT_SHA256_ALGORITHM, nullptr, 0))) {
+        _sha256 = nullptr;
+        return false;
+    }
+    if (!_compressor && !CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, nullptr, &_compressor))
+        _compressor = nullptr;  // Still usable, just larger files
+    return true;
+}
+
+bool ContentStore::Put(std::string_view utf8, std::string& key)
+{
+    if (!_sha256 || utf8.size() > MAXULONG)
+        return false;
+
+    UCHAR digest[32];
+    if (!BCRYPT_SUCCESS(BCryptHash(_sha256, nullptr, 0,
+        reinterpret_cast<PUCHAR>(const_cast<char*>(utf8.data())), static_cast<ULONG>(utf8.size()),
+        digest, sizeof(digest))))
+        return false;
+
+    constexpr char kHex[] = "0123456789abcdef";
+    key.clear();
+    for (const UCHAR byte : digest) {
+        key += kHex[byte >> 4];
+        key += kHex[byte & 0xF];
+    }
+
+    const std::filesystem::path path = _directory / (key + ".xrdz");
+    if (GetFileAttributesW(path.c_str()) != INVALID_FILE_ATTRIBUTES)
+        return true;    // Stored before
+
+    SpillHeader header{ kSpillMagic, kSpillVersion, kStoredRaw, utf8.size() };
+    _buffer.resize(sizeof(header));
+    if (_compressor) {
+        SIZE_T needed = 0;
+        if (!Compress(_compressor, utf8.data(), utf8.size(), nullptr, 0, &needed) &&
+            GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+            _buffer.resize(sizeof(header) + needed);
+            SIZE_T compressed = 0;
+            if (Compress(_compressor, utf8.data(), utf8.size(),
+                _buffer.data() + sizeof(header), needed, &compressed) && compressed < utf8.size()) {
+                _buffer.resize(sizeof(header) + compressed);
+                header.algorithm = COMPRESS_ALGORITHM_XPRESS_HUFF;
+            }
+        }
+    }
+    if (header.algorithm == kStoredRaw)
+        _buffer.replace(sizeof(header), std::string::npos, utf8);
+    std::memcpy(_buffer.data(), &header, sizeof(header));
+
+    // Written under a temporary name and renamed, so a present file is always complete
+    const std::wstring tempPath = path.wstring() + L"." + std::to_wstring(GetCurrentProcessId()) + L".tmp";
+    HANDLE file = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    bool ok = true;
+    for (size_t offset = 0; ok && offset < _buffer.size(); ) {
+        const DWORD chunk = static_cast<DWORD>(std::min<size_t>(_buffer.size() - offset, 1u << 30));
+        DWORD written = 0;
+        ok = WriteFile(file, _buffer.data() + offset, chunk, &written, nullptr) && written == chunk;
+        offset += written;
+    }
+    ok = CloseHandle(file) && ok;
+    _buffer.clear();
+
+    // Another instance may have stored the same payload meanwhile; either copy will do
+    if (!ok || !MoveFileExW(tempPath.c_str(), path.c_str(), 0)) {
+        DeleteFileW(tempPath.c_str());
+        return ok && GetFileAttributesW(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+    }
+    return true;
+}
+
+// End of ContentStore.cpp
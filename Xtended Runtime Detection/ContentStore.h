@@ -0,0 +1,54 @@
+#pragma once
+
+#include <windows.h>
+#include <bcrypt.h>
+#include <compressapi.h>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+/**
+ * @class ContentStore
+ * @brief Content-addressed store for large log payloads.
+ *
+ * Each distinct payload is written once to <directory>/<sha256>.xrdz, compressed with
+ * XPRESS-Huffman where that saves space; storing a payload that is already present costs
+ * one attribute lookup. Log records then carry the key instead of the text. SHA-256 rather
+ * than a fast hash names the files, so pasted content cannot be crafted to collide with an
+ * earlier payload and hide behind its file.
+ *
+ * Used from the log writer thread only; not thread-safe.
+ */
+class ContentStore
+{
+public:
+    ContentStore() = default;
+    ~ContentStore();
+
+    ContentStore(const ContentStore&) = delete;
+    ContentStore& operator=(const ContentStore&) = delete;
+
+    /**
+     * @brief Creates the directory and the hashing and compression handles.
+     * @param directory Folder the payload files are written to.
+     * @return False if payloads cannot be stored; records must then inline their content.
+     */
+    bool Open(const std::filesystem::path& directory);
+
+    /**
+     * @brief Stores a payload unless an identical one is already present.
+     * @param utf8 Payload bytes.
+     * @param[out] key SHA-256 of the payload as 64 lowercase hex digits (the file stem).
+     * @return True if the payload is on disk, written now or earlier.
+     */
+    bool Put(std::string_view utf8, std::string& key);
+
+    /** @brief Frees the compression buffer, which otherwise keeps the size of the largest payload. */
+    void ReleaseBuffer() { std::string().swap(_buffer); }
+
+private:
+    std::filesystem::path _directory;
+    BCRYPT_ALG_HANDLE     _sha256 = nullptr;
+    COMPRESSOR_HANDLE     _compressor = nullptr;   ///< Null: store uncompressed
+    std::string           _buffer;                 ///< Reused header + compressed bytes
+};
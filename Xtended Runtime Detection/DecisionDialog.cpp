@@ -0,0 +1,144 @@
+/**
+ * @file DecisionDialog.cpp
+ * @brief Implements the Keep/Discard dialog thread used by ClipboardWatcher.
+ */
+
+#include "DecisionDialog.h"
+
+#include <commctrl.h>
+
+#pragma comment(lib, "comctl32.lib")
+
+//------------------------------------------------------------------------------
+// Constructor / Destructor
+//------------------------------------------------------------------------------
+DecisionDialog::~DecisionDialog()
+{
+    Stop();
+}
+
+//------------------------------------------------------------------------------
+// Public API
+//------------------------------------------------------------------------------
+void DecisionDialog::Start(HWND target)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _target = target;
+    _stop = false;
+}
+
+void DecisionDialog::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+        _pending.reset();
+        if (_dialog)
+            PostMessageW(_dialog, WM_CLOSE, 0, 0);
+    }
+    _wake.notify_one();
+    if (_thread.joinable())
+        _thread.join();
+
+    // Answers carry no data, but one left in the queue would apply to the next question
+    MSG msg;
+    while (_target && PeekMessageW(&msg, _target, WM_XRD_DECISION, WM_XRD_DECISION, PM_REMOVE)) {}
+    _target = nullptr;
+    _open = false;
+}
+
+bool DecisionDialog::Ask(std::wstring title, std::wstring text, std::wstring footer)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stop || _open || !_target)
+            return false;
+        if (!_thread.joinable()) {
+            try {
+                _thread = std::thread(&DecisionDialog::Run, this);
+            }
+            catch (...) {
+                return false;
+            }
+        }
+        _pending = Question{ std::move(title), std::move(text), std::move(footer) };
+        _open = true;
+    }
+    _wake.notify_one();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Dialog thread
+//------------------------------------------------------------------------------
+HRESULT CALLBACK DecisionDialog::OnNotify(HWND hwnd, UINT msg, WPARAM /*wParam*/,
+    LPARAM /*lParam*/, LONG_PTR refData)
+{
+    auto* self = reinterpret_cast<DecisionDialog*>(refData);
+    if (msg == TDN_CREATED) {
+        SetWindowPos(hwnd, HWND_TOPMOST, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE);
+
+        // Stop() may have come before the window existed
+        std::lock_guard<std::mutex> lock(self->_mutex);
+        self->_dialog = hwnd;
+        if (self->_stop)
+            PostMessageW(hwnd, WM_CLOSE, 0, 0);
+    }
+    else if (msg == TDN_DESTROYED) {
+        std::lock_guard<std::mutex> lock(self->_mutex);
+        self->_dialog = nullptr;
+    }
+    return S_OK;
+}
+
+void DecisionDialog::Run()
+{
+    INITCOMMONCONTROLSEX icc{ sizeof(icc), ICC_STANDARD_CLASSES };
+    InitCommonControlsEx(&icc);
+
+    for (;;) {
+        Question question;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [this] { return _stop || _pending.has_value(); });
+            if (_stop)
+                return;
+            question = std::move(*_pending);
+            _pending.reset();
+        }
+
+        TASKDIALOGCONFIG cfg = {};
+        cfg.cbSize = sizeof(cfg);
+        cfg.hwndParent = nullptr;
+        cfg.dwFlags = TDF_ALLOW_DIALOG_CANCELLATION;
+        cfg.pszWindowTitle = question.title.c_str();
+        cfg.pszMainInstruction = question.text.c_str();
+        cfg.pszContent = question.footer.c_str();
+        cfg.pszMainIcon = MAKEINTRESOURCEW(TD_WARNING_ICON);
+        cfg.pfCallback = OnNotify;
+        cfg.lpCallbackData = reinterpret_cast<LONG_PTR>(this);
+
+        TASKDIALOG_BUTTON buttons[] = {
+            { IDYES, L"Yes" },
+            { IDNO,  L"No"  }
+        };
+        cfg.cButtons = _countof(buttons);
+        cfg.pButtons = buttons;
+        cfg.nDefaultButton = IDYES;
+
+        int choice = 0;
+        const HRESULT hr = TaskDialogIndirect(&cfg, &choice, nullptr, nullptr);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _dialog = nullptr;
+        _open = false;
+        if (_stop)
+            return;     // Closed by Stop(): there is nobody left to answer
+        // A dialog that could not be shown counts as No: nobody approved the content
+        if (FAILED(hr))
+            choice = IDNO;
+        PostMessageW(_target, WM_XRD_DECISION, static_cast<WPARAM>(choice), 0);
+    }
+}
+
+// End of DecisionDialog.cpp
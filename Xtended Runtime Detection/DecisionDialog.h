@@ -0,0 +1,77 @@
+#pragma once
+
+#include <windows.h>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+/** @brief Posted to the target window when the user has answered; wParam is the button id. */
+constexpr UINT WM_XRD_DECISION = WM_APP + 4;
+
+/**
+ * @class DecisionDialog
+ * @brief Shows the Keep/Discard question on a UI thread of its own.
+ *
+ * TaskDialogIndirect runs a modal loop until the user answers. On the message thread
+ * that loop would sit under the low-level hooks for as long as the user thinks, and
+ * every input event of the session would pass through it. Here the message thread
+ * only calls Ask() and carries on; the answer comes back as WM_XRD_DECISION.
+ *
+ * One question at a time: Ask() while a dialog is open replaces nothing and fails.
+ * The thread and the common controls are only set up by the first question, so a
+ * session without detections never pays for them.
+ */
+class DecisionDialog
+{
+public:
+    DecisionDialog() = default;
+
+    /** @brief Closes an open dialog and stops the thread if it is still running. */
+    ~DecisionDialog();
+
+    DecisionDialog(const DecisionDialog&) = delete;
+    DecisionDialog& operator=(const DecisionDialog&) = delete;
+
+    /**
+     * @brief Sets the window receiving WM_XRD_DECISION; the thread starts with the first Ask().
+     * @param target Window receiving WM_XRD_DECISION.
+     */
+    void Start(HWND target);
+
+    /** @brief Closes an open dialog without an answer and joins the thread. */
+    void Stop();
+
+    /**
+     * @brief Opens the dialog and returns at once.
+     * @param title Window title.
+     * @param text Main instruction.
+     * @param footer Content below it, e.g. a preview of the text.
+     * @return False if the dialog is stopped or already open, or the thread cannot start.
+     */
+    bool Ask(std::wstring title, std::wstring text, std::wstring footer);
+
+private:
+    struct Question
+    {
+        std::wstring title;
+        std::wstring text;
+        std::wstring footer;
+    };
+
+    /** @brief Dialog thread body. */
+    void Run();
+
+    /** @brief Task dialog callback: keeps the dialog on top and records its window. */
+    static HRESULT CALLBACK OnNotify(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam, LONG_PTR refData);
+
+    HWND                    _target = nullptr;
+    std::thread             _thread;
+    std::mutex              _mutex;     ///< Protects everything below
+    std::condition_variable _wake;
+    std::optional<Question> _pending;   ///< Asked, not yet shown
+    HWND                    _dialog = nullptr;  ///< Open dialog, once created
+    bool                    _open = false;      ///< A question is pending or shown
+    bool                    _stop = false;
+};
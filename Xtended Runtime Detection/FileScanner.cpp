@@ -0,0 +1,230 @@
+/**
+ * @file FileScanner.cpp
+ * @brief Implements the parallel, memory-mapped scan of dropped files.
+ */
+
+#include "FileScanner.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+namespace {
+    /** @brief Shared by the calling thread and the pool callbacks of one Scan(). */
+    struct Context
+    {
+        const PatternMatcher&            matcher;
+        const std::vector<std::wstring>& files;
+        const FileScanner::Limits&       limits;
+        const std::atomic<bool>&         cancel;
+        HANDLE                           token;          ///< Impersonated while files are opened, or nullptr
+        std::atomic<size_t>              next{ 0 };      ///< Next file to hand out
+        std::atomic<bool>                stop{ false };  ///< Set by the first match, or on cancel
+        SRWLOCK                          lock = SRWLOCK_INIT;   ///< Protects hit
+        FileScanner::Hit                 hit;
+    };
+
+    /** @brief Length of a UTF-8 prefix cut at the byte limit, without a split trailing sequence. */
+    size_t CompleteUtf8(const BYTE* data, size_t size)
+    {
+        for (size_t back = 1; back <= 4 && back <= size; ++back) {
+            const BYTE byte = data[size - back];
+            if ((byte & 0xC0) == 0x80)
+                continue;       // Continuation byte: keep looking for the lead byte
+            const size_t length = (byte >= 0xF0) ? 4 : (byte >= 0xE0) ? 3 : (byte >= 0xC0) ? 2 : 1;
+            return (length > back) ? size - back : size;
+        }
+        return size;
+    }
+
+    /** @brief UTF-16LE without a BOM: mostly zero high bytes in the first few KB. */
+    bool LooksLikeUtf16Le(const BYTE* data, size_t size)
+    {
+        const size_t sample = std::min<size_t>(size, 4096) & ~size_t(1);
+        size_t zeroHigh = 0, zeroLow = 0;
+        for (size_t i = 0; i < sample; i += 2) {
+            zeroLow += data[i] == 0;
+            zeroHigh += data[i + 1] == 0;
+        }
+        return sample >= 2 && zeroHigh * 4 > sample && zeroLow * 16 < sample;
+    }
+
+    /**
+     * @brief Decodes file bytes into at most capacity UTF-16 units.
+     * @param cut True if the bytes stop at the limit rather than at the end of the file.
+     * @return Units written.
+     */
+    size_t DecodeBytes(const BYTE* data, size_t size, bool cut, wchar_t* out, size_t capacity)
+    {
+        if (size >= 2 && ((data[0] == 0xFF && data[1] == 0xFE) || (data[0] == 0xFE && data[1] == 0xFF))) {
+            const bool bigEndian = data[0] == 0xFE;
+            const size_t units = std::min((size - 2) / 2, capacity);
+            for (size_t i = 0; i < units; ++i) {
+                const BYTE first = data[2 + 2 * i], second = data[3 + 2 * i];
+                out[i] = bigEndian ? static_cast<wchar_t>((first << 8) | second)
+                    : static_cast<wchar_t>((second << 8) | first);
+            }
+            return units;
+        }
+        if (LooksLikeUtf16Le(data, size)) {
+            const size_t units = std::min(size / 2, capacity);
+            std::memcpy(out, data, units * sizeof(wchar_t));
+            return units;
+        }
+
+        if (size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF) {
+            data += 3;
+            size -= 3;
+        }
+        if (cut)
+            size = CompleteUtf8(data, size);
+        const int bytes = static_cast<int>(std::min<size_t>(size, INT_MAX));
+        const int room = static_cast<int>(std::min<size_t>(capacity, INT_MAX));
+        if (bytes == 0)
+            return 0;
+        const auto* text = reinterpret_cast<const char*>(data);
+        int units = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, text, bytes, out, room);
+        if (units == 0)     // Not UTF-8: legacy scripts are usually in the ANSI code page
+            units = MultiByteToWideChar(CP_ACP, 0, text, bytes, out, room);
+        return static_cast<size_t>(units);
+    }
+
+    /** @brief DecodeBytes() on a mapped view; -1 if the file could not be paged in. */
+    long long DecodeView(const BYTE* view, size_t size, bool cut, wchar_t* out, size_t capacity)
+    {
+        // A file on a network share or removable drive can vanish while mapped
+        __try {
+            return static_cast<long long>(DecodeBytes(view, size, cut, out, capacity));
+        }
+        __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
+            ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+            return -1;
+        }
+    }
+
+    /** @brief Maps up to maxBytes of a file and decodes them; false if it cannot be read. */
+    bool ReadPrefix(const std::wstring& path, size_t maxBytes, std::wstring& text)
+    {
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;   // Also directories, which a drop can contain
+
+        LARGE_INTEGER size{};
+        HANDLE mapping = nullptr;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+            mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);  // The mapping keeps the file open
+        if (!mapping)
+            return false;
+
+        const size_t bytes = static_cast<size_t>(std::min<unsigned long long>(size.QuadPart, maxBytes));
+        const auto* view = static_cast<const BYTE*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, bytes));
+        CloseHandle(mapping);
+        if (!view)
+            return false;
+
+        text.resize(bytes);     // Every encoding yields at most one unit per byte
+        const long long units = DecodeView(view, bytes,
+            static_cast<unsigned long long>(size.QuadPart) > bytes, text.data(), text.size());
+        UnmapViewOfFile(view);
+        if (units < 0)
+            return false;
+        text.resize(static_cast<size_t>(units));
+        return true;
+    }
+
+    /** @brief Impersonates a token on the current thread for its lifetime. */
+    class Impersonation
+    {
+    public:
+        explicit Impersonation(HANDLE token)
+            : _active(token && SetThreadToken(nullptr, token))
+        {
+        }
+        ~Impersonation()
+        {
+            if (_active)
+                SetThreadToken(nullptr, nullptr);
+        }
+        Impersonation(const Impersonation&) = delete;
+        Impersonation& operator=(const Impersonation&) = delete;
+
+        /** @brief True if the token is in effect; a failed call leaves the thread as it was. */
+        bool Active() const { return _active; }
+
+    private:
+        bool _active;
+    };
+
+    /** @brief Takes files until none are left or one matched; runs on every participating thread. */
+    void ScanFiles(Context& context)
+    {
+        // Pool threads never keep a token past the callback
+        const Impersonation impersonation(context.token);
+        if (context.token && !impersonation.Active())
+            return;     // Never read files with the wrong identity
+        PatternMatcher::Scratch scratch;    // Per thread, as the matcher requires
+        std::wstring text;
+        for (;;) {
+            if (context.cancel.load(std::memory_order_relaxed))
+                context.stop = true;
+            if (context.stop.load(std::memory_order_relaxed))
+                return;
+
+            const size_t index = context.next.fetch_add(1);
+            if (index >= context.files.size())
+                return;
+            if (!ReadPrefix(context.files[index], context.limits.maxBytes, text))
+                continue;
+
+            const auto outcome = context.matcher.Scan(text, scratch, {}, &context.stop);
+            if (outcome.rule < 0)
+                continue;
+
+            AcquireSRWLockExclusive(&context.lock);
+            if (context.hit.rule == PatternMatcher::kNoMatch)
+                context.hit = { outcome.rule, index, std::move(text) };
+            ReleaseSRWLockExclusive(&context.lock);
+            context.stop = true;    // Cancels the scans still running on other threads
+            return;
+        }
+    }
+
+    VOID CALLBACK OnWork(PTP_CALLBACK_INSTANCE, PVOID parameter, PTP_WORK)
+    {
+        try {
+            ScanFiles(*static_cast<Context*>(parameter));
+        }
+        catch (...) {
+            // Out of memory on one file: the other threads carry on
+        }
+    }
+} // anonymous namespace
+
+FileScanner::Hit FileScanner::Scan(const PatternMatcher& matcher, const std::vector<std::wstring>& files,
+    const std::atomic<bool>& cancel, HANDLE token) const
+{
+    Context context{ matcher, files, _limits, cancel, token };
+
+    // The calling thread scans too, so a single file never waits for the pool
+    const size_t threads = std::min<size_t>(files.size(), std::max(_limits.maxThreads, 1u));
+    PTP_WORK work = threads > 1 ? CreateThreadpoolWork(OnWork, &context, nullptr) : nullptr;
+    for (size_t i = 1; work && i < threads; ++i)
+        SubmitThreadpoolWork(work);
+
+    try {
+        ScanFiles(context);
+    }
+    catch (...) {
+        context.stop = true;
+    }
+    if (work) {
+        WaitForThreadpoolWorkCallbacks(work, FALSE);
+        CloseThreadpoolWork(work);
+    }
+    return std::move(context.hit);
+}
+
+// End of FileScanner.cpp
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "PatternMatcher.h"
+
+/**
+ * @class FileScanner
+ * @brief Scans the files of a clipboard file drop (CF_HDROP) in parallel.
+ *
+ * Files are handed out to thread pool callbacks one at a time; the calling thread takes
+ * part as well. Each file is memory-mapped, only up to the per-file byte limit, decoded
+ * (UTF-16 with a BOM, UTF-8, or the ANSI code page when the bytes are not valid UTF-8)
+ * and scanned. The first match stops every other file. Used by the scan worker, so a
+ * drop of many files never runs on the message thread.
+ */
+class FileScanner
+{
+public:
+    struct Limits
+    {
+        size_t   maxBytes = 1024 * 1024;    ///< Bytes read from the start of each file
+        unsigned maxThreads = 4;            ///< Files scanned at the same time
+    };
+
+    /** @brief Outcome of Scan(). */
+    struct Hit
+    {
+        int          rule = PatternMatcher::kNoMatch;  ///< Matching pattern, or kNoMatch
+        size_t       file = 0;      ///< Index of the matching file
+        std::wstring text;          ///< Decoded part of the file that was scanned
+    };
+
+    /** @brief Sets the limits; call before the first Scan(). */
+    void SetLimits(const Limits& limits) { _limits = limits; }
+
+    /**
+     * @brief Scans the files until one matches.
+     * @param matcher Compiled pattern set.
+     * @param files Full paths; unreadable files are skipped.
+     * @param cancel Checked between files; set when the drop is outdated.
+     * @param token Impersonation token the files are opened with, or nullptr for the
+     *              caller's identity. The scan service passes the session user's token.
+     */
+    Hit Scan(const PatternMatcher& matcher, const std::vector<std::wstring>& files,
+        const std::atomic<bool>& cancel, HANDLE token = nullptr) const;
+
+private:
+    Limits _limits;
+};
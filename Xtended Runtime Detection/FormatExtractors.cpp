@@ -0,0 +1,323 @@
+/**
+ * @file FormatExtractors.cpp
+ * @brief Text extraction for the rich clipboard formats (HTML, RTF, ANSI text).
+ */
+
+#include "FormatExtractors.h"
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cwctype>
+#include <iterator>
+#include <vector>
+
+namespace {
+    /** @brief Appends bytes in the given code page to text. */
+    void AppendMultiByte(std::string_view bytes, UINT codePage, std::wstring& text)
+    {
+        if (bytes.empty())
+            return;
+        const int length = static_cast<int>(std::min<size_t>(bytes.size(), INT_MAX));
+        const size_t start = text.size();
+        text.resize(start + length);    // At most one unit per byte
+        const int units = MultiByteToWideChar(codePage, 0, bytes.data(), length, text.data() + start, length);
+        text.resize(start + std::max(units, 0));
+    }
+
+    //--------------------------------------------------------------------------
+    // HTML Format
+    //--------------------------------------------------------------------------
+
+    /** @brief Value of a "Name:123" line of the CF_HTML header, or -1. */
+    long long HeaderOffset(std::string_view header, std::string_view name)
+    {
+        const size_t at = header.find(name);
+        if (at == std::string_view::npos)
+            return -1;
+        return std::strtoll(std::string(header.substr(at + name.size(), 20)).c_str(), nullptr, 10);
+    }
+
+    /** @brief Decodes the entity starting at html[at] ('&'); returns its length, or 0 if unknown. */
+    size_t DecodeEntity(std::wstring_view html, size_t at, std::wstring& text)
+    {
+        const size_t end = html.find(L';', at);
+        if (end == std::wstring_view::npos || end - at > 10)
+            return 0;
+        const std::wstring_view name = html.substr(at + 1, end - at - 1);
+        wchar_t decoded = 0;
+        if (name.size() > 1 && name[0] == L'#') {
+            const bool hex = name[1] == L'x' || name[1] == L'X';
+            const unsigned long code = std::wcstoul(std::wstring(name.substr(hex ? 2 : 1)).c_str(), nullptr, hex ? 16 : 10);
+            if (code == 0 || code > 0x10FFFF)
+                return 0;
+            if (code > 0xFFFF) {
+                text += static_cast<wchar_t>(0xD800 + ((code - 0x10000) >> 10));
+                text += static_cast<wchar_t>(0xDC00 + ((code - 0x10000) & 0x3FF));
+                return end - at + 1;
+            }
+            decoded = static_cast<wchar_t>(code);
+        }
+        else if (name == L"amp")  decoded = L'&';
+        else if (name == L"lt")   decoded = L'<';
+        else if (name == L"gt")   decoded = L'>';
+        else if (name == L"quot") decoded = L'"';
+        else if (name == L"apos") decoded = L'\'';
+        else if (name == L"nbsp") decoded = L' ';
+        else
+            return 0;
+        text += decoded;
+        return end - at + 1;
+    }
+
+    /** @brief Tags that end a line of rendered text. */
+    bool IsBreakTag(std::wstring_view tag)
+    {
+        static constexpr const wchar_t* kBreaks[] = { L"br", L"p", L"div", L"li", L"tr", L"table", L"pre" };
+        for (const wchar_t* name : kBreaks) {
+            if (tag.size() == std::wcslen(name) &&
+                CompareStringOrdinal(tag.data(), static_cast<int>(tag.size()), name, -1, TRUE) == CSTR_EQUAL)
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Text of the document with markup removed, but nothing hidden left out: the
+     *        content of every element (including script, style and display:none), comments
+     *        and quoted attribute values, with entities decoded.
+     */
+    void StripMarkup(std::wstring_view html, std::wstring& text)
+    {
+        text.reserve(html.size());
+        size_t i = 0;
+        while (i < html.size()) {
+            const wchar_t c = html[i];
+            if (c == L'&') {
+                const size_t length = DecodeEntity(html, i, text);
+                if (length == 0)
+                    text += c;
+                i += std::max<size_t>(length, 1);
+                continue;
+            }
+            const wchar_t after = i + 1 < html.size() ? html[i + 1] : L' ';
+            if (c != L'<' || !(std::iswalpha(after) || after == L'/' || after == L'!')) {
+                text += c;
+                ++i;
+                continue;
+            }
+
+            if (html.compare(i, 4, L"<!--") == 0) {
+                const size_t end = html.find(L"-->", i + 4);
+                const size_t stop = end == std::wstring_view::npos ? html.size() : end;
+                text.append(html.substr(i + 4, stop - i - 4));
+                text += L'\n';
+                i = end == std::wstring_view::npos ? html.size() : end + 3;
+                continue;
+            }
+
+            // Tag: its name decides on a line break; quoted attribute values are kept
+            size_t j = i + 1;
+            if (j < html.size() && html[j] == L'/')
+                ++j;
+            const size_t nameStart = j;
+            while (j < html.size() && std::iswalnum(html[j]))
+                ++j;
+            if (IsBreakTag(html.substr(nameStart, j - nameStart)))
+                text += L'\n';
+            while (j < html.size() && html[j] != L'>') {
+                if (html[j] == L'"' || html[j] == L'\'') {
+                    const size_t close = html.find(html[j], j + 1);
+                    const size_t stop = close == std::wstring_view::npos ? html.size() : close;
+                    text.append(html.substr(j + 1, stop - j - 1));
+                    text += L'\n';
+                    j = stop;
+                }
+                if (j < html.size())
+                    ++j;
+            }
+            i = j + 1;
+        }
+    }
+
+    bool ExtractHtml(std::string_view raw, std::wstring& text)
+    {
+        // Header lines give byte offsets of the document; without them the data is taken as is
+        const size_t headerEnd = std::min(raw.find('<'), raw.size());
+        const std::string_view header = raw.substr(0, headerEnd);
+        long long start = HeaderOffset(header, "StartHTML:");
+        long long end = HeaderOffset(header, "EndHTML:");
+        if (start < 0 || static_cast<unsigned long long>(start) >= raw.size())
+            start = static_cast<long long>(headerEnd);
+        if (end < start || static_cast<unsigned long long>(end) > raw.size())
+            end = static_cast<long long>(raw.size());
+
+        std::wstring html;
+        AppendMultiByte(raw.substr(static_cast<size_t>(start), static_cast<size_t>(end - start)), CP_UTF8, html);
+        text.clear();
+        StripMarkup(html, text);
+        return true;
+    }
+
+    //--------------------------------------------------------------------------
+    // Rich Text Format
+    //--------------------------------------------------------------------------
+
+    /** @brief Destinations that hold tables, pictures or binary data rather than document text. */
+    bool IsSkippedDestination(std::string_view word)
+    {
+        static constexpr std::string_view kSkipped[] = {
+            "fonttbl", "colortbl", "stylesheet", "info", "pict", "object", "objdata", "themedata",
+            "colorschememapping", "datastore", "latentstyles", "listtable", "listoverridetable",
+            "rsidtbl", "xmlnstbl", "generator", "filetbl", "revtbl"
+        };
+        return std::find(std::begin(kSkipped), std::end(kSkipped), word) != std::end(kSkipped);
+    }
+
+    /**
+     * @brief Text of an RTF document: control words removed, \\'hh and \\u escapes decoded.
+     *        Hidden runs (\\v) are kept; font tables, pictures and other data are skipped.
+     */
+    bool ExtractRtf(std::string_view raw, std::wstring& text)
+    {
+        if (raw.compare(0, 5, "{\\rtf") != 0)
+            return false;
+
+        struct Group
+        {
+            bool skip = false;
+            int  unicodeSkip = 1;   ///< \ucN: fallback characters after each \uN
+        };
+        std::vector<Group> groups(1);
+        UINT codePage = 1252;
+        std::string bytes;          // Pending 8-bit text, decoded in codePage
+        int fallback = 0;           // Characters still to drop after a \uN
+        text.clear();
+
+        auto flush = [&] {
+            AppendMultiByte(bytes, codePage, text);
+            bytes.clear();
+        };
+        auto emit = [&](char c) {
+            if (fallback > 0)
+                --fallback;
+            else if (!groups.back().skip)
+                bytes += c;
+        };
+
+        for (size_t i = 0; i < raw.size(); ++i) {
+            const char c = raw[i];
+            if (c == '{') {
+                groups.push_back(groups.back());
+                fallback = 0;
+                continue;
+            }
+            if (c == '}') {
+                if (groups.size() > 1)
+                    groups.pop_back();
+                fallback = 0;
+                continue;
+            }
+            if (c == '\r' || c == '\n')
+                continue;
+            if (c != '\\' || i + 1 >= raw.size()) {
+                emit(c);
+                continue;
+            }
+
+            const char next = raw[++i];
+            if (next == '\'' && i + 2 < raw.size()) {
+                const char hex[3] = { raw[i + 1], raw[i + 2], 0 };
+                emit(static_cast<char>(std::strtol(hex, nullptr, 16)));
+                i += 2;
+                continue;
+            }
+            if (next == '*') {
+                groups.back().skip = true;      // Ignorable destination
+                continue;
+            }
+            if (!std::isalpha(static_cast<unsigned char>(next))) {
+                if (next == '~')
+                    emit(' ');
+                else if (next == '\\' || next == '{' || next == '}')
+                    emit(next);
+                else if (next == '\r' || next == '\n')
+                    emit('\n');
+                continue;
+            }
+
+            // Control word, optional signed parameter, optional space delimiter
+            const size_t wordStart = i;
+            while (i < raw.size() && std::isalpha(static_cast<unsigned char>(raw[i])))
+                ++i;
+            const std::string_view word = raw.substr(wordStart, i - wordStart);
+            bool hasParam = false;
+            long param = 0;
+            if (i < raw.size() && (raw[i] == '-' || std::isdigit(static_cast<unsigned char>(raw[i])))) {
+                char* end = nullptr;
+                const std::string digits(raw.substr(i, 12));
+                param = std::strtol(digits.c_str(), &end, 10);
+                i += end - digits.c_str();
+                hasParam = true;
+            }
+            if (i >= raw.size() || raw[i] != ' ')
+                --i;    // The delimiter belongs to the text
+
+            if (word == "par" || word == "line" || word == "row" || word == "sect" || word == "page")
+                emit('\n');
+            else if (word == "tab" || word == "cell")
+                emit('\t');
+            else if (word == "u" && hasParam) {
+                if (!groups.back().skip) {
+                    flush();
+                    text += static_cast<wchar_t>(param < 0 ? param + 65536 : param);
+                }
+                fallback = groups.back().unicodeSkip;
+            }
+            else if (word == "uc" && hasParam)
+                groups.back().unicodeSkip = static_cast<int>(std::max(param, 0L));
+            else if (word == "ansicpg" && hasParam && param > 0) {
+                flush();
+                codePage = static_cast<UINT>(param);
+            }
+            else if (word == "bin" && hasParam && param > 0)
+                i += std::min<size_t>(param, raw.size() - i - 1);   // Raw binary data
+            else if (IsSkippedDestination(word))
+                groups.back().skip = true;
+        }
+        flush();
+        return true;
+    }
+
+    //--------------------------------------------------------------------------
+    // CF_TEXT
+    //--------------------------------------------------------------------------
+    bool ExtractAnsi(std::string_view raw, std::wstring& text)
+    {
+        text.clear();
+        AppendMultiByte(raw.substr(0, raw.find('\0')), CP_ACP, text);
+        return true;
+    }
+
+    const FormatExtractor kExtractors[] = {
+        { L"HTML Format",      0,       ExtractHtml },
+        { L"Rich Text Format", 0,       ExtractRtf },
+        { L"CF_TEXT",          CF_TEXT, ExtractAnsi },
+    };
+    static_assert(std::size(kExtractors) == static_cast<size_t>(TextFormat::Count));
+} // anonymous namespace
+
+const FormatExtractor& ExtractorOf(TextFormat format)
+{
+    return kExtractors[static_cast<size_t>(format)];
+}
+
+UINT ClipboardFormatOf(TextFormat format)
+{
+    const FormatExtractor& extractor = ExtractorOf(format);
+    return extractor.standard != 0 ? extractor.standard : RegisterClipboardFormatW(extractor.name);
+}
+
+// End of FormatExtractors.cpp
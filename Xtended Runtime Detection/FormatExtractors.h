@@ -0,0 +1,42 @@
+#pragma once
+
+#include <windows.h>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief Clipboard formats scanned besides CF_UNICODETEXT.
+ *
+ * Browsers and word processors put the same copy on the clipboard in several formats;
+ * the rich ones can carry text that the plain-text rendering leaves out (hidden
+ * elements, comments, attribute values, hidden RTF runs). Each entry turns the raw
+ * bytes of its format into text for the pattern matcher.
+ */
+enum class TextFormat
+{
+    Html,       ///< "HTML Format" (CF_HTML): UTF-8 with a description header
+    Rtf,        ///< "Rich Text Format"
+    Ansi,       ///< CF_TEXT, when an application put it on the clipboard itself
+    Count
+};
+
+/** @brief Extracts the text of one clipboard format. */
+struct FormatExtractor
+{
+    const wchar_t* name;        ///< Registered clipboard format name, or a label for a standard format
+    UINT           standard;    ///< Standard format, or 0 to register name
+    /**
+     * @brief Converts the raw clipboard bytes.
+     * @param raw Clipboard data, possibly cut at the snapshot limit.
+     * @param[out] text Text to scan; replaced, so its capacity is reused.
+     * @return False if the data is not in the expected format.
+     */
+    bool (*extract)(std::string_view raw, std::wstring& text);
+};
+
+/** @brief The extractor for a format. */
+const FormatExtractor& ExtractorOf(TextFormat format);
+
+/** @brief Clipboard format id of an extractor; registers the name on first use. */
+UINT ClipboardFormatOf(TextFormat format);
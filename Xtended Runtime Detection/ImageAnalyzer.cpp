@@ -0,0 +1,136 @@
+/**
+ * @file ImageAnalyzer.cpp
+ * @brief Implements the in-place LSB analysis of clipboard bitmaps.
+ */
+
+#include "ImageAnalyzer.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define XRD_SSE2_LSB 1
+#endif
+
+namespace {
+    /** @brief Where the pixels of a DIB are and how they are laid out. */
+    struct Layout
+    {
+        const BYTE* pixels = nullptr;
+        size_t      stride = 0;         ///< Bytes per row, DWORD aligned
+        size_t      rowBytes = 0;       ///< Bytes of pixel data per row, without padding
+        size_t      rows = 0;
+        unsigned    bytesPerPixel = 0;  ///< 3 (BGR) or 4 (BGRX / BGRA)
+    };
+
+    bool ParseDib(const BYTE* dib, size_t size, BITMAPINFOHEADER& header, Layout& layout)
+    {
+        if (size < sizeof(BITMAPINFOHEADER))
+            return false;
+        std::memcpy(&header, dib, sizeof(header));  // The block need not be aligned
+        if (header.biSize < sizeof(BITMAPINFOHEADER) || header.biSize > size || header.biPlanes != 1)
+            return false;
+        if (header.biBitCount != 24 && header.biBitCount != 32)
+            return false;
+        if (header.biCompression != BI_RGB && header.biCompression != BI_BITFIELDS)
+            return false;
+        if (header.biWidth <= 0 || header.biHeight == 0 || header.biClrUsed > size)
+            return false;
+
+        // Header, then the colour masks of a plain BITMAPINFOHEADER, then an optional palette
+        size_t offset = header.biSize;
+        if (header.biCompression == BI_BITFIELDS && header.biSize == sizeof(BITMAPINFOHEADER))
+            offset += 3 * sizeof(DWORD);
+        offset += static_cast<size_t>(header.biClrUsed) * sizeof(RGBQUAD);
+
+        const unsigned long long width = static_cast<unsigned long long>(header.biWidth);
+        const unsigned long long rows = header.biHeight < 0     // Negative: top-down
+            ? 0ULL - static_cast<unsigned long long>(static_cast<long long>(header.biHeight))
+            : static_cast<unsigned long long>(header.biHeight);
+        const unsigned long long stride = (width * header.biBitCount + 31) / 32 * 4;
+        if (offset > size || rows > (size - offset) / stride)
+            return false;
+
+        layout.pixels = dib + offset;
+        layout.stride = static_cast<size_t>(stride);
+        layout.bytesPerPixel = header.biBitCount / 8;
+        layout.rowBytes = static_cast<size_t>(width) * layout.bytesPerPixel;
+        layout.rows = static_cast<size_t>(rows);
+        return true;
+    }
+
+    /** @brief Set LSBs of the colour channels in one row; the alpha byte of 32 bpp pixels is skipped. */
+    std::uint64_t CountRow(const BYTE* row, size_t bytes, unsigned bytesPerPixel)
+    {
+        std::uint64_t count = 0;
+        size_t i = 0;
+#ifdef XRD_SSE2_LSB
+        // Lengths of 16 bytes keep 32 bpp pixels aligned with the mask
+        const __m128i mask = bytesPerPixel == 4 ? _mm_set1_epi32(0x00010101) : _mm_set1_epi8(1);
+        __m128i sums = _mm_setzero_si128();
+        for (; i + 16 <= bytes; i += 16) {
+            const __m128i bits = _mm_and_si128(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i)), mask);
+            sums = _mm_add_epi64(sums, _mm_sad_epu8(bits, _mm_setzero_si128()));  // Two sums of 8 bytes
+        }
+        count = static_cast<std::uint64_t>(_mm_cvtsi128_si32(sums)) +
+            static_cast<std::uint64_t>(_mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums)));
+#else
+        const std::uint64_t mask = bytesPerPixel == 4 ? 0x0001010100010101ULL : 0x0101010101010101ULL;
+        for (; i + 8 <= bytes; i += 8) {
+            std::uint64_t word;
+            std::memcpy(&word, row + i, sizeof(word));
+            count += std::popcount(word & mask);
+        }
+#endif
+        for (; i < bytes; ++i) {
+            if (bytesPerPixel == 3 || i % 4 != 3)
+                count += row[i] & 1;
+        }
+        return count;
+    }
+} // anonymous namespace
+
+ImageAnalyzer::Finding ImageAnalyzer::Analyze(const void* dib, size_t size) const
+{
+    Finding finding;
+    BITMAPINFOHEADER header{};
+    Layout layout;
+    if (!dib || !ParseDib(static_cast<const BYTE*>(dib), size, header, layout) || layout.rows == 0)
+        return finding;
+
+    // Every step-th row, spread over the whole image, up to the sample budget
+    const size_t budgetRows = std::max<size_t>(_options.maxSampleBytes / layout.rowBytes, 1);
+    const size_t step = std::max<size_t>((layout.rows + budgetRows - 1) / budgetRows, 1);
+
+    std::uint64_t ones = 0, rowsSampled = 0;
+    for (size_t row = step / 2; row < layout.rows; row += step) {
+        ones += CountRow(layout.pixels + row * layout.stride, layout.rowBytes, layout.bytesPerPixel);
+        ++rowsSampled;
+    }
+
+    finding.analyzed = true;
+    finding.width = header.biWidth;
+    finding.height = static_cast<long>(layout.rows);
+    finding.bitCount = header.biBitCount;
+    finding.sampledPixels = rowsSampled * static_cast<std::uint64_t>(header.biWidth);
+    const std::uint64_t channels = finding.sampledPixels * 3;
+    finding.lsbRatio = channels != 0 ? static_cast<double>(ones) / static_cast<double>(channels) : 0;
+    finding.anomalous = finding.lsbRatio > _options.lsbLower && finding.lsbRatio < _options.lsbUpper;
+    return finding;
+}
+
+std::wstring ImageAnalyzer::Describe(const Finding& finding)
+{
+    std::wostringstream out;
+    out << L"[Image LSB anomaly] " << finding.width << L'x' << finding.height << L", "
+        << finding.bitCount << L" bpp, LSB ratio " << std::fixed << std::setprecision(3)
+        << finding.lsbRatio << L" over " << finding.sampledPixels << L" pixels";
+    return out.str();
+}
+
+// End of ImageAnalyzer.cpp
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <windows.h>
+#include <cstdint>
+#include <string>
+
+/**
+ * @class ImageAnalyzer
+ * @brief Opt-in check of clipboard bitmaps (CF_DIB) for least-significant-bit steganography.
+ *
+ * Works in place on the locked clipboard block: the BITMAPINFOHEADER gives the pixel
+ * array offset and row stride, and the LSBs of the colour channels are counted 16 bytes
+ * at a time with SSE2. Large images are sampled by rows, so the time the clipboard is
+ * held open stays bounded whatever the image size. Only uncompressed 24 and 32 bpp
+ * bitmaps are analysed; the LSB of a palette index carries no meaning.
+ */
+class ImageAnalyzer
+{
+public:
+    struct Options
+    {
+        size_t maxSampleBytes = 1024 * 1024;    ///< Pixel bytes read per image, in whole rows
+        double lsbLower = 0.4;                  ///< Ratio of set LSBs above which the image is flagged...
+        double lsbUpper = 0.6;                  ///< ...and below which
+    };
+
+    /** @brief Outcome of Analyze(). */
+    struct Finding
+    {
+        bool          analyzed = false;     ///< False if the format is not supported
+        bool          anomalous = false;    ///< LSB ratio inside the suspicious band
+        long          width = 0;
+        long          height = 0;
+        unsigned      bitCount = 0;
+        double        lsbRatio = 0;        ///< Set LSBs / colour channels sampled
+        std::uint64_t sampledPixels = 0;
+    };
+
+    /** @brief Sets the options; call before the first Analyze(). */
+    void SetOptions(const Options& options) { _options = options; }
+
+    /**
+     * @brief Analyses a packed DIB as found on the clipboard.
+     * @param dib Locked CF_DIB block.
+     * @param size GlobalSize() of the block; nothing beyond it is read.
+     */
+    Finding Analyze(const void* dib, size_t size) const;
+
+    /** @brief Short description of an anomalous finding, used as the preview and in the log. */
+    static std::wstring Describe(const Finding& finding);
+
+private:
+    Options _options;
+};
@@ -0,0 +1,218 @@
+/**
+ * @file JobScanner.cpp
+ * @brief Implements the scan of one clipboard snapshot: format pipeline, files, image finding.
+ */
+
+#include "JobScanner.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace {
+    constexpr size_t kUnicodeStage = 0;     // CF_UNICODETEXT; stage 1 + f is TextFormat f
+    constexpr size_t kNoStage = SIZE_MAX;
+    constexpr double kPriorNanoseconds = 10000;     // Assumed cost of a stage never run
+    constexpr std::uint64_t kStageHistory = 1024;   // Runs after which a stage's counters are halved
+
+    TextFormat FormatOfStage(size_t stage)
+    {
+        return static_cast<TextFormat>(stage - 1);
+    }
+} // anonymous namespace
+
+std::unique_ptr<ScanResult> JobScanner::Scan(const PatternMatcher& patterns, ScanJob& job,
+    const std::atomic<bool>& cancel, HANDLE fileToken)
+{
+    const auto started = std::chrono::steady_clock::now();
+    auto result = std::make_unique<ScanResult>();
+    result->sequence = job.sequence;
+
+    bool cached = false;
+    size_t matched = kNoStage;
+    const bool finished = ScanFormats(patterns, job, cancel, *result, cached, matched);
+    if (!finished) {
+        if (_stats) {
+            _stats->RecordScan(std::chrono::steady_clock::now() - started,
+                { PatternMatcher::kNoMatch, PatternMatcher::ScanStatus::Cancelled }, false, _jobProfile);
+        }
+        return nullptr;
+    }
+
+    // A match in a rich format is shown as the text that format carried
+    bool findingText = false;   // result->text already holds what the user has to judge
+    if (matched != kNoStage && matched != kUnicodeStage) {
+        result->text = L"[" + std::wstring(ExtractorOf(FormatOfStage(matched)).name) + L"]\n" + _extracted;
+        findingText = true;
+    }
+
+    // Dropped files are not in the verdict cache: their content can change under the same paths
+    if (result->rule == PatternMatcher::kNoMatch && !job.files.empty()) {
+        FileScanner::Hit hit = _files.Scan(patterns, job.files, cancel, fileToken);
+        if (cancel) {
+            if (_stats) {
+                _stats->RecordScan(std::chrono::steady_clock::now() - started,
+                    { PatternMatcher::kNoMatch, PatternMatcher::ScanStatus::Cancelled }, false, _jobProfile);
+            }
+            return nullptr;
+        }
+        if (hit.rule != PatternMatcher::kNoMatch) {
+            result->rule = hit.rule;
+            result->status = PatternMatcher::ScanStatus::Complete;
+            result->text = L"[File] " + job.files[hit.file] + L"\n" + hit.text;
+            findingText = true;
+        }
+    }
+
+    // The image analysis ran on the snapshot already; it only counts if no pattern matched
+    if (result->rule == PatternMatcher::kNoMatch && !job.image.empty()) {
+        result->image = true;
+        result->status = PatternMatcher::ScanStatus::Complete;
+        result->text = std::move(job.image);
+        findingText = true;
+    }
+
+    // A clean prefix says nothing about the part that was never snapshotted
+    result->incomplete = job.truncated || !job.files.empty() || result->image || findingText;
+    if (job.truncated && result->rule == PatternMatcher::kNoMatch && !result->image)
+        result->status = PatternMatcher::ScanStatus::Partial;
+    if (result->rule != PatternMatcher::kNoMatch)
+        result->severity = patterns.OptionsOf(result->rule).severity;
+
+    if (_stats) {
+        _stats->RecordScan(std::chrono::steady_clock::now() - started,
+            { result->rule, result->status }, cached, _jobProfile);
+    }
+
+    // Clean content is released here; only content the user has to judge is retained
+    if (!findingText && (result->rule != PatternMatcher::kNoMatch ||
+        result->status == PatternMatcher::ScanStatus::Partial)) {
+        result->text = std::move(job.text);
+        result->jobText = true;
+    }
+
+    return result;
+}
+
+//------------------------------------------------------------------------------
+// Format pipeline
+//------------------------------------------------------------------------------
+std::array<size_t, JobScanner::kStages> JobScanner::StageOrder() const
+{
+    // Expected time per hit, with one assumed run and hit so new stages get their turn
+    auto costPerHit = [this](size_t stage) {
+        const StageStats& stats = _stageStats[stage];
+        const double cost = (static_cast<double>(stats.time.count()) + kPriorNanoseconds)
+            / static_cast<double>(stats.runs + 1);
+        const double hitRate = static_cast<double>(stats.hits + 1) / static_cast<double>(stats.runs + 2);
+        return cost / hitRate;
+    };
+    std::array<size_t, kStages> order;
+    std::iota(order.begin(), order.end(), size_t(0));
+    std::stable_sort(order.begin(), order.end(),
+        [&](size_t a, size_t b) { return costPerHit(a) < costPerHit(b); });
+    return order;
+}
+
+void JobScanner::RecordStage(size_t stage, std::chrono::nanoseconds time, bool hit)
+{
+    StageStats& stats = _stageStats[stage];
+    if (stats.runs >= kStageHistory) {      // Recent behaviour weighs more than the distant past
+        stats.runs /= 2;
+        stats.hits /= 2;
+        stats.time /= 2;
+    }
+    ++stats.runs;
+    stats.hits += hit ? 1 : 0;
+    stats.time += time;
+}
+
+bool JobScanner::ScanFormats(const PatternMatcher& patterns, const ScanJob& job,
+    const std::atomic<bool>& cancel, ScanResult& result, bool& cached, size_t& matched)
+{
+    using Clock = std::chrono::steady_clock;
+    const auto started = Clock::now();
+    const std::uint64_t generation = patterns.Generation();
+    _jobProfile.automaton = std::chrono::nanoseconds::zero();
+    _jobProfile.fallback.clear();
+    size_t charsLeft = _budget.maxChars;
+    bool anyCached = false, anyScanned = false;
+
+    for (const size_t stage : StageOrder()) {
+        const auto stageStarted = Clock::now();
+        std::wstring_view text;
+        if (stage == kUnicodeStage) {
+            text = job.text;
+        }
+        else {
+            const auto data = std::find_if(job.formats.begin(), job.formats.end(),
+                [&](const FormatData& format) { return format.format == FormatOfStage(stage); });
+            if (data == job.formats.end())
+                continue;
+            // A rendering identical to the plain text shows nothing new
+            if (!ExtractorOf(data->format).extract(data->bytes, _extracted) || _extracted == job.text)
+                continue;
+            text = _extracted;
+        }
+        if (text.empty())
+            continue;
+
+        // One budget for the whole job, spent in stage order
+        PatternMatcher::ScanBudget budget;
+        if (_budget.maxChars != 0) {
+            if (charsLeft == 0) {
+                result.status = PatternMatcher::ScanStatus::Partial;
+                break;
+            }
+            budget.maxChars = charsLeft;
+            charsLeft -= std::min(charsLeft, text.size());
+        }
+        if (_budget.maxTime.count() > 0) {
+            budget.maxTime = _budget.maxTime
+                - std::chrono::duration_cast<std::chrono::milliseconds>(stageStarted - started);
+            if (budget.maxTime.count() <= 0) {
+                result.status = PatternMatcher::ScanStatus::Partial;
+                break;
+            }
+        }
+
+        // Repeated copies of the same payload only cost one hash pass
+        const auto key = VerdictCache::KeyOf(text);
+        PatternMatcher::ScanOutcome outcome;
+        if (const auto verdict = _verdicts.Lookup(generation, key)) {
+            outcome.rule = *verdict;
+            anyCached = true;
+        }
+        else {
+            // Terminals and log viewers re-copy a growing buffer: only the new tail is scanned
+            outcome = patterns.Scan(text, _scratch, budget, &cancel, _stats ? &_profile : nullptr,
+                &_checkpoints[stage]);
+            anyScanned = true;
+            if (_stats) {
+                _jobProfile.automaton += _profile.automaton;
+                _jobProfile.fallback.insert(_jobProfile.fallback.end(),
+                    _profile.fallback.begin(), _profile.fallback.end());
+            }
+            if (outcome.status == PatternMatcher::ScanStatus::Cancelled)
+                return false;
+            // A partial verdict depends on the budget, not only on the content
+            if (outcome.status == PatternMatcher::ScanStatus::Complete)
+                _verdicts.Store(generation, key, outcome.rule);
+        }
+        RecordStage(stage, Clock::now() - stageStarted, outcome.rule != PatternMatcher::kNoMatch);
+
+        if (outcome.rule != PatternMatcher::kNoMatch) {
+            result.rule = outcome.rule;
+            result.status = outcome.status;
+            matched = stage;
+            break;
+        }
+        if (outcome.status == PatternMatcher::ScanStatus::Partial) {
+            result.status = outcome.status;
+            break;
+        }
+    }
+    cached = anyCached && !anyScanned;
+    return true;
+}
+
+// End of JobScanner.cpp
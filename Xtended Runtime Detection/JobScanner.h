@@ -0,0 +1,124 @@
+#pragma once
+
+#include <windows.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FileScanner.h"
+#include "FormatExtractors.h"
+#include "PatternMatcher.h"
+#include "ScanStats.h"
+#include "VerdictCache.h"
+
+/** @brief Raw clipboard data of one rich format, extracted by the scanner. */
+struct FormatData
+{
+    TextFormat  format;
+    std::string bytes;
+};
+
+/** @brief Clipboard snapshot to be scanned. */
+struct ScanJob
+{
+    DWORD        sequence = 0;  ///< GetClipboardSequenceNumber() at snapshot time
+    std::wstring text;          ///< CF_UNICODETEXT content
+    std::vector<FormatData> formats;    ///< Other text-bearing formats on the clipboard
+    bool         truncated = false; ///< text or a format was cut at its cap, or files were left out
+    std::vector<std::wstring> files;    ///< CF_HDROP paths to scan after the text
+    std::wstring image;         ///< ImageAnalyzer finding for CF_DIB, empty if the image looked clean
+};
+
+/** @brief Verdict for one ScanJob. */
+struct ScanResult
+{
+    DWORD        sequence = 0;                   ///< Sequence number of the scanned snapshot
+    std::wstring text;                           ///< Content if suspicious or partial (moved from the job)
+    bool         incomplete = false;             ///< text is not the whole clipboard (memory cap or file
+                                                 ///< drop), so it is never offered back as the paste
+    int          rule = PatternMatcher::kNoMatch; ///< Matching pattern, or kNoMatch
+    PatternMatcher::Severity severity = PatternMatcher::Severity::Medium; ///< Of rule, if one matched
+    bool         image = false;                  ///< Flagged by the image analysis (text is the finding)
+    bool         jobText = false;                ///< text is the job's own text, not a finding
+    PatternMatcher::ScanStatus status = PatternMatcher::ScanStatus::Complete; ///< Complete or Partial
+};
+
+/**
+ * @class JobScanner
+ * @brief Turns one ScanJob into a ScanResult; the scan state of one thread at a time.
+ *
+ * The text and every rich format of a job form a pipeline of stages that share one
+ * scan budget and stop at the first match. Stages run in order of their observed cost
+ * per hit, so cheap formats that tend to match go first. Payloads seen before are
+ * answered from a VerdictCache after a single hash pass, and a stage whose text only
+ * grew since its last clean scan resumes from a PatternMatcher::Checkpoint, so only the
+ * appended part is scanned. Files of a dropped file list
+ * are scanned after the text by a FileScanner, and never cached.
+ *
+ * Used by ScanWorker's thread, and by the scan service, which keeps one per scan in
+ * progress. Not thread-safe.
+ */
+class JobScanner
+{
+public:
+    /** @brief Sets the per-job size and time limits, shared by all stages. */
+    void SetBudget(const PatternMatcher::ScanBudget& budget) { _budget = budget; }
+
+    /** @brief Sets how much of each dropped file is scanned and by how many threads. */
+    void SetFileLimits(const FileScanner::Limits& limits) { _files.SetLimits(limits); }
+
+    /** @brief Records every job into the given statistics. */
+    void SetStats(ScanStats* stats) { _stats = stats; }
+
+    /**
+     * @brief Scans a job.
+     * @param patterns Compiled pattern set.
+     * @param job Snapshot; its text is moved into the result if the user has to judge it.
+     * @param cancel Abandons the scan when set.
+     * @param fileToken Token dropped files are opened with (the service passes the
+     *                  session user's); nullptr for the thread's own.
+     * @return The verdict, or nullptr if the scan was cancelled.
+     */
+    std::unique_ptr<ScanResult> Scan(const PatternMatcher& patterns, ScanJob& job,
+        const std::atomic<bool>& cancel, HANDLE fileToken = nullptr);
+
+private:
+    static constexpr size_t kStages = 1 + static_cast<size_t>(TextFormat::Count);   ///< Text, then each format
+
+    /** @brief Observed behaviour of one pipeline stage, decayed over time. */
+    struct StageStats
+    {
+        std::uint64_t            runs = 0;
+        std::uint64_t            hits = 0;
+        std::chrono::nanoseconds time{ 0 };    ///< Extraction and scan
+    };
+
+    /**
+     * @brief Scans the text and the rich formats of a job until one matches.
+     * @param[out] cached True if every verdict came from the verdict cache.
+     * @param[out] matched Stage that matched; its text is in _extracted unless it is the plain text.
+     * @return False if the job was cancelled.
+     */
+    bool ScanFormats(const PatternMatcher& patterns, const ScanJob& job, const std::atomic<bool>& cancel,
+        ScanResult& result, bool& cached, size_t& matched);
+
+    /** @brief Stages, lowest expected cost per hit first. */
+    std::array<size_t, kStages> StageOrder() const;
+
+    void RecordStage(size_t stage, std::chrono::nanoseconds time, bool hit);
+
+    PatternMatcher::Scratch     _scratch;
+    std::array<PatternMatcher::Checkpoint, kStages> _checkpoints;  ///< Last clean scan per stage
+    VerdictCache                _verdicts;
+    PatternMatcher::ScanBudget  _budget;
+    PatternMatcher::ScanProfile _profile;       ///< One Scan()
+    PatternMatcher::ScanProfile _jobProfile;    ///< All stages of a job
+    std::array<StageStats, kStages> _stageStats{};
+    std::wstring                _extracted;     ///< Text of the rich format being scanned
+    FileScanner                 _files;
+    ScanStats*                  _stats = nullptr;
+};
@@ -0,0 +1,274 @@
+/**
+ * @file LogArchiver.cpp
+ * @brief Implements background compression and retention of rotated log segments.
+ *
+ * Archive layout: an ArchiveHeader, then blocks of at most kBlockSize input bytes, each
+ * a BlockHeader and the block data. A block whose stored size equals its raw size is
+ * raw; otherwise it is one Compression API buffer (CreateDecompressor(header.algorithm)).
+ */
+
+#include "LogArchiver.h"
+
+#include <algorithm>
+#include <string>
+
+#pragma comment(lib, "Cabinet.lib")
+
+namespace {
+    constexpr std::uint32_t kArchiveMagic = 0x41445258;     // "XRDA"
+    constexpr std::uint16_t kArchiveVersion = 1;
+    constexpr DWORD kBlockSize = 1024 * 1024;
+    constexpr wchar_t kSegmentPrefix[] = L"xrd_log_";
+    constexpr wchar_t kActivePrefix[] = L"xrd_log_file";    // The live log, never touched
+    constexpr wchar_t kArchiveExtension[] = L".xrda";
+
+    struct ArchiveHeader
+    {
+        std::uint32_t magic;
+        std::uint16_t version;
+        std::uint16_t algorithm;
+        std::uint64_t size;         // Segment bytes before compression
+    };
+
+    struct BlockHeader
+    {
+        std::uint32_t rawSize;
+        std::uint32_t storedSize;
+    };
+
+    enum class SegmentKind { None, Plain, Archived };
+
+    SegmentKind KindOf(const std::filesystem::path& path)
+    {
+        const std::wstring name = path.filename().wstring();
+        if (name.rfind(kSegmentPrefix, 0) != 0 || name.rfind(kActivePrefix, 0) == 0)
+            return SegmentKind::None;
+        const std::wstring extension = path.extension().wstring();
+        if (extension == kArchiveExtension)
+            return SegmentKind::Archived;
+        if (extension == L".txt" || extension == L".jsonl")
+            return SegmentKind::Plain;
+        return SegmentKind::None;
+    }
+
+    bool WriteAll(HANDLE file, const void* data, DWORD size)
+    {
+        DWORD written = 0;
+        return WriteFile(file, data, size, &written, nullptr) && written == size;
+    }
+} // anonymous namespace
+
+//------------------------------------------------------------------------------
+// Constructor / Destructor
+//------------------------------------------------------------------------------
+LogArchiver::~LogArchiver()
+{
+    Stop();
+}
+
+//------------------------------------------------------------------------------
+// Public API
+//------------------------------------------------------------------------------
+bool LogArchiver::Start(const std::filesystem::path& directory, const Retention& retention)
+{
+    if (_thread.joinable())
+        return true;
+
+    _directory = directory;
+    _retention = retention;
+    if (!_compressor && !CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, nullptr, &_compressor))
+        _compressor = nullptr;  // Retention still runs; segments stay uncompressed
+
+    _wakeEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    _stopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!_wakeEvent || !_stopEvent) {
+        Stop();
+        return false;
+    }
+
+    try {
+        _thread = std::thread(&LogArchiver::Run, this);
+    }
+    catch (...) {
+        Stop();
+        return false;
+    }
+    return true;
+}
+
+void LogArchiver::Submit(std::filesystem::path segment)
+{
+    {
+        std::lock_guard lock(_mutex);
+        _pending.push_back(std::move(segment));
+    }
+    if (_wakeEvent)
+        SetEvent(_wakeEvent);
+}
+
+void LogArchiver::Stop()
+{
+    if (_stopEvent)
+        SetEvent(_stopEvent);
+    if (_thread.joinable())
+        _thread.join();
+
+    if (_compressor) {
+        CloseCompressor(_compressor);
+        _compressor = nullptr;
+    }
+    if (_wakeEvent) {
+        CloseHandle(_wakeEvent);
+        _wakeEvent = nullptr;
+    }
+    if (_stopEvent) {
+        CloseHandle(_stopEvent);
+        _stopEvent = nullptr;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Archiver thread
+//------------------------------------------------------------------------------
+void LogArchiver::Run()
+{
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    // Leftovers of earlier runs: unfinished archives and segments never compressed
+    std::vector<std::filesystem::path> segments;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(_directory, ec)) {
+        const auto& path = entry.path();
+        if (path.extension() == L".tmp" && KindOf(path.stem()) == SegmentKind::Archived)
+            DeleteFileW(path.c_str());
+        else if (KindOf(path) == SegmentKind::Plain)
+            segments.push_back(path);
+    }
+    {
+        std::lock_guard lock(_mutex);
+        for (const auto& segment : segments) {
+            if (std::find(_pending.begin(), _pending.end(), segment) == _pending.end())
+                _pending.push_back(segment);
+        }
+    }
+
+    const HANDLE handles[] = { _stopEvent, _wakeEvent };
+    for (;;) {
+        std::vector<std::filesystem::path> work;
+        {
+            std::lock_guard lock(_mutex);
+            work.swap(_pending);
+        }
+        for (const auto& segment : work) {
+            if (Stopping())
+                return;
+            if (_compressor)
+                Archive(segment);
+        }
+        EnforceRetention();
+
+        if (WaitForMultipleObjects(_countof(handles), handles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+            return;
+    }
+}
+
+bool LogArchiver::Archive(const std::filesystem::path& segment)
+{
+    HANDLE source = CreateFileW(segment.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (source == INVALID_HANDLE_VALUE)
+        return false;
+
+    FILETIME written{};
+    GetFileTime(source, nullptr, nullptr, &written);
+
+    const std::wstring archivePath = segment.wstring() + kArchiveExtension;
+    const std::wstring tempPath = archivePath + L".tmp";
+    HANDLE target = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (target == INVALID_HANDLE_VALUE) {
+        CloseHandle(source);
+        return false;
+    }
+
+    ArchiveHeader header{ kArchiveMagic, kArchiveVersion, COMPRESS_ALGORITHM_XPRESS_HUFF, 0 };
+    bool ok = WriteAll(target, &header, sizeof(header));
+
+    std::vector<char> raw(kBlockSize);
+    std::vector<char> packed;
+    while (ok && !Stopping()) {
+        DWORD read = 0;
+        if (!ReadFile(source, raw.data(), kBlockSize, &read, nullptr)) {
+            ok = false;
+            break;
+        }
+        if (read == 0)
+            break;
+
+        SIZE_T needed = 0;
+        BlockHeader block{ read, read };
+        const char* data = raw.data();
+        if (!Compress(_compressor, raw.data(), read, nullptr, 0, &needed) &&
+            GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+            packed.resize(needed);
+            SIZE_T size = 0;
+            if (Compress(_compressor, raw.data(), read, packed.data(), packed.size(), &size) && size < read) {
+                block.storedSize = static_cast<std::uint32_t>(size);
+                data = packed.data();
+            }
+        }
+        ok = WriteAll(target, &block, sizeof(block)) && WriteAll(target, data, block.storedSize);
+        header.size += read;
+    }
+    const bool complete = ok && !Stopping();
+
+    // Final size in the header; the archive keeps the segment's time for age-based retention
+    LARGE_INTEGER start{};
+    DWORD headerWritten = 0;
+    ok = complete && SetFilePointerEx(target, start, nullptr, FILE_BEGIN) &&
+        WriteFile(target, &header, sizeof(header), &headerWritten, nullptr) && headerWritten == sizeof(header) &&
+        SetFileTime(target, nullptr, nullptr, &written);
+    ok = CloseHandle(target) && ok;
+    CloseHandle(source);
+
+    if (!ok || !MoveFileExW(tempPath.c_str(), archivePath.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFileW(tempPath.c_str());
+        return false;
+    }
+    DeleteFileW(segment.c_str());
+    return true;
+}
+
+void LogArchiver::EnforceRetention()
+{
+    if (_retention.keepSegments == 0 && _retention.keepDays == 0)
+        return;
+
+    struct Segment
+    {
+        std::filesystem::path           path;
+        std::filesystem::file_time_type time;
+    };
+    std::vector<Segment> segments;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(_directory, ec)) {
+        if (KindOf(entry.path()) == SegmentKind::None)
+            continue;
+        const auto time = entry.last_write_time(ec);
+        if (!ec)
+            segments.push_back({ entry.path(), time });
+    }
+    std::sort(segments.begin(), segments.end(),
+        [](const Segment& a, const Segment& b) { return a.time > b.time; });
+
+    const auto cutoff = std::filesystem::file_time_type::clock::now()
+        - std::chrono::hours(24) * _retention.keepDays;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const bool tooMany = _retention.keepSegments != 0 && i >= _retention.keepSegments;
+        const bool tooOld = _retention.keepDays != 0 && segments[i].time < cutoff;
+        if (tooMany || tooOld)
+            DeleteFileW(segments[i].path.c_str());
+    }
+}
+
+// End of LogArchiver.cpp
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <windows.h>
+#include <compressapi.h>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @class LogArchiver
+ * @brief Compresses rotated log segments and enforces retention, in the background.
+ *
+ * Runs on one thread in background processing mode (low CPU and I/O priority), so it
+ * never competes with the paste path or the log writer. Each segment xrd_log_<stamp>.<ext>
+ * becomes <segment>.xrda and the original is deleted. Segments left uncompressed by an
+ * earlier run are picked up at start; a segment interrupted by Stop() is redone next time.
+ */
+class LogArchiver
+{
+public:
+    struct Retention
+    {
+        size_t keepSegments = 0;    ///< Rotated segments to keep, newest first (0 = all)
+        DWORD  keepDays = 0;        ///< Delete segments older than this (0 = never)
+    };
+
+    LogArchiver() = default;
+
+    /** @brief Stops the archiver thread if it is still running. */
+    ~LogArchiver();
+
+    LogArchiver(const LogArchiver&) = delete;
+    LogArchiver& operator=(const LogArchiver&) = delete;
+
+    /**
+     * @brief Starts the archiver thread.
+     * @param directory Log directory holding the segments.
+     * @param retention Limits applied after every archived segment.
+     * @return True if the thread is running.
+     */
+    bool Start(const std::filesystem::path& directory, const Retention& retention);
+
+    /** @brief Queues a freshly rotated segment for compression. */
+    void Submit(std::filesystem::path segment);
+
+    /** @brief Stops and joins the archiver thread; queued segments wait for the next start. */
+    void Stop();
+
+private:
+    /** @brief Archiver thread body. */
+    void Run();
+
+    /** @brief Writes <segment>.xrda and deletes the segment; false if stopped or failed. */
+    bool Archive(const std::filesystem::path& segment);
+
+    /** @brief Deletes segments and archives beyond the retention limits. */
+    void EnforceRetention();
+
+    bool Stopping() const { return WaitForSingleObject(_stopEvent, 0) == WAIT_OBJECT_0; }
+
+    std::filesystem::path              _directory;
+    Retention                          _retention;
+    COMPRESSOR_HANDLE                  _compressor = nullptr;
+
+    std::mutex                         _mutex;       ///< Protects _pending
+    std::vector<std::filesystem::path> _pending;
+
+    HANDLE                             _wakeEvent = nullptr;
+    HANDLE                             _stopEvent = nullptr;
+    std::thread                        _thread;
+};
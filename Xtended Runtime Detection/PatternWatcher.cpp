@@ -0,0 +1,210 @@
+/**
+ * @file PatternWatcher.cpp
+ * @brief Implements hot reload of the pattern file.
+ */
+
+#include "PatternWatcher.h"
+
+#include <filesystem>
+#include <sstream>
+
+#include "PatternFile.h"
+
+namespace {
+    constexpr DWORD kSettleMs = 200;            // Editors write in several steps; wait for quiet
+    constexpr DWORD kNotifyBufferSize = 16 * 1024;
+} // anonymous namespace
+
+//------------------------------------------------------------------------------
+// Constructor / Destructor
+//------------------------------------------------------------------------------
+PatternWatcher::PatternWatcher(RuleSet& rules, XrdLogger& logger)
+    : _rules(rules)
+    , _logger(logger)
+{
+}
+
+PatternWatcher::~PatternWatcher()
+{
+    Stop();
+}
+
+//------------------------------------------------------------------------------
+// Public API
+//------------------------------------------------------------------------------
+bool PatternWatcher::Start(const std::wstring& patternFile, std::uint64_t sourceHash, HWND loadTarget)
+{
+    if (_thread.joinable())
+        return true;
+
+    const std::filesystem::path path(patternFile);
+    _patternFile = patternFile;
+    _fileName = path.filename().wstring();
+    _sourceHash = sourceHash;
+    _loadTarget = loadTarget;
+
+    _directory = CreateFileW(path.parent_path().c_str(),
+        FILE_LIST_DIRECTORY,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+        nullptr);
+    if (_directory == INVALID_HANDLE_VALUE)
+        return false;
+
+    _stopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!_stopEvent) {
+        Stop();
+        return false;
+    }
+
+    try {
+        _thread = std::thread(&PatternWatcher::Run, this);
+    }
+    catch (...) {
+        Stop();
+        return false;
+    }
+    return true;
+}
+
+void PatternWatcher::Stop()
+{
+    if (_stopEvent)
+        SetEvent(_stopEvent);
+    if (_thread.joinable())
+        _thread.join();
+
+    if (_directory != INVALID_HANDLE_VALUE) {
+        CloseHandle(_directory);
+        _directory = INVALID_HANDLE_VALUE;
+    }
+    if (_stopEvent) {
+        CloseHandle(_stopEvent);
+        _stopEvent = nullptr;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Watcher thread
+//------------------------------------------------------------------------------
+void PatternWatcher::Run()
+{
+    constexpr DWORD kFilter = FILE_NOTIFY_CHANGE_FILE_NAME
+        | FILE_NOTIFY_CHANGE_LAST_WRITE
+        | FILE_NOTIFY_CHANGE_SIZE;
+
+    alignas(DWORD) BYTE buffer[kNotifyBufferSize];
+    OVERLAPPED overlapped{};
+    overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!overlapped.hEvent) {
+        if (_loadTarget)
+            InitialLoad();
+        return;
+    }
+
+    bool changed = false;   // Seen a relevant change, waiting for the file to settle
+    for (;;) {
+        ResetEvent(overlapped.hEvent);
+        if (!ReadDirectoryChangesW(_directory, buffer, sizeof(buffer), FALSE,
+            kFilter, nullptr, &overlapped, nullptr)) {
+            _logger.logMessage(L"Pattern hot reload disabled: cannot watch the pattern directory");
+            if (_loadTarget)
+                InitialLoad();
+            break;
+        }
+
+        // Watching already, so an edit made while the first set compiles is reloaded
+        if (_loadTarget)
+            InitialLoad();
+
+        const HANDLE handles[] = { _stopEvent, overlapped.hEvent };
+        const DWORD wait = WaitForMultipleObjects(_countof(handles), handles, FALSE,
+            changed ? kSettleMs : INFINITE);
+
+        if (wait == WAIT_OBJECT_0 + 1) {
+            DWORD bytes = 0;
+            if (GetOverlappedResult(_directory, &overlapped, &bytes, FALSE)) {
+                // Zero bytes means the buffer overflowed; the file may have changed
+                if (bytes == 0 || MentionsPatternFile(buffer, bytes))
+                    changed = true;
+            }
+            continue;
+        }
+
+        // Stop or settle timeout: the read is still pending and must finish first
+        CancelIoEx(_directory, &overlapped);
+        DWORD ignored = 0;
+        GetOverlappedResult(_directory, &overlapped, &ignored, TRUE);
+
+        if (wait != WAIT_TIMEOUT)
+            break;
+
+        changed = false;
+        Reload();
+    }
+
+    CloseHandle(overlapped.hEvent);
+}
+
+bool PatternWatcher::MentionsPatternFile(const BYTE* buffer, DWORD length) const
+{
+    DWORD offset = 0;
+    while (offset + sizeof(FILE_NOTIFY_INFORMATION) <= length) {
+        const auto* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(buffer + offset);
+        const int nameLength = static_cast<int>(info->FileNameLength / sizeof(WCHAR));
+        if (CompareStringOrdinal(info->FileName, nameLength,
+            _fileName.c_str(), static_cast<int>(_fileName.size()), TRUE) == CSTR_EQUAL)
+            return true;
+
+        if (info->NextEntryOffset == 0)
+            break;
+        offset += info->NextEntryOffset;
+    }
+    return false;
+}
+
+void PatternWatcher::InitialLoad()
+{
+    PatternFileResult loaded = LoadPatternFile(_patternFile);
+    for (const auto& error : loaded.errors)
+        _logger.logMessage(error);
+    for (const auto& note : loaded.notes)
+        _logger.logMessage(note);
+
+    const bool published = loaded.matcher != nullptr;
+    if (published) {
+        _sourceHash = loaded.sourceHash;
+        _rules.store(std::move(loaded.matcher));
+    }
+    PostMessageW(_loadTarget, WM_XRD_PATTERNSLOADED, published ? TRUE : FALSE, 0);
+    _loadTarget = nullptr;
+}
+
+void PatternWatcher::Reload()
+{
+    PatternFileResult loaded = LoadPatternFile(_patternFile);
+    if (loaded.sourceHash == _sourceHash)
+        return;     // Touched but not changed
+
+    if (!loaded.matcher || !loaded.errors.empty()) {
+        std::wstringstream msg;
+        msg << L"Pattern reload rejected, keeping the previous rules:";
+        for (const auto& error : loaded.errors)
+            msg << L"\n             " << error;
+        _logger.logMessage(msg.str());
+        return;
+    }
+
+    _sourceHash = loaded.sourceHash;
+    const size_t rules = loaded.matcher->RuleCount();
+    _rules.store(std::move(loaded.matcher));
+
+    std::wstringstream msg;
+    msg << L"Patterns reloaded: " << rules << L" rules";
+    for (const auto& note : loaded.notes)
+        msg << L"\n             " << note;
+    _logger.logMessage(msg.str());
+}
+
+// End of PatternWatcher.cpp
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "PatternMatcher.h"
+#include "XrdLogger.h"
+
+/** @brief Posted when the first load of a deferred start is done; wParam is TRUE if a set was published. */
+constexpr UINT WM_XRD_PATTERNSLOADED = WM_APP + 5;
+
+/**
+ * @class PatternWatcher
+ * @brief Reloads the pattern file when it changes on disk.
+ *
+ * Watches the directory of patterns.txt with ReadDirectoryChangesW on its own thread.
+ * After a short quiet period the file is recompiled off the message thread and, if every
+ * line compiled, published by swapping the shared rule set; scans already running keep
+ * the set they started with. A file with errors is rejected as a whole: the previous set
+ * stays active and the problems go to the log instead of a dialog.
+ *
+ * On a fast start the first set is compiled here as well, so the message thread can
+ * serve the clipboard while it is built; bad lines are then skipped as at any start.
+ */
+class PatternWatcher
+{
+public:
+    using RuleSet = std::atomic<std::shared_ptr<const PatternMatcher>>;
+
+    /**
+     * @brief Creates an idle watcher.
+     * @param rules  Slot the compiled set is published into; must outlive the watcher.
+     * @param logger Receives reload and error messages; must outlive the watcher.
+     */
+    PatternWatcher(RuleSet& rules, XrdLogger& logger);
+
+    /** @brief Stops the watcher thread if it is still running. */
+    ~PatternWatcher();
+
+    PatternWatcher(const PatternWatcher&) = delete;
+    PatternWatcher& operator=(const PatternWatcher&) = delete;
+
+    /**
+     * @brief Starts watching.
+     * @param patternFile Full path of patterns.txt.
+     * @param sourceHash  Hash of the file contents the current set was built from.
+     * @param loadTarget  If set, nothing is published yet: the thread first loads the file
+     *                    and posts WM_XRD_PATTERNSLOADED to this window.
+     * @return True if the directory could be opened and the thread is running.
+     */
+    bool Start(const std::wstring& patternFile, std::uint64_t sourceHash, HWND loadTarget = nullptr);
+
+    /** @brief Stops and joins the watcher thread. */
+    void Stop();
+
+private:
+    /** @brief Watcher thread body. */
+    void Run();
+
+    /** @brief Recompiles the file and publishes it if it is valid and has changed. */
+    void Reload();
+
+    /** @brief First load of a deferred start: publishes whatever compiled, then notifies. */
+    void InitialLoad();
+
+    /** @brief True if a change notification buffer mentions the pattern file. */
+    bool MentionsPatternFile(const BYTE* buffer, DWORD length) const;
+
+    RuleSet&      _rules;
+    XrdLogger&    _logger;
+
+    std::wstring  _patternFile;
+    std::wstring  _fileName;            ///< Name part of _patternFile, compared case-insensitively
+    std::uint64_t _sourceHash = 0;      ///< Hash of the file behind the published set
+    HWND          _loadTarget = nullptr;    ///< Receives WM_XRD_PATTERNSLOADED, if loading here
+
+    HANDLE        _directory = INVALID_HANDLE_VALUE;
+    HANDLE        _stopEvent = nullptr;
+    std::thread   _thread;
+};
@@ -0,0 +1,160 @@
+/**
+ * @file ProcessIdentity.cpp
+ * @brief Implements the process identity cache.
+ */
+
+#include "ProcessIdentity.h"
+
+#include <vector>
+
+namespace {
+    /** @brief Reads the identity of an opened process; false if the image name is unavailable. */
+    bool ReadIdentity(HANDLE process, DWORD pid, ProcessIdentity& identity)
+    {
+        wchar_t path[MAX_PATH] = {};
+        DWORD len = MAX_PATH;
+        if (!QueryFullProcessImageNameW(process, 0, path, &len))
+            return false;
+
+        FILETIME created{}, exited{}, kernel{}, user{};
+        if (GetProcessTimes(process, &created, &exited, &kernel, &user))
+            identity.created = (static_cast<std::uint64_t>(created.dwHighDateTime) << 32) | created.dwLowDateTime;
+
+        identity.pid = pid;
+        identity.imagePath.assign(path, len);
+        const auto pos = identity.imagePath.find_last_of(L"\\/");
+        identity.name = (pos == std::wstring::npos)
+            ? identity.imagePath
+            : identity.imagePath.substr(pos + 1);
+        return true;
+    }
+} // anonymous namespace
+
+//------------------------------------------------------------------------------
+// Destructor
+//------------------------------------------------------------------------------
+ProcessIdentityCache::~ProcessIdentityCache()
+{
+    std::vector<std::unique_ptr<Entry>> entries;
+    AcquireSRWLockExclusive(&_lock);
+    for (auto& [pid, entry] : _entries)
+        entries.push_back(std::move(entry));
+    _entries.clear();
+    ReleaseSRWLockExclusive(&_lock);
+
+    // Outside the lock: a callback in flight takes it, finds nothing and returns
+    for (auto& entry : entries)
+        Release(std::move(entry), true);
+}
+
+//------------------------------------------------------------------------------
+// Lookup
+//------------------------------------------------------------------------------
+std::shared_ptr<const ProcessIdentity> ProcessIdentityCache::Resolve(DWORD pid)
+{
+    if (pid == 0)
+        return nullptr;
+
+    AcquireSRWLockShared(&_lock);
+    if (const auto it = _entries.find(pid); it != _entries.end()) {
+        auto identity = it->second->identity;
+        ReleaseSRWLockShared(&_lock);
+        return identity;
+    }
+    ReleaseSRWLockShared(&_lock);
+
+    // Miss: one round of kernel calls for the whole lifetime of the process
+    auto identity = std::make_shared<ProcessIdentity>();
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE, FALSE, pid);
+    if (!process) {
+        // Without SYNCHRONIZE the exit cannot be observed: answer, but do not cache
+        process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+        const bool known = process && ReadIdentity(process, pid, *identity);
+        if (process)
+            CloseHandle(process);
+        return known ? identity : nullptr;
+    }
+    if (!ReadIdentity(process, pid, *identity)) {
+        CloseHandle(process);
+        return nullptr;
+    }
+
+    auto entry = std::make_unique<Entry>();
+    entry->owner = this;
+    entry->identity = identity;
+    entry->process = process;
+
+    std::unique_ptr<Entry> evicted;
+    AcquireSRWLockExclusive(&_lock);
+    if (const auto it = _entries.find(pid); it != _entries.end()) {
+        auto existing = it->second->identity;     // Resolved concurrently
+        ReleaseSRWLockExclusive(&_lock);
+        CloseHandle(process);
+        return existing;
+    }
+    if (_entries.size() >= kMaxEntries) {
+        auto victim = _entries.begin();
+        evicted = std::move(victim->second);
+        _entries.erase(victim);
+    }
+    // Registered under the lock, so the callback always finds the entry complete
+    Entry* raw = entry.get();
+    if (RegisterWaitForSingleObject(&raw->wait, process, OnProcessExit, raw,
+        INFINITE, WT_EXECUTEONLYONCE)) {
+        _entries.emplace(pid, std::move(entry));
+    }
+    ReleaseSRWLockExclusive(&_lock);
+
+    if (entry)      // Not registered: the answer is still right, it just is not kept
+        CloseHandle(process);
+    if (evicted)
+        Release(std::move(evicted), true);
+    return identity;
+}
+
+std::shared_ptr<const ProcessIdentity> ProcessIdentityCache::ResolveWindow(HWND window)
+{
+    DWORD pid = 0;
+    if (!window || !GetWindowThreadProcessId(window, &pid))
+        return nullptr;
+    return Resolve(pid);
+}
+
+std::wstring ProcessIdentityCache::NameOfWindow(HWND window)
+{
+    const auto identity = ResolveWindow(window);
+    return identity ? identity->name : L"Unknown";
+}
+
+//------------------------------------------------------------------------------
+// Exit notification
+//------------------------------------------------------------------------------
+void CALLBACK ProcessIdentityCache::OnProcessExit(PVOID context, BOOLEAN /*timedOut*/)
+{
+    auto* raw = static_cast<Entry*>(context);
+    ProcessIdentityCache* cache = raw->owner;
+
+    // Whoever takes the entry out of the map frees it; eviction and the
+    // destructor wait for this callback before they free theirs
+    std::unique_ptr<Entry> entry;
+    AcquireSRWLockExclusive(&cache->_lock);
+    const auto it = cache->_entries.find(raw->identity->pid);
+    if (it != cache->_entries.end() && it->second.get() == raw) {
+        entry = std::move(it->second);
+        cache->_entries.erase(it);
+    }
+    ReleaseSRWLockExclusive(&cache->_lock);
+
+    if (entry)
+        Release(std::move(entry), false);   // Blocking on our own callback would deadlock
+}
+
+void ProcessIdentityCache::Release(std::unique_ptr<Entry> entry, bool waitForCallback)
+{
+    if (entry->wait)
+        UnregisterWaitEx(entry->wait, waitForCallback ? INVALID_HANDLE_VALUE : nullptr);
+    if (entry->process)
+        CloseHandle(entry->process);
+}
+
+// End of ProcessIdentity.cpp
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <windows.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+/** @brief Who a process is: the PID and creation time identify it, the image names describe it. */
+struct ProcessIdentity
+{
+    DWORD         pid = 0;
+    std::uint64_t created = 0;  ///< Creation time (FILETIME ticks); a reused PID gets a new one
+    std::wstring  imagePath;    ///< Full path of the executable
+    std::wstring  name;         ///< File name part of imagePath, as logged
+};
+
+/**
+ * @class ProcessIdentityCache
+ * @brief Resolves PIDs and windows to process identities, with one lookup per process lifetime.
+ *
+ * The first lookup of a PID opens the process, reads its image name and creation time and
+ * keeps the handle; holding it stops Windows from reusing the PID, so later lookups are a
+ * map hit under a shared lock. A wait on the handle drops the entry when the process exits.
+ * Safe to use from any thread; exit notifications arrive on the thread pool.
+ */
+class ProcessIdentityCache
+{
+public:
+    ProcessIdentityCache() = default;
+
+    /** @brief Cancels the exit waits and closes every cached handle. */
+    ~ProcessIdentityCache();
+
+    ProcessIdentityCache(const ProcessIdentityCache&) = delete;
+    ProcessIdentityCache& operator=(const ProcessIdentityCache&) = delete;
+
+    /**
+     * @brief Identity of a running process.
+     * @param pid Process ID.
+     * @return Null if the process cannot be opened (exited, or protected).
+     */
+    std::shared_ptr<const ProcessIdentity> Resolve(DWORD pid);
+
+    /** @brief Identity of the process that owns a window; null if unknown. */
+    std::shared_ptr<const ProcessIdentity> ResolveWindow(HWND window);
+
+    /** @brief Image file name of the process owning a window, or "Unknown". */
+    std::wstring NameOfWindow(HWND window);
+
+private:
+    struct Entry
+    {
+        ProcessIdentityCache*                  owner = nullptr;
+        std::shared_ptr<const ProcessIdentity> identity;
+        HANDLE                                 process = nullptr;
+        HANDLE                                 wait = nullptr;
+    };
+
+    /** @brief Exit wait callback: removes the entry unless someone else already did. */
+    static void CALLBACK OnProcessExit(PVOID context, BOOLEAN timedOut);
+
+    /** @brief Cancels the wait (blocking if asked) and frees an entry removed from the map. */
+    static void Release(std::unique_ptr<Entry> entry, bool waitForCallback);
+
+    SRWLOCK _lock = SRWLOCK_INIT;   ///< Protects _entries
+    std::unordered_map<DWORD, std::unique_ptr<Entry>> _entries;
+
+    static constexpr size_t kMaxEntries = 512;
+};
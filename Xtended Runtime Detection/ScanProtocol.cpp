@@ -0,0 +1,353 @@
+/**
+ * @file ScanProtocol.cpp
+ * @brief Messages and job sections exchanged between the agents and the scan service.
+ */
+
+#include "ScanProtocol.h"
+
+#include <chrono>
+#include <cstring>
+
+namespace {
+    /** @brief Start of a job section, followed by the serialized job. */
+    struct JobSectionHeader
+    {
+        static constexpr std::uint32_t kMagic = 0x4A445258;    // "XRDJ"
+
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint64_t requestId;
+        std::uint64_t bytes;    ///< Of the job that follows
+    };
+
+    /** @brief Appends values to a buffer, or only counts them when it has none. */
+    class Writer
+    {
+    public:
+        explicit Writer(BYTE* out = nullptr) : _out(out) {}
+
+        void Bytes(const void* data, size_t size)
+        {
+            if (_out && size != 0)
+                std::memcpy(_out + _size, data, size);
+            _size += size;
+        }
+
+        template <typename T>
+        void Value(T value) { Bytes(&value, sizeof(value)); }
+
+        void Text(std::wstring_view text)
+        {
+            Value<std::uint64_t>(text.size());
+            Bytes(text.data(), text.size() * sizeof(wchar_t));
+        }
+
+        void Data(std::string_view data)
+        {
+            Value<std::uint64_t>(data.size());
+            Bytes(data.data(), data.size());
+        }
+
+        size_t Size() const { return _size; }
+
+    private:
+        BYTE*  _out;
+        size_t _size = 0;
+    };
+
+    /** @brief Reads values in the order they were written; every read fails once one has. */
+    class Reader
+    {
+    public:
+        Reader(const void* data, size_t size)
+            : _data(static_cast<const BYTE*>(data)), _size(size)
+        {
+        }
+
+        bool Bytes(void* data, size_t size)
+        {
+            if (!_ok || size > _size - _pos)
+                return _ok = false;
+            if (size != 0)
+                std::memcpy(data, _data + _pos, size);
+            _pos += size;
+            return true;
+        }
+
+        template <typename T>
+        bool Value(T& value) { return Bytes(&value, sizeof(value)); }
+
+        bool Text(std::wstring& text)
+        {
+            std::uint64_t units = 0;
+            if (!Value(units) || units > (_size - _pos) / sizeof(wchar_t))
+                return _ok = false;
+            text.resize(static_cast<size_t>(units));
+            return Bytes(text.data(), text.size() * sizeof(wchar_t));
+        }
+
+        bool Data(std::string& data)
+        {
+            std::uint64_t bytes = 0;
+            if (!Value(bytes) || bytes > _size - _pos)
+                return _ok = false;
+            data.resize(static_cast<size_t>(bytes));
+            return Bytes(data.data(), data.size());
+        }
+
+        /** @brief True if everything was read and nothing is left over. */
+        bool Done() const { return _ok && _pos == _size; }
+
+    private:
+        const BYTE* _data;
+        size_t      _size;
+        size_t      _pos = 0;
+        bool        _ok = true;
+    };
+
+    void WriteJob(Writer& out, const ScanJob& job)
+    {
+        out.Value<std::uint32_t>(job.sequence);
+        out.Value<std::uint8_t>(job.truncated ? 1 : 0);
+        out.Text(job.text);
+        out.Text(job.image);
+        out.Value<std::uint32_t>(static_cast<std::uint32_t>(job.formats.size()));
+        for (const FormatData& format : job.formats) {
+            out.Value<std::uint32_t>(static_cast<std::uint32_t>(format.format));
+            out.Data(format.bytes);
+        }
+        out.Value<std::uint32_t>(static_cast<std::uint32_t>(job.files.size()));
+        for (const std::wstring& file : job.files)
+            out.Text(file);
+    }
+
+    bool ReadJob(Reader& in, ScanJob& job)
+    {
+        std::uint8_t truncated = 0;
+        std::uint32_t sequence = 0, formats = 0, files = 0;
+        if (!in.Value(sequence) || !in.Value(truncated) || !in.Text(job.text) || !in.Text(job.image))
+            return false;
+        job.sequence = sequence;
+        job.truncated = truncated != 0;
+
+        if (!in.Value(formats) || formats > static_cast<std::uint32_t>(TextFormat::Count))
+            return false;
+        job.formats.resize(formats);
+        for (FormatData& format : job.formats) {
+            std::uint32_t id = 0;
+            if (!in.Value(id) || id >= static_cast<std::uint32_t>(TextFormat::Count) || !in.Data(format.bytes))
+                return false;
+            format.format = static_cast<TextFormat>(id);
+        }
+
+        if (!in.Value(files) || files > 0xFFFF)
+            return false;
+        job.files.resize(files);
+        for (std::wstring& file : job.files) {
+            if (!in.Text(file))
+                return false;
+        }
+        return in.Done();
+    }
+
+    XrdMessageHeader HeaderOf(XrdMessageHeader::Type type, std::uint64_t requestId)
+    {
+        return { XrdMessageHeader::kMagic, XrdMessageHeader::kVersion, type, 0, requestId };
+    }
+
+    /** @brief Header followed by whatever write() appends: counted first, then written in place. */
+    template <typename Write>
+    std::string BuildMessage(XrdMessageHeader::Type type, std::uint64_t requestId, Write write)
+    {
+        Writer counter;
+        counter.Value(HeaderOf(type, requestId));
+        write(counter);
+
+        std::string message(counter.Size(), '\0');
+        Writer out(reinterpret_cast<BYTE*>(message.data()));
+        out.Value(HeaderOf(type, requestId));
+        write(out);
+        return message;
+    }
+
+    Reader PayloadOf(std::string_view message)
+    {
+        const size_t header = std::min(message.size(), sizeof(XrdMessageHeader));
+        return Reader(message.data() + header, message.size() - header);
+    }
+} // anonymous namespace
+
+//------------------------------------------------------------------------------
+// Job sections
+//------------------------------------------------------------------------------
+HANDLE CreateJobSection(const ScanJob& job, std::uint64_t requestId, std::uint64_t& bytes)
+{
+    Writer counter;
+    WriteJob(counter, job);
+    const std::uint64_t size = sizeof(JobSectionHeader) + counter.Size();
+
+    HANDLE section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+        static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+    if (!section)
+        return nullptr;
+    BYTE* view = static_cast<BYTE*>(MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, static_cast<SIZE_T>(size)));
+    if (!view) {
+        CloseHandle(section);
+        return nullptr;
+    }
+
+    const JobSectionHeader header{ JobSectionHeader::kMagic, XrdMessageHeader::kVersion, requestId, counter.Size() };
+    std::memcpy(view, &header, sizeof(header));
+    Writer out(view + sizeof(header));
+    WriteJob(out, job);
+    UnmapViewOfFile(view);
+
+    bytes = size;
+    return section;
+}
+
+bool ReadJobSection(HANDLE section, std::uint64_t requestId, std::uint64_t bytes, ScanJob& job)
+{
+    if (bytes < sizeof(JobSectionHeader) || bytes > SIZE_MAX)
+        return false;
+
+    // Fails if the section is smaller than the agent claimed
+    const BYTE* view = static_cast<const BYTE*>(MapViewOfFile(section, FILE_MAP_READ, 0, 0, static_cast<SIZE_T>(bytes)));
+    if (!view)
+        return false;
+
+    bool ok = false;
+    try {
+        JobSectionHeader header{};
+        std::memcpy(&header, view, sizeof(header));
+        if (header.magic == JobSectionHeader::kMagic && header.version == XrdMessageHeader::kVersion &&
+            header.requestId == requestId && header.bytes == bytes - sizeof(header)) {
+            Reader in(view + sizeof(header), static_cast<size_t>(header.bytes));
+            ok = ReadJob(in, job);
+        }
+    }
+    catch (const std::bad_alloc&) {
+        ok = false;
+    }
+    UnmapViewOfFile(view);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Messages
+//------------------------------------------------------------------------------
+std::string ScanMessage(std::uint64_t requestId, HANDLE section, std::uint64_t bytes)
+{
+    return BuildMessage(XrdMessageHeader::Type::Scan, requestId, [&](Writer& out) {
+        out.Value<std::uint64_t>(reinterpret_cast<ULONG_PTR>(section));
+        out.Value(bytes);
+    });
+}
+
+std::string CancelMessage(std::uint64_t requestId)
+{
+    return BuildMessage(XrdMessageHeader::Type::Cancel, requestId, [](Writer&) {});
+}
+
+std::string VerdictMessage(std::uint64_t requestId, const ScanResult& result)
+{
+    return BuildMessage(XrdMessageHeader::Type::Verdict, requestId, [&](Writer& out) {
+        out.Value<std::int32_t>(result.rule);
+        out.Value<std::uint8_t>(static_cast<std::uint8_t>(result.status));
+        out.Value<std::uint8_t>(static_cast<std::uint8_t>(result.severity));
+        out.Value<std::uint8_t>((result.incomplete ? 1 : 0) | (result.image ? 2 : 0) | (result.jobText ? 4 : 0));
+        out.Text(result.jobText ? std::wstring_view() : std::wstring_view(result.text));
+    });
+}
+
+std::string LogMessage(const XrdLogger::Record& record)
+{
+    return BuildMessage(XrdMessageHeader::Type::Log, 0, [&](Writer& out) {
+        out.Value<std::int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            record.time.time_since_epoch()).count());
+        out.Value<std::uint8_t>((record.truncated ? 1 : 0) | (record.isMessage ? 2 : 0));
+        for (const std::wstring* field : { &record.user, &record.host, &record.sourceApp,
+            &record.destApp, &record.content, &record.action })
+            out.Text(*field);
+    });
+}
+
+bool ParseHeader(std::string_view message, XrdMessageHeader& header)
+{
+    if (message.size() < sizeof(header))
+        return false;
+    std::memcpy(&header, message.data(), sizeof(header));
+    return header.magic == XrdMessageHeader::kMagic && header.version == XrdMessageHeader::kVersion;
+}
+
+bool ParseScan(std::string_view message, std::uint64_t& section, std::uint64_t& bytes)
+{
+    Reader in = PayloadOf(message);
+    return in.Value(section) && in.Value(bytes) && in.Done();
+}
+
+bool ParseVerdict(std::string_view message, ScanResult& result)
+{
+    Reader in = PayloadOf(message);
+    std::int32_t rule = 0;
+    std::uint8_t status = 0, severity = 0, flags = 0;
+    if (!in.Value(rule) || !in.Value(status) || !in.Value(severity) || !in.Value(flags) ||
+        !in.Text(result.text) || !in.Done())
+        return false;
+    if (status > static_cast<std::uint8_t>(PatternMatcher::ScanStatus::Cancelled) ||
+        severity > static_cast<std::uint8_t>(PatternMatcher::Severity::High))
+        return false;
+    result.rule = rule;
+    result.status = static_cast<PatternMatcher::ScanStatus>(status);
+    result.severity = static_cast<PatternMatcher::Severity>(severity);
+    result.incomplete = (flags & 1) != 0;
+    result.image = (flags & 2) != 0;
+    result.jobText = (flags & 4) != 0;
+    return true;
+}
+
+bool ParseLog(std::string_view message, XrdLogger::Record& record)
+{
+    Reader in = PayloadOf(message);
+    std::int64_t micros = 0;
+    std::uint8_t flags = 0;
+    if (!in.Value(micros) || !in.Value(flags))
+        return false;
+    for (std::wstring* field : { &record.user, &record.host, &record.sourceApp,
+        &record.destApp, &record.content, &record.action }) {
+        if (!in.Text(*field))
+            return false;
+    }
+    record.time = std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::microseconds(micros)));
+    record.truncated = (flags & 1) != 0;
+    record.isMessage = (flags & 2) != 0;
+    return in.Done();
+}
+
+//------------------------------------------------------------------------------
+// Pipe I/O
+//------------------------------------------------------------------------------
+bool WriteMessage(HANDLE pipe, const std::string& message, HANDLE event, DWORD timeoutMs)
+{
+    if (message.size() > XrdMessageHeader::kMaxBytes)
+        return false;
+
+    // The low bit keeps the completion off the handle's completion port
+    OVERLAPPED overlapped{};
+    overlapped.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(event) | 1);
+    ResetEvent(event);
+
+    DWORD written = 0;
+    if (!WriteFile(pipe, message.data(), static_cast<DWORD>(message.size()), &written, &overlapped)) {
+        if (GetLastError() != ERROR_IO_PENDING)
+            return false;
+        if (WaitForSingleObject(event, timeoutMs) != WAIT_OBJECT_0)
+            CancelIoEx(pipe, &overlapped);      // The reader stalled; the wait below returns at once
+        if (!GetOverlappedResult(pipe, &overlapped, &written, TRUE))
+            return false;
+    }
+    return written == message.size();
+}
+
+// End of ScanProtocol.cpp
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <windows.h>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "JobScanner.h"
+#include "XrdLogger.h"
+
+/** @brief Pipe of the scan service, one instance per connected agent. */
+constexpr const wchar_t* XRD_SERVICE_PIPE = L"\\\\.\\pipe\\XtendedRuntimeDetection.Scan";
+
+/**
+ * @brief Header of every message between an agent and the scan service.
+ *
+ * The pipe runs in message mode, so each message arrives whole. A Scan request names a
+ * pagefile-backed section in the agent's process that holds the serialized ScanJob; the
+ * service duplicates the handle, maps it read-only and copies the job out, so clipboard
+ * content never travels through the pipe. Every Scan request gets exactly one Verdict
+ * with the same id, also when it was cancelled. A Log message carries one record for
+ * the service's log and gets no reply.
+ */
+struct XrdMessageHeader
+{
+    static constexpr std::uint32_t kMagic = 0x50445258;    // "XRDP"
+    static constexpr std::uint32_t kVersion = 2;
+    static constexpr size_t        kMaxBytes = 128 * 1024 * 1024;   // Largest message accepted
+
+    enum class Type : std::uint32_t
+    {
+        Scan = 1,   ///< Agent: section handle and size of a job
+        Cancel,     ///< Agent: the job is outdated
+        Verdict,    ///< Service: result of a job
+        Log,        ///< Agent: one log record
+    };
+
+    std::uint32_t magic;
+    std::uint32_t version;
+    Type          type;
+    std::uint32_t reserved;
+    std::uint64_t requestId;    ///< Scan, Cancel and Verdict: the job; Log: 0
+};
+
+/**
+ * @brief Serializes a job into a new pagefile-backed section of the current process.
+ * @param job Snapshot to send.
+ * @param requestId Stored in the section so the service can check it got the right one.
+ * @param[out] bytes Size the service maps.
+ * @return The section handle, or nullptr if it could not be created.
+ */
+HANDLE CreateJobSection(const ScanJob& job, std::uint64_t requestId, std::uint64_t& bytes);
+
+/**
+ * @brief Reads a job from a section received with a Scan request.
+ * @return False if the section is smaller than announced or its content is malformed.
+ */
+bool ReadJobSection(HANDLE section, std::uint64_t requestId, std::uint64_t bytes, ScanJob& job);
+
+std::string ScanMessage(std::uint64_t requestId, HANDLE section, std::uint64_t bytes);
+std::string CancelMessage(std::uint64_t requestId);
+
+/** @brief Verdict for a job; the text is left out if it is the job's own (ScanResult::jobText). */
+std::string VerdictMessage(std::uint64_t requestId, const ScanResult& result);
+std::string LogMessage(const XrdLogger::Record& record);
+
+/** @brief Checks the header of a received message; false if it is not one of ours. */
+bool ParseHeader(std::string_view message, XrdMessageHeader& header);
+
+bool ParseScan(std::string_view message, std::uint64_t& section, std::uint64_t& bytes);
+bool ParseVerdict(std::string_view message, ScanResult& result);
+bool ParseLog(std::string_view message, XrdLogger::Record& record);
+
+/**
+ * @brief Writes one message to an overlapped pipe handle and waits for it to complete.
+ *
+ * The completion is taken from event rather than the handle's completion port, so this
+ * also works on handles bound to a thread pool I/O object.
+ * @param event Manual-reset event owned by the caller, used for this write only.
+ * @param timeoutMs Gives up and cancels the write after this long.
+ */
+bool WriteMessage(HANDLE pipe, const std::string& message, HANDLE event, DWORD timeoutMs);
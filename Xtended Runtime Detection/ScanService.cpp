@@ -0,0 +1,600 @@
+/**
+ * @file ScanService.cpp
+ * @brief Implements the machine-wide scan service and its pipe server.
+ */
+
+#include "ScanService.h"
+
+#include "PatternFile.h"
+#include "ScanProtocol.h"
+
+#include <sddl.h>
+#include <algorithm>
+#include <filesystem>
+
+#pragma comment(lib, "Advapi32.lib")
+
+namespace {
+    constexpr DWORD  kPipeBufferBytes = 64 * 1024;
+    constexpr DWORD  kWriteTimeoutMs = 5000;        // An agent that stops reading is disconnected
+    constexpr size_t kReadChunk = 4096;             // Initial receive buffer per connection
+    constexpr size_t kRetainedBytes = 1024 * 1024;  // Larger buffers are freed after the message
+    constexpr size_t kMaxIdleScanners = 8;          // Scanners kept after a burst of pastes
+
+    // SYSTEM and administrators: full control; interactive users: read and write, but not
+    // FILE_CREATE_PIPE_INSTANCE, so no session can add a rogue instance to the pipe
+    constexpr const wchar_t* kPipeSecurity = L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;0x12019b;;;AU)";
+
+    void ReportStatus(SERVICE_STATUS_HANDLE handle, DWORD state, DWORD exitCode = NO_ERROR, DWORD waitHint = 0)
+    {
+        static DWORD checkPoint = 1;
+        SERVICE_STATUS status{};
+        status.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+        status.dwCurrentState = state;
+        status.dwControlsAccepted = state == SERVICE_START_PENDING ? 0 : SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN;
+        status.dwWin32ExitCode = exitCode;
+        status.dwWaitHint = waitHint;
+        status.dwCheckPoint = (state == SERVICE_RUNNING || state == SERVICE_STOPPED) ? 0 : checkPoint++;
+        SetServiceStatus(handle, &status);
+    }
+
+    /** @brief DOMAIN\user of a token, or empty. */
+    std::wstring UserOfToken(HANDLE token)
+    {
+        DWORD size = 0;
+        GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            return {};
+        std::vector<BYTE> buffer(size);
+        if (!GetTokenInformation(token, TokenUser, buffer.data(), size, &size))
+            return {};
+
+        wchar_t name[256]{}, domain[256]{};
+        DWORD nameLength = _countof(name), domainLength = _countof(domain);
+        SID_NAME_USE use;
+        if (!LookupAccountSidW(nullptr, reinterpret_cast<TOKEN_USER*>(buffer.data())->User.Sid,
+            name, &nameLength, domain, &domainLength, &use))
+            return {};
+        return std::wstring(domain, domainLength) + L"\\" + std::wstring(name, nameLength);
+    }
+
+    std::wstring ExecutableDirectory()
+    {
+        wchar_t modulePath[MAX_PATH]{};
+        const DWORD length = GetModuleFileNameW(nullptr, modulePath, MAX_PATH);
+        return std::filesystem::path(modulePath, modulePath + length).parent_path().wstring();
+    }
+} // anonymous namespace
+
+//------------------------------------------------------------------------------
+// Client: one pipe instance
+//------------------------------------------------------------------------------
+struct ScanService::Job
+{
+    ScanService*                       service = nullptr;
+    std::shared_ptr<Client>            client;
+    std::uint64_t                      requestId = 0;
+    HANDLE                             section = nullptr;  ///< Duplicated into this process
+    std::uint64_t                      bytes = 0;
+    std::shared_ptr<std::atomic<bool>> cancel;
+};
+
+/**
+ * @brief An agent's connection. Only one I/O (connect or read) is in flight at a time,
+ *        so the completion callbacks of a client never overlap; verdicts are written
+ *        from the scan callbacks under a lock.
+ */
+class ScanService::Client : public std::enable_shared_from_this<Client>
+{
+public:
+    Client(ScanService& service, HANDLE pipe)
+        : _service(service), _pipe(pipe)
+    {
+    }
+
+    ~Client()
+    {
+        if (_io)
+            CloseThreadpoolIo(_io);     // No I/O is pending once the client is dropped
+        CloseHandle(_pipe);
+        if (_writeEvent)
+            CloseHandle(_writeEvent);
+        if (_token)
+            CloseHandle(_token);
+        if (_process)
+            CloseHandle(_process);
+    }
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    /** @brief Waits for an agent to connect; false if the instance cannot be used. */
+    bool Listen()
+    {
+        _writeEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        _io = CreateThreadpoolIo(_pipe, OnIo, this, nullptr);
+        if (!_writeEvent || !_io)
+            return false;
+
+        StartThreadpoolIo(_io);
+        _overlapped = {};
+        if (!ConnectNamedPipe(_pipe, &_overlapped)) {
+            const DWORD error = GetLastError();
+            if (error == ERROR_IO_PENDING)
+                return true;
+            CancelThreadpoolIo(_io);
+            if (error != ERROR_PIPE_CONNECTED)
+                return false;
+            OnCompleted(NO_ERROR, 0);   // Connected before we waited: no completion is queued
+        }
+        return true;
+    }
+
+    /** @brief Writes a verdict; an agent that does not take it is disconnected. */
+    void Send(const std::string& message)
+    {
+        std::lock_guard<std::mutex> lock(_writeMutex);
+        if (!WriteMessage(_pipe, message, _writeEvent, kWriteTimeoutMs))
+            Disconnect();
+    }
+
+    /** @brief Breaks the connection; the pending I/O fails and the client is removed. */
+    void Disconnect()
+    {
+        DisconnectNamedPipe(_pipe);
+        CancelIoEx(_pipe, nullptr);
+    }
+
+    /** @brief Session user's impersonation token; valid once the first message arrived. */
+    HANDLE Token() const { return _token; }
+
+private:
+    static VOID CALLBACK OnIo(PTP_CALLBACK_INSTANCE, PVOID context, PVOID, ULONG result, ULONG_PTR bytes, PTP_IO)
+    {
+        static_cast<Client*>(context)->OnCompleted(result, static_cast<size_t>(bytes));
+    }
+
+    void OnCompleted(ULONG result, size_t bytes)
+    {
+        const std::shared_ptr<Client> self = shared_from_this();    // Remove() may drop the last other reference
+        try {
+            if (!_connected) {
+                _service.Listen();      // The next agent gets the next instance
+                _connected = result == NO_ERROR;
+                if (_connected && Read())
+                    return;
+                _service.Remove(this);
+                return;
+            }
+
+            if (result == NO_ERROR || result == ERROR_MORE_DATA)
+                _received += bytes;
+            if (result == NO_ERROR) {
+                const bool valid = Dispatch(std::string_view(_buffer.data(), _received));
+                _received = 0;
+                if (_buffer.size() > kRetainedBytes)
+                    std::string().swap(_buffer);
+                if (!valid)
+                    Disconnect();
+            }
+            if ((result != NO_ERROR && result != ERROR_MORE_DATA) || !Read())
+                _service.Remove(this);
+        }
+        catch (const std::exception&) {
+            Disconnect();
+            _service.Remove(this);
+        }
+    }
+
+    /** @brief Reads the next message, or the rest of one that did not fit the buffer. */
+    bool Read()
+    {
+        if (_buffer.size() < kReadChunk)
+            _buffer.resize(kReadChunk);
+        if (_received == _buffer.size()) {
+            if (_buffer.size() >= XrdMessageHeader::kMaxBytes)
+                return false;
+            _buffer.resize(std::min(_buffer.size() * 2, XrdMessageHeader::kMaxBytes));
+        }
+
+        StartThreadpoolIo(_io);
+        _overlapped = {};
+        const DWORD space = static_cast<DWORD>(_buffer.size() - _received);
+        if (!ReadFile(_pipe, _buffer.data() + _received, space, nullptr, &_overlapped)) {
+            const DWORD error = GetLastError();
+            if (error != ERROR_IO_PENDING && error != ERROR_MORE_DATA) {
+                CancelThreadpoolIo(_io);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /** @brief Handles one message; false if the agent broke the protocol. */
+    bool Dispatch(std::string_view message)
+    {
+        XrdMessageHeader header{};
+        if (!ParseHeader(message, header) || (!_process && !Identify()))
+            return false;
+
+        switch (header.type) {
+        case XrdMessageHeader::Type::Scan: {
+            auto job = std::make_unique<Job>();
+            std::uint64_t section = 0;
+            if (!ParseScan(message, section, job->bytes))
+                return false;
+
+            // Only the latest snapshot of a session matters
+            if (_cancel)
+                *_cancel = true;
+            _cancel = std::make_shared<std::atomic<bool>>(false);
+            _latestRequest = header.requestId;
+
+            job->client = shared_from_this();
+            job->requestId = header.requestId;
+            job->cancel = _cancel;
+            if (!DuplicateHandle(_process, reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(section)),
+                GetCurrentProcess(), &job->section, SECTION_MAP_READ, FALSE, 0))
+                job->section = nullptr;     // Answered as cancelled by RunJob()
+            _service.Submit(std::move(job));
+            return true;
+        }
+        case XrdMessageHeader::Type::Cancel:
+            if (_cancel && header.requestId == _latestRequest)
+                *_cancel = true;
+            return true;
+        case XrdMessageHeader::Type::Log: {
+            XrdLogger::Record record;
+            if (!ParseLog(message, record))
+                return false;
+            if (!_user.empty())
+                record.user = _user;    // The pipe knows who the agent runs as
+            _service._logger.logRecord(std::move(record));
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    /** @brief Takes the agent's process and token on its first message. */
+    bool Identify()
+    {
+        ULONG processId = 0;
+        if (!GetNamedPipeClientProcessId(_pipe, &processId))
+            return false;
+        _process = OpenProcess(PROCESS_DUP_HANDLE, FALSE, processId);
+        if (!_process)
+            return false;
+
+        if (ImpersonateNamedPipeClient(_pipe)) {
+            if (!OpenThreadToken(GetCurrentThread(), TOKEN_QUERY | TOKEN_IMPERSONATE, TRUE, &_token))
+                _token = nullptr;
+            RevertToSelf();
+        }
+        if (!_token)
+            return false;   // Files would otherwise be read as the service
+        _user = UserOfToken(_token);
+        return true;
+    }
+
+    ScanService& _service;
+    HANDLE       _pipe;
+    PTP_IO       _io = nullptr;
+    OVERLAPPED   _overlapped{};
+    bool         _connected = false;
+    std::string  _buffer;           ///< Message being received
+    size_t       _received = 0;
+    HANDLE       _process = nullptr;    ///< Agent process, to duplicate section handles from
+    HANDLE       _token = nullptr;
+    std::wstring _user;
+    std::shared_ptr<std::atomic<bool>> _cancel;     ///< Of the latest job
+    std::uint64_t _latestRequest = 0;
+    std::mutex   _writeMutex;       ///< One verdict at a time
+    HANDLE       _writeEvent = nullptr;
+};
+
+//------------------------------------------------------------------------------
+// Service control
+//------------------------------------------------------------------------------
+SERVICE_STATUS_HANDLE ScanService::s_status = nullptr;
+HANDLE                ScanService::s_stopEvent = nullptr;
+
+int ScanService::Run()
+{
+    SERVICE_TABLE_ENTRYW table[] = {
+        { const_cast<LPWSTR>(kServiceName), ServiceMain },
+        { nullptr, nullptr }
+    };
+    return StartServiceCtrlDispatcherW(table) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void WINAPI ScanService::ServiceMain(DWORD, LPWSTR*)
+{
+    s_status = RegisterServiceCtrlHandlerExW(kServiceName, OnControl, nullptr);
+    if (!s_status)
+        return;
+    s_stopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    ReportStatus(s_status, SERVICE_START_PENDING, NO_ERROR, 30000);
+
+    DWORD exitCode = NO_ERROR;
+    try {
+        ScanService service;
+        if (s_stopEvent && service.Start(ExecutableDirectory())) {
+            ReportStatus(s_status, SERVICE_RUNNING);
+            WaitForSingleObject(s_stopEvent, INFINITE);
+            ReportStatus(s_status, SERVICE_STOP_PENDING, NO_ERROR, 30000);
+            service.Stop();
+        }
+        else {
+            exitCode = ERROR_SERVICE_SPECIFIC_ERROR;
+        }
+    }
+    catch (const std::exception&) {
+        exitCode = ERROR_SERVICE_SPECIFIC_ERROR;    // The log could not be opened
+    }
+    ReportStatus(s_status, SERVICE_STOPPED, exitCode);
+}
+
+DWORD WINAPI ScanService::OnControl(DWORD control, DWORD, LPVOID, LPVOID)
+{
+    switch (control) {
+    case SERVICE_CONTROL_STOP:
+    case SERVICE_CONTROL_SHUTDOWN:
+        ReportStatus(s_status, SERVICE_STOP_PENDING, NO_ERROR, 30000);
+        SetEvent(s_stopEvent);
+        return NO_ERROR;
+    case SERVICE_CONTROL_INTERROGATE:
+        return NO_ERROR;
+    default:
+        return ERROR_CALL_NOT_IMPLEMENTED;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Public API
+//------------------------------------------------------------------------------
+ScanService::~ScanService()
+{
+    Stop();
+    if (_security)
+        LocalFree(_security);
+}
+
+bool ScanService::Start(const std::wstring& directory)
+{
+    _patternFile = (std::filesystem::path(directory) / L"patterns.txt").wstring();
+    _config = XrdConfig::Load(XrdConfig::PathFor(_patternFile));
+
+    // No desktop to show a dialog on
+    XrdLogger::Options logOptions = _config.LogOptions();
+    logOptions.reportErrors = false;
+    _logger.configure(logOptions);
+    if (_config.statsEnabled)
+        _stats.Open(true);
+
+    PatternFileResult loaded = LoadPatternFile(_patternFile);
+    for (const auto& error : loaded.errors)
+        _logger.logMessage(error);
+    for (const auto& note : loaded.notes)
+        _logger.logMessage(note);
+    if (!loaded.matcher)
+        return false;
+    _patterns.store(std::move(loaded.matcher));
+    if (!_patternWatcher.Start(_patternFile, loaded.sourceHash))
+        _logger.logMessage(L"Pattern hot reload unavailable: cannot watch the pattern directory");
+
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(kPipeSecurity, SDDL_REVISION_1, &_security, nullptr))
+        return false;
+    _running = true;
+    if (!Listen(true)) {
+        _logger.logMessage(L"Scan service: cannot create " + std::wstring(XRD_SERVICE_PIPE)
+            + L" (error " + std::to_wstring(GetLastError()) + L"); is another instance running?");
+        Stop();
+        return false;
+    }
+
+    if (_config.statsEnabled && _config.statsSummaryMinutes != 0) {
+        _statsTimer = CreateThreadpoolTimer(OnStatsTimer, this, nullptr);
+        if (_statsTimer) {
+            const DWORD periodMs = _config.statsSummaryMinutes * 60 * 1000;
+            ULARGE_INTEGER due{};
+            due.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(periodMs) * 10000);   // Relative, 100 ns
+            FILETIME dueTime{ due.LowPart, due.HighPart };
+            SetThreadpoolTimer(_statsTimer, &dueTime, periodMs, 0);
+        }
+    }
+    _logger.logMessage(L"Scan service started");
+    return true;
+}
+
+void ScanService::Stop()
+{
+    std::vector<std::shared_ptr<Client>> clients;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_running)
+            return;
+        _running = false;
+        clients = _clients;
+    }
+
+    // Every pending connect and read fails now; their callbacks remove the clients
+    for (const auto& client : clients)
+        client->Disconnect();
+    clients.clear();
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _idle.wait(lock, [this] { return _clients.empty() && _activeJobs == 0; });
+        _scanners.clear();
+    }
+
+    if (_statsTimer) {
+        SetThreadpoolTimer(_statsTimer, nullptr, 0, 0);
+        WaitForThreadpoolTimerCallbacks(_statsTimer, TRUE);
+        CloseThreadpoolTimer(_statsTimer);
+        _statsTimer = nullptr;
+    }
+    _patternWatcher.Stop();
+    if (_config.statsEnabled) {
+        const std::wstring summary = _stats.Summarize();
+        if (!summary.empty())
+            _logger.logMessage(summary);
+    }
+    _logger.logMessage(L"Scan service stopped");
+    _patterns.store(nullptr);
+    _logger.shutdown();
+}
+
+//------------------------------------------------------------------------------
+// Pipe server
+//------------------------------------------------------------------------------
+bool ScanService::Listen(bool first)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_running)
+            return false;
+    }
+
+    // The first instance fails if anyone else already serves the name
+    const DWORD openMode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0);
+    SECURITY_ATTRIBUTES attributes{ sizeof(attributes), _security, FALSE };
+    const HANDLE pipe = CreateNamedPipeW(XRD_SERVICE_PIPE, openMode,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        PIPE_UNLIMITED_INSTANCES, kPipeBufferBytes, kPipeBufferBytes, 0, &attributes);
+    if (pipe == INVALID_HANDLE_VALUE)
+        return false;
+
+    const auto client = std::make_shared<Client>(*this, pipe);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_running)
+            return false;
+        _clients.push_back(client);
+    }
+    if (client->Listen())
+        return true;
+    Remove(client.get());
+    return false;
+}
+
+void ScanService::Remove(const Client* client)
+{
+    std::shared_ptr<Client> removed;    // Destroyed outside the lock
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        const auto it = std::find_if(_clients.begin(), _clients.end(),
+            [&](const auto& known) { return known.get() == client; });
+        if (it == _clients.end())
+            return;
+        removed = std::move(*it);
+        _clients.erase(it);
+    }
+    _idle.notify_all();
+}
+
+//------------------------------------------------------------------------------
+// Scans
+//------------------------------------------------------------------------------
+void ScanService::Submit(std::unique_ptr<Job> job)
+{
+    job->service = this;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_running) {
+            ++_activeJobs;
+            if (TrySubmitThreadpoolCallback(OnScan, job.get(), nullptr)) {
+                job.release();
+                return;
+            }
+            --_activeJobs;
+        }
+    }
+    ScanResult cancelled;
+    cancelled.status = PatternMatcher::ScanStatus::Cancelled;
+    job->client->Send(VerdictMessage(job->requestId, cancelled));
+    if (job->section)
+        CloseHandle(job->section);
+}
+
+VOID CALLBACK ScanService::OnScan(PTP_CALLBACK_INSTANCE, PVOID context)
+{
+    std::unique_ptr<Job> job(static_cast<Job*>(context));
+    ScanService& service = *job->service;
+    try {
+        service.RunJob(*job);
+    }
+    catch (const std::exception&) {
+        ScanResult cancelled;
+        cancelled.status = PatternMatcher::ScanStatus::Cancelled;
+        job->client->Send(VerdictMessage(job->requestId, cancelled));
+    }
+    if (job->section)
+        CloseHandle(job->section);
+    job.reset();    // The client may go with it
+
+    {
+        std::lock_guard<std::mutex> lock(service._mutex);
+        --service._activeJobs;
+    }
+    service._idle.notify_all();
+}
+
+void ScanService::RunJob(Job& job)
+{
+    ScanJob scanJob;
+    std::unique_ptr<ScanResult> result;
+    const std::shared_ptr<const PatternMatcher> patterns = _patterns.load();
+    if (patterns && job.section && !*job.cancel &&
+        ReadJobSection(job.section, job.requestId, job.bytes, scanJob)) {
+        CloseHandle(job.section);
+        job.section = nullptr;
+
+        std::unique_ptr<JobScanner> scanner = AcquireScanner();
+        result = scanner->Scan(*patterns, scanJob, *job.cancel, job.client->Token());
+        ReleaseScanner(std::move(scanner));
+    }
+
+    // Every request gets its verdict, so the agent can release the section
+    if (!result) {
+        result = std::make_unique<ScanResult>();
+        result->status = PatternMatcher::ScanStatus::Cancelled;
+    }
+    job.client->Send(VerdictMessage(job.requestId, *result));
+}
+
+std::unique_ptr<JobScanner> ScanService::AcquireScanner()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_scanners.empty()) {
+            std::unique_ptr<JobScanner> scanner = std::move(_scanners.back());
+            _scanners.pop_back();
+            return scanner;
+        }
+    }
+    auto scanner = std::make_unique<JobScanner>();
+    scanner->SetBudget({ _config.maxScanChars, std::chrono::milliseconds(_config.maxScanMs) });
+    scanner->SetFileLimits({ _config.filesMaxBytes, _config.filesThreads });
+    if (_config.statsEnabled)
+        scanner->SetStats(&_stats);
+    return scanner;
+}
+
+void ScanService::ReleaseScanner(std::unique_ptr<JobScanner> scanner)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_scanners.size() < kMaxIdleScanners)
+        _scanners.push_back(std::move(scanner));
+}
+
+VOID CALLBACK ScanService::OnStatsTimer(PTP_CALLBACK_INSTANCE, PVOID context, PTP_TIMER)
+{
+    auto* service = static_cast<ScanService*>(context);
+    const std::wstring summary = service->_stats.Summarize();
+    if (!summary.empty())
+        service->_logger.logMessage(summary);
+}
+
+// End of ScanService.cpp
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "JobScanner.h"
+#include "PatternWatcher.h"
+#include "ScanStats.h"
+#include "XrdConfig.h"
+#include "XrdLogger.h"
+
+/**
+ * @class ScanService
+ * @brief Machine-wide scan service for terminal servers, run with --service.
+ *
+ * Holds the one compiled rule set, the pattern file watcher and the log writer of the
+ * machine; the tray process of each session runs as a thin agent that snapshots the
+ * clipboard, sends the job over the service pipe and applies the verdict (see
+ * ServiceClient and ScanProtocol.h). Connections wait on the thread pool without a
+ * thread of their own, and scans run as pool callbacks, each with a JobScanner taken
+ * from an idle pool that only grows with the number of pastes scanned at the same time,
+ * so memory and CPU follow the active pastes rather than the number of sessions.
+ *
+ * Dropped files are opened with the token of the session user, never as the service.
+ */
+class ScanService
+{
+public:
+    static constexpr const wchar_t* kServiceName = L"XrdScanService";
+
+    /**
+     * @brief Runs the process as the service until the SCM stops it.
+     * @return Exit code for wWinMain.
+     */
+    static int Run();
+
+    ScanService() = default;
+
+    /** @brief Stops the service if it is still running. */
+    ~ScanService();
+
+    ScanService(const ScanService&) = delete;
+    ScanService& operator=(const ScanService&) = delete;
+
+    /**
+     * @brief Loads the patterns and starts serving agents.
+     * @param directory Directory of patterns.txt and xrd.ini.
+     * @return False if there is nothing to scan with or the pipe is already taken.
+     * @throws std::runtime_error if the log cannot be opened.
+     */
+    bool Start(const std::wstring& directory);
+
+    /** @brief Disconnects every agent, waits for the scans in flight and closes the log. */
+    void Stop();
+
+private:
+    class Client;       ///< One pipe instance: an agent, or the instance waiting for the next one
+    struct Job;         ///< A Scan request on its way to the thread pool
+
+    static void WINAPI ServiceMain(DWORD argc, LPWSTR* argv);
+    static DWORD WINAPI OnControl(DWORD control, DWORD type, LPVOID data, LPVOID context);
+
+    /** @brief Creates the next pipe instance and waits for an agent on it. */
+    bool Listen(bool first = false);
+
+    /** @brief Forgets a client whose pipe broke; scans still running keep it alive. */
+    void Remove(const Client* client);
+
+    /** @brief Queues a Scan request; answered with a cancelled verdict if it cannot run. */
+    void Submit(std::unique_ptr<Job> job);
+
+    static VOID CALLBACK OnScan(PTP_CALLBACK_INSTANCE instance, PVOID context);
+    void RunJob(Job& job);
+
+    std::unique_ptr<JobScanner> AcquireScanner();
+    void ReleaseScanner(std::unique_ptr<JobScanner> scanner);
+
+    static VOID CALLBACK OnStatsTimer(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer);
+
+    static SERVICE_STATUS_HANDLE s_status;
+    static HANDLE                s_stopEvent;
+
+    std::wstring              _patternFile;
+    XrdConfig                 _config;
+    PatternWatcher::RuleSet   _patterns;
+    ScanStats                 _stats;
+    XrdLogger                 _logger;
+    PatternWatcher            _patternWatcher{ _patterns, _logger };
+    PSECURITY_DESCRIPTOR      _security = nullptr;     ///< Of every pipe instance
+    PTP_TIMER                 _statsTimer = nullptr;
+
+    std::mutex                _mutex;       ///< Protects everything below
+    std::condition_variable   _idle;        ///< Signalled when a client or a job is gone
+    std::vector<std::shared_ptr<Client>>     _clients;
+    std::vector<std::unique_ptr<JobScanner>> _scanners;    ///< Idle, ready for the next job
+    size_t                    _activeJobs = 0;
+    bool                      _running = false;
+};
@@ -0,0 +1,270 @@
+/**
+ * @file ScanStats.cpp
+ * @brief Implements the shared scan statistics block and its log summary.
+ */
+
+#include "ScanStats.h"
+
+#include <algorithm>
+#include <bit>
+#include <new>
+#include <sstream>
+#include <vector>
+
+namespace {
+    using Counter = XrdStatsBlock::Counter;
+
+    /** @brief Single-writer increment: no locked instruction, readers still see whole values. */
+    void Add(Counter& counter, std::uint64_t amount)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    /** @brief Increment of a counter with several writers. */
+    void AddShared(Counter& counter, std::uint64_t amount)
+    {
+        counter.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    size_t BucketOf(std::chrono::nanoseconds duration)
+    {
+        const auto micros = static_cast<std::uint64_t>(std::max<std::int64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(duration).count(), 0));
+        return std::min<size_t>(std::bit_width(micros), XrdStatsBlock::kBuckets - 1);
+    }
+
+    /** @brief Upper bound of a bucket, e.g. "<64 us", "<4 ms"; the last bucket shows its lower bound. */
+    std::wstring BucketLabel(size_t bucket)
+    {
+        const bool open = bucket == XrdStatsBlock::kBuckets - 1;
+        const std::uint64_t micros = open ? (1ULL << (bucket - 1)) : (1ULL << bucket);
+        std::wostringstream label;
+        label << (open ? L">=" : L"<");
+        if (micros < 1000)
+            label << micros << L" us";
+        else if (micros < 1000 * 1000)
+            label << micros / 1000 << L" ms";
+        else
+            label << micros / (1000 * 1000) << L" s";
+        return label.str();
+    }
+
+    /** @brief Bucket holding the given percentile of a histogram of deltas. */
+    size_t PercentileBucket(const std::uint64_t (&histogram)[XrdStatsBlock::kBuckets], std::uint64_t total,
+        double percent)
+    {
+        const auto rank = static_cast<std::uint64_t>(percent / 100.0 * static_cast<double>(total) + 0.5);
+        std::uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < XrdStatsBlock::kBuckets; ++bucket) {
+            seen += histogram[bucket];
+            if (seen >= std::max<std::uint64_t>(rank, 1))
+                return bucket;
+        }
+        return XrdStatsBlock::kBuckets - 1;
+    }
+} // anonymous namespace
+
+/** @brief Plain copy of every counter, to report the change since the previous summary. */
+struct ScanStats::Totals
+{
+    std::uint64_t scans = 0, cached = 0, partial = 0, cancelled = 0;
+    std::uint64_t automatonRuns = 0, automatonNanoseconds = 0, clipboardLocks = 0;
+    std::uint64_t listeningMicros = 0, protectedMicros = 0;
+    std::uint64_t scanMicros[XrdStatsBlock::kBuckets]{};
+    std::uint64_t lockMicros[XrdStatsBlock::kBuckets]{};
+    std::uint64_t evaluations[XrdStatsBlock::kMaxRules]{};
+    std::uint64_t nanoseconds[XrdStatsBlock::kMaxRules]{};
+    std::uint64_t hits[XrdStatsBlock::kMaxRules]{};
+
+    explicit Totals(const XrdStatsBlock& block)
+    {
+        auto read = [](const Counter& counter) { return counter.load(std::memory_order_relaxed); };
+        scans = read(block.scans);
+        cached = read(block.cached);
+        partial = read(block.partial);
+        cancelled = read(block.cancelled);
+        automatonRuns = read(block.automatonRuns);
+        automatonNanoseconds = read(block.automatonNanoseconds);
+        clipboardLocks = read(block.clipboardLocks);
+        listeningMicros = read(block.listeningMicros);
+        protectedMicros = read(block.protectedMicros);
+        for (size_t i = 0; i < XrdStatsBlock::kBuckets; ++i) {
+            scanMicros[i] = read(block.scanMicros[i]);
+            lockMicros[i] = read(block.lockMicros[i]);
+        }
+        for (size_t i = 0; i < XrdStatsBlock::kMaxRules; ++i) {
+            evaluations[i] = read(block.rules[i].evaluations);
+            nanoseconds[i] = read(block.rules[i].nanoseconds);
+            hits[i] = read(block.rules[i].hits);
+        }
+    }
+};
+
+//------------------------------------------------------------------------------
+// Constructor / Destructor
+//------------------------------------------------------------------------------
+ScanStats::ScanStats() = default;
+
+ScanStats::~ScanStats()
+{
+    if (_mapping) {
+        UnmapViewOfFile(_block);
+        CloseHandle(_mapping);
+    }
+}
+
+void ScanStats::Open(bool concurrentScans)
+{
+    if (_block)
+        return;
+    _concurrentScans = concurrentScans;
+
+    const std::wstring name = L"Local\\XrdStats." + std::to_wstring(GetCurrentProcessId());
+    _mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+        0, sizeof(XrdStatsBlock), name.c_str());
+    void* view = _mapping ? MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, sizeof(XrdStatsBlock)) : nullptr;
+    if (view) {
+        _block = new (view) XrdStatsBlock{};
+    }
+    else {
+        if (_mapping)
+            CloseHandle(_mapping);
+        _mapping = nullptr;
+        _private = std::make_unique<XrdStatsBlock>();   // Still summarized into the log
+        _block = _private.get();
+    }
+
+    _block->buckets = XrdStatsBlock::kBuckets;
+    _block->maxRules = XrdStatsBlock::kMaxRules;
+    _block->version = XrdStatsBlock::kVersion;
+    std::atomic_thread_fence(std::memory_order_release);
+    _block->magic = XrdStatsBlock::kMagic;      // Last: readers check it before anything else
+    _previous = std::make_unique<Totals>(*_block);
+}
+
+//------------------------------------------------------------------------------
+// Recording
+//------------------------------------------------------------------------------
+void ScanStats::RecordScan(std::chrono::nanoseconds duration, const PatternMatcher::ScanOutcome& outcome,
+    bool cached, const PatternMatcher::ScanProfile& profile)
+{
+    if (!_block)
+        return;
+    XrdStatsBlock& block = Block();
+    const auto add = _concurrentScans ? AddShared : Add;
+
+    add(block.scans, 1);
+    add(block.scanMicros[BucketOf(duration)], 1);
+    if (cached)
+        add(block.cached, 1);
+    if (outcome.status == PatternMatcher::ScanStatus::Partial)
+        add(block.partial, 1);
+    if (outcome.status == PatternMatcher::ScanStatus::Cancelled)
+        add(block.cancelled, 1);
+    if (outcome.rule >= 0)
+        add(block.rules[std::min<size_t>(outcome.rule, XrdStatsBlock::kMaxRules - 1)].hits, 1);
+    if (cached)
+        return;
+
+    if (profile.automaton.count() > 0) {
+        add(block.automatonRuns, 1);
+        add(block.automatonNanoseconds, profile.automaton.count());
+    }
+    for (const auto& [rule, time] : profile.fallback) {
+        auto& counters = block.rules[std::min<size_t>(rule, XrdStatsBlock::kMaxRules - 1)];
+        add(counters.evaluations, 1);
+        add(counters.nanoseconds, time.count());
+    }
+}
+
+void ScanStats::RecordClipboardLock(std::chrono::nanoseconds duration)
+{
+    if (!_block)
+        return;
+    Add(Block().clipboardLocks, 1);
+    Add(Block().lockMicros[BucketOf(duration)], 1);
+}
+
+void ScanStats::RecordStartup(std::chrono::microseconds listening, std::chrono::microseconds protecting)
+{
+    if (!_block || Block().protectedMicros.load(std::memory_order_relaxed) != 0)
+        return;
+    Block().listeningMicros.store(listening.count(), std::memory_order_relaxed);
+    Block().protectedMicros.store(std::max<std::int64_t>(protecting.count(), 1), std::memory_order_relaxed);
+}
+
+//------------------------------------------------------------------------------
+// Summary
+//------------------------------------------------------------------------------
+std::wstring ScanStats::Summarize()
+{
+    if (!_block)
+        return {};
+
+    auto current = std::make_unique<Totals>(*_block);
+    const Totals& previous = *_previous;
+    const std::uint64_t scans = current->scans - previous.scans;
+    if (scans == 0)
+        return {};
+
+    std::uint64_t scanMicros[XrdStatsBlock::kBuckets], lockMicros[XrdStatsBlock::kBuckets];
+    size_t slowest = 0;
+    for (size_t i = 0; i < XrdStatsBlock::kBuckets; ++i) {
+        scanMicros[i] = current->scanMicros[i] - previous.scanMicros[i];
+        lockMicros[i] = current->lockMicros[i] - previous.lockMicros[i];
+        if (scanMicros[i] != 0)
+            slowest = i;
+    }
+    const std::uint64_t locks = current->clipboardLocks - previous.clipboardLocks;
+
+    std::wostringstream out;
+    out << L"Scan stats: " << scans << L" scans ("
+        << current->cached - previous.cached << L" cached, "
+        << current->partial - previous.partial << L" partial, "
+        << current->cancelled - previous.cancelled << L" cancelled); latency p50 "
+        << BucketLabel(PercentileBucket(scanMicros, scans, 50)) << L", p99 "
+        << BucketLabel(PercentileBucket(scanMicros, scans, 99)) << L", max "
+        << BucketLabel(slowest);
+    if (locks != 0)
+        out << L"; clipboard held p99 " << BucketLabel(PercentileBucket(lockMicros, locks, 99));
+    out << L"; automaton " << (current->automatonNanoseconds - previous.automatonNanoseconds) / 1000
+        << L" us in " << current->automatonRuns - previous.automatonRuns << L" runs";
+    if (previous.protectedMicros == 0 && current->protectedMicros != 0) {
+        out << L"; startup: listening after " << current->listeningMicros / 1000
+            << L" ms, protected after " << current->protectedMicros / 1000 << L" ms";
+    }
+
+    // The few patterns that cost the most on their own, and every pattern that matched
+    struct Cost
+    {
+        size_t        rule;
+        std::uint64_t nanoseconds, evaluations;
+    };
+    std::vector<Cost> costs;
+    for (size_t rule = 0; rule < XrdStatsBlock::kMaxRules; ++rule) {
+        const std::uint64_t time = current->nanoseconds[rule] - previous.nanoseconds[rule];
+        if (time != 0)
+            costs.push_back({ rule, time, current->evaluations[rule] - previous.evaluations[rule] });
+    }
+    std::sort(costs.begin(), costs.end(),
+        [](const Cost& a, const Cost& b) { return a.nanoseconds > b.nanoseconds; });
+    constexpr size_t kReportedRules = 5;
+    for (size_t i = 0; i < costs.size() && i < kReportedRules; ++i) {
+        out << (i == 0 ? L"; slowest patterns: " : L", ")
+            << L"rule " << costs[i].rule << L' ' << costs[i].nanoseconds / 1000 << L" us/"
+            << costs[i].evaluations << L" runs";
+    }
+    bool anyHit = false;
+    for (size_t rule = 0; rule < XrdStatsBlock::kMaxRules; ++rule) {
+        const std::uint64_t hits = current->hits[rule] - previous.hits[rule];
+        if (hits == 0)
+            continue;
+        out << (anyHit ? L", " : L"; hits: ") << L"rule " << rule << L" x" << hits;
+        anyHit = true;
+    }
+
+    _previous = std::move(current);
+    return out.str();
+}
+
+// End of ScanStats.cpp
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "PatternMatcher.h"
+
+/**
+ * @brief Layout of the shared statistics block, mapped as Local\XrdStats.<pid>.
+ *
+ * Counters only ever grow, and the startup group is written once. Each group has a
+ * single writer thread, so it is updated without locked instructions. The scan service
+ * is the exception: several scans run at once there, so its scan group uses fetch_add.
+ * Readers (the periodic log summary, external tools) see every 64-bit value atomically,
+ * but the group as a whole is not a snapshot.
+ * Histograms count durations in power-of-two microsecond buckets: bucket 0 is below
+ * 1 us, bucket i covers [2^(i-1), 2^i) us and the last bucket everything longer.
+ */
+struct XrdStatsBlock
+{
+    static constexpr std::uint32_t kMagic = 0x53445258;    // "XRDS"
+    static constexpr std::uint32_t kVersion = 2;
+    static constexpr size_t        kBuckets = 24;
+    static constexpr size_t        kMaxRules = 512;         // Later rules share the last slot
+
+    using Counter = std::atomic<std::uint64_t>;
+
+    struct Rule
+    {
+        Counter evaluations;    ///< Runs of this pattern on its own (std::wregex patterns only)
+        Counter nanoseconds;    ///< Time of those runs
+        Counter hits;           ///< Payloads this pattern matched, scanned or from the verdict cache
+    };
+
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t buckets;
+    std::uint32_t maxRules;
+
+    // Scan worker thread
+    Counter scans;              ///< Payloads handed to the worker, including cancelled ones
+    Counter cached;             ///< Verdicts answered by the verdict cache
+    Counter partial;            ///< Scans stopped by the budget
+    Counter cancelled;          ///< Scans abandoned for newer content
+    Counter automatonRuns;
+    Counter automatonNanoseconds;
+    Counter scanMicros[kBuckets];   ///< Whole job: hash, cache lookup and scan
+
+    // Message thread
+    Counter clipboardLocks;
+    Counter lockMicros[kBuckets];   ///< OpenClipboard() to CloseClipboard() while snapshotting
+
+    // Message thread, once per process; zero until reached
+    Counter listeningMicros;    ///< Process start to the clipboard listener being registered
+    Counter protectedMicros;    ///< Process start to the first rule set scanning copies
+
+    Rule    rules[kMaxRules];
+};
+
+/**
+ * @class ScanStats
+ * @brief Always-on scan instrumentation: per-rule counters and latency histograms.
+ *
+ * The counters live in a named shared-memory block (XrdStatsBlock) so they can be read
+ * from outside the process without attaching a debugger; if the mapping cannot be
+ * created they are kept in private memory and still reach the log summary. Recording
+ * costs a few relaxed stores per scan.
+ */
+class ScanStats
+{
+public:
+    ScanStats();
+
+    /** @brief Unmaps the block. */
+    ~ScanStats();
+
+    ScanStats(const ScanStats&) = delete;
+    ScanStats& operator=(const ScanStats&) = delete;
+
+    /**
+     * @brief Creates the block; call before the scan worker starts.
+     * @param concurrentScans True if RecordScan() is called from several threads at once.
+     */
+    void Open(bool concurrentScans = false);
+
+    /**
+     * @brief Records one job of the scan worker; scan worker thread only, unless opened
+     *        for concurrent scans.
+     * @param duration Time from picking up the job to the verdict.
+     * @param outcome Verdict and status of the job.
+     * @param cached True if the verdict came from the verdict cache (profile is then ignored).
+     * @param profile Time per part of the scan, as filled by PatternMatcher::Scan().
+     */
+    void RecordScan(std::chrono::nanoseconds duration, const PatternMatcher::ScanOutcome& outcome,
+        bool cached, const PatternMatcher::ScanProfile& profile);
+
+    /** @brief Records how long the clipboard was held open; message thread only. */
+    void RecordClipboardLock(std::chrono::nanoseconds duration);
+
+    /**
+     * @brief Records the time to protection, once; message thread only.
+     * @param listening Process start to the clipboard listener being registered.
+     * @param protecting Process start to the first rule set being in place.
+     */
+    void RecordStartup(std::chrono::microseconds listening, std::chrono::microseconds protecting);
+
+    /**
+     * @brief One-line summary of the counters since the previous call, for the log.
+     *        The first summary after protection was reached also gives the startup times.
+     * @return Empty if nothing was scanned in that period.
+     */
+    std::wstring Summarize();
+
+private:
+    struct Totals;      ///< Copy of the counters at the previous summary
+
+    XrdStatsBlock& Block() { return *_block; }
+
+    HANDLE                         _mapping = nullptr;
+    XrdStatsBlock*                 _block = nullptr;    ///< View of _mapping, or _private
+    std::unique_ptr<XrdStatsBlock> _private;
+    std::unique_ptr<Totals>        _previous;
+    bool                           _concurrentScans = false;
+};
@@ -0,0 +1,154 @@
+/**
+ * @file ScanWorker.cpp
+ * @brief Implements the background scan thread used by ClipboardWatcher.
+ */
+
+#include "ScanWorker.h"
+
+//------------------------------------------------------------------------------
+// Constructor / Destructor
+//------------------------------------------------------------------------------
+ScanWorker::ScanWorker(const RuleSet& patterns)
+    : _patterns(patterns)
+{
+}
+
+ScanWorker::~ScanWorker()
+{
+    Stop();
+    if (_cancelEvent)
+        CloseHandle(_cancelEvent);
+}
+
+//------------------------------------------------------------------------------
+// Public API
+//------------------------------------------------------------------------------
+bool ScanWorker::Start(HWND target)
+{
+    if (_thread.joinable())
+        return true;
+
+    if (!_cancelEvent)
+        _cancelEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!_cancelEvent)
+        return false;
+
+    _target = target;
+    _stop = false;
+    try {
+        _thread = std::thread(&ScanWorker::Run, this);
+    }
+    catch (...) {
+        return false;
+    }
+    return true;
+}
+
+void ScanWorker::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+        _pending.reset();
+        _cancel = true;
+        if (_cancelEvent)
+            SetEvent(_cancelEvent);
+    }
+    _wake.notify_one();
+    if (_thread.joinable())
+        _thread.join();
+
+    // Results posted after the window stopped pumping would leak otherwise
+    MSG msg;
+    while (_target && PeekMessageW(&msg, _target, WM_XRD_SCANRESULT, WM_XRD_SCANRESULT, PM_REMOVE))
+        TakeResult(msg.lParam);
+    _target = nullptr;
+}
+
+void ScanWorker::Submit(ScanJob job)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stop)
+            return;
+        _pending = std::move(job);
+        _cancel = true;     // Whatever is being scanned now is already outdated
+        if (_cancelEvent)
+            SetEvent(_cancelEvent);
+    }
+    _wake.notify_one();
+}
+
+void ScanWorker::Cancel()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _pending.reset();
+    _cancel = true;
+    if (_cancelEvent)
+        SetEvent(_cancelEvent);
+}
+
+std::unique_ptr<ScanResult> ScanWorker::TakeResult(LPARAM lParam)
+{
+    return std::unique_ptr<ScanResult>(reinterpret_cast<ScanResult*>(lParam));
+}
+
+void ScanWorker::SetBudget(const PatternMatcher::ScanBudget& budget)
+{
+    _scanner.SetBudget(budget);
+}
+
+void ScanWorker::SetStats(ScanStats* stats)
+{
+    _scanner.SetStats(stats);
+}
+
+void ScanWorker::SetFileLimits(const FileScanner::Limits& limits)
+{
+    _scanner.SetFileLimits(limits);
+}
+
+void ScanWorker::SetService(ServiceClient* service)
+{
+    _service = service;
+}
+
+//------------------------------------------------------------------------------
+// Worker thread
+//------------------------------------------------------------------------------
+void ScanWorker::Run()
+{
+    for (;;) {
+        ScanJob job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [this] { return _stop || _pending.has_value(); });
+            if (_stop)
+                return;
+            job = std::move(*_pending);
+            _pending.reset();
+            _cancel = false;
+            ResetEvent(_cancelEvent);
+        }
+
+        std::unique_ptr<ScanResult> result;
+        if (_service) {
+            result = _service->Scan(job, _cancelEvent);
+        }
+        else {
+            // Pinned for the whole job; a reload publishes a new set without waiting for us
+            const std::shared_ptr<const PatternMatcher> patterns = _patterns.load();
+            if (!patterns)
+                continue;
+            result = _scanner.Scan(*patterns, job, _cancel);
+        }
+        if (!result)
+            continue;   // Cancelled: a newer snapshot is already queued
+
+        // Ownership passes to the window; on failure the result is simply dropped
+        if (PostMessageW(_target, WM_XRD_SCANRESULT, 0, reinterpret_cast<LPARAM>(result.get())))
+            result.release();
+    }
+}
+
+// End of ScanWorker.cpp
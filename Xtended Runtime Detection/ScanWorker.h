@@ -0,0 +1,102 @@
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "JobScanner.h"
+#include "PatternMatcher.h"
+#include "ScanStats.h"
+#include "ServiceClient.h"
+
+/** @brief Posted to the target window when a scan has finished; lParam owns a ScanResult. */
+constexpr UINT WM_XRD_SCANRESULT = WM_APP + 2;
+
+/**
+ * @class ScanWorker
+ * @brief Runs pattern scans on a dedicated thread so the message thread never blocks.
+ *
+ * The message thread snapshots the clipboard and calls Submit(); the worker scans the
+ * snapshot and posts WM_XRD_SCANRESULT to the target window. The low-level hooks run on
+ * the message thread too, so keeping scans off it keeps every keystroke responsive.
+ *
+ * Only the latest snapshot matters: a new Submit() replaces a job that has not started
+ * yet and cancels the scan in flight, which then posts no result. The scan itself is
+ * done by a JobScanner owned by the worker thread, or, for an agent of the scan
+ * service, by the service.
+ */
+class ScanWorker
+{
+public:
+    using RuleSet = std::atomic<std::shared_ptr<const PatternMatcher>>;
+
+    /**
+     * @brief Creates an idle worker.
+     * @param patterns Slot holding the current compiled set; must outlive the worker.
+     *                 Each job scans with the set that was current when it started.
+     */
+    explicit ScanWorker(const RuleSet& patterns);
+
+    /** @brief Stops the worker thread if it is still running. */
+    ~ScanWorker();
+
+    ScanWorker(const ScanWorker&) = delete;
+    ScanWorker& operator=(const ScanWorker&) = delete;
+
+    /**
+     * @brief Starts the worker thread.
+     * @param target Window receiving WM_XRD_SCANRESULT.
+     * @return True if the thread is running.
+     */
+    bool Start(HWND target);
+
+    /** @brief Stops and joins the worker thread; queued jobs are dropped. */
+    void Stop();
+
+    /** @brief Queues a snapshot for scanning, superseding any older job. */
+    void Submit(ScanJob job);
+
+    /** @brief Drops the queued job and cancels the scan in flight, if any. */
+    void Cancel();
+
+    /**
+     * @brief Takes ownership of the result carried by a WM_XRD_SCANRESULT message.
+     * @param lParam The message's lParam.
+     */
+    static std::unique_ptr<ScanResult> TakeResult(LPARAM lParam);
+
+    /** @brief Sets the per-scan size and time limits; call before Start(). */
+    void SetBudget(const PatternMatcher::ScanBudget& budget);
+
+    /** @brief Records every job into the given statistics; call before Start(). */
+    void SetStats(ScanStats* stats);
+
+    /** @brief Sets how much of each dropped file is scanned and by how many threads; call before Start(). */
+    void SetFileLimits(const FileScanner::Limits& limits);
+
+    /** @brief Sends every job to the scan service instead of scanning it here; call before Start(). */
+    void SetService(ServiceClient* service);
+
+private:
+    /** @brief Worker thread body. */
+    void Run();
+
+
+    const RuleSet&          _patterns;
+    JobScanner              _scanner;   ///< Owned by the worker thread
+
+    HWND                    _target = nullptr;
+    std::thread             _thread;
+    std::mutex              _mutex;     ///< Protects _pending and _stop
+    std::condition_variable _wake;
+    std::optional<ScanJob>  _pending;   ///< Latest snapshot not yet picked up
+    std::atomic<bool>       _cancel{ false };   ///< Abandons the scan in flight
+    HANDLE                  _cancelEvent = nullptr; ///< Set with _cancel; abandons the wait for the service
+    ServiceClient*          _service = nullptr;
+    bool                    _stop = false;
+};
@@ -0,0 +1,252 @@
+/**
+ * @file ServiceClient.cpp
+ * @brief Implements the agent's connections to the scan service.
+ */
+
+#include "ServiceClient.h"
+
+#include "ScanProtocol.h"
+
+#include <algorithm>
+
+namespace {
+    constexpr DWORD  kConnectTimeoutMs = 1000;      // Wait for a free pipe instance
+    constexpr DWORD  kWriteTimeoutMs = 5000;        // The service reads continuously; longer means it hangs
+    constexpr size_t kReadChunk = 4096;             // Initial receive buffer; verdicts are usually short
+    constexpr size_t kRetainedBytes = 1024 * 1024;  // Larger buffers are freed after the message
+} // anonymous namespace
+
+//------------------------------------------------------------------------------
+// Constructor / Destructor
+//------------------------------------------------------------------------------
+ServiceClient::~ServiceClient()
+{
+    for (Connection* connection : { &_scan, &_log }) {
+        Close(*connection);
+        if (connection->readEvent)
+            CloseHandle(connection->readEvent);
+        if (connection->writeEvent)
+            CloseHandle(connection->writeEvent);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Public API
+//------------------------------------------------------------------------------
+bool ServiceClient::Running()
+{
+    // A busy pipe still means the service is there
+    return WaitNamedPipeW(XRD_SERVICE_PIPE, 1) || GetLastError() == ERROR_SEM_TIMEOUT;
+}
+
+bool ServiceClient::Connect()
+{
+    return Open(_scan);
+}
+
+std::unique_ptr<ScanResult> ServiceClient::Scan(ScanJob& job, HANDLE cancel)
+{
+    if (!Open(_scan))
+        return Unscanned(job);
+
+    const std::uint64_t id = _nextRequest++;
+    std::uint64_t bytes = 0;
+    const HANDLE section = CreateJobSection(job, id, bytes);
+    if (!section)
+        return Unscanned(job);
+
+    // Kept until the verdict arrives: the service may not have duplicated it yet
+    _sections.emplace_back(id, section);
+    if (!WriteMessage(_scan.pipe, ScanMessage(id, section, bytes), _scan.writeEvent, kWriteTimeoutMs)) {
+        Close(_scan);
+        return Unscanned(job);
+    }
+
+    for (;;) {
+        if (!StartRead(_scan)) {
+            Close(_scan);
+            return Unscanned(job);
+        }
+        const HANDLE handles[] = { _scan.readEvent, cancel };
+        if (WaitForMultipleObjects(_countof(handles), handles, FALSE, INFINITE) != WAIT_OBJECT_0) {
+            // The read stays in flight; its verdict is received and dropped by the next Scan()
+            if (!WriteMessage(_scan.pipe, CancelMessage(id), _scan.writeEvent, kWriteTimeoutMs))
+                Close(_scan);
+            return nullptr;
+        }
+
+        bool complete = false;
+        if (!FinishRead(_scan, complete)) {
+            Close(_scan);
+            return Unscanned(job);
+        }
+        if (!complete)
+            continue;
+
+        const std::string_view message(_scan.buffer.data(), _scan.received);
+        _scan.received = 0;
+        XrdMessageHeader header{};
+        auto result = std::make_unique<ScanResult>();
+        if (!ParseHeader(message, header) || header.type != XrdMessageHeader::Type::Verdict ||
+            !ParseVerdict(message, *result)) {
+            Close(_scan);
+            return Unscanned(job);
+        }
+        if (_scan.buffer.size() > kRetainedBytes)
+            std::string().swap(_scan.buffer);
+
+        ReleaseSection(header.requestId);
+        if (header.requestId != id)
+            continue;   // Verdict of a job that was abandoned
+
+        // The service cancels on its own only while it stops
+        if (result->status == PatternMatcher::ScanStatus::Cancelled)
+            return Unscanned(job);
+        result->sequence = job.sequence;
+        if (result->jobText)
+            result->text = std::move(job.text);
+        return result;
+    }
+}
+
+bool ServiceClient::Log(const XrdLogger::Record& record)
+{
+    if (!Open(_log))
+        return false;
+    if (!WriteMessage(_log.pipe, LogMessage(record), _log.writeEvent, kWriteTimeoutMs)) {
+        Close(_log);
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Connections
+//------------------------------------------------------------------------------
+bool ServiceClient::Open(Connection& connection)
+{
+    if (connection.pipe != INVALID_HANDLE_VALUE)
+        return true;
+
+    if (!connection.readEvent)
+        connection.readEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!connection.writeEvent)
+        connection.writeEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!connection.readEvent || !connection.writeEvent)
+        return false;
+
+    // Impersonation level: the service opens dropped files as the session user
+    constexpr DWORD kFlags = FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT | SECURITY_IMPERSONATION;
+    HANDLE pipe = CreateFileW(XRD_SERVICE_PIPE, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+        OPEN_EXISTING, kFlags, nullptr);
+    if (pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY &&
+        WaitNamedPipeW(XRD_SERVICE_PIPE, kConnectTimeoutMs)) {
+        pipe = CreateFileW(XRD_SERVICE_PIPE, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+            OPEN_EXISTING, kFlags, nullptr);
+    }
+    if (pipe == INVALID_HANDLE_VALUE)
+        return false;
+
+    // Only a service runs in session 0; anything else squatting on the name is ignored
+    ULONG server = 0;
+    DWORD session = 0;
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    if (!GetNamedPipeServerProcessId(pipe, &server) || !ProcessIdToSessionId(server, &session) ||
+        session != 0 || !SetNamedPipeHandleState(pipe, &mode, nullptr, nullptr)) {
+        CloseHandle(pipe);
+        return false;
+    }
+    connection.pipe = pipe;
+    connection.received = 0;
+    return true;
+}
+
+void ServiceClient::Close(Connection& connection)
+{
+    if (connection.pipe != INVALID_HANDLE_VALUE) {
+        // The buffer must outlive a read that is still in flight
+        if (connection.readPending) {
+            DWORD bytes = 0;
+            CancelIoEx(connection.pipe, &connection.read);
+            GetOverlappedResult(connection.pipe, &connection.read, &bytes, TRUE);
+            connection.readPending = false;
+        }
+        CloseHandle(connection.pipe);
+        connection.pipe = INVALID_HANDLE_VALUE;
+    }
+    connection.received = 0;
+
+    // No verdict will come for these any more
+    if (&connection == &_scan) {
+        for (const auto& [id, section] : _sections)
+            CloseHandle(section);
+        _sections.clear();
+    }
+}
+
+bool ServiceClient::StartRead(Connection& connection)
+{
+    if (connection.readPending)
+        return true;
+
+    if (connection.buffer.size() < kReadChunk)
+        connection.buffer.resize(kReadChunk);
+    if (connection.received == connection.buffer.size()) {
+        if (connection.buffer.size() >= XrdMessageHeader::kMaxBytes)
+            return false;
+        connection.buffer.resize(std::min(connection.buffer.size() * 2, XrdMessageHeader::kMaxBytes));
+    }
+
+    connection.read = {};
+    connection.read.hEvent = connection.readEvent;
+    ResetEvent(connection.readEvent);
+    const DWORD space = static_cast<DWORD>(connection.buffer.size() - connection.received);
+    if (!ReadFile(connection.pipe, connection.buffer.data() + connection.received, space, nullptr, &connection.read)) {
+        const DWORD error = GetLastError();
+        if (error != ERROR_IO_PENDING && error != ERROR_MORE_DATA)
+            return false;
+    }
+    connection.readPending = true;    // Also when it completed at once: the event is set then
+    return true;
+}
+
+bool ServiceClient::FinishRead(Connection& connection, bool& complete)
+{
+    DWORD bytes = 0;
+    connection.readPending = false;
+    complete = GetOverlappedResult(connection.pipe, &connection.read, &bytes, FALSE) != FALSE;
+    if (!complete && GetLastError() != ERROR_MORE_DATA)
+        return false;
+    connection.received += bytes;
+    return true;
+}
+
+void ServiceClient::ReleaseSection(std::uint64_t requestId)
+{
+    const auto it = std::find_if(_sections.begin(), _sections.end(),
+        [&](const auto& sent) { return sent.first == requestId; });
+    if (it != _sections.end()) {
+        CloseHandle(it->second);
+        _sections.erase(it);
+    }
+}
+
+std::unique_ptr<ScanResult> ServiceClient::Unscanned(ScanJob& job)
+{
+    auto result = std::make_unique<ScanResult>();
+    result->sequence = job.sequence;
+    if (!job.image.empty()) {
+        // The image was analysed here already; that finding still stands
+        result->image = true;
+        result->text = std::move(job.image);
+        result->incomplete = true;
+        return result;
+    }
+    result->status = PatternMatcher::ScanStatus::Partial;
+    result->text = std::move(job.text);
+    result->jobText = true;
+    result->incomplete = job.truncated || !job.files.empty();
+    return result;
+}
+
+// End of ServiceClient.cpp
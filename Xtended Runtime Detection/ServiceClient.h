@@ -0,0 +1,85 @@
+#pragma once
+
+#include <windows.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "JobScanner.h"
+#include "XrdLogger.h"
+
+/**
+ * @class ServiceClient
+ * @brief The agent's side of the scan service pipe (see ScanProtocol.h).
+ *
+ * Scans and log records use separate connections, since they are sent from different
+ * threads: Scan() from the scan worker, Log() from the logger's writer thread. A broken
+ * connection is reopened on the next call. The service is only trusted if the pipe is
+ * served from session 0, so a user process cannot pose as it by creating the pipe first.
+ */
+class ServiceClient
+{
+public:
+    ServiceClient() = default;
+
+    /** @brief Closes both connections. */
+    ~ServiceClient();
+
+    ServiceClient(const ServiceClient&) = delete;
+    ServiceClient& operator=(const ServiceClient&) = delete;
+
+    /** @brief True if a scan service is listening; a hint only, nothing is verified. */
+    static bool Running();
+
+    /** @brief Opens the scan connection now; false if no trusted service answers. */
+    bool Connect();
+
+    /**
+     * @brief Has the service scan a job and waits for the verdict.
+     * @param job Snapshot; its text is moved into the result if the user has to judge it.
+     * @param cancel Event that abandons the wait; the service is told to stop as well.
+     * @return The verdict; nullptr if cancelled. Without a service the result is Partial,
+     *         so the content is handled like a scan that ran out of budget.
+     */
+    std::unique_ptr<ScanResult> Scan(ScanJob& job, HANDLE cancel);
+
+    /** @brief Sends a record to the service's log; false if it could not be delivered. */
+    bool Log(const XrdLogger::Record& record);
+
+private:
+    struct Connection
+    {
+        HANDLE      pipe = INVALID_HANDLE_VALUE;
+        HANDLE      readEvent = nullptr;    ///< Manual reset, for read
+        HANDLE      writeEvent = nullptr;   ///< Manual reset, for WriteMessage()
+        OVERLAPPED  read{};
+        bool        readPending = false;    ///< A read is in flight into buffer
+        std::string buffer;                 ///< Message being received
+        size_t      received = 0;           ///< Bytes of buffer filled by completed reads
+    };
+
+    bool Open(Connection& connection);
+    void Close(Connection& connection);
+
+    /** @brief Issues or continues the read of the next message; false if the pipe broke. */
+    bool StartRead(Connection& connection);
+
+    /**
+     * @brief Finishes the read in flight once readEvent is signalled.
+     * @param[out] complete True if buffer now holds a whole message.
+     */
+    bool FinishRead(Connection& connection, bool& complete);
+
+    /** @brief Closes the section of a request once its verdict has arrived. */
+    void ReleaseSection(std::uint64_t requestId);
+
+    /** @brief Verdict used while the service cannot be reached. */
+    static std::unique_ptr<ScanResult> Unscanned(ScanJob& job);
+
+    Connection    _scan;
+    Connection    _log;
+    std::uint64_t _nextRequest = 1;
+    std::vector<std::pair<std::uint64_t, HANDLE>> _sections;   ///< Sent jobs without a verdict yet
+};
@@ -0,0 +1,113 @@
+/**
+ * @file XrdConfig.cpp
+ * @brief Loads xrd.ini via the profile API.
+ */
+
+#include "XrdConfig.h"
+
+#include <filesystem>
+
+XrdConfig XrdConfig::Load(const std::wstring& iniPath)
+{
+    XrdConfig config;
+    const wchar_t* file = iniPath.c_str();
+
+    config.maxScanChars = GetPrivateProfileIntW(L"Scan", L"MaxChars",
+        static_cast<INT>(config.maxScanChars), file);
+    config.maxScanMs = GetPrivateProfileIntW(L"Scan", L"MaxTimeMs",
+        static_cast<INT>(config.maxScanMs), file);
+    config.promptOnPartial = GetPrivateProfileIntW(L"Scan", L"PromptOnPartial",
+        config.promptOnPartial ? 1 : 0, file) != 0;
+
+    wchar_t gate[16]{};
+    GetPrivateProfileStringW(L"Paste", L"Gate", L"hooks", gate, _countof(gate), file);
+    config.pasteRenderGate = CompareStringOrdinal(gate, -1, L"render", -1, TRUE) == CSTR_EQUAL;
+    config.pasteTimeoutMs = GetPrivateProfileIntW(L"Paste", L"TimeoutMs",
+        static_cast<INT>(config.pasteTimeoutMs), file);
+
+    config.logFlushEvents = GetPrivateProfileIntW(L"Log", L"FlushEvents",
+        static_cast<INT>(config.logFlushEvents), file);
+    config.logFlushMs = GetPrivateProfileIntW(L"Log", L"FlushIntervalMs",
+        static_cast<INT>(config.logFlushMs), file);
+    config.logSyncToDisk = GetPrivateProfileIntW(L"Log", L"SyncToDisk",
+        config.logSyncToDisk ? 1 : 0, file) != 0;
+
+    wchar_t format[16]{};
+    GetPrivateProfileStringW(L"Log", L"Format", L"text", format, _countof(format), file);
+    config.logJsonLines = CompareStringOrdinal(format, -1, L"json", -1, TRUE) == CSTR_EQUAL;
+    config.logInlineContentChars = GetPrivateProfileIntW(L"Log", L"InlineContentChars",
+        static_cast<INT>(config.logInlineContentChars), file);
+    config.logMaxSizeMB = GetPrivateProfileIntW(L"Log", L"MaxSizeMB",
+        static_cast<INT>(config.logMaxSizeMB), file);
+    config.logKeepSegments = GetPrivateProfileIntW(L"Log", L"KeepSegments",
+        static_cast<INT>(config.logKeepSegments), file);
+    config.logKeepDays = GetPrivateProfileIntW(L"Log", L"KeepDays",
+        static_cast<INT>(config.logKeepDays), file);
+
+    config.memoryBounded = GetPrivateProfileIntW(L"Memory", L"Bounded",
+        config.memoryBounded ? 1 : 0, file) != 0;
+    config.memoryMaxContentMB = GetPrivateProfileIntW(L"Memory", L"MaxContentMB",
+        static_cast<INT>(config.memoryMaxContentMB), file);
+    config.memoryIdleTrimMs = GetPrivateProfileIntW(L"Memory", L"IdleTrimMs",
+        static_cast<INT>(config.memoryIdleTrimMs), file);
+
+    config.statsEnabled = GetPrivateProfileIntW(L"Stats", L"Enabled",
+        config.statsEnabled ? 1 : 0, file) != 0;
+    config.statsSummaryMinutes = GetPrivateProfileIntW(L"Stats", L"SummaryMinutes",
+        static_cast<INT>(config.statsSummaryMinutes), file);
+
+    config.formatsHtml = GetPrivateProfileIntW(L"Formats", L"Html",
+        config.formatsHtml ? 1 : 0, file) != 0;
+    config.formatsRtf = GetPrivateProfileIntW(L"Formats", L"Rtf",
+        config.formatsRtf ? 1 : 0, file) != 0;
+    config.formatsAnsi = GetPrivateProfileIntW(L"Formats", L"Text",
+        config.formatsAnsi ? 1 : 0, file) != 0;
+    config.formatsMaxBytes = GetPrivateProfileIntW(L"Formats", L"MaxBytes",
+        static_cast<INT>(config.formatsMaxBytes), file);
+
+    config.filesEnabled = GetPrivateProfileIntW(L"Files", L"Scan",
+        config.filesEnabled ? 1 : 0, file) != 0;
+    config.filesMaxBytes = GetPrivateProfileIntW(L"Files", L"MaxBytesPerFile",
+        static_cast<INT>(config.filesMaxBytes), file);
+    config.filesMaxFiles = GetPrivateProfileIntW(L"Files", L"MaxFiles",
+        static_cast<INT>(config.filesMaxFiles), file);
+    config.filesThreads = GetPrivateProfileIntW(L"Files", L"Threads",
+        static_cast<INT>(config.filesThreads), file);
+
+    config.imageEnabled = GetPrivateProfileIntW(L"Image", L"Analyze",
+        config.imageEnabled ? 1 : 0, file) != 0;
+    config.imageMaxSampleKB = GetPrivateProfileIntW(L"Image", L"MaxSampleKB",
+        static_cast<INT>(config.imageMaxSampleKB), file);
+
+    wchar_t mode[16]{};
+    GetPrivateProfileStringW(L"Service", L"Mode", L"auto", mode, _countof(mode), file);
+    if (CompareStringOrdinal(mode, -1, L"local", -1, TRUE) == CSTR_EQUAL)
+        config.serviceMode = ServiceMode::Local;
+    else if (CompareStringOrdinal(mode, -1, L"agent", -1, TRUE) == CSTR_EQUAL)
+        config.serviceMode = ServiceMode::Agent;
+
+    config.fastStart = GetPrivateProfileIntW(L"Startup", L"Fast",
+        config.fastStart ? 1 : 0, file) != 0;
+    return config;
+}
+
+XrdLogger::Options XrdConfig::LogOptions() const
+{
+    XrdLogger::Options options;
+    options.format = logJsonLines ? XrdLogger::Format::JsonLines : XrdLogger::Format::Text;
+    options.inlineContentChars = logInlineContentChars;
+    if (logMaxSizeMB != 0)
+        options.maxLogBytes = static_cast<std::uint64_t>(logMaxSizeMB) * 1024 * 1024;
+    options.retention = { logKeepSegments, logKeepDays };
+    options.flush = { logFlushEvents, logFlushMs, logSyncToDisk };
+    options.releaseBuffers = memoryBounded;
+    options.deferOpen = fastStart;
+    return options;
+}
+
+std::wstring XrdConfig::PathFor(const std::wstring& patternFile)
+{
+    return (std::filesystem::path(patternFile).parent_path() / L"xrd.ini").wstring();
+}
+
+// End of XrdConfig.cpp
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+
+#include "XrdLogger.h"
+
+/**
+ * @brief Tunables read from xrd.ini next to patterns.txt.
+ *
+ * Every key is optional; a missing file or key keeps the default below.
+ *
+ * @code
+ * [Scan]
+ * MaxChars=8388608      ; characters scanned per clipboard update (0 = unlimited)
+ * MaxTimeMs=500         ; wall time per scan (0 = unlimited)
+ * PromptOnPartial=1     ; 1 = ask the user about content that was not fully scanned
+ *
+ * [Paste]
+ * Gate=hooks            ; hooks, or render: no input hooks after "Keep", the paste is seen by
+ *                       ; delayed rendering (only the text format is offered again)
+ * TimeoutMs=60000       ; revoke an unused "Keep" and clear the clipboard (0 = wait forever)
+ *
+ * [Log]
+ * FlushEvents=1         ; write the log once this many records are queued (0 = not by count)
+ * FlushIntervalMs=1000  ; write queued records at least this often (0 = not by time)
+ * SyncToDisk=0          ; 1 = force every write to disk; otherwise only on exit
+ * Format=text           ; text, or json for one JSON object per line (xrd_log_file.jsonl)
+ * InlineContentChars=4096 ; longer content is stored once in LogFiles\content (0 = always inline)
+ * MaxSizeMB=100         ; rotate the log once it grows beyond this
+ * KeepSegments=0        ; rotated segments to keep, newest first (0 = all)
+ * KeepDays=0            ; delete rotated segments older than this (0 = never)
+ *
+ * [Memory]
+ * Bounded=0             ; 1 = cap the clipboard copy held in memory and give memory back when idle
+ * MaxContentMB=64       ; with Bounded=1: text beyond this is neither held nor scanned (0 = no cap)
+ * IdleTrimMs=30000      ; with Bounded=1: trim the working set this long after the last decision (0 = never)
+ *
+ * [Stats]
+ * Enabled=1             ; per-rule counters and latency histograms in Local\XrdStats.<pid>
+ * SummaryMinutes=60     ; write a summary of the counters to the log this often (0 = only on exit)
+ *
+ * [Formats]
+ * Html=1                ; also scan the HTML Format of a copy (text, comments, attribute values)
+ * Rtf=1                 ; also scan the Rich Text Format of a copy
+ * Text=1                ; also scan CF_TEXT when an application put it there itself
+ * MaxBytes=16777216     ; raw bytes taken per format; a larger one counts as partially scanned
+ *
+ * [Files]
+ * Scan=1                ; scan text and script files copied in Explorer (CF_HDROP)
+ * MaxBytesPerFile=1048576 ; bytes read from the start of each file
+ * MaxFiles=64           ; files scanned per copy; a larger drop counts as partially scanned
+ * Threads=4             ; files scanned at the same time
+ *
+ * [Image]
+ * Analyze=0             ; 1 = check copied bitmaps (CF_DIB) for LSB steganography
+ * MaxSampleKB=1024      ; pixel data read per bitmap; larger images are sampled by rows
+ *
+ * [Service]
+ * Mode=auto             ; auto: use the scan service if it runs, else scan in this process;
+ *                       ; agent: always use the service; local: never use it
+ *
+ * [Startup]
+ * Fast=0                ; 1 = listen to the clipboard first, compile patterns.txt in the
+ *                       ; background when patterns.xrdc is out of date, and open the log
+ *                       ; with its first record
+ * @endcode
+ *
+ * The scan service reads the xrd.ini next to its own executable. For agents, the scan
+ * limits (MaxChars, MaxTimeMs, MaxBytesPerFile, Threads) and the log are the service's.
+ */
+struct XrdConfig
+{
+    // [Scan]
+    size_t maxScanChars = 8ULL * 1024 * 1024;   ///< 16 MB of UTF-16 text
+    DWORD  maxScanMs = 500;
+    bool   promptOnPartial = true;              ///< Treat partially scanned content as suspicious
+
+    // [Paste]
+    bool   pasteRenderGate = false;
+    DWORD  pasteTimeoutMs = 60000;
+
+    // [Log]
+    size_t logFlushEvents = 1;
+    DWORD  logFlushMs = 1000;
+    bool   logSyncToDisk = false;
+    bool   logJsonLines = false;
+    size_t logInlineContentChars = 4096;
+    DWORD  logMaxSizeMB = 100;
+    size_t logKeepSegments = 0;
+    DWORD  logKeepDays = 0;
+
+    // [Memory]
+    bool   memoryBounded = false;
+    DWORD  memoryMaxContentMB = 64;
+    DWORD  memoryIdleTrimMs = 30000;
+
+    // [Stats]
+    bool   statsEnabled = true;
+    DWORD  statsSummaryMinutes = 60;
+
+    // [Formats]
+    bool   formatsHtml = true;
+    bool   formatsRtf = true;
+    bool   formatsAnsi = true;
+    DWORD  formatsMaxBytes = 16 * 1024 * 1024;
+
+    // [Files]
+    bool   filesEnabled = true;
+    DWORD  filesMaxBytes = 1024 * 1024;
+    DWORD  filesMaxFiles = 64;
+    DWORD  filesThreads = 4;
+
+    // [Image]
+    bool   imageEnabled = false;                ///< Off by default: costs every screenshot copy
+    DWORD  imageMaxSampleKB = 1024;
+
+    // [Service]
+    enum class ServiceMode { Auto, Local, Agent };
+    ServiceMode serviceMode = ServiceMode::Auto;
+
+    // [Startup]
+    bool   fastStart = false;                   ///< Off by default: a bad log directory then only shows on first use
+
+    /**
+     * @brief Reads the configuration file.
+     * @param iniPath Full path of xrd.ini.
+     */
+    static XrdConfig Load(const std::wstring& iniPath);
+
+    /** @brief Logger options of the [Log] and [Memory] sections. */
+    XrdLogger::Options LogOptions() const;
+
+    /** @brief Path of xrd.ini in the directory of the given pattern file. */
+    static std::wstring PathFor(const std::wstring& patternFile);
+};
@@ -1,52 +1,293 @@
 ﻿// XrdLogger.cpp
 #include "XrdLogger.h"
 #include <windows.h>
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
 #include <sstream>
 #include <iomanip>
 
+#if defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define XRD_SSE2_UTF8 1
+#endif
+
 //----------------------------------------------------------------------------
-// Helper: Convert std::wstring → UTF-8 std::string
+// Helper: Encode UTF-16 [src, end) as UTF-8 at dst (room for 3 bytes per unit);
+// returns the new end. Unpaired surrogates become U+FFFD, as with WideCharToMultiByte.
 //----------------------------------------------------------------------------
-static std::string to_utf8(const std::wstring& w) {
-    if (w.empty()) return {};
-    int size_needed = ::WideCharToMultiByte(
-        CP_UTF8, 0,
-        w.data(), (int)w.size(),
-        nullptr, 0,
-        nullptr, nullptr
-    );
-    std::string s(size_needed, '\0');
-    ::WideCharToMultiByte(
-        CP_UTF8, 0,
-        w.data(), (int)w.size(),
-        s.data(), size_needed,
-        nullptr, nullptr
-    );
-    return s;
+static char* encode_utf8(const wchar_t* src, const wchar_t* end, char* dst) {
+    while (src < end) {
+#ifdef XRD_SSE2_UTF8
+        // Most payloads are ASCII shell commands: narrow 16 units per step
+        static_assert(sizeof(wchar_t) == 2, "UTF-16 wchar_t expected");
+        const __m128i nonAscii = _mm_set1_epi16(static_cast<short>(0xFF80));
+        while (end - src >= 16) {
+            const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+            const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8));
+            const __m128i high = _mm_and_si128(_mm_or_si128(lo, hi), nonAscii);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xFFFF)
+                break;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_packus_epi16(lo, hi));
+            src += 16;
+            dst += 16;
+        }
+        if (src == end) break;
+#endif
+        const unsigned c = static_cast<unsigned>(*src++);
+        if (c < 0x80) {
+            *dst++ = static_cast<char>(c);
+        }
+        else if (c < 0x800) {
+            *dst++ = static_cast<char>(0xC0 | (c >> 6));
+            *dst++ = static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if (IS_HIGH_SURROGATE(c) && src < end && IS_LOW_SURROGATE(*src)) {
+            const unsigned cp = 0x10000 + ((c - 0xD800) << 10) + (static_cast<unsigned>(*src++) - 0xDC00);
+            *dst++ = static_cast<char>(0xF0 | (cp >> 18));
+            *dst++ = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            *dst++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            *dst++ = static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        else {
+            const unsigned cp = (c >= 0xD800 && c <= 0xDFFF) ? 0xFFFD : c;
+            *dst++ = static_cast<char>(0xE0 | (cp >> 12));
+            *dst++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            *dst++ = static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+    return dst;
 }
 
 //----------------------------------------------------------------------------
-// Constructor
+// Helper: Append UTF-16 text as UTF-8, converting straight into the batch buffer.
+// Works in bounded chunks so the buffer grows by at most 3 bytes per unit of one
+// chunk at a time; once it has reached its working size nothing is allocated.
 //----------------------------------------------------------------------------
-XrdLogger::XrdLogger() {
-    // Defer heavy setup until first logEvent
-    std::call_once(_initFlag, [this]() {
-        ensureInitialized();
-        _initialized = true;
-        });
+static void append_utf8(std::string& out, std::wstring_view w) {
+    constexpr size_t kChunk = 16 * 1024;
+    size_t pos = 0;
+    while (pos < w.size()) {
+        size_t end = std::min(w.size(), pos + kChunk);
+        if (end < w.size() && IS_HIGH_SURROGATE(w[end - 1]))
+            ++end;      // keep a surrogate pair in one chunk
+        const size_t offset = out.size();
+        out.resize(offset + (end - pos) * 3);
+        char* last = encode_utf8(w.data() + pos, w.data() + end, out.data() + offset);
+        out.resize(last - out.data());
+        pos = end;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Helper: Append an unsigned number in decimal
+//----------------------------------------------------------------------------
+static void append_number(std::string& out, std::uint64_t value) {
+    char digits[20];
+    const auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr);
+}
+
+//----------------------------------------------------------------------------
+// Helper: Write a whole buffer to an append handle
+//----------------------------------------------------------------------------
+static bool write_all(HANDLE file, const std::string& bytes) {
+    if (file == INVALID_HANDLE_VALUE) return false;
+    for (size_t offset = 0; offset < bytes.size(); ) {
+        const DWORD chunk = static_cast<DWORD>(std::min<size_t>(bytes.size() - offset, 1u << 30));
+        DWORD written = 0;
+        if (!::WriteFile(file, bytes.data() + offset, chunk, &written, nullptr) || written != chunk)
+            return false;
+        offset += written;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// Helper: Leading part of spilled content, not ending inside a surrogate pair
+//----------------------------------------------------------------------------
+static std::wstring_view previewOf(std::wstring_view w, size_t length) {
+    if (w.size() <= length) return w;
+    if (length > 0 && IS_HIGH_SURROGATE(w[length - 1])) --length;
+    return w.substr(0, length);
+}
+
+//----------------------------------------------------------------------------
+// Helper: Append UTF-16 text as a quoted, escaped JSON string
+//----------------------------------------------------------------------------
+static bool needs_json_escape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+static void append_json_string(std::string& out, std::wstring_view w) {
+    out += '"';
+    const size_t start = out.size();
+    append_utf8(out, w);
+
+    // Most text needs no escaping; otherwise widen in place from the back
+    size_t extra = 0;
+    for (size_t i = start; i < out.size(); ++i) {
+        const auto c = static_cast<unsigned char>(out[i]);
+        if (needs_json_escape(c))
+            extra += (c == '"' || c == '\\' || c == '\n' || c == '\r' || c == '\t') ? 1 : 5;
+    }
+    if (extra != 0) {
+        constexpr char kHex[] = "0123456789abcdef";
+        size_t src = out.size();
+        out.resize(out.size() + extra);
+        size_t dst = out.size();
+        while (src > start) {
+            const auto c = static_cast<unsigned char>(out[--src]);
+            if (!needs_json_escape(c)) { out[--dst] = static_cast<char>(c); continue; }
+            switch (c) {
+            case '"':  out[--dst] = '"';  break;
+            case '\\': out[--dst] = '\\'; break;
+            case '\n': out[--dst] = 'n';  break;
+            case '\r': out[--dst] = 'r';  break;
+            case '\t': out[--dst] = 't';  break;
+            default:
+                out[--dst] = kHex[c & 0xF];
+                out[--dst] = kHex[c >> 4];
+                out[--dst] = '0';
+                out[--dst] = '0';
+                out[--dst] = 'u';
+            }
+            out[--dst] = '\\';
+        }
+    }
+    out += '"';
+}
+
+//----------------------------------------------------------------------------
+// Constructor / Destructor
+//----------------------------------------------------------------------------
+XrdLogger::XrdLogger()
+    : _ring(std::make_unique<Slot[]>(RING_CAPACITY))
+{
+    static_assert((RING_CAPACITY & (RING_CAPACITY - 1)) == 0, "RING_CAPACITY must be a power of two");
+    for (size_t i = 0; i < RING_CAPACITY; ++i)
+        _ring[i].sequence.store(i, std::memory_order_relaxed);
+
+    // Heavy setup is deferred to configure() or the first record
+}
+
+XrdLogger::~XrdLogger()
+{
+    shutdown();
+    if (_file != INVALID_HANDLE_VALUE)
+        CloseHandle(_file);
+    if (_wakeEvent)
+        CloseHandle(_wakeEvent);
+    if (_stopEvent)
+        CloseHandle(_stopEvent);
 }
 
 //----------------------------------------------------------------------------
 // Public API
 //----------------------------------------------------------------------------
-void XrdLogger::logEvent(const std::wstring& user,
-    const std::wstring& host,
-    const std::wstring& sourceApp,
-    const std::wstring& destApp,
+void XrdLogger::configure(const Options& options)
+{
+    _flushEvents = options.flush.everyEvents;
+    _flushMs = options.flush.everyMs;
+    _syncToDisk = options.flush.syncToDisk;
+
+    if (!_initialized && !_configured) {
+        // Called before any producer runs; with deferOpen the first record initializes
+        _format = options.format;
+        _inlineContentChars = options.inlineContentChars;
+        _maxLogBytes = options.maxLogBytes;
+        _retention = options.retention;
+        _releaseBuffers = options.releaseBuffers;
+        _reportErrors = options.reportErrors;
+        _forward = options.forward;
+        _deferOpen = options.deferOpen;
+        _perSession = options.perSession;
+        _configured = true;
+        if (!_deferOpen) {
+            std::call_once(_initFlag, [this]() {
+                ensureInitialized();
+                _initialized = true;
+                });
+        }
+    }
+    else if (_wakeEvent) {
+        SetEvent(_wakeEvent);   // re-evaluate the wait timeout
+    }
+}
+
+void XrdLogger::logEvent(std::wstring_view user,
+    std::wstring_view host,
+    std::wstring_view sourceApp,
+    std::wstring_view destApp,
     std::wstring content,
-    const std::wstring& action)
+    std::wstring_view action)
+{
+    // Cap content length to avoid out-of-memory or huge logs
+    const auto time = std::chrono::system_clock::now();
+    const bool truncated = content.size() > MAX_CONTENT_LENGTH;
+    if (truncated)
+        content.resize(MAX_CONTENT_LENGTH);
+
+    // Straight into the slot: the content is moved, the short fields reuse the capacity
+    // of its strings; formatting happens on the writer thread
+    submit([&](Record& record) {
+        record.time = time;
+        record.user.assign(user);
+        record.host.assign(host);
+        record.sourceApp.assign(sourceApp);
+        record.destApp.assign(destApp);
+        record.content = std::move(content);
+        record.action.assign(action);
+        record.truncated = truncated;
+        record.isMessage = false;
+        });
+}
+
+void XrdLogger::logMessage(std::wstring_view message)
+{
+    const auto time = std::chrono::system_clock::now();
+    submit([&](Record& record) {
+        record.time = time;
+        record.user.clear();
+        record.host.clear();
+        record.sourceApp.clear();
+        record.destApp.clear();
+        record.content.assign(message);
+        record.action.clear();
+        record.truncated = false;
+        record.isMessage = true;
+        });
+}
+
+void XrdLogger::logRecord(Record record)
+{
+    if (record.content.size() > MAX_CONTENT_LENGTH) {
+        record.content.resize(MAX_CONTENT_LENGTH);
+        record.truncated = true;
+    }
+    submit([&](Record& slot) { slot = std::move(record); });
+}
+
+void XrdLogger::shutdown()
+{
+    if (_writer.joinable()) {
+        SetEvent(_stopEvent);
+        _writer.join();     // the writer drains the ring and syncs the file before it exits
+    }
+    _stopped = true;
+    _archiver.Stop();       // an unfinished segment is compressed on the next start
+
+    // Anything pushed while the writer was exiting
+    std::lock_guard lock(_fileMutex);
+    drainAndWrite(true);
+}
+
+//----------------------------------------------------------------------------
+// Queue
+//----------------------------------------------------------------------------
+template <typename Fill>
+void XrdLogger::submit(Fill&& fill)
 {
-    // Ensure we've initialized once
     if (!_initialized) {
         std::call_once(_initFlag, [this]() {
             ensureInitialized();
@@ -54,46 +295,279 @@ void XrdLogger::logEvent(const std::wstring& user,
             });
     }
 
-    // Cap content length to avoid out-of-memory or huge logs
-    if (content.size() > MAX_CONTENT_LENGTH) {
-        content.resize(MAX_CONTENT_LENGTH);
-        content += L"\n…(truncated)…\n";
+    if (_stopped) {
+        Record record;
+        fill(record);
+        std::lock_guard lock(_fileMutex);
+        deliverRecord(record);
+        writeBatch(true);
+        return;
+    }
+
+    // Counted before the push so the writer never sees more records than _queued
+    const size_t queued = ++_queued;
+    if (!tryPush(fill)) {
+        --_queued;
+        ++_dropped;         // Disk stalled long enough to fill the ring
+        SetEvent(_wakeEvent);
+        return;
     }
 
-    try {
+    const size_t everyEvents = _flushEvents;
+    if ((everyEvents != 0 && queued >= everyEvents) || queued >= RING_CAPACITY / 2)
+        SetEvent(_wakeEvent);
+}
+
+template <typename Fill>
+bool XrdLogger::tryPush(Fill& fill)
+{
+    size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot& slot = _ring[pos & (RING_CAPACITY - 1)];
+        const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        const auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+        if (diff == 0) {
+            if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                fill(slot.record);
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0) {
+            return false;   // Full: the writer has not released this slot yet
+        }
+        else {
+            pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool XrdLogger::deliverNext()
+{
+    Slot& slot = _ring[_dequeuePos & (RING_CAPACITY - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != _dequeuePos + 1)
+        return false;
+    deliverRecord(slot.record);
+
+    // The short fields keep their capacity for the next producer; content can be large
+    if (slot.record.content.capacity() > RETAINED_SLOT_CHARS)
+        std::wstring().swap(slot.record.content);
+    slot.sequence.store(_dequeuePos + RING_CAPACITY, std::memory_order_release);
+    ++_dequeuePos;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// Writer thread
+//----------------------------------------------------------------------------
+void XrdLogger::writerLoop()
+{
+    const HANDLE handles[] = { _stopEvent, _wakeEvent };
+    for (;;) {
+        const DWORD everyMs = _flushMs;
+        const DWORD wait = WaitForMultipleObjects(_countof(handles), handles, FALSE,
+            everyMs ? everyMs : INFINITE);
+
         std::lock_guard lock(_fileMutex);
+        if (wait == WAIT_OBJECT_0) {
+            drainAndWrite(true);
+            return;
+        }
+
+        // A wake below the count threshold is a policy change; the timer covers the rest
+        const size_t queued = _queued;
+        const size_t everyEvents = _flushEvents;
+        const bool due = (wait == WAIT_TIMEOUT)
+            ? queued != 0
+            : (everyEvents != 0 && queued >= everyEvents) || queued >= RING_CAPACITY / 2;
+        if (due || _dropped != 0)
+            drainAndWrite(_syncToDisk);
+    }
+}
+
+void XrdLogger::drainAndWrite(bool sync)
+{
+    size_t written = 0;
+    while (deliverNext())
+        ++written;
+    _queued -= written;
+
+    if (const size_t dropped = _dropped.exchange(0)) {
+        Record note;
+        note.time = std::chrono::system_clock::now();
+        note.content = std::to_wstring(dropped) + L" log records dropped (log writer fell behind)";
+        note.isMessage = true;
+        deliverRecord(note);
+    }
+
+    if (!_batch.empty() || sync)
+        writeBatch(sync);
+}
+
+void XrdLogger::deliverRecord(const Record& record)
+{
+    if (_forward && _forward(record))
+        return;
+
+    // The service is gone, or the open was deferred to the first record
+    if (!_localLogTried) {
+        _localLogTried = true;
+        try {
+            openLocalLog();
+        }
+        catch (const std::exception& ex) {
+            // Nowhere left to write; writeBatch() drops the batch without a file
+            if (_deferOpen && !_forward && _reportErrors) {
+                const std::string what = ex.what();
+                MessageBoxW(nullptr,
+                    (L"XRD Logger cannot open the log:\n" + std::wstring(what.begin(), what.end())).c_str(),
+                    L"Logging Error",
+                    MB_OK | MB_ICONERROR | MB_SYSTEMMODAL);
+            }
+        }
+    }
+    appendRecord(record);
+}
+
+void XrdLogger::appendRecord(const Record& record)
+{
+    if (_format == Format::JsonLines)
+        appendJsonRecord(_batch, record);
+    else
+        appendTextRecord(_batch, record);
+}
+
+void XrdLogger::appendTextRecord(std::string& out, const Record& record)
+{
+    out += "-------------------------------------------------------\n";
+    out += "Time       : "; appendTimestamp(out, record.time); out += "\n";
+    if (record.isMessage) {
+        out += "Message    : "; append_utf8(out, record.content); out += "\n\n";
+        return;
+    }
+    out += "User       : "; append_utf8(out, record.user); out += "\n";
+    out += "Host       : "; append_utf8(out, record.host); out += "\n";
+    out += "SourceApp  : "; append_utf8(out, record.sourceApp); out += "\n";
+    out += "DestApp    : "; append_utf8(out, record.destApp); out += "\n";
+    if (spillContent(record)) {
+        out += "Content    : "; append_utf8(out, previewOf(record.content, PREVIEW_LENGTH));
+        append_utf8(out, L"\n…(stored as content\\"); out += _contentKey; append_utf8(out, L".xrdz)…\n");
+    }
+    else {
+        out += "Content    : "; append_utf8(out, record.content);
+    }
+    if (record.truncated)
+        append_utf8(out, L"\n…(truncated)…\n");
+    out += "\n";
+    out += "Action     : "; append_utf8(out, record.action); out += "\n";
+    out += "Length     : "; append_number(out, record.content.size()); out += "\n\n";
+}
+
+void XrdLogger::appendJsonRecord(std::string& out, const Record& record)
+{
+    out += "{\"time\":\""; appendIsoTimestamp(out, record.time); out += '"';
+    if (record.isMessage) {
+        out += ",\"type\":\"message\",\"message\":"; append_json_string(out, record.content);
+        out += "}\n";
+        return;
+    }
+    out += ",\"type\":\"event\"";
+    out += ",\"user\":"; append_json_string(out, record.user);
+    out += ",\"host\":"; append_json_string(out, record.host);
+    out += ",\"sourceApp\":"; append_json_string(out, record.sourceApp);
+    out += ",\"destApp\":"; append_json_string(out, record.destApp);
+    out += ",\"action\":"; append_json_string(out, record.action);
+    out += ",\"length\":"; append_number(out, record.content.size());
+    out += ",\"truncated\":"; out += record.truncated ? "true" : "false";
+
+    if (spillContent(record)) {
+        out += ",\"preview\":"; append_json_string(out, previewOf(record.content, PREVIEW_LENGTH));
+        out += ",\"contentRef\":{\"sha256\":\""; out += _contentKey;
+        out += "\",\"bytes\":"; append_number(out, _payload.size()); out += '}';
+    }
+    else {
+        out += ",\"content\":"; append_json_string(out, record.content);
+    }
+    out += "}\n";
+}
+
+bool XrdLogger::spillContent(const Record& record)
+{
+    if (!_contentStoreOpen || _inlineContentChars == 0 || record.content.size() <= _inlineContentChars)
+        return false;
 
-        // Timestamp
-        std::string ts = formatTimestamp();
+    _payload.clear();
+    append_utf8(_payload, record.content);
+    const bool stored = _contentStore.Put(_payload, _contentKey);
+    if (_releaseBuffers)
+        _contentStore.ReleaseBuffer();
+    return stored;
+}
+
+void XrdLogger::writeBatch(bool sync)
+{
+    if (_file == INVALID_HANDLE_VALUE) {
+        _batch.clear();
+        return;
+    }
+
+    bool ok = write_all(_file, _batch);
+    if (ok)
+        _logBytes += _batch.size();
+    _batch.clear();
 
-        // Stream fields directly to the open file
-        _logStream
-            << "-------------------------------------------------------\n"
-            << "Time       : " << ts << "\n"
-            << "User       : " << to_utf8(user) << "\n"
-            << "Host       : " << to_utf8(host) << "\n"
-            << "SourceApp  : " << to_utf8(sourceApp) << "\n"
-            << "DestApp    : " << to_utf8(destApp) << "\n"
-            << "Content    : "  // label
-            << to_utf8(content) << "\n"
-            << "Action     : " << to_utf8(action) << "\n"
-            << "Length     : " << content.size() << "\n\n";
+    // One large record must not pin its buffers for the rest of the session
+    if (_releaseBuffers) {
+        if (_batch.capacity() > RETAINED_BUFFER_BYTES)
+            std::string().swap(_batch);
+        if (_payload.capacity() > RETAINED_BUFFER_BYTES)
+            std::string().swap(_payload);
+    }
+    if (ok && sync)
+        ok = ::FlushFileBuffers(_file) != FALSE;
 
-        _logStream.flush();  // ensure it's on disk
+    if (ok) {
+        _reportedError = false;
     }
-    catch (const std::exception& e) {
-        // If logging fails, show a system-modal message box
-        MessageBoxW(nullptr,
-            (L"XRD Logger write error:\n" + std::wstring(e.what(), e.what() + strlen(e.what()))).c_str(),
-            L"Logging Error",
-            MB_OK | MB_ICONERROR | MB_SYSTEMMODAL);
+    else if (!_reportedError) {
+        // If logging fails, show a system-modal message box (once until writes succeed again)
+        _reportedError = true;
+        if (_reportErrors)
+            MessageBoxW(nullptr,
+                (L"XRD Logger write error:\n" + std::to_wstring(GetLastError())).c_str(),
+                L"Logging Error",
+                MB_OK | MB_ICONERROR | MB_SYSTEMMODAL);
     }
+
+    // Counted here rather than asking the file system for its size on every batch
+    if (_logBytes > _rotateAt)
+        rotateLog();
 }
 
 //----------------------------------------------------------------------------
-// One-time setup: create dirs, rotate old log, write BOM/header, open stream
+// One-time setup: open the local log (unless records are forwarded), start the writer
 //----------------------------------------------------------------------------
 void XrdLogger::ensureInitialized()
+{
+    // An agent only opens its own log once the service stops taking records, and a
+    // deferred log with the first record, on the writer thread
+    if (!_forward && !_deferOpen) {
+        _localLogTried = true;
+        openLocalLog();
+    }
+
+    _wakeEvent = ::CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    _stopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!_wakeEvent || !_stopEvent) {
+        throw std::runtime_error("Unable to create log writer events");
+    }
+    _writer = std::thread(&XrdLogger::writerLoop, this);
+}
+
+//----------------------------------------------------------------------------
+// Create dirs, open (and if too big rotate) the log, start the archiver
+//----------------------------------------------------------------------------
+void XrdLogger::openLocalLog()
 {
     // Determine executable folder
     wchar_t modulePath[MAX_PATH]{};
@@ -109,66 +583,123 @@ void XrdLogger::ensureInitialized()
         throw std::runtime_error("Failed to create log directories: " + ec.message());
     }
 
-    // Prepare log file path
-    _logFilePath = logDir / L"xrd_log_file.txt";
-
-    // Rotate if it's too big
-    rotateLogIfNeeded();
+    // Prepare log file path. Rotation renames the live log by path, so it must have one
+    // writer: a tray process of each session appends to a log of its own
+    DWORD session = 0;
+    if (_perSession && ::ProcessIdToSessionId(::GetCurrentProcessId(), &session))
+        _fileTag = L"_s" + std::to_wstring(session);
+    const bool json = _format == Format::JsonLines;
+    _logFilePath = logDir / (L"xrd_log_file" + _fileTag + (json ? L".jsonl" : L".txt"));
 
-    // If brand-new, write BOM + header
-    bool isNew = !std::filesystem::exists(_logFilePath);
-    if (isNew) {
-        std::ofstream header(_logFilePath, std::ios::binary);
-        if (!header) {
-            throw std::runtime_error("Unable to create log file at " + _logFilePath.string());
-        }
-        // UTF-8 BOM
-        header.write("\xEF\xBB\xBF", 3);
-        // Header line
-        header << to_utf8(L"==================== XRD Log File ====================\n\n");
-    }
-
-    // Open the stream for all future appends
-    _logStream.open(_logFilePath, std::ios::binary | std::ios::app);
-    if (!_logStream) {
+    // Open the file for all future appends; readers (Open Logs) may keep it open
+    _file = openLogFile();
+    if (_file == INVALID_HANDLE_VALUE) {
         throw std::runtime_error("Unable to open log file for appending: " + _logFilePath.string());
     }
+    _rotateAt = _maxLogBytes;
+    if (_logBytes > _rotateAt)
+        rotateLog();
+
+    // Compression and retention of rotated segments; without it they are just kept
+    _archiver.Start(logDir, _retention);
+
+    // Without a content store large content is simply kept inline
+    _contentStoreOpen = _contentStore.Open(logDir / L"content");
 }
 
 //----------------------------------------------------------------------------
-// If the log exceeds MAX_LOG_SIZE, rename it with a timestamp suffix.
+// Open _logFilePath for appending; a new text log gets the BOM and header line
 //----------------------------------------------------------------------------
-void XrdLogger::rotateLogIfNeeded()
+HANDLE XrdLogger::openLogFile()
 {
-    if (std::filesystem::exists(_logFilePath)) {
-        auto size = std::filesystem::file_size(_logFilePath);
-        if (size > MAX_LOG_SIZE) {
-            // Generate timestamp for backup filename
-            auto now = std::chrono::system_clock::now();
-            auto tt = std::chrono::system_clock::to_time_t(now);
-            std::tm tm{};
-            localtime_s(&tm, &tt);
-            std::wostringstream woss;
-            woss << std::put_time(&tm, L"%Y%m%d_%H%M%S");
+    HANDLE file = ::CreateFileW(_logFilePath.c_str(), FILE_APPEND_DATA,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return file;
 
-            auto backup = _logFilePath.parent_path()
-                / (L"xrd_log_" + woss.str() + L".txt");
-            std::filesystem::rename(_logFilePath, backup);
-        }
+    LARGE_INTEGER size{};
+    ::GetFileSizeEx(file, &size);
+    _logBytes = static_cast<std::uint64_t>(size.QuadPart);
+
+    // JSON Lines files start with the first record
+    if (_logBytes == 0 && _format == Format::Text) {
+        std::string header = "\xEF\xBB\xBF";
+        append_utf8(header, L"==================== XRD Log File ====================\n\n");
+        if (write_all(file, header))
+            _logBytes = header.size();
     }
+    return file;
 }
 
 //----------------------------------------------------------------------------
-// Return current local time as "YYYY-MM-DD HH:MM:SS"
+// Rename the log to xrd_log_<timestamp><tag>.<ext>, continue in a fresh file and hand
+// the segment to the archiver. Never loses records: if the rename or the reopen
+// fails, writing simply continues in the current file and is retried later.
 //----------------------------------------------------------------------------
-std::string XrdLogger::formatTimestamp()
+void XrdLogger::rotateLog()
 {
     auto now = std::chrono::system_clock::now();
     auto tt = std::chrono::system_clock::to_time_t(now);
     std::tm tm{};
     localtime_s(&tm, &tt);
+    std::wostringstream woss;
+    woss << std::put_time(&tm, L"%Y%m%d_%H%M%S");
+
+    auto backup = _logFilePath.parent_path()
+        / (L"xrd_log_" + woss.str() + _fileTag + _logFilePath.extension().wstring());
+    for (int n = 2; ::GetFileAttributesW(backup.c_str()) != INVALID_FILE_ATTRIBUTES; ++n)
+        backup.replace_filename(L"xrd_log_" + woss.str() + _fileTag + L"_" + std::to_wstring(n)
+            + _logFilePath.extension().wstring());
+
+    // Our handle shares delete access, so the open file can be renamed in place
+    if (!::MoveFileExW(_logFilePath.c_str(), backup.c_str(), 0)) {
+        _rotateAt = _logBytes + ROTATE_RETRY_BYTES;     // a reader without FILE_SHARE_DELETE
+        return;
+    }
+
+    const std::uint64_t segmentBytes = _logBytes;
+    HANDLE file = openLogFile();
+    if (file == INVALID_HANDLE_VALUE) {
+        // Name it back: retention deletes segments, and this one would still be written
+        ::MoveFileExW(backup.c_str(), _logFilePath.c_str(), 0);
+        _logBytes = segmentBytes;
+        _rotateAt = _logBytes + ROTATE_RETRY_BYTES;
+        return;
+    }
+    ::CloseHandle(_file);
+    _file = file;
+    _rotateAt = _maxLogBytes;
+    _archiver.Submit(std::move(backup));
+}
+
+//----------------------------------------------------------------------------
+// Append the given time as local "YYYY-MM-DD HH:MM:SS"
+//----------------------------------------------------------------------------
+void XrdLogger::appendTimestamp(std::string& out, std::chrono::system_clock::time_point time)
+{
+    auto tt = std::chrono::system_clock::to_time_t(time);
+    std::tm tm{};
+    localtime_s(&tm, &tt);
+
+    char text[32];
+    const size_t length = std::strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+    out.append(text, length);
+}
+
+//----------------------------------------------------------------------------
+// Append the given time as UTC "YYYY-MM-DDTHH:MM:SS.mmmZ" (ISO 8601)
+//----------------------------------------------------------------------------
+void XrdLogger::appendIsoTimestamp(std::string& out, std::chrono::system_clock::time_point time)
+{
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        time.time_since_epoch()).count() % 1000;
+    auto tt = std::chrono::system_clock::to_time_t(time);
+    std::tm tm{};
+    gmtime_s(&tm, &tt);
 
-    std::ostringstream oss;
-    oss << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
-    return oss.str();
+    char text[32];
+    size_t length = std::strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &tm);
+    length += std::snprintf(text + length, sizeof(text) - length, ".%03dZ", static_cast<int>(ms));
+    out.append(text, length);
 }
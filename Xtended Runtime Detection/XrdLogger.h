@@ -1,24 +1,97 @@
 // XrdLogger.h
 #pragma once
 
+#include <windows.h>
 #include <string>
+#include <string_view>
 #include <filesystem>
-#include <fstream>
+#include <memory>
 #include <mutex>
+#include <atomic>
+#include <thread>
 #include <chrono>
+#include <cstdint>
 #include <ctime>
+#include <functional>
+
+#include "ContentStore.h"
+#include "LogArchiver.h"
 
 /**
  * @brief Thread-safe, resilient logger for XR_D paste events.
  *
  * - Writes UTF-8 (with BOM) log entries under:
  *     <exe_dir>/xtended Runtime Detection/LogFiles/xrd_log_file.txt
- * - Rotates the log file when it exceeds 100 MB.
- * - Streams fields directly, catching all exceptions.
+ *   or, in JSON Lines format, one object per line (no BOM) to xrd_log_file.jsonl.
+ *   With Options::perSession the names carry the session (xrd_log_file_s<id>.txt), so
+ *   the tray processes of several sessions never write, rotate or delete each other's log.
+ * - Content longer than the inline limit is stored once, compressed, in LogFiles/content
+ *   (see ContentStore); the record keeps a short preview and the SHA-256 key.
+ * - Rotates the log on the writer thread once it exceeds the size limit (100 MB by default);
+ *   LogArchiver compresses the old segment and applies the retention limits in the background.
+ * - Never blocks the caller on disk I/O: records go into a bounded lock-free ring and
+ *   a writer thread formats them and appends each batch with a single WriteFile.
+ * - In agent mode (Options::forward) the writer hands records to the scan service, which
+ *   keeps the one log of the machine; the local log is only opened if that fails.
  */
 class XrdLogger {
 public:
+    /** @brief One paste event or diagnostic message, as queued for the writer. */
+    struct Record
+    {
+        std::chrono::system_clock::time_point time;
+        std::wstring user, host, sourceApp, destApp, content, action;
+        bool         truncated = false;
+        bool         isMessage = false;     // Only time and content are used
+    };
+
+    /** @brief When queued records are written out and forced to disk. */
+    struct FlushPolicy
+    {
+        size_t everyEvents = 1;     ///< Write once this many records are queued (0 = not by count)
+        DWORD  everyMs = 1000;      ///< Write pending records at least this often (0 = not by time)
+        bool   syncToDisk = false;  ///< FlushFileBuffers after every write, not only on shutdown
+    };
+
+    /** @brief On-disk layout of the log. */
+    enum class Format
+    {
+        Text,       ///< Human-readable blocks in xrd_log_file.txt
+        JsonLines,  ///< One JSON object per line in xrd_log_file.jsonl
+    };
+
+    struct Options
+    {
+        Format      format = Format::Text;
+        size_t      inlineContentChars = 4096;  ///< Longer content goes to the content store (0 = always inline)
+        std::uint64_t maxLogBytes = 100ULL * 1024 * 1024;  ///< Rotate once the log grows beyond this
+        LogArchiver::Retention retention;
+        FlushPolicy flush;
+        bool        releaseBuffers = false;     ///< Free buffers grown past RETAINED_BUFFER_BYTES after each use
+        bool        reportErrors = true;        ///< Message box on a failed write (off in the service)
+        bool        deferOpen = false;          ///< Open the log and start the writer with the first record
+        bool        perSession = false;         ///< Live log and segments named after the session (tray processes)
+        /// Agent mode: called on the writer thread for every record instead of writing it;
+        /// records it returns false for go to the local log, which is then opened.
+        std::function<bool(const Record&)> forward;
+    };
+
     XrdLogger();
+    ~XrdLogger();
+
+    XrdLogger(const XrdLogger&) = delete;
+    XrdLogger& operator=(const XrdLogger&) = delete;
+
+    /**
+     * @brief Applies the options and opens the log.
+     *
+     * Call before the first record, otherwise the log is opened with the defaults and
+     * only the flush policy of later calls takes effect. With Options::deferOpen nothing
+     * is opened yet; the writer opens the log for the first record, and a failure is
+     * then reported like a failed write.
+     * @throws std::runtime_error if the log directory or file cannot be created.
+     */
+    void configure(const Options& options);
 
     /**
      * @brief Log an event, always with the full (or capped) content.
@@ -26,29 +99,116 @@ public:
      * @param host       Hostname of the machine.
      * @param sourceApp  Originating application name.
      * @param destApp    Destination application name.
-     * @param content    Full content of the clipboard (capped internally).
+     * @param content    Full content of the clipboard (capped internally); move it in to avoid a copy.
      * @param action     Description of the action taken.
      */
-    void logEvent(const std::wstring& user,
-        const std::wstring& host,
-        const std::wstring& sourceApp,
-        const std::wstring& destApp,
+    void logEvent(std::wstring_view user,
+        std::wstring_view host,
+        std::wstring_view sourceApp,
+        std::wstring_view destApp,
         std::wstring content,
-        const std::wstring& action);
+        std::wstring_view action);
+
+    /**
+     * @brief Log a diagnostic message (configuration problems, reloads, ...).
+     * @param message    Free-form description; never shown to the user.
+     */
+    void logMessage(std::wstring_view message);
+
+    /**
+     * @brief Log a record forwarded by an agent, keeping its original time.
+     * @param record     As the agent's logger queued it; content is capped again here.
+     */
+    void logRecord(Record record);
+
+    /**
+     * @brief Writes every queued record, syncs the file and stops the writer thread.
+     *
+     * Call once the producers have stopped; records logged afterwards are written
+     * synchronously on the calling thread.
+     */
+    void shutdown();
 
 private:
-    void ensureInitialized();            // called once to set up dirs, BOM/header, rotation, open stream
-    void rotateLogIfNeeded();            // moves old log aside if too large
-    std::string formatTimestamp();       // YYYY-MM-DD HH:MM:SS
+    struct Slot
+    {
+        std::atomic<size_t> sequence{ 0 };  // Ring position this slot is ready for
+        Record              record;
+    };
+
+    void ensureInitialized();            // called once: opens the local log unless forwarding, starts the writer
+    void openLocalLog();                 // dirs, log file, archiver and content store; throws on failure
+    HANDLE openLogFile();                // append handle, BOM/header if new; sets _logBytes
+    void rotateLog();                    // renames the log, reopens it and queues the segment; holds _fileMutex
+    void appendTimestamp(std::string& out, std::chrono::system_clock::time_point time);     // YYYY-MM-DD HH:MM:SS
+    void appendIsoTimestamp(std::string& out, std::chrono::system_clock::time_point time);  // UTC, milliseconds
+
+    // fill(Record&) sets every field of a reused record: the claimed slot's, so short
+    // strings are assigned into capacity left by earlier records and nothing is allocated
+    template <typename Fill>
+    void submit(Fill&& fill);            // queue for the writer, or write inline after shutdown
+    template <typename Fill>
+    bool tryPush(Fill& fill);            // producers; false if the ring is full
+    bool deliverNext();                  // writer thread only; delivers the oldest record in its slot
+    void writerLoop();
+    void drainAndWrite(bool sync);       // one batch: every queued record, one WriteFile
+    void deliverRecord(const Record& record);       // forward, or else appendRecord; caller holds _fileMutex
+    void appendRecord(const Record& record);        // into _batch in the chosen format
+    void appendTextRecord(std::string& out, const Record& record);
+    void appendJsonRecord(std::string& out, const Record& record);
+    bool spillContent(const Record& record);     // stores it, key in _contentKey; false: inline it
+    void writeBatch(bool sync);          // writes and clears _batch; caller holds _fileMutex
 
     std::filesystem::path _logFilePath;
-    std::ofstream         _logStream;    // kept open for appends
-    std::mutex            _fileMutex;    // protects _logStream
+    HANDLE                _file = INVALID_HANDLE_VALUE;   // kept open for appends
+    std::uint64_t         _logBytes = 0;     // size of the open log, counted on the write path
+    std::uint64_t         _rotateAt = 0;     // rotate when _logBytes passes this
+    std::mutex            _fileMutex;    // protects _file, the content store and the buffers
+    std::string           _batch;        // reused formatting buffer
+    std::string           _payload;      // reused UTF-8 buffer for content being spilled
+    std::string           _contentKey;   // key of the last spilled content
+    ContentStore          _contentStore;
+    bool                  _contentStoreOpen = false;
+
+    Format                _format = Format::Text;     // fixed once the log is open
+    size_t                _inlineContentChars = 4096;
+    std::uint64_t         _maxLogBytes = 100ULL * 1024 * 1024;
+    LogArchiver::Retention _retention;
+    LogArchiver           _archiver;
+    bool                  _releaseBuffers = false;
+    bool                  _reportErrors = true;
+    std::function<bool(const Record&)> _forward;  // agent mode; fixed once initialized
+    bool                  _localLogTried = false; // openLocalLog() ran (or failed) already
+    bool                  _deferOpen = false;     // the writer opens the local log for the first record
+    bool                  _perSession = false;
+    std::wstring          _fileTag;      // "_s<session>" with perSession, in every file name we write
+    bool                  _configured = false;    // configure() applied its options
 
     bool                  _initialized = false;
     static inline std::once_flag _initFlag;
 
+    // Ring (bounded MPSC): producers claim positions with a CAS, the writer consumes in order
+    std::unique_ptr<Slot[]> _ring;
+    alignas(64) std::atomic<size_t> _enqueuePos{ 0 };
+    alignas(64) size_t    _dequeuePos = 0;
+    std::atomic<size_t>   _queued{ 0 };  // records pushed but not yet written
+    std::atomic<size_t>   _dropped{ 0 }; // records lost to a full ring, reported in the log
+
+    std::atomic<size_t>   _flushEvents{ 1 };
+    std::atomic<DWORD>    _flushMs{ 1000 };
+    std::atomic<bool>     _syncToDisk{ false };
+
+    HANDLE                _wakeEvent = nullptr;   // auto-reset: records to write or policy change
+    HANDLE                _stopEvent = nullptr;
+    std::thread           _writer;
+    std::atomic<bool>     _stopped{ false };      // writer gone; log inline
+    bool                  _reportedError = false; // one dialog per failure streak
+
     // thresholds
-    static constexpr std::uintmax_t MAX_LOG_SIZE = 100ULL * 1024 * 1024; // 100 MB
+    static constexpr std::uint64_t  ROTATE_RETRY_BYTES = 1024 * 1024;    // after a failed rename
     static constexpr size_t         MAX_CONTENT_LENGTH = 50ULL * 1024 * 1024; // 50 MB
+    static constexpr size_t         PREVIEW_LENGTH = 256;   // chars kept in a record whose content is spilled
+    static constexpr size_t         RING_CAPACITY = 1024;   // records; power of two
+    static constexpr size_t         RETAINED_BUFFER_BYTES = 64 * 1024;  // kept across batches with releaseBuffers
+    static constexpr size_t         RETAINED_SLOT_CHARS = 256;  // content capacity a ring slot keeps
 };
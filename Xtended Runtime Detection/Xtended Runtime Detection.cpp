@@ -4,10 +4,13 @@
 #include <stdexcept>
 #include "ClipboardWatcher.h"
 #include <filesystem>
+#include "ScanService.h"
+#include "ServiceClient.h"
 #include "TrayLogic.h"
 
-// Application-wide constants
-static constexpr std::wstring_view MUTEX_NAME = L"Global\\XtendedRuntimeDetection_Mutex";
+// Application-wide constants; one instance per session, so every session of a terminal server is protected
+static constexpr std::wstring_view MUTEX_NAME = L"Local\\XtendedRuntimeDetection_Mutex";
+static constexpr std::wstring_view SERVICE_SWITCH = L"--service";
 
 
 //  Helpers
@@ -33,11 +36,15 @@ using UniqueHandle = std::unique_ptr<std::remove_pointer_t<HANDLE>, HandleDelete
 int WINAPI wWinMain(
     HINSTANCE hInstance,          // Handle to the current instance
     HINSTANCE /*hPrevInstance*/,  // Unused parameter
-    LPWSTR /*lpCmdLine*/,         // Command line arguments (unused)
+    LPWSTR lpCmdLine,             // Command line arguments: --service runs the scan service
     int /*nCmdShow*/)             // Show window flag (unused)
 {
+    // Started by the SCM: the machine-wide scan service, no tray and no clipboard
+    if (lpCmdLine && SERVICE_SWITCH == lpCmdLine)
+        return ScanService::Run();
+
     try {
-        // Ensure only one instance runs by creating a named mutex
+        // Ensure only one instance runs per session by creating a named mutex
         UniqueHandle mutex(CreateMutexW(nullptr, FALSE, MUTEX_NAME.data()));
         if (!mutex) {
             throw std::runtime_error("Failed to create mutex");
@@ -47,29 +54,32 @@ int WINAPI wWinMain(
             return EXIT_SUCCESS;
         }
 
-        // Initialize system tray icon
-        HWND trayWindow = nullptr;
-        UINT trayIconId = 0;
-        if (!InitTray(hInstance, trayWindow, trayIconId)) {
-            throw std::runtime_error("Tray icon initialization failed");
-        }
-
         // Determine the absolute path to patterns.txt
         const std::wstring patternFile = GetPatternFilePath();
        
-        if (!std::filesystem::exists(patternFile)) {
+        // An agent of a running scan service needs no pattern file of its own
+        if (GetFileAttributesW(patternFile.c_str()) == INVALID_FILE_ATTRIBUTES && !ServiceClient::Running()) {
             MessageBoxW(nullptr,
                 (L"patterns.txt not found in:\n" + patternFile).c_str(),
                 L"Error", MB_ICONERROR);
             return EXIT_FAILURE;
         }
 
-        // Start clipboard watcher with specified pattern file
+        // Start clipboard watcher with specified pattern file; the tray icon only
+        // reports verdicts, so it comes after the watcher is listening
         ClipboardWatcher watcher(patternFile);
-        if (!watcher.Start(hInstance, trayWindow, trayIconId)) {
-            CleanupTray();
+        if (!watcher.Start(hInstance)) {
             throw std::runtime_error("Failed to start clipboard watcher");
         }
+
+        // Initialize system tray icon
+        HWND trayWindow = nullptr;
+        UINT trayIconId = 0;
+        if (!InitTray(hInstance, trayWindow, trayIconId)) {
+            watcher.Stop();
+            throw std::runtime_error("Tray icon initialization failed");
+        }
+        watcher.AttachTray(trayWindow, trayIconId);
         watcher.ForceInitialScan();  // Perform an immediate initial scan
 
         // Main message loop: dispatch Windows messages until WM_QUIT
@@ -79,7 +89,8 @@ int WINAPI wWinMain(
             DispatchMessageW(&msg);
         }
 
-        // Clean up resources in reverse order of creation
+        // Clean up resources in reverse order of creation; Stop() also drains the
+        // log writer, so every queued record is on disk before the process exits
         watcher.Stop();
         CleanupTray();
         return static_cast<int>(msg.wParam);